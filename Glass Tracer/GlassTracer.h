@@ -1,11 +1,13 @@
 #ifndef GLASSTRACER_H
 #define GLASSTRACER_H
 
+#include <atomic>
 #include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <random>
 
 
 
@@ -26,8 +28,12 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    // Returns a random real in [0,1).
-    return std::rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1), from a generator of the calling thread's own, so that
+    // threads rendering at once neither share its state nor wait on each other for it. Each
+    // thread's generator is seeded in the order the threads first ask for a number.
+    static std::atomic<unsigned> next_seed{0};
+    thread_local std::mt19937 generator(5489u + next_seed.fetch_add(1, std::memory_order_relaxed));
+    return generator() / 4294967296.0;
 }
 
 inline double random_double(double min, double max) {
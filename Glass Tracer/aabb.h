@@ -5,6 +5,8 @@
 #include "interval.h"
 #include "ray.h"
 
+#include <utility>
+
 class aabb {
   public:
     interval x, y, z;
@@ -64,6 +66,23 @@ class aabb {
         return true;
     }
 
+    bool hit(const ray& r, const vec3& inv_dir, interval& ray_t) const {
+        // The same test with the reciprocal of the ray direction given, as tree and grid
+        // traversals work it out once for the many boxes they test. On a hit, ray_t is
+        // narrowed to the part of the ray inside the box; on a miss it is left undefined.
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = axis_interval(axis);
+            auto t0 = (ax.min - r.origin()[axis]) * inv_dir[axis];
+            auto t1 = (ax.max - r.origin()[axis]) * inv_dir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
     int longest_axis() const {
         // Returns the index of the longest axis of the bounding box.
 
@@ -73,6 +92,15 @@ class aabb {
             return y.size() > z.size() ? 1 : 2;
     }
 
+    bool is_empty() const {
+        return x.size() < 0 || y.size() < 0 || z.size() < 0;
+    }
+
+    double surface_area() const {
+        auto dx = x.size(), dy = y.size(), dz = z.size();
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
     static const aabb empty, universe;
 
     private:
@@ -98,4 +126,23 @@ aabb operator+(const vec3& offset, const aabb& bbox) {
     return bbox + offset;
 }
 
+inline aabb overlap(const aabb& a, const aabb& b) {
+    // The region common to both boxes. Unlike the constructors this doesn't pad, so the result
+    // is empty (is_empty) when the boxes are disjoint.
+    aabb result;
+    result.x = interval(std::fmax(a.x.min, b.x.min), std::fmin(a.x.max, b.x.max));
+    result.y = interval(std::fmax(a.y.min, b.y.min), std::fmin(a.y.max, b.y.max));
+    result.z = interval(std::fmax(a.z.min, b.z.min), std::fmin(a.z.max, b.z.max));
+    return result;
+}
+
+inline aabb lerp(const aabb& a, const aabb& b, double s) {
+    // Linear blend of two boxes, s=0 gives a and s=1 gives b.
+    return aabb(
+        interval(a.x.min + s*(b.x.min - a.x.min), a.x.max + s*(b.x.max - a.x.max)),
+        interval(a.y.min + s*(b.y.min - a.y.min), a.y.max + s*(b.y.max - a.y.max)),
+        interval(a.z.min + s*(b.z.min - a.z.min), a.z.max + s*(b.z.max - a.z.max))
+    );
+}
+
 #endif
\ No newline at end of file
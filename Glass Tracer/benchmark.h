@@ -0,0 +1,199 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "GlassTracer.h"
+
+#include "flat_bvh.h"
+#include "hittable.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Helpers for the timing scenes in main.cpp. They trace a fixed set of primary rays through
+// a scene without shading, so the numbers measure the acceleration structure alone.
+
+class stopwatch {
+  public:
+    stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+    double seconds() const {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double>(elapsed).count();
+    }
+
+  private:
+    std::chrono::steady_clock::time_point start;
+};
+
+enum class counter_event {
+    l1d_misses,   // Level 1 data cache read misses.
+    llc_misses,   // Last level cache misses.
+    dtlb_misses   // Data TLB read misses.
+};
+
+class hardware_counter {
+  public:
+    // A hardware event counter for the calling thread, through Linux perf events. Elsewhere,
+    // or when the kernel refuses (no PMU in a VM, perf_event_paranoid), available() is false
+    // and stop() returns zero.
+
+    hardware_counter(counter_event event) {
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        if (event == counter_event::l1d_misses || event == counter_event::dtlb_misses) {
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = (event == counter_event::l1d_misses ? PERF_COUNT_HW_CACHE_L1D
+                                                              : PERF_COUNT_HW_CACHE_DTLB)
+                        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        } else {
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        }
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+        (void)event;
+#endif
+    }
+
+    ~hardware_counter() {
+#if defined(__linux__)
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    hardware_counter(const hardware_counter&) = delete;
+    hardware_counter& operator=(const hardware_counter&) = delete;
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+#if defined(__linux__)
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    uint64_t stop() {
+        uint64_t count = 0;
+#if defined(__linux__)
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = 0;
+#endif
+        return count;
+    }
+
+  private:
+    int fd = -1;
+};
+
+inline std::vector<ray> primary_rays(
+    const point3& lookfrom, const point3& lookat, double vfov, int width, int height
+) {
+    // Builds one jittered pinhole ray per pixel of a width x height image, in scanline order.
+
+    auto w = unit_vector(lookfrom - lookat);
+    auto u = unit_vector(cross(vec3(0,1,0), w));
+    auto v = cross(w, u);
+
+    auto h = std::tan(degrees_to_radians(vfov) / 2);
+    auto viewport_height = 2 * h;
+    auto viewport_width = viewport_height * (double(width) / height);
+
+    std::vector<ray> rays;
+    rays.reserve(size_t(width) * height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            auto s = ((i + random_double()) / width - 0.5) * viewport_width;
+            auto t = (0.5 - (j + random_double()) / height) * viewport_height;
+            rays.push_back(ray(lookfrom, s*u + t*v - w, random_double(), viewport_width / width));
+        }
+    }
+    return rays;
+}
+
+inline std::vector<ray> scattered_rays(const aabb& bounds, int count) {
+    // Rays from random points in bounds in random directions: an incoherent workload like
+    // secondary bounces, where neighboring rays share little of their traversal.
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        auto origin = point3(random_double(bounds.x.min, bounds.x.max),
+                             random_double(bounds.y.min, bounds.y.max),
+                             random_double(bounds.z.min, bounds.z.max));
+        rays.push_back(ray(origin, random_unit_vector()));
+    }
+    return rays;
+}
+
+class trace_stats {
+  public:
+    double seconds = 0;
+    double rays_per_second = 0;
+    size_t hits = 0;
+};
+
+inline trace_stats trace_rays(const hittable& world, const std::vector<ray>& rays) {
+    trace_stats stats;
+    stopwatch timer;
+
+    for (const auto& r : rays) {
+        hit_record rec;
+        if (world.hit(r, interval(0.001, infinity), rec))
+            stats.hits++;
+    }
+
+    stats.seconds = timer.seconds();
+    stats.rays_per_second = rays.size() / stats.seconds;
+    return stats;
+}
+
+inline double simulated_misses(
+    const flat_bvh& bvh, const std::vector<ray>& rays, size_t bytes, int line_bytes, int ways
+) {
+    // Misses per ray of the node accesses in a cache_model with the given geometry.
+    cache_model cache(bytes, line_bytes, ways);
+    traversal_counts counts;
+    counts.cache = &cache;
+    for (const auto& r : rays) {
+        hit_record rec;
+        bvh.hit(r, interval(0.001, infinity), rec, counts);
+    }
+    return double(cache.misses) / rays.size();
+}
+
+inline void report(const std::string& label, const trace_stats& stats) {
+    std::clog << label << ": " << stats.rays_per_second / 1e6 << " Mrays/s, "
+              << stats.hits << " hits in " << stats.seconds << " s\n";
+}
+
+inline void report_traversal(const std::string& label, const flat_bvh& bvh, const std::vector<ray>& rays) {
+    // Average work per ray: node boxes and objects tested.
+    traversal_counts counts;
+    for (const auto& r : rays) {
+        hit_record rec;
+        bvh.hit(r, interval(0.001, infinity), rec, counts);
+    }
+    std::clog << label << ": " << double(counts.nodes) / rays.size() << " nodes/ray, "
+              << double(counts.objects) / rays.size() << " objects/ray\n";
+}
+
+#endif
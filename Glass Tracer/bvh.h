@@ -56,8 +56,23 @@ class bvh_node : public hittable {
         return hit_left || hit_right;
     }
 
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        // Nodes that start past the second crossing found so far can't add to it.
+        if (!bbox.hit(r, interval(ray_t.min, std::fmin(ray_t.max, out.reach()))))
+            return;
+
+        left->crossings(r, ray_t, out);
+        if (right != left)
+            right->crossings(r, ray_t, out);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    // The two subtrees, for tools that walk the tree (see bvh_analysis.h). A node over a
+    // single object has that object on both sides.
+    const shared_ptr<hittable>& left_child() const { return left; }
+    const shared_ptr<hittable>& right_child() const { return right; }
+
   private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
@@ -0,0 +1,293 @@
+#ifndef BVH_ANALYSIS_H
+#define BVH_ANALYSIS_H
+
+#include "GlassTracer.h"
+
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+// Tools for finding out how good a BVH is and where rays spend their time in it: a report of
+// the tree's shape and cost, and per-ray counts of the work done, which camera::render_heatmap()
+// turns into images.
+
+class bvh_report {
+  public:
+    size_t interior_nodes = 0;
+    size_t leaves = 0;
+    size_t references = 0;      // Objects in the leaves, counting repeats.
+    size_t memory_bytes = 0;    // Bytes held by the tree, not counting the objects.
+    double sah_cost = 0;        // See flat_bvh::sah_cost().
+
+    // Overlap between the two children of each interior node, as the surface area of their
+    // intersection. mean_overlap is its average over nodes as a fraction of the node's own
+    // area; weighted_overlap is the sum over nodes relative to the root's area, which is the
+    // expected number of nodes per random ray where both children have to be visited.
+    double mean_overlap = 0;
+    double worst_overlap = 0;
+    double weighted_overlap = 0;
+
+    std::vector<size_t> leaves_by_depth;   // Leaves at each depth, the root being depth 0.
+    std::vector<size_t> leaves_by_size;    // Leaves with each number of objects.
+
+    double mean_leaf_depth() const {
+        double sum = 0;
+        for (size_t d = 0; d < leaves_by_depth.size(); d++)
+            sum += double(d) * leaves_by_depth[d];
+        return leaves ? sum / leaves : 0;
+    }
+
+    void print(std::ostream& out) const {
+        out << "BVH: " << interior_nodes << " interior nodes, " << leaves << " leaves, "
+            << references << " object references, " << memory_bytes / 1048576.0 << " MB\n"
+            << "  SAH cost " << sah_cost << ", leaf depth mean " << mean_leaf_depth()
+            << " max " << (leaves_by_depth.empty() ? 0 : leaves_by_depth.size() - 1) << '\n'
+            << "  child overlap: mean " << mean_overlap << " of the node, worst " << worst_overlap
+            << ", weighted " << weighted_overlap << '\n';
+        print_histogram(out, "  leaves by depth", leaves_by_depth);
+        print_histogram(out, "  leaves by size ", leaves_by_size);
+    }
+
+    void add_leaf(size_t depth, size_t size) {
+        leaves++;
+        references += size;
+        count(leaves_by_depth, depth);
+        count(leaves_by_size, size);
+    }
+
+    void add_interior(const aabb& box, const aabb& left, const aabb& right, double root_area) {
+        interior_nodes++;
+        auto shared = intersection_area(left, right);
+        auto fraction = box.surface_area() > 0 ? shared / box.surface_area() : 0;
+        mean_overlap += fraction;
+        worst_overlap = std::fmax(worst_overlap, fraction);
+        weighted_overlap += root_area > 0 ? shared / root_area : 0;
+    }
+
+    void finish() {
+        if (interior_nodes)
+            mean_overlap /= interior_nodes;
+    }
+
+  private:
+    static void count(std::vector<size_t>& histogram, size_t bin) {
+        if (histogram.size() <= bin)
+            histogram.resize(bin + 1, 0);
+        histogram[bin]++;
+    }
+
+    static double intersection_area(const aabb& a, const aabb& b) {
+        interval axes[3];
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& x = a.axis_interval(axis);
+            const auto& y = b.axis_interval(axis);
+            axes[axis] = interval(std::fmax(x.min, y.min), std::fmin(x.max, y.max));
+            if (axes[axis].size() < 0)
+                return 0;
+        }
+        return aabb(point3(axes[0].min, axes[1].min, axes[2].min),
+                    point3(axes[0].max, axes[1].max, axes[2].max)).surface_area();
+    }
+
+    static void print_histogram(std::ostream& out, const char* label, const std::vector<size_t>& h) {
+        // One line per non-empty bin, with a bar scaled to the largest one.
+        out << label << ":\n";
+        size_t largest = 0;
+        for (auto n : h)
+            largest = std::max(largest, n);
+        for (size_t bin = 0; bin < h.size(); bin++) {
+            if (h[bin] == 0)
+                continue;
+            out << std::setw(8) << bin << std::setw(10) << h[bin] << ' '
+                << std::string(size_t(40.0 * h[bin] / largest + 0.5), '#') << '\n';
+        }
+    }
+};
+
+inline bvh_report analyze_bvh(const bvh_node& root) {
+    // A bvh_node is a leaf when its children are objects rather than other nodes; a leaf
+    // over one object has it on both sides and, since hit() doesn't check, tests it twice.
+    // The SAH cost counts those tests as they happen.
+    const double traversal_cost = 1.0;
+    const double intersection_cost = 1.0;
+
+    bvh_report report;
+    auto root_area = root.bounding_box().surface_area();
+
+    struct entry { const bvh_node* node; size_t depth; };
+    std::vector<entry> pending = { { &root, 0 } };
+    while (!pending.empty()) {
+        auto [node, depth] = pending.back();
+        pending.pop_back();
+        report.memory_bytes += sizeof(bvh_node) + 16;   // Plus its make_shared control block.
+
+        const hittable* children[2] = { node->left_child().get(), node->right_child().get() };
+        auto left = dynamic_cast<const bvh_node*>(children[0]);
+        auto right = dynamic_cast<const bvh_node*>(children[1]);
+        auto area = node->bounding_box().surface_area();
+
+        if (left && right) {
+            report.add_interior(node->bounding_box(), left->bounding_box(), right->bounding_box(),
+                                root_area);
+            report.sah_cost += traversal_cost * area;
+            pending.push_back({ right, depth + 1 });
+            pending.push_back({ left, depth + 1 });
+            continue;
+        }
+
+        // The builder never mixes objects and nodes under one parent, but a hand-made tree
+        // could: descend into whichever side is a node and count the other as a leaf.
+        size_t tests = 0;
+        for (int side = 0; side < 2; side++) {
+            auto child = dynamic_cast<const bvh_node*>(children[side]);
+            if (child)
+                pending.push_back({ child, depth + 1 });
+            else
+                tests++;
+        }
+        size_t size = (children[0] == children[1]) ? 1 : tests;
+        report.add_leaf(depth, size);
+        report.sah_cost += intersection_cost * tests * area;
+    }
+
+    report.sah_cost = root_area > 0 ? report.sah_cost / root_area : 0;
+    report.finish();
+    return report;
+}
+
+inline bvh_report analyze_bvh(const flat_bvh& bvh) {
+    bvh_report report;
+    report.memory_bytes = bvh.memory_usage();
+    report.sah_cost = bvh.sah_cost();
+
+    const auto& nodes = bvh.node_data();
+    if (nodes.empty())
+        return report;
+
+    auto root_area = nodes[0].bbox.surface_area();
+    std::vector<std::pair<int, size_t>> pending = { { 0, 0 } };
+    while (!pending.empty()) {
+        auto [i, depth] = pending.back();
+        pending.pop_back();
+        const auto& n = nodes[i];
+        if (n.count > 0) {
+            report.add_leaf(depth, size_t(n.count));
+            continue;
+        }
+        report.add_interior(n.bbox, nodes[n.first].bbox, nodes[n.first + 1].bbox, root_area);
+        pending.push_back({ n.first + 1, depth + 1 });
+        pending.push_back({ n.first, depth + 1 });
+    }
+
+    report.finish();
+    return report;
+}
+
+inline bool counted_hit(
+    const hittable& object, const ray& r, interval ray_t, hit_record& rec, traversal_counts& counts
+) {
+    // Same as object.hit(r, ray_t, rec), also adding up the work done into counts. Looks
+    // through hittable_list, bvh_node and flat_bvh; anything else counts as one object test.
+    if (auto node = dynamic_cast<const bvh_node*>(&object)) {
+        counts.nodes++;
+        if (!node->bounding_box().hit(r, ray_t))
+            return false;
+        bool hit_left = counted_hit(*node->left_child(), r, ray_t, rec, counts);
+        bool hit_right = counted_hit(*node->right_child(), r,
+                                     interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec, counts);
+        return hit_left || hit_right;
+    }
+
+    if (auto bvh = dynamic_cast<const flat_bvh*>(&object))
+        return bvh->hit(r, ray_t, rec, counts);
+
+    if (auto list = dynamic_cast<const hittable_list*>(&object)) {
+        hit_record temp_rec;
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+        for (const auto& child : list->objects) {
+            if (counted_hit(*child, r, interval(ray_t.min, closest_so_far), temp_rec, counts)) {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                rec = temp_rec;
+            }
+        }
+        return hit_anything;
+    }
+
+    counts.objects++;
+    return object.hit(r, ray_t, rec);
+}
+
+class traversal_heatmap {
+  public:
+    // Per-pixel traversal counts of one primary ray each, written out as false-color images
+    // from blue (no work) to red. The scale tops out at the 99th percentile rather than the
+    // maximum, so that a handful of extreme pixels don't leave the rest of the image blue;
+    // the pixels above it saturate. The scale is printed with each image.
+
+    traversal_heatmap(int width, int height)
+      : width(width), height(height), nodes(size_t(width) * height), objects(size_t(width) * height)
+    {}
+
+    void record(int i, int j, const traversal_counts& counts) {
+        nodes[size_t(j) * width + i] = counts.nodes;
+        objects[size_t(j) * width + i] = counts.objects;
+    }
+
+    void write(const std::string& nodes_file, const std::string& objects_file) const {
+        write_image(nodes_file, "nodes visited", nodes);
+        write_image(objects_file, "objects tested", objects);
+    }
+
+  private:
+    int width, height;
+    std::vector<size_t> nodes, objects;
+
+    void write_image(const std::string& filename, const char* label,
+                     const std::vector<size_t>& values) const {
+        std::ofstream out{filename, std::ios::out | std::ios::binary};
+        if (!out) {
+            std::cerr << "Error: Could not open " << filename << " for writing.\n";
+            return;
+        }
+
+        auto sorted = values;
+        double sum = 0;
+        for (auto v : sorted)
+            sum += double(v);
+        auto p99 = sorted.begin() + std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+        std::nth_element(sorted.begin(), p99, sorted.end());
+        double scale = std::max<double>(1, double(*p99));
+        auto largest = *std::max_element(values.begin(), values.end());
+
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (auto v : values) {
+            auto c = heat(std::fmin(1.0, v / scale));
+            out << int(255.999 * c.x()) << ' ' << int(255.999 * c.y()) << ' '
+                << int(255.999 * c.z()) << '\n';
+        }
+
+        std::clog << filename << ": " << label << " per ray, mean " << sum / values.size()
+                  << ", red from " << scale << " (99th percentile), max " << largest << '\n';
+    }
+
+    static color heat(double x) {
+        // Blue, cyan, green, yellow, red.
+        static const color stops[] = {
+            color(0,0,1), color(0,1,1), color(0,1,0), color(1,1,0), color(1,0,0)
+        };
+        auto f = x * 4;
+        int k = std::min(3, int(f));
+        return stops[k] + (f - k) * (stops[k + 1] - stops[k]);
+    }
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "GlassTracer.h"
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class bvh_cache {
+  public:
+    // Built flat_bvh trees kept in a directory across runs, one file per scene, named after a
+    // hash of the objects' shapes and the build settings. A scene that hashes the same as a
+    // cached one has its tree mapped in from the file instead of built. Only the tree is
+    // stored: the objects themselves come from the list passed in, so materials and anything
+    // else the builders don't look at can change freely.
+    //
+    // A file with the wrong format version, a different node size or byte order, a different
+    // hash, or contents that don't form a valid tree is ignored and replaced by a rebuild.
+    // The boxes in the nodes aren't checked against the objects, so a file damaged without
+    // breaking the tree structure can cost hits; delete the directory to start over.
+
+    static const uint32_t format_version = 1;
+
+    explicit bvh_cache(const std::string& directory) : directory(directory) {}
+
+    shared_ptr<flat_bvh> build(const hittable_list& list, const bvh_settings& settings) {
+        // The BVH for list, from the cache if possible. Otherwise builds it and stores it.
+        auto key = scene_key(list.objects, settings);
+        auto path = file_path(key);
+
+        auto bvh = make_shared<flat_bvh>(settings);
+        if (load(path, key, list.objects, *bvh)) {
+            loads++;
+            return bvh;
+        }
+
+        bvh = make_shared<flat_bvh>(list, settings);
+        builds++;
+        save(path, key, *bvh);
+        return bvh;
+    }
+
+    static uint64_t scene_key(
+        const std::vector<shared_ptr<hittable>>& objects, const bvh_settings& settings
+    ) {
+        // Changes whenever a rebuild could give a different tree.
+        int32_t fields[] = {
+            int32_t(settings.builder), settings.max_leaf_size, settings.morton_bits,
+            settings.treelet_passes, int32_t(settings.layout), int32_t(objects.size())
+        };
+        auto key = hash_bytes(fields, sizeof(fields));
+        key = hash_bytes(&settings.split_budget, sizeof(settings.split_budget), key);
+        for (const auto& object : objects) {
+            auto shape = object->shape_hash();
+            key = hash_bytes(&shape, sizeof(shape), key);
+        }
+        return key;
+    }
+
+    std::string file_path(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+        return (std::filesystem::path(directory) / name).string();
+    }
+
+    size_t loads = 0;    // Trees taken from the cache.
+    size_t builds = 0;   // Trees built because the cache had no usable one.
+
+  private:
+    // File layout: this header, then the nodes starting at byte 64, then the leaf sources.
+    struct header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t byte_order;   // 0x01020304 as written.
+        uint32_t node_size;
+        uint32_t reserved;
+        uint64_t key;
+        uint64_t node_count;
+        uint64_t leaf_count;
+        uint64_t object_count;
+    };
+    static_assert(sizeof(header) <= 64, "the nodes start at byte 64");
+    static constexpr char file_magic[8] = { 'G','T','B','V','H','\0','\0','\0' };
+    static const size_t nodes_offset = 64;
+
+    std::string directory;
+
+    static bool load(
+        const std::string& path, uint64_t key, const std::vector<shared_ptr<hittable>>& objects,
+        flat_bvh& bvh
+    ) {
+        // Maps the file, checks it, and hands its contents to flat_bvh::restore().
+        const char* data = nullptr;
+        size_t size = 0;
+
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            size = size_t(info.st_size);
+            mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = static_cast<const char*>(mapped);
+#else
+        std::vector<char> buffer;
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+#endif
+
+        bool loaded = false;
+        header h;
+        if (size >= nodes_offset) {
+            std::memcpy(&h, data, sizeof(h));
+            bool matches = std::memcmp(h.magic, file_magic, sizeof(file_magic)) == 0
+                        && h.version == format_version
+                        && h.byte_order == 0x01020304
+                        && h.node_size == sizeof(flat_bvh::node)
+                        && h.key == key
+                        && h.object_count == objects.size()
+                        && h.node_count <= (size - nodes_offset) / sizeof(flat_bvh::node)
+                        && h.leaf_count <= size / sizeof(int)
+                        && size == nodes_offset + h.node_count * sizeof(flat_bvh::node)
+                                 + h.leaf_count * sizeof(int);
+            if (matches) {
+                // The mapping is page aligned and the nodes start on a cache line, so they can
+                // be read in place; the leaf sources follow 64-byte nodes, so stay aligned too.
+                auto tree = reinterpret_cast<const flat_bvh::node*>(data + nodes_offset);
+                auto leaf_sources = reinterpret_cast<const int*>(tree + h.node_count);
+                loaded = bvh.restore(objects, tree, h.node_count, leaf_sources, h.leaf_count);
+            }
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(mapped, size);
+#endif
+        return loaded;
+    }
+
+    void save(const std::string& path, uint64_t key, const flat_bvh& bvh) const {
+        // Writes to a temporary file and renames it into place, so a run that stops halfway,
+        // or another process reading the cache, never sees a partial file. Failing to write
+        // only costs the next run a rebuild.
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+
+        const auto& tree = bvh.node_data();
+        const auto& leaf_sources = bvh.leaf_sources();
+        header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, file_magic, sizeof(file_magic));
+        h.version = format_version;
+        h.byte_order = 0x01020304;
+        h.node_size = sizeof(flat_bvh::node);
+        h.key = key;
+        h.node_count = tree.size();
+        h.leaf_count = leaf_sources.size();
+        h.object_count = bvh.source_count();
+
+        char padded[nodes_offset] = {};
+        std::memcpy(padded, &h, sizeof(h));
+
+        auto temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(padded, sizeof(padded));
+            file.write(reinterpret_cast<const char*>(tree.data()),
+                       std::streamsize(tree.size() * sizeof(flat_bvh::node)));
+            file.write(reinterpret_cast<const char*>(leaf_sources.data()),
+                       std::streamsize(leaf_sources.size() * sizeof(int)));
+            if (!file) {
+                std::clog << "bvh_cache: could not write " << temporary << '\n';
+                file.close();
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error)
+            std::filesystem::remove(temporary, error);
+    }
+};
+
+#endif
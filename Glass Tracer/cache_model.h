@@ -0,0 +1,51 @@
+#ifndef CACHE_MODEL_H
+#define CACHE_MODEL_H
+
+#include <cstdint>
+#include <vector>
+
+class cache_model {
+  public:
+    // A set-associative cache with LRU replacement, fed the addresses a traversal touches.
+    // It stands in for hardware miss counters where those aren't available, and gives the
+    // same numbers on every run.
+
+    cache_model(size_t bytes, int line_bytes = 64, int ways = 8)
+      : line_shift(0), ways(ways)
+    {
+        while ((size_t(1) << line_shift) < size_t(line_bytes))
+            line_shift++;
+        sets = bytes / line_bytes / ways;
+        if (sets == 0) sets = 1;
+        tags.assign(sets * ways, ~uint64_t(0));
+    }
+
+    void access(const void* address) {
+        auto line = uint64_t(reinterpret_cast<uintptr_t>(address)) >> line_shift;
+        auto* set = &tags[(line % sets) * ways];
+        accesses++;
+
+        // The set is kept in most-recently-used order.
+        int way = 0;
+        while (way < ways && set[way] != line)
+            way++;
+        if (way == ways) {
+            misses++;
+            way = ways - 1;
+        }
+        for (; way > 0; way--)
+            set[way] = set[way - 1];
+        set[0] = line;
+    }
+
+    size_t accesses = 0;
+    size_t misses = 0;
+
+  private:
+    int line_shift;
+    int ways;
+    size_t sets;
+    std::vector<uint64_t> tags;
+};
+
+#endif
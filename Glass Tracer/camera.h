@@ -1,10 +1,21 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "bvh_analysis.h"
+#include "guiding.h"
+#include "heterogeneous_medium.h"
 #include "hittable.h"
+#include "irradiance_cache.h"
+#include "lightmap.h"
+#include "lights.h"
+#include "manifold.h"
 #include "material.h"
+#include "parallel.h"
+#include "photon_map.h"
+#include "restir.h"
 
 #include <fstream>
+#include <vector>
 
 class camera {
   public:
@@ -13,6 +24,7 @@ class camera {
     int    samples_per_pixel = 10;   // Count of random samples for each pixel
     int    max_depth         = 10;   // Maximum number of ray bounces into scene
     color  background;               // Scene background color
+    shared_ptr<environment_map> environment;  // Replaces the background when set
 
 
     double vfov = 90;  // Vertical view angle (field of view)
@@ -23,6 +35,20 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    bool sample_lights = false; // Sample emissive quads and spheres directly (see ray_color)
+    bool sample_caustics = false;  // Also sample them through glass spheres (see manifold_nee)
+    light_selection choose_lights = light_selection::bvh;  // How each light sample picks a light
+    bool resample_lights = false;  // Direct light at first hits by reservoir reuse (see light_resampler)
+    restir_settings resampling;    // Settings for resample_lights
+    bool guide_paths = false;      // Learn where light comes from as it renders (see path_guide)
+    guiding_settings guiding;      // Settings for guide_paths
+    bool map_caustics = false;     // Caustics from photons traced from the lights (see caustic_photons)
+    caustic_settings caustics;     // Settings for map_caustics
+    bool cache_irradiance = false; // Light between diffuse surfaces from shared records (see irradiance_cache)
+    irradiance_settings irradiance;  // Settings for cache_irradiance
+    bool use_lightmaps = false;    // Light between diffuse surfaces from baked lightmaps (see bake())
+    bool track_transmittance = true;  // Light samples through heterogeneous media by ratio tracking (see medium_list)
+
     void render(const hittable& world) {
         initialize();
 
@@ -33,26 +59,120 @@ class camera {
             return;
         }
 
+        auto pixels = render_pixels(world);
+
         output_file << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        for (const auto& pixel_color : pixels)
+            write_color(output_file, pixel_color);
 
-        for (int j = 0; j < image_height; j++) {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            for (int i = 0; i < image_width; i++) {
-                color pixel_color(0,0,0);
-                for (int sample = 0; sample < samples_per_pixel; sample++) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                write_color(output_file, pixel_samples_scale * pixel_color);
-            }
-        }
-        
         output_file.flush();
         output_file.close();
 
         std::clog << "\rDone.                 \n";
     }
 
+    std::vector<color> render_pixels(const hittable& world) {
+        // The image in linear color, in scanline order, without writing it out.
+        initialize();
+
+        light_list lights;
+        lights.selection = choose_lights;
+        if (sample_lights) {
+            lights.collect(world);
+            lights.environment = environment;
+        }
+        manifolds.reset();
+        if (sample_caustics && !map_caustics && lights.size() > 0) {
+            auto glass = make_shared<manifold_nee>(world);
+            if (!glass->empty())
+                manifolds = glass;
+        }
+        find_media(world, lights);
+        if (resample_lights && !lights.empty() && max_depth > 1)
+            return render_resampled(world, lights);
+        if (guide_paths && max_depth > 1)
+            return render_guided(world, lights);
+        if (map_caustics && lights.size() > 0 && max_depth > 1)
+            return render_caustics(world, lights);
+        if ((cache_irradiance || use_lightmaps) && max_depth > 1)
+            return render_cached(world, lights);
+
+        // Rows are spread over all hardware threads, as in the other renders, so that each of
+        // those compares with this one at the same thread count.
+        std::vector<color> pixels(size_t(image_width) * image_height);
+        int threads = thread_count();
+        parallel_chunks(size_t(threads), threads, [&](int c, size_t, size_t) {
+            for (int j = c; j < image_height; j += threads) {
+                if (c == 0)
+                    std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
+                for (int i = 0; i < image_width; i++) {
+                    color pixel_color(0,0,0);
+                    for (int sample = 0; sample < samples_per_pixel; sample++) {
+                        ray r = get_ray(i, j);
+                        pixel_color += ray_color(r, max_depth, world, lights, 0);
+                    }
+                    pixels[size_t(j) * image_width + i] = pixel_samples_scale * pixel_color;
+                }
+            }
+        });
+        return pixels;
+    }
+
+    void bake(const hittable& world, lightmap& maps) {
+        // Fills maps with the irradiance reaching each of its texels from all but the lights,
+        // from maps.settings.rays cosine-distributed rays, stratified as irradiance_cache's
+        // are. The lights are left out for the light sample that use_lightmaps takes where it
+        // looks the texels up, as they are from irradiance_cache's records.
+        light_list lights;
+        lights.selection = choose_lights;
+        if (sample_lights) {
+            lights.collect(world);
+            lights.environment = environment;
+        }
+        manifolds.reset();
+        find_media(world, lights);
+
+        int rings = std::max(2, int(std::sqrt(maps.settings.rays / pi) + 0.5));
+        int sectors = std::max(3, maps.settings.rays / rings);
+        maps.bake([&](const point3& p, const vec3& normal) {
+            onb frame(normal);
+            color sum(0,0,0);
+            for (int k = 0; k < sectors; k++) {
+                for (int j = 0; j < rings; j++) {
+                    auto sin_theta = std::sqrt((j + random_double()) / rings);
+                    auto cos_theta = std::sqrt(1 - sin_theta * sin_theta);
+                    auto phi = 2 * pi * (k + random_double()) / sectors;
+                    auto direction = frame.transform(vec3(sin_theta * std::cos(phi),
+                                                          sin_theta * std::sin(phi), cos_theta));
+                    ray sample(p, direction, random_double());
+                    sum += ray_color(sample, max_depth-1, world, lights, cos_theta / pi, true);
+                }
+            }
+            return pi * sum / (double(rings) * sectors);
+        });
+    }
+
+    // Forgets the frames resample_lights reuses, as after a cut to another shot.
+    void reset_history() { resampler.reset(); }
+
+    void render_heatmap(const hittable& world, const std::string& nodes_file = "heatmap_nodes.ppm",
+                        const std::string& objects_file = "heatmap_objects.ppm") {
+        // Instead of an image of the scene, two images of the work its primary rays take: BVH
+        // nodes visited and objects tested per pixel, one ray each (see traversal_heatmap).
+        initialize();
+
+        traversal_heatmap heatmap(image_width, image_height);
+        for (int j = 0; j < image_height; j++) {
+            for (int i = 0; i < image_width; i++) {
+                traversal_counts counts;
+                hit_record rec;
+                counted_hit(world, get_ray(i, j), interval(0.001, infinity), rec, counts);
+                heatmap.record(i, j, counts);
+            }
+        }
+        heatmap.write(nodes_file, objects_file);
+    }
+
   private:
     int    image_height;   // Rendered image height
     double pixel_samples_scale;  // Color scale factor for a sum of pixel samples
@@ -63,6 +183,13 @@ class camera {
     vec3   u, v, w;              // Camera frame basis vectors
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radiusZ   
+    light_resampler resampler;   // Reservoirs kept from one frame to the next
+    shared_ptr<path_guide> guide;  // While guide_paths renders; see render_guided()
+    bool learning = false;         // Whether paths record their light into guide
+    shared_ptr<caustic_photons> photons;  // While map_caustics renders; see render_caustics()
+    shared_ptr<manifold_nee> manifolds;   // With sample_caustics, when there is glass to sample through
+    shared_ptr<medium_list> media;        // With light samples, when there is smoke to see them through
+    shared_ptr<irradiance_cache> cache;   // While cache_irradiance renders; see render_cached()
 
 
     void initialize() {
@@ -107,6 +234,290 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     }
 
+    std::vector<color> render_resampled(const hittable& world, const light_list& lights) {
+        // Each sample per pixel is a frame for light_resampler: the camera rays' first hits
+        // and everything they see but the lights' direct light, then that from the resampler,
+        // which keeps reusing its reservoirs across calls as the camera moves.
+        auto size = size_t(image_width) * image_height;
+        std::vector<color> pixels(size, color(0,0,0));
+        std::vector<shading_point> points(size);
+        camera_view view{ center, pixel00_loc, pixel_delta_u, pixel_delta_v };
+        resampler.settings = resampling;
+
+        for (int sample = 0; sample < samples_per_pixel; sample++) {
+            std::clog << "\rFrames remaining: " << (samples_per_pixel - sample) << ' ' << std::flush;
+            for (int j = 0; j < image_height; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    auto k = size_t(j) * image_width + i;
+                    pixels[k] += first_hit(get_ray(i, j), world, lights, points[k]);
+                }
+            }
+            auto direct = resampler.direct_light(points, image_width, view, world, lights);
+            for (size_t k = 0; k < size; k++)
+                pixels[k] += direct[k];
+        }
+
+        for (auto& pixel_color : pixels)
+            pixel_color *= pixel_samples_scale;
+        return pixels;
+    }
+
+    std::vector<color> render_guided(const hittable& world, const light_list& lights) {
+        // Passes of 1, 2, 4, ... samples per pixel, each learning into a path_guide that the
+        // next one samples from. The last pass also takes whatever of samples_per_pixel would
+        // be left for a shorter one after it. Every pass is an unbiased image of its own, so
+        // the result is their average by samples. Rows are spread over all hardware threads,
+        // which record into the guide without locks and draw random numbers each from a
+        // generator of their own.
+        auto size = size_t(image_width) * image_height;
+        std::vector<color> pixels(size, color(0,0,0));
+        guide = make_shared<path_guide>(world.bounding_box(), guiding);
+
+        int threads = thread_count();
+        int done = 0;
+        for (int pass_samples = 1; done < samples_per_pixel; pass_samples *= 2) {
+            auto remaining = samples_per_pixel - done;
+            if (remaining < 3 * pass_samples)
+                pass_samples = remaining;
+            learning = pass_samples < remaining;
+            std::clog << "\rSamples remaining: " << remaining << ' ' << std::flush;
+
+            parallel_chunks(size_t(threads), threads, [&](int c, size_t, size_t) {
+                for (int j = c; j < image_height; j += threads) {
+                    for (int i = 0; i < image_width; i++) {
+                        color pixel_color(0,0,0);
+                        for (int sample = 0; sample < pass_samples; sample++)
+                            pixel_color += ray_color(get_ray(i, j), max_depth, world, lights, 0);
+                        pixels[size_t(j) * image_width + i] += pixel_color;
+                    }
+                }
+            });
+
+            done += pass_samples;
+            if (learning)
+                guide->refine(pass_samples);
+        }
+
+        guide.reset();
+        learning = false;
+        for (auto& pixel_color : pixels)
+            pixel_color *= pixel_samples_scale;
+        return pixels;
+    }
+
+    std::vector<color> render_caustics(const hittable& world, const light_list& lights) {
+        // Each sample per pixel is a pass: photons from the lights, then camera paths that
+        // take caustics from them, recording where they first meet a diffuse surface (see
+        // visible_hit()) for the photons to be gathered at. Photons and camera rows are both
+        // spread over all hardware threads.
+        auto size = size_t(image_width) * image_height;
+        std::vector<color> pixels(size, color(0,0,0));
+        std::vector<visible_point> points(size);
+
+        // Gather radii start from the width of each pixel where its ray first hits.
+        std::vector<double> footprints(size, 0.0);
+        int threads = thread_count();
+        parallel_chunks(size_t(threads), threads, [&](int c, size_t, size_t) {
+            for (int j = c; j < image_height; j += threads) {
+                for (int i = 0; i < image_width; i++) {
+                    auto r = get_ray(i, j);
+                    hit_record rec;
+                    if (world.hit(r, interval(0.001, infinity), rec))
+                        footprints[size_t(j) * image_width + i] = r.spread() * rec.t;
+                }
+            }
+        });
+        auto map = make_shared<caustic_photons>();
+        map->settings = caustics;
+        map->reset(footprints);
+        photons = map;
+
+        for (int sample = 0; sample < samples_per_pixel; sample++) {
+            std::clog << "\rPasses remaining: " << (samples_per_pixel - sample) << ' ' << std::flush;
+            map->trace(world, lights, max_depth);
+            parallel_chunks(size_t(threads), threads, [&](int c, size_t, size_t) {
+                for (int j = c; j < image_height; j += threads) {
+                    for (int i = 0; i < image_width; i++) {
+                        auto k = size_t(j) * image_width + i;
+                        pixels[k] += visible_hit(get_ray(i, j), world, lights, points[k]);
+                    }
+                }
+            });
+            map->gather(points);
+        }
+
+        photons.reset();
+        for (size_t k = 0; k < size; k++)
+            pixels[k] = pixel_samples_scale * pixels[k] + map->radiance(k);
+        return pixels;
+    }
+
+    std::vector<color> render_cached(const hittable& world, const light_list& lights) {
+        // Camera paths that take the light reflected onto the first diffuse surface they meet
+        // from baked lightmaps or an irradiance_cache (see cached_hit()), filling the cache as
+        // they go. A first pass of one ray per pixel only fills it, so that no part of the
+        // image is drawn while the cache there is still sparse. Rows are spread over all
+        // hardware threads, which share the cache.
+        auto size = size_t(image_width) * image_height;
+        std::vector<color> pixels(size, color(0,0,0));
+        if (cache_irradiance)
+            cache = make_shared<irradiance_cache>(world.bounding_box(), irradiance);
+
+        int threads = thread_count();
+        for (int pass = cache ? 0 : 1; pass < 2; pass++) {
+            std::clog << "\r" << (pass == 0 ? "Filling irradiance cache" : "Rendering") << ' ' << std::flush;
+            parallel_chunks(size_t(threads), threads, [&](int c, size_t, size_t) {
+                for (int j = c; j < image_height; j += threads) {
+                    for (int i = 0; i < image_width; i++) {
+                        if (pass == 0) {
+                            cached_hit(get_ray(i, j), world, lights);
+                            continue;
+                        }
+                        color pixel_color(0,0,0);
+                        for (int sample = 0; sample < samples_per_pixel; sample++)
+                            pixel_color += cached_hit(get_ray(i, j), world, lights);
+                        pixels[size_t(j) * image_width + i] = pixel_samples_scale * pixel_color;
+                    }
+                }
+            });
+        }
+
+        cache.reset();
+        return pixels;
+    }
+
+    color first_hit(const ray& r, const hittable& world, const light_list& lights, shading_point& point) const {
+        // As ray_color(), without the light sample at the first surface, which is recorded in
+        // point for light_resampler instead.
+        point.valid = false;
+        hit_record rec;
+        if (!world.hit(r, interval(0.001, infinity), rec))
+            return environment ? environment->value(r.direction()) : background;
+
+        ray scattered;
+        color attenuation;
+        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        if (!rec.mat->scatter(r, rec, attenuation, scattered))
+            return color_from_emission;
+
+        point = { true, r, rec };
+        auto pdf = rec.mat->pdf(r, rec, scattered.direction());
+        return color_from_emission
+             + attenuation * ray_color(scattered, max_depth-1, world, lights, pdf, true);
+    }
+
+    color visible_hit(const ray& r, const hittable& world, const light_list& lights, visible_point& point) const {
+        // As ray_color(), following r through mirrors and glass to the first diffuse surface,
+        // which is recorded in point for caustic_photons. From there on, light that reaches
+        // that surface through mirrors and glass alone is left to the photons.
+        point.valid = false;
+        ray current = r;
+        color weight(1,1,1);
+        color result(0,0,0);
+        for (int depth = max_depth; depth > 0; depth--) {
+            hit_record rec;
+            if (!world.hit(current, interval(0.001, infinity), rec))
+                return result + weight * (environment ? environment->value(current.direction()) : background);
+
+            ray scattered;
+            color attenuation;
+            result += weight * rec.mat->emitted(rec.u, rec.v, rec.p);
+            if (!rec.mat->scatter(current, rec, attenuation, scattered))
+                return result;
+
+            auto pdf = rec.mat->pdf(current, rec, scattered.direction());
+            if (pdf <= 0) {
+                weight = weight * attenuation;
+                current = scattered;
+                continue;
+            }
+
+            // Volumes have no surface to gather photons on, so paths from them keep caustics.
+            // Nor does the last surface, whose light paths end too soon to take in.
+            bool gathers = rec.mat->is_surface() && depth > 1;
+            if (gathers)
+                point = { true, current, rec, weight };
+
+            color color_from_lights(0,0,0);
+            if (depth > 1)
+                color_from_lights = sample_light(current, rec, world, lights);
+            color incoming = ray_color(scattered, depth-1, world, lights, pdf, false, gathers);
+            return result + weight * (color_from_lights + attenuation * incoming);
+        }
+        return result;
+    }
+
+    color cached_hit(const ray& r, const hittable& world, const light_list& lights) const {
+        // As ray_color(), following r through mirrors and glass to the first diffuse surface,
+        // where the light other surfaces reflect onto it comes from its lightmap or the cache
+        // rather than a scattered ray. With no scattered ray to find the lights, its light
+        // sample takes all of their light.
+        ray current = r;
+        color weight(1,1,1);
+        color result(0,0,0);
+        double travelled = 0;   // For the width of a pixel where the path lands.
+        for (int depth = max_depth; depth > 0; depth--) {
+            hit_record rec;
+            if (!world.hit(current, interval(0.001, infinity), rec))
+                return result + weight * (environment ? environment->value(current.direction()) : background);
+
+            // Volumes, and the last surface, which has no light to cache, are left to
+            // ray_color(), which finds them again.
+            if (!rec.mat->is_surface() || depth == 1)
+                return result + weight * ray_color(current, depth, world, lights, 0);
+            travelled += rec.t * current.direction().length();
+
+            ray scattered;
+            color attenuation;
+            result += weight * rec.mat->emitted(rec.u, rec.v, rec.p);
+            if (!rec.mat->scatter(current, rec, attenuation, scattered))
+                return result;
+
+            auto pdf = rec.mat->pdf(current, rec, scattered.direction());
+            if (pdf <= 0) {
+                weight = weight * attenuation;
+                current = scattered;
+                continue;
+            }
+
+            color irradiance;
+            bool baked = use_lightmaps && rec.mat->baked_irradiance(rec, irradiance);
+            if (!baked && !(cache && cache->contains(rec.p))) {
+                color incoming = ray_color(scattered, depth-1, world, lights, pdf);
+                return result + weight * (sample_light(current, rec, world, lights) + attenuation * incoming);
+            }
+            if (!baked) {
+                auto footprint = travelled * r.spread() / r.direction().length();
+                irradiance = cached_irradiance(current, rec, depth, footprint, world, lights);
+            }
+            auto reflected = rec.mat->eval(current, rec, rec.normal) * irradiance;
+            auto direct = sample_light(current, rec, world, lights, nullptr, false);
+            return result + weight * (direct + reflected);
+        }
+        return result;
+    }
+
+    color cached_irradiance(
+        const ray& r, const hit_record& rec, int depth, double footprint, const hittable& world,
+        const light_list& lights
+    ) const {
+        // The irradiance at rec.p from all but the lights, from the cache, or from a record
+        // made there when none reach it. Its rays leave the lights out as lights_resampled
+        // does, as the light sample at rec.p counts them.
+        color irradiance;
+        if (cache->lookup(rec.p, rec.normal, irradiance))
+            return irradiance;
+        auto record = cache->make_record(rec.p, rec.normal, footprint,
+            [&](const vec3& direction, double& distance) {
+                ray sample(rec.p, direction, r.time());
+                hit_record sample_rec;
+                distance = world.hit(sample, interval(0.001, infinity), sample_rec) ? sample_rec.t : infinity;
+                return ray_color(sample, depth-1, world, lights, rec.mat->pdf(r, rec, direction), true);
+            });
+        cache->add(record);
+        return record.irradiance;
+    }
+
     ray get_ray(int i, int j) const {
         // Construct a camera ray originating from the defocus disk and directed at a randomly
         // sampled point around the pixel location i, j.
@@ -121,7 +532,8 @@ class camera {
         auto ray_direction = pixel_sample - ray_origin;
         auto ray_time = random_double();
 
-        return ray(ray_origin, ray_direction, ray_time);
+        // At t=1 the ray reaches the focus plane, where it covers one pixel.
+        return ray(ray_origin, ray_direction, ray_time, pixel_delta_u.length());
     }
 
     vec3 sample_square() const {
@@ -136,27 +548,235 @@ class camera {
     }
 
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
+    color ray_color(
+        const ray& r, int depth, const hittable& world, const light_list& lights, double scatter_pdf,
+        bool lights_resampled = false, bool caustics_mapped = false,
+        const refraction_chain* chain = nullptr
+    ) const {
+        // Light reaches each surface two ways: along the scattered ray, when it happens to hit
+        // a light, and along a ray sampled toward the lights (next-event estimation). Both are
+        // counted, weighted by the power heuristic of their two pdfs (multiple importance
+        // sampling), so each covers the cases where the other is noisy: small lights for the
+        // scattered ray, large lights and glossy surfaces for the light sample.
+        //
+        // scatter_pdf is the pdf with which r was scattered, or zero when it couldn't have
+        // been picked by light sampling (camera rays, mirrors, glass), which gives light it
+        // hits full weight.
+        //
+        // With lights_resampled, the lights seen from where r was scattered have already been
+        // accounted for (by light_resampler, or a light sample at full weight), so any listed
+        // light r hits counts for nothing instead.
+        //
+        // While a path_guide is learning, surfaces whose material has a pdf() take the
+        // scattered direction from it or from the material, by guiding.bsdf_fraction, and
+        // record the light that comes back along it.
+        //
+        // While map_caustics renders, diffuse surfaces take the light reaching them through
+        // mirrors and glass alone from the photons instead. With caustics_mapped, the last
+        // surface before r that isn't a mirror or glass is one of them, so a listed light r
+        // hits right after a mirror or glass counts for nothing here.
+        //
+        // With sample_caustics, surfaces also take a light sample through glass spheres from
+        // manifold_nee. chain is the path since the last surface that scatters diffusely, when
+        // it has only refracted through glass since, so that a light it reaches is weighted
+        // against manifold_nee finding the same path.
+
         // Verifica si se ha llegado al limite de rebotes de rayos de luz permitidos
         if (depth <= 0)
             return color(0,0,0);
 
        hit_record rec;
 
-        // If the ray hits nothing, return the background color.
-        if (!world.hit(r, interval(0.001, infinity), rec))
-            return background;
+        // If the ray hits nothing, return the background color, or the environment's light
+        // from that direction, weighted like any other light.
+        if (!world.hit(r, interval(0.001, infinity), rec)) {
+            if (!environment)
+                return background;
+            color color_from_environment = environment->value(r.direction());
+            if (scatter_pdf > 0 && lights.environment) {
+                if (lights_resampled)
+                    return color(0,0,0);
+                auto light_pdf = lights.pdf_value(r.origin(), r.direction());
+                color_from_environment *= power_heuristic(scatter_pdf, light_pdf);
+            }
+            return color_from_environment;
+        }
 
         ray scattered;
         color attenuation;
         color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
 
+        if (scatter_pdf > 0 && !lights.empty() && color_from_emission.length_squared() > 0) {
+            if (lights_resampled) {
+                if (is_listed_light(r, rec, lights))
+                    color_from_emission = color(0,0,0);
+            } else {
+                auto light_pdf = lights.pdf_value(r.origin(), r.direction());
+                color_from_emission *= power_heuristic(scatter_pdf, light_pdf);
+            }
+        }
+        if (caustics_mapped && scatter_pdf == 0 && color_from_emission.length_squared() > 0
+            && is_listed_light(r, rec, lights))
+            color_from_emission = color(0,0,0);
+        if (chain && chain->count > 0 && scatter_pdf == 0 && color_from_emission.length_squared() > 0) {
+            auto glass_pdf = manifolds->pdf_value(*chain, r, rec, lights);
+            if (glass_pdf > 0)
+                color_from_emission *= power_heuristic(chain->pdf, glass_pdf);
+        }
+
         if (!rec.mat->scatter(r, rec, attenuation, scattered))
             return color_from_emission;
 
-        color color_from_scatter = attenuation * ray_color(scattered, depth-1, world);
+        auto pdf = rec.mat->pdf(r, rec, scattered.direction());
+
+        // Paths end after max_depth surfaces either way, so the last surface gets no light
+        // sample: the scattered ray wouldn't be traced to match it. Nor does it use or teach
+        // the guide, as nothing can come back along its scattered ray.
+        const direction_tree* guide_tree = nullptr;
+        if (guide && depth > 1 && pdf > 0)
+            guide_tree = guide->distribution(rec.p, rec.normal);
+
+        color color_from_lights(0,0,0);
+        if (depth > 1)
+            color_from_lights = sample_light(r, rec, world, lights, guide_tree);
+        if (manifolds && depth > 1 && pdf > 0)
+            color_from_lights += sample_glass(r, rec, world, lights, depth, guide_tree);
+
+        if (guide_tree) {
+            // Either way the direction is weighted by the pdf of picking it from the mix.
+            if (random_double() >= guide->settings.bsdf_fraction)
+                scattered = ray(rec.p, guide_tree->random(), r.time());
+            pdf = mixed_pdf(r, rec, scattered.direction(), guide_tree);
+            attenuation = rec.mat->eval(r, rec, scattered.direction());
+            if (pdf <= 0 || attenuation.length_squared() == 0)
+                return color_from_emission + color_from_lights;
+            attenuation = attenuation / pdf;
+        }
+
+        color color_from_caustics(0,0,0);
+        bool gathers = photons && depth > 1 && pdf > 0 && rec.mat->is_surface();
+        if (gathers)
+            color_from_caustics = photons->estimate(r, rec);
+
+        bool mapped = (pdf > 0) ? gathers : caustics_mapped;
+
+        refraction_chain next_chain;
+        const refraction_chain* followed = nullptr;
+        if (manifolds && pdf > 0) {
+            next_chain.origin = rec.p;
+            next_chain.pdf = pdf;
+            followed = &next_chain;
+        } else if (chain && chain->count < 2 && rec.mat->index_of_refraction() > 0
+                   && dot(scattered.direction(), rec.normal) < 0) {
+            next_chain = *chain;
+            next_chain.vertices[next_chain.count++] = rec.p;
+            followed = &next_chain;
+        }
+
+        color incoming = ray_color(scattered, depth-1, world, lights, pdf, false, mapped, followed);
+        if (learning && depth > 1 && pdf > 0)
+            guide->record(rec.p, rec.normal, scattered.direction(), luminance(incoming) / pdf);
+        color color_from_scatter = attenuation * incoming;
+
+        return color_from_emission + color_from_lights + color_from_caustics + color_from_scatter;
+    }
+
+    void find_media(const hittable& world, const light_list& lights) {
+        // The heterogeneous media for light samples to see through, if there are any.
+        media.reset();
+        if (!track_transmittance || lights.empty())
+            return;
+        auto smoke = make_shared<medium_list>(world);
+        if (!smoke->empty())
+            media = smoke;
+    }
+
+    color sample_light(
+        const ray& r, const hit_record& rec, const hittable& world, const light_list& lights,
+        const direction_tree* guide_tree = nullptr, bool weighted = true
+    ) const {
+        // One light sample from rec.p. The shadow ray keeps whatever it hits first, light or
+        // not, rather than only testing for occlusion: the scattered ray does the same, so
+        // both estimate the same thing even where a light the list doesn't hold is in the way.
+        // Collisions in the heterogeneous media, though, are passed by, and the light is
+        // scaled by their ratio-tracked transmittance instead (see medium_list).
+        // guide_tree is the path guide's distribution at rec.p, if the scattered ray uses it.
+        // Unless weighted, the sample takes all of the light, for when no scattered ray will.
+        if (lights.empty())
+            return color(0,0,0);
+
+        auto direction = lights.random(rec.p);
+        if (direction.length_squared() == 0)
+            return color(0,0,0);
+        auto light_pdf = lights.pdf_value(rec.p, direction);
+        if (light_pdf <= 0)
+            return color(0,0,0);
+
+        color f = rec.mat->eval(r, rec, direction);
+        if (f.length_squared() == 0)
+            return color(0,0,0);
+
+        color emission;
+        hit_record light_rec;
+        ray shadow(rec.p, direction, r.time());
+        interval shadow_t(0.001, infinity);
+        bool found = world.hit(shadow, shadow_t, light_rec);
+        while (found && media && media->passes(light_rec)) {
+            shadow_t.min = light_rec.t;
+            found = world.hit(shadow, shadow_t, light_rec);
+        }
+        if (found)
+            emission = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+        else if (lights.environment)
+            emission = lights.environment->value(direction);
+        else
+            return color(0,0,0);
+        if (emission.length_squared() == 0)
+            return color(0,0,0);
+        if (media)
+            emission *= media->transmittance(shadow, interval(0.001, found ? light_rec.t : infinity));
+
+        auto weight = weighted ? power_heuristic(light_pdf, mixed_pdf(r, rec, direction, guide_tree)) : 1.0;
+        return weight * f * emission / light_pdf;
+    }
+
+    color sample_glass(
+        const ray& r, const hit_record& rec, const hittable& world, const light_list& lights,
+        int depth, const direction_tree* guide_tree
+    ) const {
+        // manifold_nee's light sample through glass, weighted against the scattered ray
+        // finding the same paths, as in sample_light().
+        manifold_sample samples[manifold_nee::max_samples];
+        auto count = manifolds->sample(r, rec, world, lights, depth, samples);
+        color sum(0,0,0);
+        for (int k = 0; k < count; k++) {
+            const auto& s = samples[k];
+            auto weight = power_heuristic(s.pdf, mixed_pdf(r, rec, s.direction, guide_tree));
+            sum += weight * s.value / s.pdf;
+        }
+        return sum;
+    }
+
+    double mixed_pdf(const ray& r, const hit_record& rec, const vec3& direction,
+                     const direction_tree* guide_tree) const {
+        // The pdf of scattering toward direction, from the material and the guide together.
+        auto pdf = rec.mat->pdf(r, rec, direction);
+        if (!guide_tree)
+            return pdf;
+        auto fraction = guide->settings.bsdf_fraction;
+        return fraction * pdf + (1 - fraction) * guide_tree->pdf_value(direction);
+    }
+
+    static bool is_listed_light(const ray& r, const hit_record& rec, const light_list& lights) {
+        // Whether the surface r hit at rec is one of lights, rather than an emitter the list
+        // doesn't hold (which light_resampler can't have sampled).
+        hit_record light_rec;
+        return lights.hit(r, interval(0.001, infinity), light_rec)
+            && std::fabs(light_rec.t - rec.t) <= 1e-9 * std::fmax(1.0, rec.t);
+    }
 
-        return color_from_emission + color_from_scatter;
+    static double power_heuristic(double pdf, double other_pdf) {
+        return pdf*pdf / (pdf*pdf + other_pdf*other_pdf);
     }
 };
 
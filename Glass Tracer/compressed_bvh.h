@@ -0,0 +1,294 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include "GlassTracer.h"
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class compressed_bvh : public hittable {
+  public:
+    // A 4-wide BVH whose child boxes are stored as 8-bit coordinates on a small grid fitted to
+    // the parent box, so one 64-byte node (a cache line) describes four children, where a
+    // flat_bvh spends 64 bytes on each one. It is built by collapsing the binary tree of a
+    // flat_bvh, and shares that tree's object order.
+    //
+    // Quantization always rounds child boxes outward, and the encoder checks every decoded
+    // bound against the exact one, so decoded boxes always contain the exact ones. Traversal
+    // widens its slab distances to cover its own rounding. Boxes get a little looser; no hits
+    // are lost.
+    //
+    // A leaf holds at most max_leaf_count objects. Larger leaves of the source tree are split
+    // into runs under an extra node, each run with the whole leaf's box.
+
+    static const int width = 4;
+    static const int max_leaf_count = 255;   // What wide_node::leaf_count can hold.
+
+    explicit compressed_bvh(const flat_bvh& source) : objects(source.leaf_objects()) {
+        bbox = source.bounding_box();
+        const auto& tree = source.node_data();
+        if (tree.empty())
+            return;
+
+        nodes.reserve(tree.size() / 2 + 1);
+        build(tree);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+
+        // Pending subtrees with their entry distances, so ones behind the closest hit so far
+        // are dropped when popped.
+        struct entry { int index; int count; double t; };
+        traversal_stack<entry> stack;
+        stack.push({ 0, 0, ray_t.min });
+        bool hit_anything = false;
+
+        while (!stack.empty()) {
+            auto e = stack.pop();
+            if (e.t >= ray_t.max)
+                continue;
+
+            if (e.count > 0) {
+                for (int i = e.index; i < e.index + e.count; i++) {
+                    if (objects[i]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            const auto& n = nodes[e.index];
+            double t_enter[width], t_exit[width];
+            for (int c = 0; c < width; c++) {
+                t_enter[c] = ray_t.min;
+                t_exit[c] = ray_t.max;
+            }
+
+            for (int axis = 0; axis < 3; axis++) {
+                // Slab distances straight from the grid coordinates: t = base + step * q.
+                auto base = (n.origin[axis] - r.origin()[axis]) * inv_dir[axis];
+                auto step = power_of_two(n.exponent[axis]) * inv_dir[axis];
+                const auto* near_q = (inv_dir[axis] < 0) ? n.hi[axis] : n.lo[axis];
+                const auto* far_q  = (inv_dir[axis] < 0) ? n.lo[axis] : n.hi[axis];
+                for (int c = 0; c < width; c++) {
+                    auto t0 = base + near_q[c] * step;
+                    auto t1 = base + far_q[c] * step;
+                    t1 += std::fabs(t1) * exit_margin;
+                    if (t0 > t_enter[c]) t_enter[c] = t0;
+                    if (t1 < t_exit[c]) t_exit[c] = t1;
+                }
+            }
+
+            // Push the children that were hit, farthest first, so the nearest is popped next.
+            int order[width];
+            int hits = 0;
+            for (int c = 0; c < width; c++) {
+                if (n.child[c] < 0 || t_exit[c] <= t_enter[c])
+                    continue;
+                int k = hits++;
+                while (k > 0 && t_enter[order[k-1]] < t_enter[c]) {
+                    order[k] = order[k-1];
+                    k--;
+                }
+                order[k] = c;
+            }
+            for (int k = 0; k < hits; k++) {
+                int c = order[k];
+                stack.push({ n.child[c], n.leaf_count[c], t_enter[c] });
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    size_t memory_usage() const {
+        // Bytes held by the nodes and the object references, not counting the objects.
+        return sizeof(*this) + nodes.capacity() * sizeof(wide_node)
+             + objects.capacity() * sizeof(shared_ptr<hittable>);
+    }
+
+  private:
+    struct alignas(64) wide_node {
+        float   origin[3];           // Grid origin, at or below the node's box minimum.
+        int8_t  exponent[3];         // Grid spacing along each axis is 2^exponent.
+        uint8_t lo[3][width];        // Child box bounds, in grid steps from the origin.
+        uint8_t hi[3][width];
+        uint8_t leaf_count[width];   // Objects in a leaf child, zero for interior or empty slots.
+        int32_t child[width];        // Interior: node index. Leaf: first object. Empty: -1.
+    };
+
+    // Computing slab distances from the grid in one step rounds differently from decoding the
+    // box first; pushing every exit distance out by a few ulps keeps the test conservative
+    // (Pharr et al., Physically Based Rendering, section 3.9).
+    static constexpr double exit_margin = 4 * std::numeric_limits<double>::epsilon();
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<wide_node> nodes;
+    aabb bbox;
+
+    static double power_of_two(int exponent) {
+        // 2^exponent, built directly from the bits of a double.
+        uint64_t bits = uint64_t(exponent + 1023) << 52;
+        double result;
+        std::memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    void build(const std::vector<flat_bvh::node>& tree) {
+        // Wide nodes in depth first order, from a stack of the subtrees still to build rather
+        // than by recursion, since trees grown by insertion can be as deep as they have
+        // objects. Each pending subtree is either a node of the source tree, whose wide node
+        // keeps opening the interior child with the largest surface area until there are
+        // `width` children, or a run of a leaf with more objects than one leaf_count holds.
+        struct subtree {
+            int parent, slot;   // The wide node and child slot to point at this one, if any.
+            int source;         // Node of the source tree; for a run, the leaf it is from.
+            int first, count;   // A run's objects, or count zero for the whole source node.
+        };
+        std::vector<subtree> pending = { { -1, 0, 0, 0, 0 } };
+
+        while (!pending.empty()) {
+            auto s = pending.back();
+            pending.pop_back();
+
+            int index = int(nodes.size());
+            nodes.push_back(wide_node());
+            if (s.parent >= 0)
+                nodes[s.parent].child[s.slot] = index;
+
+            // Subtrees below this node, pushed last to first so they are built in order.
+            subtree below[width];
+            int below_count = 0;
+            auto& n = nodes[index];
+            if (s.count > 0) {
+                // Even shares of the run, in leaves of up to max_leaf_count or, for very
+                // large runs, in further nodes like this one, all with the whole leaf's box.
+                const auto& box = tree[s.source].bbox;
+                int share = (s.count + width - 1) / width;
+                if (share < max_leaf_count)
+                    share = max_leaf_count;
+                int child_count = (s.count + share - 1) / share;
+                aabb boxes[width];
+                for (int c = 0; c < width; c++)
+                    boxes[c] = box;
+                quantize(n, box, boxes, child_count);
+
+                for (int c = 0; c < width; c++) {
+                    int run = std::min(share, s.count - c*share);
+                    n.child[c] = -1;
+                    n.leaf_count[c] = 0;
+                    if (run > max_leaf_count) {
+                        below[below_count++] = { index, c, s.source, s.first + c*share, run };
+                    } else if (run > 0) {
+                        n.child[c] = s.first + c*share;
+                        n.leaf_count[c] = uint8_t(run);
+                    }
+                }
+            } else {
+                // A leaf at the root becomes a node with that single leaf as its child.
+                int children[width];
+                int child_count = 0;
+                if (tree[s.source].count > 0) {
+                    children[child_count++] = s.source;
+                } else {
+                    children[child_count++] = tree[s.source].first;
+                    children[child_count++] = tree[s.source].first + 1;
+                }
+
+                while (child_count < width) {
+                    int largest = -1;
+                    double largest_area = -1;
+                    for (int c = 0; c < child_count; c++) {
+                        if (tree[children[c]].count > 0) continue;
+                        auto area = tree[children[c]].bbox.surface_area();
+                        if (area > largest_area) { largest = c; largest_area = area; }
+                    }
+                    if (largest < 0) break;
+
+                    int opened = children[largest];
+                    children[largest] = tree[opened].first;
+                    children[child_count++] = tree[opened].first + 1;
+                }
+
+                aabb boxes[width];
+                for (int c = 0; c < child_count; c++)
+                    boxes[c] = tree[children[c]].bbox;
+                quantize(n, tree[s.source].bbox, boxes, child_count);
+
+                for (int c = 0; c < width; c++) {
+                    n.child[c] = -1;
+                    n.leaf_count[c] = 0;
+                    if (c >= child_count)
+                        continue;
+                    const auto& child = tree[children[c]];
+                    if (child.count > max_leaf_count) {
+                        below[below_count++] = { index, c, children[c], child.first, child.count };
+                    } else if (child.count > 0) {
+                        n.child[c] = child.first;
+                        n.leaf_count[c] = uint8_t(child.count);
+                    } else {
+                        below[below_count++] = { index, c, children[c], 0, 0 };
+                    }
+                }
+            }
+
+            while (below_count > 0)
+                pending.push_back(below[--below_count]);
+        }
+    }
+
+    static void quantize(wide_node& n, const aabb& parent, const aabb* boxes, int child_count) {
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& range = parent.axis_interval(axis);
+
+            // A float origin at or below the parent minimum, and the smallest power-of-two
+            // spacing whose 255 steps reach the parent maximum from there.
+            float origin = float(range.min);
+            if (double(origin) > range.min)
+                origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+            int exponent;
+            std::frexp((range.max - origin) / 255, &exponent);
+            exponent = std::max(exponent, -126);
+            while (origin + 255 * power_of_two(exponent) < range.max)
+                exponent++;
+
+            n.origin[axis] = origin;
+            n.exponent[axis] = int8_t(exponent);
+            double scale = power_of_two(exponent);
+
+            for (int c = 0; c < width; c++) {
+                if (c >= child_count) {
+                    n.lo[axis][c] = n.hi[axis][c] = 0;
+                    continue;
+                }
+                const auto& box = boxes[c].axis_interval(axis);
+                int lo = int(std::floor((box.min - origin) / scale));
+                int hi = int(std::ceil((box.max - origin) / scale));
+                lo = std::max(0, std::min(255, lo));
+                hi = std::max(0, std::min(255, hi));
+                while (lo > 0 && origin + lo * scale > box.min) lo--;
+                while (hi < 255 && origin + hi * scale < box.max) hi++;
+                n.lo[axis][c] = uint8_t(lo);
+                n.hi[axis][c] = uint8_t(hi);
+            }
+        }
+    }
+};
+
+#endif
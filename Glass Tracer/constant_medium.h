@@ -18,31 +18,32 @@ class constant_medium : public hittable {
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record rec1, rec2;
+        // Where the ray enters and leaves the boundary, found in one pass over it.
+        ray_crossings boundary_crossings;
+        boundary->crossings(r, interval::universe, boundary_crossings);
+        auto t1 = boundary_crossings.entry;
+        auto t2 = boundary_crossings.exit;
 
-        if (!boundary->hit(r, interval::universe, rec1))
+        if (t2 == infinity)
             return false;
 
-        if (!boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
-            return false;
-
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+        if (t1 < ray_t.min) t1 = ray_t.min;
+        if (t2 > ray_t.max) t2 = ray_t.max;
 
-        if (rec1.t >= rec2.t)
+        if (t1 >= t2)
             return false;
 
-        if (rec1.t < 0)
-            rec1.t = 0;
+        if (t1 < 0)
+            t1 = 0;
 
         auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+        auto distance_inside_boundary = (t2 - t1) * ray_length;
         auto hit_distance = neg_inv_density * std::log(random_double());
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / ray_length;
+        rec.t = t1 + hit_distance / ray_length;
         rec.p = r.at(rec.t);
 
         rec.normal = vec3(1,0,0);  // arbitrary
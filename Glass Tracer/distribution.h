@@ -0,0 +1,100 @@
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include "GlassTracer.h"
+
+#include <algorithm>
+#include <vector>
+
+class distribution_1d {
+  public:
+    // A piecewise-constant distribution over [0,1), split into as many equal parts as there
+    // are weights, each part as likely as its weight. Negative weights count as zero; if
+    // they are all zero, every part is equally likely.
+
+    distribution_1d() {}
+
+    explicit distribution_1d(const std::vector<double>& weights)
+      : cdf(weights.size() + 1, 0.0)
+    {
+        for (size_t i = 0; i < weights.size(); i++)
+            cdf[i+1] = cdf[i] + std::fmax(weights[i], 0.0);
+        sum = cdf.back();
+
+        for (size_t i = 1; i < cdf.size(); i++)
+            cdf[i] = (sum > 0) ? cdf[i] / sum : double(i) / weights.size();
+    }
+
+    size_t size() const { return cdf.empty() ? 0 : cdf.size() - 1; }
+
+    // The sum of the weights, before normalizing.
+    double total() const { return sum; }
+
+    double chance(size_t i) const {
+        // Probability of the part i.
+        return cdf[i+1] - cdf[i];
+    }
+
+    double pdf(double x) const {
+        // Density at x in [0,1).
+        return chance(part(x)) * size();
+    }
+
+    double sample(double u, size_t& i) const {
+        // Maps a uniform u in [0,1) to a point in [0,1) with this distribution, setting i to
+        // the part it falls in. Within the part, u is rescaled linearly.
+        i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+        i = std::min(i, size() - 1);
+        while (chance(i) <= 0 && i > 0)   // Only when u lands exactly on a boundary.
+            i--;
+        auto offset = (u - cdf[i]) / chance(i);
+        return std::fmin((i + std::clamp(offset, 0.0, 1.0)) / size(), 1 - 1e-12);
+    }
+
+  private:
+    std::vector<double> cdf;
+    double sum = 0;
+
+    size_t part(double x) const {
+        return std::min(size_t(std::fmax(x, 0.0) * size()), size() - 1);
+    }
+};
+
+class distribution_2d {
+  public:
+    // A piecewise-constant distribution over [0,1)², given by a grid of weights in rows of
+    // the given width. Samples pick a row from the row sums, then a point within it.
+
+    distribution_2d() {}
+
+    distribution_2d(const std::vector<double>& weights, int width) {
+        int height = int(weights.size()) / width;
+        std::vector<double> row_sums(height);
+        rows.reserve(height);
+        for (int j = 0; j < height; j++) {
+            std::vector<double> row(weights.begin() + size_t(j) * width,
+                                    weights.begin() + size_t(j + 1) * width);
+            rows.emplace_back(row);
+            row_sums[j] = rows.back().total();
+        }
+        marginal = distribution_1d(row_sums);
+    }
+
+    double pdf(double x, double y) const {
+        // Density at (x,y) in [0,1)², where y selects the row.
+        auto j = std::min(size_t(std::fmax(y, 0.0) * rows.size()), rows.size() - 1);
+        return marginal.chance(j) * rows.size() * rows[j].pdf(x);
+    }
+
+    void sample(double u1, double u2, double& x, double& y) const {
+        size_t i, j;
+        y = marginal.sample(u1, j);
+        x = rows[j].sample(u2, i);
+    }
+
+  private:
+    std::vector<distribution_1d> rows;
+    distribution_1d marginal;   // Over the rows, by their sums.
+};
+
+#endif
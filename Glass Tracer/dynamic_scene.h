@@ -0,0 +1,174 @@
+#ifndef DYNAMIC_SCENE_H
+#define DYNAMIC_SCENE_H
+
+#include "GlassTracer.h"
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+
+#include <algorithm>
+#include <vector>
+
+class scene_object : public instance {
+  public:
+    // An instance whose material, when set, replaces whatever the geometry reports, so one
+    // piece of geometry can be shown in different materials.
+    scene_object(shared_ptr<hittable> object, const affine_transform& xform,
+                 shared_ptr<material> mat = nullptr)
+      : instance(object, xform), mat(mat)
+    {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!instance::hit(r, ray_t, rec))
+            return false;
+        if (mat)
+            rec.mat = mat;
+        return true;
+    }
+
+    void set_material(shared_ptr<material> m) { mat = m; }
+
+  private:
+    shared_ptr<material> mat;
+};
+
+class dynamic_scene : public hittable {
+  public:
+    // A scene that stays editable after it is built. Objects are added as instances and
+    // referred to by the handle insert() returns; they can be moved, given another material
+    // or removed. Edits are collected until commit(), which updates the BVH over them with as
+    // little work as the edits allow:
+    //
+    //   - a material change needs none;
+    //   - an insert, a removal or a move changes the tree next to the object, a move being a
+    //     removal and an insert (flat_bvh::insert(), remove() and reinsert());
+    //   - more moves than min_bulk and a fraction bulk of the scene, as in an animation,
+    //     refit the boxes above the moved objects instead;
+    //   - as many new objects make for a full rebuild.
+    //
+    // After enough edits, commit() also checks the tree's SAH cost and rebuilds the part of
+    // it that has degraded past rebuild_threshold (flat_bvh::rebuild_degraded()). Call
+    // commit() before tracing rays; in between, moved objects may be missed.
+    //
+    // remove(), set_transform() and set_material() return false, and do nothing, for a
+    // handle insert() never returned or whose object has been removed.
+
+    using handle = int;
+
+    double rebuild_threshold = 1.3;    // See flat_bvh::rebuild_degraded().
+    double check_interval    = 0.01;   // Edits between quality checks, as a fraction of objects.
+    double bulk              = 0.125;  // Edits of one kind, as a fraction of objects, that
+    size_t min_bulk          = 64;     // are applied all at once.
+
+    explicit dynamic_scene(const bvh_settings& settings = bvh_settings())
+      : settings(settings), bvh(settings)
+    {}
+
+    handle insert(shared_ptr<hittable> object, const affine_transform& xform = affine_transform(),
+                  shared_ptr<material> mat = nullptr) {
+        entries.push_back(make_shared<scene_object>(object, xform, mat));
+        removing.push_back(0);
+        return handle(entries.size() - 1);
+    }
+
+    bool remove(handle h) {
+        if (!valid(h))
+            return false;
+        removed.push_back(h);
+        removing[h] = 1;
+        return true;
+    }
+
+    bool set_transform(handle h, const affine_transform& xform) {
+        if (!valid(h))
+            return false;
+        entries[h]->set_transform(xform);
+        if (size_t(h) < bvh.source_count())
+            moved.push_back(h);
+        return true;
+    }
+
+    bool set_material(handle h, shared_ptr<material> mat) {
+        if (!valid(h))
+            return false;
+        entries[h]->set_material(mat);
+        return true;
+    }
+
+    size_t commit() {
+        // Applies the edits since the last commit to the BVH. Returns the number of objects
+        // that were rebuilt rather than updated in place.
+        size_t in_tree = bvh.source_count();
+        size_t added = entries.size() - in_tree;
+        size_t rebuilt = 0;
+        edits += added + removed.size() + moved.size();
+
+        if (is_bulk(added)) {
+            for (auto h : removed)
+                entries[h] = nullptr;
+            hittable_list all;
+            all.objects.assign(entries.begin(), entries.end());
+            bvh = flat_bvh(all, settings);
+            live = entries.size() - std::count(entries.begin(), entries.end(), nullptr);
+            rebuilt = live;
+            edits = 0;
+        } else {
+            for (size_t h = in_tree; h < entries.size(); h++) {
+                bvh.insert(entries[h]);
+                live++;
+            }
+            for (auto h : removed) {
+                if (!entries[h])
+                    continue;
+                bvh.remove(h);
+                entries[h] = nullptr;
+                live--;
+            }
+            if (is_bulk(moved.size())) {
+                bvh.refit(moved);
+            } else {
+                for (auto h : moved)
+                    bvh.reinsert(h);
+            }
+        }
+        removed.clear();
+        moved.clear();
+
+        if (edits > check_interval * live) {
+            rebuilt += bvh.rebuild_degraded(rebuild_threshold);
+            edits = 0;
+        }
+        return rebuilt;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return bvh.hit(r, ray_t, rec);
+    }
+
+    aabb bounding_box() const override { return bvh.bounding_box(); }
+
+    size_t object_count() const { return live; }
+    const flat_bvh& hierarchy() const { return bvh; }
+
+  private:
+    bvh_settings settings;
+    flat_bvh bvh;
+    std::vector<shared_ptr<scene_object>> entries;   // By handle; null once removed.
+    std::vector<handle> removed, moved;              // Edits waiting for commit().
+    std::vector<char> removing;                      // By handle, set once in removed.
+    size_t live = 0;                                 // Objects in the BVH.
+    size_t edits = 0;                                // Edits since the last quality check.
+
+    bool valid(handle h) const {
+        // Removals take effect at commit(), but the handle is stale from remove() on.
+        return h >= 0 && size_t(h) < entries.size() && entries[h] && !removing[h];
+    }
+
+    bool is_bulk(size_t count) const {
+        return count > min_bulk && count > bulk * (live + count);
+    }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "GlassTracer.h"
+
+#include "color.h"
+#include "distribution.h"
+#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <vector>
+
+class environment_map {
+  public:
+    // Light arriving from infinitely far away, from an equirectangular (latitude-longitude)
+    // image: columns go once around the y axis, and rows from straight up (+y) at the top to
+    // straight down at the bottom. The mapping is the same as sphere::get_sphere_uv(), so an
+    // image shows the same way as it would on a sphere around the origin seen from inside.
+    //
+    // Directions can be sampled in proportion to the luminance of the image, so a sun a few
+    // pixels across is found by nearly every light sample instead of by the few scattered
+    // rays that happen to point at it. Each pixel is sampled uniformly in (u,v), so the
+    // density toward a direction is the pixel's chance divided by the solid angle it
+    // covers, which shrinks with sin(theta) near the poles.
+
+    environment_map(const char* filename, double scale = 1.0) {
+        // Loads an image through rtw_image, usually Radiance .hdr for the range a sky needs;
+        // 8-bit images work too, as linear values up to 1. If it can't be loaded, the map is
+        // a single magenta pixel.
+        rtw_image image(filename);
+        width = std::max(1, image.width());
+        height = std::max(1, image.height());
+        pixels.resize(size_t(width) * height);
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                auto rgb = image.float_pixel_data(i, j);
+                pixels[size_t(j) * width + i] = scale * color(rgb[0], rgb[1], rgb[2]);
+            }
+        }
+        build();
+    }
+
+    environment_map(const std::vector<color>& pixels, int width)
+      : pixels(pixels), width(width), height(int(pixels.size()) / width)
+    {
+        // From pixels already in memory, in scanline order from the top.
+        build();
+    }
+
+    color value(const vec3& direction) const {
+        auto [u, v] = to_uv(unit_vector(direction));
+        return pixels[pixel_index(u, v)];
+    }
+
+    double pdf_value(const vec3& direction) const {
+        auto [u, v] = to_uv(unit_vector(direction));
+        auto sin_theta = std::sin(v * pi);
+        if (sin_theta <= 0)
+            return 0;
+        return distribution.pdf(u, v) / (2 * pi * pi * sin_theta);
+    }
+
+    vec3 random() const {
+        double u, v;
+        distribution.sample(random_double(), random_double(), u, v);
+        auto theta = v * pi;
+        auto phi = u * 2 * pi;
+        return vec3(-std::cos(phi) * std::sin(theta), std::cos(theta), std::sin(phi) * std::sin(theta));
+    }
+
+    int image_width() const { return width; }
+    int image_height() const { return height; }
+
+  private:
+    std::vector<color> pixels;
+    int width, height;
+    distribution_2d distribution;
+
+    void build() {
+        // Each pixel weighted by its luminance and by sin(theta), for the solid angle it
+        // covers, so that the wide rows around the pole don't soak up samples.
+        std::vector<double> weights(pixels.size());
+        for (int j = 0; j < height; j++) {
+            auto sin_theta = std::sin(pi * (j + 0.5) / height);
+            for (int i = 0; i < width; i++) {
+                auto k = size_t(j) * width + i;
+                weights[k] = luminance(pixels[k]) * sin_theta;
+            }
+        }
+        distribution = distribution_2d(weights, width);
+    }
+
+    static std::pair<double, double> to_uv(const vec3& d) {
+        // u around the y axis as in sphere::get_sphere_uv(); v from the top of the image.
+        auto theta = std::acos(std::clamp(d.y(), -1.0, 1.0));
+        auto phi = std::atan2(-d.z(), d.x()) + pi;
+        return { phi / (2 * pi), theta / pi };
+    }
+
+    size_t pixel_index(double u, double v) const {
+        auto i = std::min(int(u * width), width - 1);
+        auto j = std::min(int(v * height), height - 1);
+        return size_t(j) * width + i;
+    }
+};
+
+#endif
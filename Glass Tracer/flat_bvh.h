@@ -0,0 +1,1674 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "GlassTracer.h"
+
+#include "aabb.h"
+#include "cache_model.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "parallel.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+enum class bvh_builder {
+    median,   // Top-down, splitting each span of objects at the median of its longest axis.
+    lbvh,     // Linear BVH: objects sorted along a Morton curve, hierarchy read off the codes.
+    sbvh      // Binned SAH, plus spatial splits that clip objects straddling a split plane.
+};
+
+enum class bvh_layout {
+    depth_first,     // As built: every subtree contiguous, first child's subtree first.
+    breadth_first,   // Level by level, so the top levels sit together.
+    van_emde_boas,   // Top half of the levels, then each subtree below it, laid out recursively.
+    treelets         // Page-sized clusters of the nodes most likely to be visited together.
+};
+
+class bvh_settings {
+  public:
+    bvh_builder builder = bvh_builder::median;
+    int max_leaf_size   = 2;   // Subtrees with this many objects or fewer become one leaf.
+    int morton_bits     = 63;  // LBVH key width: 30 (10 bits per axis) or 63 (21 bits per axis).
+    int treelet_passes  = 0;   // Treelet restructuring passes run over the finished tree.
+
+    // SBVH: extra object references that spatial splits may create, as a fraction of the
+    // object count. Zero gives a plain SAH build.
+    double split_budget = 0.3;
+
+    bvh_layout layout = bvh_layout::depth_first;   // Node order in memory, see reorder().
+};
+
+class traversal_counts {
+  public:
+    size_t nodes = 0;     // Node boxes tested.
+    size_t objects = 0;   // Object intersection tests.
+
+    cache_model* cache = nullptr;   // If set, receives the address of every node tested.
+};
+
+class flat_bvh : public hittable {
+  public:
+    // A BVH over arbitrary hittables, stored as one array of nodes instead of a tree of
+    // shared_ptr nodes. The hierarchy can come from several builders (see bvh_builder), which
+    // trade build time against tree quality; sah_cost() measures the result.
+
+    // One cache line per node. The node array is a std::vector, which from C++17 on allocates
+    // over-aligned types at their alignment, so no node straddles two lines.
+    struct alignas(64) node {
+        aabb  bbox;
+        int   first;        // Leaf: first entry in objects. Interior: index of the first of two children.
+        int   count;        // Number of objects in a leaf, zero for interior nodes.
+        int   axis;         // Axis along which the first child is the lower one.
+        float built_area;   // Surface area when the node was built, for degradation().
+    };
+    static_assert(sizeof(node) == 64 && alignof(node) == 64, "a node fills one cache line");
+
+    // Children always come after their parent in the node array, whatever the layout.
+
+    flat_bvh(const hittable_list& list, const bvh_settings& settings = bvh_settings())
+      : settings(settings)
+    {
+        build(list.objects);
+    }
+
+    // An empty BVH, to be filled by restore().
+    explicit flat_bvh(const bvh_settings& settings) : settings(settings) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return traverse<false>(r, ray_t, rec, nullptr);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec, traversal_counts& counts) const {
+        // Same as hit(), also adding up the work done into counts.
+        return traverse<true>(r, ray_t, rec, &counts);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size() - garbage; }
+
+    // Object references in the leaves. Spatial splits can make this larger than the number
+    // of objects, since a split object is referenced from both sides.
+    size_t reference_count() const { return objects.size(); }
+
+    // The finished layout, for structures derived from this one. The root is node 0.
+    const std::vector<node>& node_data() const { return nodes; }
+    const std::vector<shared_ptr<hittable>>& leaf_objects() const { return objects; }
+
+    size_t source_count() const { return sources.size(); }
+
+    // Index in the list the BVH was built from of each entry of leaf_objects(), or -1 for
+    // entries no leaf uses any more.
+    const std::vector<int>& leaf_sources() const { return source_of_slot; }
+
+    bool restore(
+        const std::vector<shared_ptr<hittable>>& source, const node* tree, size_t tree_size,
+        const int* leaf_source, size_t leaf_count
+    ) {
+        // Takes over a tree saved from node_data() and leaf_sources() of a BVH built over the
+        // same objects, instead of building one. The data is checked to describe a tree over
+        // source whose traversal stays in bounds: every index and axis in range, children
+        // after their parents, and every node reached from the root exactly once, so that no
+        // two parents share children and the work of a traversal stays within the size of
+        // the tree. Trees holding the garbage of edits don't pass; reorder() drops it. If the
+        // data doesn't pass, the BVH is left empty and false is returned. Whether the boxes
+        // fit the objects is the caller's business.
+        build(std::vector<shared_ptr<hittable>>());
+        if (tree_size > size_t(INT32_MAX) || leaf_count > size_t(INT32_MAX))
+            return false;
+
+        // Entries outside every leaf, left behind by remove(), hold -1.
+        for (size_t slot = 0; slot < leaf_count; slot++)
+            if (leaf_source[slot] < -1 || leaf_source[slot] >= int64_t(source.size()))
+                return false;
+        for (size_t i = 0; i < tree_size; i++) {
+            const auto& n = tree[i];
+            bool valid = n.axis >= 0 && n.axis <= 2 && ((n.count > 0)
+                ? n.first >= 0 && int64_t(n.first) + n.count <= int64_t(leaf_count)
+                : n.count == 0 && size_t(n.first) > i && size_t(n.first) + 1 < tree_size);
+            for (int slot = n.first; valid && n.count > 0 && slot < n.first + n.count; slot++)
+                valid = leaf_source[slot] >= 0 && source[leaf_source[slot]];
+            if (!valid)
+                return false;
+        }
+
+        // The walk stops at the first node reached twice, so it takes no more steps than there
+        // are nodes.
+        std::vector<char> reached(tree_size, 0);
+        size_t reached_count = 0;
+        std::vector<int> pending;
+        if (tree_size > 0)
+            pending.push_back(0);
+        while (!pending.empty()) {
+            int i = pending.back();
+            pending.pop_back();
+            if (reached[i])
+                return false;
+            reached[i] = 1;
+            reached_count++;
+            if (tree[i].count == 0) {
+                pending.push_back(tree[i].first);
+                pending.push_back(tree[i].first + 1);
+            }
+        }
+        if (reached_count != tree_size)
+            return false;
+
+        sources = source;
+        nodes.assign(tree, tree + tree_size);
+        source_of_slot.assign(leaf_source, leaf_source + leaf_count);
+        objects.resize(leaf_count);
+        for (size_t slot = 0; slot < leaf_count; slot++)
+            if (source_of_slot[slot] >= 0) objects[slot] = sources[source_of_slot[slot]];
+
+        if (!nodes.empty())
+            bbox = nodes[0].bbox;
+        return true;
+    }
+
+    size_t memory_usage() const {
+        // Bytes held by the nodes and the object references, not counting the objects.
+        return sizeof(*this) + nodes.capacity() * sizeof(node)
+             + (sources.capacity() + objects.capacity()) * sizeof(shared_ptr<hittable>)
+             + source_of_slot.capacity() * sizeof(int);
+    }
+
+    void reorder(bvh_layout layout) {
+        // Moves the nodes into the given order without changing the tree. Siblings always stay
+        // side by side, so the pairs of siblings are what gets ordered, after the root.
+        if (!nodes.empty() && nodes[0].count > 0) {
+            nodes.resize(1);
+            garbage = 0;
+            topology_valid = false;
+        }
+        if (nodes.size() <= 1)
+            return;
+
+        std::vector<int> pairs;   // Index of the first node of each pair, in the new order.
+        pairs.reserve(nodes.size() / 2);
+        if (layout == bvh_layout::breadth_first) {
+            pairs.push_back(nodes[0].first);
+            for (size_t i = 0; i < pairs.size(); i++)
+                for (int child : child_pairs(pairs[i]))
+                    pairs.push_back(child);
+        } else if (layout == bvh_layout::van_emde_boas) {
+            van_emde_boas_order(nodes[0].first, pair_height(nodes[0].first), pairs);
+        } else if (layout == bvh_layout::treelets) {
+            treelet_order(pairs);
+        } else {
+            depth_first_order(nodes[0].first, pairs);
+        }
+
+        // Only reachable nodes are listed, so this also drops the garbage of partial rebuilds.
+        std::vector<int> moved_to(nodes.size(), -1);
+        moved_to[0] = 0;
+        for (size_t k = 0; k < pairs.size(); k++) {
+            moved_to[pairs[k]] = int(1 + 2*k);
+            moved_to[pairs[k] + 1] = int(2 + 2*k);
+        }
+
+        std::vector<node> reordered(1 + 2*pairs.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (moved_to[i] < 0)
+                continue;
+            auto n = nodes[i];
+            if (n.count == 0)
+                n.first = moved_to[n.first];
+            reordered[moved_to[i]] = n;
+        }
+        nodes.swap(reordered);
+        garbage = 0;
+        topology_valid = false;
+    }
+
+    double sah_cost() const {
+        // Expected cost of tracing a random ray that hits the root, relative to one object
+        // intersection, under the surface area heuristic. Lower is a better tree.
+        if (nodes.empty())
+            return 0;
+
+        double cost = 0;
+        visit([&](int i) { cost += node_weight(nodes[i]) * nodes[i].bbox.surface_area(); });
+        return cost / nodes[0].bbox.surface_area();
+    }
+
+    // Animation support. When objects move without the tree changing shape, refit() updates
+    // the boxes in place, which is much cheaper than a rebuild but lets the tree drift away
+    // from what a builder would make. degradation() measures the drift and rebuild_degraded()
+    // rebuilds as much of the tree as needed once it passes a threshold.
+
+    void refit() {
+        // Recomputes every box bottom-up from the current bounds of the objects, one level at
+        // a time, with the nodes of each level spread over all threads. Boxes that spatial
+        // splits had clipped grow back to whole objects.
+        if (nodes.empty())
+            return;
+
+        std::vector<std::vector<int>> levels = { { 0 } };
+        while (true) {
+            std::vector<int> next;
+            for (int i : levels.back()) {
+                if (nodes[i].count == 0) {
+                    next.push_back(nodes[i].first);
+                    next.push_back(nodes[i].first + 1);
+                }
+            }
+            if (next.empty())
+                break;
+            levels.push_back(std::move(next));
+        }
+
+        for (size_t depth = levels.size(); depth-- > 0; ) {
+            const auto& level = levels[depth];
+            parallel_for(level.size(), [&](size_t k) { refit_node(level[k]); });
+        }
+        bbox = nodes[0].bbox;
+    }
+
+    bool refit(const std::vector<int>& changed) {
+        // Same as refit(), restricted to the objects at the given indices of the list the BVH
+        // was built from and the nodes above them. Those nodes are refit a level at a time,
+        // deepest first, like refit() does, with the nodes of a level spread over all threads
+        // once there are enough of them. Removed objects have nothing to refit and are passed
+        // over. An index that was never given makes it return false without refitting.
+        for (int id : changed)
+            if (id < 0 || size_t(id) >= sources.size())
+                return false;
+        if (nodes.empty())
+            return true;
+
+        update_topology();
+        std::vector<int> pending;
+        for (int id : changed) {
+            for (int k = slots_start[id]; k < slots_start[id + 1]; k++) {
+                if (slots[k] < 0)
+                    continue;
+                for (int n = leaf_of_slot[slots[k]]; n >= 0 && !dirty[n]; n = parents[n]) {
+                    dirty[n] = 1;
+                    pending.push_back(n);
+                }
+            }
+        }
+
+        // Every node marked has its parent marked too, and parents come before their children,
+        // so in index order each node's depth follows from its parent's, kept in dirty as
+        // depth + 1.
+        std::sort(pending.begin(), pending.end());
+        std::vector<std::vector<int>> levels;
+        for (int n : pending) {
+            int depth = (parents[n] < 0) ? 0 : dirty[parents[n]];
+            dirty[n] = depth + 1;
+            if (int(levels.size()) <= depth)
+                levels.resize(depth + 1);
+            levels[depth].push_back(n);
+        }
+
+        for (size_t depth = levels.size(); depth-- > 0; ) {
+            const auto& level = levels[depth];
+            parallel_for(level.size(), [&](size_t k) { refit_node(level[k]); });
+        }
+        for (int n : pending)
+            dirty[n] = 0;
+        bbox = nodes[0].bbox;
+        return true;
+    }
+
+    // Editing. insert() and remove() change the tree in place in time proportional to its
+    // depth, without a rebuild; like refits, they wear down its quality over time, which
+    // degradation() reports.
+
+    int insert(shared_ptr<hittable> object) {
+        // Adds object to the BVH and returns its index, the next one after the list the BVH
+        // was built from. The object goes next to the node whose surface area it grows the
+        // least, found by walking down from the root (Goldsmith and Salmon, 1987); that leaf
+        // becomes an interior node over itself and a new leaf with the object.
+        update_topology();
+        int id = int(sources.size());
+        sources.push_back(object);
+        slots_start.push_back(slots_start.back() + 1);
+        slots.push_back(-1);
+        place(id, slots_start[id]);
+        return id;
+    }
+
+    bool reinsert(int id) {
+        // Takes the object at index id out and inserts it again where it is now. For objects
+        // that moved far, where a refit would stretch boxes across the scene. Returns false,
+        // changing nothing, if there is no object at id.
+        if (!present(id))
+            return false;
+        update_topology();
+        take_out(id);
+        place(id, slots_start[id]);
+        collect_garbage();
+        return true;
+    }
+
+    bool remove(int id) {
+        // Takes the object at index id out of the BVH for good. The index isn't reused.
+        // Returns false if there is no object at id, as after an earlier remove().
+        if (!present(id))
+            return false;
+        update_topology();
+        take_out(id);
+        sources[id] = nullptr;
+        collect_garbage();
+        return true;
+    }
+
+    bool present(int id) const {
+        // Whether id is the index of an object given and not removed since.
+        return id >= 0 && size_t(id) < sources.size() && sources[id];
+    }
+
+    void rebuild() {
+        // A full rebuild over the objects currently in the BVH, keeping their indices.
+        build(sources);
+    }
+
+    double degradation() const {
+        // SAH cost now over SAH cost when built, each relative to the root box of the time.
+        // 1 means refits and edits haven't made the tree worse; the whole scene moving or
+        // scaling together also keeps it at 1. Boxes that insert() grows keep the area they
+        // were built with, so insertions count against the tree like refits do.
+        if (nodes.empty())
+            return 1;
+
+        double now = 0, built = 0;
+        visit([&](int i) {
+            now += node_weight(nodes[i]) * nodes[i].bbox.surface_area();
+            built += node_weight(nodes[i]) * nodes[i].built_area;
+        });
+        return (now / nodes[0].bbox.surface_area()) / (built / nodes[0].built_area);
+    }
+
+    size_t rebuild_degraded(double threshold) {
+        // If degradation() is past threshold, rebuilds the smallest subtree that holds the
+        // damage: starting at the root, it steps into a child for as long as exactly one of
+        // the two children is itself degraded past threshold. Stopping at the root means a
+        // full rebuild. Returns the number of objects rebuilt, zero if none needed to be.
+        if (nodes.empty() || degradation() <= threshold)
+            return 0;
+
+        // Subtree costs now and when built, children before parents.
+        std::vector<int> order;
+        visit([&](int i) { order.push_back(i); });
+        std::vector<double> now(nodes.size()), built(nodes.size());
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            int i = *it;
+            const auto& n = nodes[i];
+            now[i] = node_weight(n) * n.bbox.surface_area();
+            built[i] = node_weight(n) * n.built_area;
+            if (n.count == 0) {
+                now[i] += now[n.first] + now[n.first + 1];
+                built[i] += built[n.first] + built[n.first + 1];
+            }
+        }
+        auto degraded = [&](int i) {
+            const auto& n = nodes[i];
+            return n.count == 0
+                && (now[i] / n.bbox.surface_area()) / (built[i] / n.built_area) > threshold;
+        };
+
+        int target = 0;
+        while (nodes[target].count == 0) {
+            int a = nodes[target].first, b = a + 1;
+            bool a_degraded = degraded(a), b_degraded = degraded(b);
+            if (a_degraded == b_degraded)
+                break;
+            target = a_degraded ? a : b;
+        }
+
+        if (target == 0) {
+            rebuild();
+            return objects.size();
+        }
+        return rebuild_subtree(target);
+    }
+
+  private:
+    // Builders produce a binary tree with one object per leaf, which is then collapsed into
+    // the flat layout above.
+    struct build_node {
+        aabb   bbox;
+        int    left = -1;     // Child indices into the build tree, -1 for leaves.
+        int    right = -1;
+        int    object = -1;   // Source object of a leaf.
+        int    count = 1;     // Objects below this node.
+        double cost = 0;      // SAH cost of the subtree, used by treelet restructuring.
+    };
+
+    struct reference {
+        aabb bbox;     // Bounds of the part of the object this reference covers.
+        int  object;
+    };
+
+    class split_choice {
+      public:
+        double cost = infinity;
+        int    axis = 0;
+        int    plane = 0;       // Bin boundary the split sits on.
+        bool   spatial = false;
+        aabb   left, right;     // Bounds of the two sides.
+        int    left_count = 0, right_count = 0;
+    };
+
+    struct morton_key {
+        uint64_t code;
+        int      object;
+    };
+
+    static constexpr double traversal_cost = 1.0;
+    static constexpr double intersection_cost = 1.0;
+    static const int treelet_size = 5;
+    static const int object_bins = 16;
+    static const int spatial_bins = 32;
+    static const int max_split_depth = 64;
+
+    // Spatial splits are only tried where the children of the best object split overlap by
+    // more than this fraction of the root's surface area (Stich et al. use 1e-5).
+    static constexpr double min_split_overlap = 1e-5;
+
+    bvh_settings settings;
+    std::vector<shared_ptr<hittable>> sources;   // The objects as given, for rebuilds.
+    std::vector<shared_ptr<hittable>> objects;   // In leaf order.
+    std::vector<int> source_of_slot;             // Index in sources of each entry of objects.
+    std::vector<node> nodes;
+    size_t garbage = 0;                          // Nodes cut off by partial rebuilds.
+    aabb bbox;
+
+    // Derived from the tree shape by update_topology(). insert() and remove() keep them up to
+    // date; anything else that changes the shape clears topology_valid.
+    bool topology_valid = false;
+    std::vector<int> parents;                    // -1 for the root and unreachable nodes.
+    std::vector<int> leaf_of_slot;               // Leaf holding each entry of objects, or -1.
+    std::vector<int> slots_start, slots;         // Entries of objects for each source, CSR;
+                                                 // -1 for entries removed since.
+    std::vector<int> dirty;                      // Scratch for refit(changed), all zero.
+
+    void build(const std::vector<shared_ptr<hittable>>& source) {
+        sources = source;
+        objects.clear();
+        source_of_slot.clear();
+        nodes.clear();
+        garbage = 0;
+        topology_valid = false;
+        bbox = aabb::empty;
+
+        // Objects taken out by remove() leave null entries, which keep their indices but
+        // aren't built into the tree.
+        std::vector<int> ids;
+        ids.reserve(sources.size());
+        for (size_t i = 0; i < sources.size(); i++)
+            if (sources[i]) ids.push_back(int(i));
+        if (ids.empty())
+            return;
+
+        std::vector<shared_ptr<hittable>> present;
+        if (ids.size() < sources.size()) {
+            for (int id : ids)
+                present.push_back(sources[id]);
+        }
+        const auto& list = present.empty() ? sources : present;
+
+        std::vector<aabb> boxes(list.size());
+        parallel_for(list.size(), [&](size_t i) { boxes[i] = list[i]->bounding_box(); });
+
+        std::vector<build_node> tree;
+        int root = build_tree(list, boxes, settings.split_budget, tree);
+
+        objects.resize(tree[root].count);
+        source_of_slot.resize(tree[root].count);
+        nodes.reserve(2 * list.size());
+        nodes.push_back(node());
+        int next_slot = 0;
+        flatten(tree, root, 0, ids, next_slot);
+        bbox = nodes[0].bbox;
+
+        reorder(settings.layout);
+    }
+
+    int build_tree(
+        const std::vector<shared_ptr<hittable>>& source, const std::vector<aabb>& boxes,
+        double split_budget, std::vector<build_node>& tree
+    ) const {
+        // Runs the configured builder and treelet passes, returning the root of the tree.
+        int root;
+        if (settings.builder == bvh_builder::lbvh) {
+            root = build_lbvh(boxes, tree);
+        } else if (settings.builder == bvh_builder::sbvh) {
+            root = build_sbvh(source, boxes, split_budget, tree);
+        } else {
+            std::vector<int> order(source.size());
+            std::iota(order.begin(), order.end(), 0);
+            tree.reserve(2 * source.size());
+            root = build_median(boxes, order, 0, order.size(), tree);
+        }
+
+        for (int pass = 0; pass < settings.treelet_passes; pass++)
+            optimize_treelets(tree, root);
+        return root;
+    }
+
+    static double node_weight(const node& n) {
+        return (n.count > 0) ? intersection_cost * n.count : traversal_cost;
+    }
+
+    template <typename F>
+    void visit(const F& f) const {
+        // Calls f(index) for every node reachable from the root, skipping garbage.
+        std::vector<int> pending = { 0 };
+        while (!pending.empty()) {
+            int i = pending.back();
+            pending.pop_back();
+            f(i);
+            if (nodes[i].count == 0) {
+                pending.push_back(nodes[i].first);
+                pending.push_back(nodes[i].first + 1);
+            }
+        }
+    }
+
+    void update_topology() {
+        if (topology_valid)
+            return;
+        topology_valid = true;
+
+        parents.assign(nodes.size(), -1);
+        dirty.assign(nodes.size(), 0);
+        leaf_of_slot.assign(objects.size(), -1);
+        if (!nodes.empty()) {
+            visit([&](int i) {
+                const auto& n = nodes[i];
+                if (n.count > 0) {
+                    for (int slot = n.first; slot < n.first + n.count; slot++)
+                        leaf_of_slot[slot] = i;
+                } else {
+                    parents[n.first] = parents[n.first + 1] = i;
+                }
+            });
+        }
+
+        slots_start.assign(sources.size() + 1, 0);
+        for (size_t slot = 0; slot < objects.size(); slot++)
+            if (leaf_of_slot[slot] >= 0) slots_start[source_of_slot[slot] + 1]++;
+        for (size_t id = 0; id < sources.size(); id++)
+            slots_start[id + 1] += slots_start[id];
+        slots.resize(slots_start.back());
+        std::vector<int> next(slots_start.begin(), slots_start.end() - 1);
+        for (size_t slot = 0; slot < objects.size(); slot++)
+            if (leaf_of_slot[slot] >= 0) slots[next[source_of_slot[slot]]++] = int(slot);
+    }
+
+    void take_out(int id) {
+        // Removes every entry of objects that refers to sources[id] from its leaf. Each leaf
+        // left empty is replaced, together with its parent, by its sibling.
+        for (int k = slots_start[id]; k < slots_start[id + 1]; k++) {
+            int slot = slots[k];
+            if (slot < 0)
+                continue;
+            slots[k] = -1;
+            int leaf = leaf_of_slot[slot];
+            auto& n = nodes[leaf];
+
+            // Move the leaf's last entry into the hole.
+            int last = n.first + n.count - 1;
+            if (slot != last) {
+                objects[slot] = objects[last];
+                source_of_slot[slot] = source_of_slot[last];
+                int moved = source_of_slot[slot];
+                for (int j = slots_start[moved]; j < slots_start[moved + 1]; j++)
+                    if (slots[j] == last) slots[j] = slot;
+            }
+            objects[last] = nullptr;
+            source_of_slot[last] = -1;
+            leaf_of_slot[last] = -1;
+            n.count--;
+
+            if (n.count > 0) {
+                refit_path(leaf);
+            } else if (leaf == 0) {
+                nodes.clear();
+                parents.clear();
+                dirty.clear();
+                garbage = 0;
+                bbox = aabb::empty;
+            } else {
+                collapse(leaf);
+            }
+        }
+    }
+
+    void place(int id, int entry) {
+        // Puts sources[id] into a new leaf, recording its entry of objects in slots[entry].
+        auto box = sources[id]->bounding_box();
+        int slot = int(objects.size());
+        objects.push_back(sources[id]);
+        source_of_slot.push_back(id);
+        slots[entry] = slot;
+
+        node leaf;
+        leaf.bbox = box;
+        leaf.first = slot;
+        leaf.count = 1;
+        leaf.axis = 0;
+        leaf.built_area = float(box.surface_area());
+
+        if (nodes.empty()) {
+            nodes.push_back(leaf);
+            parents.push_back(-1);
+            dirty.push_back(0);
+            leaf_of_slot.push_back(0);
+            bbox = box;
+            return;
+        }
+
+        // The boxes on the way down grow to hold the object, but keep their built_area, so
+        // degradation() sees what the insertion costs.
+        int target = 0;
+        while (nodes[target].count == 0) {
+            nodes[target].bbox = aabb(nodes[target].bbox, box);
+            int a = nodes[target].first, b = a + 1;
+            auto growth_a = aabb(nodes[a].bbox, box).surface_area() - nodes[a].bbox.surface_area();
+            auto growth_b = aabb(nodes[b].bbox, box).surface_area() - nodes[b].bbox.surface_area();
+            if (growth_a != growth_b)
+                target = (growth_a < growth_b) ? a : b;
+            else
+                target = (nodes[a].bbox.surface_area() < nodes[b].bbox.surface_area()) ? a : b;
+        }
+
+        int first = int(nodes.size());
+        auto old_leaf = nodes[target];
+        bool new_first = centroid(box)[old_leaf.bbox.longest_axis()]
+                       < centroid(old_leaf.bbox)[old_leaf.bbox.longest_axis()];
+        nodes.push_back(new_first ? leaf : old_leaf);
+        nodes.push_back(new_first ? old_leaf : leaf);
+        parents.push_back(target);
+        parents.push_back(target);
+        dirty.push_back(0);
+        dirty.push_back(0);
+        for (int s = old_leaf.first; s < old_leaf.first + old_leaf.count; s++)
+            leaf_of_slot[s] = new_first ? first + 1 : first;
+        leaf_of_slot.push_back(new_first ? first : first + 1);
+
+        auto& split = nodes[target];
+        split.bbox = aabb(old_leaf.bbox, box);
+        split.first = first;
+        split.count = 0;
+        split.axis = old_leaf.bbox.longest_axis();
+        split.built_area = old_leaf.built_area;
+        bbox = nodes[0].bbox;
+    }
+
+    void refit_path(int index) {
+        // Refits a node and everything above it.
+        for (int n = index; n >= 0; n = parents[n])
+            refit_node(n);
+        bbox = nodes[0].bbox;
+    }
+
+    void collapse(int leaf) {
+        // Replaces the parent of an empty leaf with the leaf's sibling. Moving a node up one
+        // place keeps its children after it.
+        int parent = parents[leaf];
+        int sibling = (leaf == nodes[parent].first) ? leaf + 1 : leaf - 1;
+        nodes[parent] = nodes[sibling];
+
+        const auto& n = nodes[parent];
+        if (n.count > 0) {
+            for (int slot = n.first; slot < n.first + n.count; slot++)
+                leaf_of_slot[slot] = parent;
+        } else {
+            parents[n.first] = parents[n.first + 1] = parent;
+        }
+        parents[leaf] = parents[sibling] = -1;
+        garbage += 2;
+
+        if (parents[parent] >= 0)
+            refit_path(parents[parent]);
+        else
+            bbox = nodes[0].bbox;
+    }
+
+    void refit_node(int index) {
+        auto& n = nodes[index];
+        if (n.count > 0) {
+            aabb box = aabb::empty;
+            for (int slot = n.first; slot < n.first + n.count; slot++)
+                box = aabb(box, objects[slot]->bounding_box());
+            n.bbox = box;
+        } else {
+            n.bbox = aabb(nodes[n.first].bbox, nodes[n.first + 1].bbox);
+        }
+    }
+
+    size_t rebuild_subtree(int root) {
+        // Rebuilds the subtree under nodes[root] from the current object bounds. Its new
+        // descendants are appended to nodes and the old ones become garbage, collected by a
+        // reorder once they outnumber the rest. The objects go back into the subtree's own
+        // entries when those are one run (as builds leave them), otherwise to the end of
+        // objects; either way there is no room for spatial splits.
+        std::vector<int> ids, old_slots;
+        size_t old_nodes = 0;
+        std::vector<int> pending = { root };
+        while (!pending.empty()) {
+            const auto& n = nodes[pending.back()];
+            pending.pop_back();
+            old_nodes++;
+            if (n.count > 0) {
+                for (int slot = n.first; slot < n.first + n.count; slot++) {
+                    ids.push_back(source_of_slot[slot]);
+                    old_slots.push_back(slot);
+                }
+            } else {
+                pending.push_back(n.first);
+                pending.push_back(n.first + 1);
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        std::sort(old_slots.begin(), old_slots.end());
+        for (int slot : old_slots) {
+            objects[slot] = nullptr;
+            source_of_slot[slot] = -1;
+        }
+
+        std::vector<shared_ptr<hittable>> subset(ids.size());
+        std::vector<aabb> boxes(ids.size());
+        parallel_for(ids.size(), [&](size_t k) {
+            subset[k] = sources[ids[k]];
+            boxes[k] = subset[k]->bounding_box();
+        });
+
+        std::vector<build_node> tree;
+        int tree_root = build_tree(subset, boxes, 0.0, tree);
+
+        int next_slot = old_slots.front();
+        if (old_slots.back() - old_slots.front() + 1 != int(old_slots.size())) {
+            next_slot = int(objects.size());
+            objects.resize(objects.size() + ids.size());
+            source_of_slot.resize(objects.size(), -1);
+        }
+        flatten(tree, tree_root, root, ids, next_slot);
+
+        garbage += old_nodes - 1;
+        topology_valid = false;
+        collect_garbage();
+        return ids.size();
+    }
+
+    void collect_garbage() {
+        // Drops unreachable nodes, through a reorder, once they make up half the array.
+        if (garbage > nodes.size() / 2)
+            reorder(settings.layout);
+    }
+
+    static point3 centroid(const aabb& box) {
+        return point3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max) / 2;
+    }
+
+    static int make_leaf(std::vector<build_node>& tree, const std::vector<aabb>& boxes, int object) {
+        build_node leaf;
+        leaf.bbox = boxes[object];
+        leaf.object = object;
+        tree.push_back(leaf);
+        return int(tree.size()) - 1;
+    }
+
+    static int build_median(
+        const std::vector<aabb>& boxes, std::vector<int>& order, size_t start, size_t end,
+        std::vector<build_node>& tree
+    ) {
+        if (end - start == 1)
+            return make_leaf(tree, boxes, order[start]);
+
+        aabb centroids = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            auto c = centroid(boxes[order[i]]);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+        int axis = centroids.longest_axis();
+
+        auto mid = start + (end - start)/2;
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+            [&boxes, axis](int a, int b) {
+                return centroid(boxes[a])[axis] < centroid(boxes[b])[axis];
+            });
+
+        int index = int(tree.size());
+        tree.push_back(build_node());
+        int left = build_median(boxes, order, start, mid, tree);
+        int right = build_median(boxes, order, mid, end, tree);
+
+        auto& n = tree[index];
+        n.left = left;
+        n.right = right;
+        n.bbox = aabb(tree[left].bbox, tree[right].bbox);
+        n.count = int(end - start);
+        return index;
+    }
+
+    // Spatial split BVH (Stich, Friedrich and Dietrich, "Spatial Splits in Bounding Volume
+    // Hierarchies", 2009). Each node takes the cheaper of a binned SAH object split and a
+    // spatial split, which cuts the node's box with a plane and clips every object reference
+    // that straddles it, so the two halves don't overlap. A straddling reference is still
+    // sent to just one side ("unsplit") when that is cheaper. Splitting stops adding
+    // references once split_budget is used up.
+
+    int build_sbvh(
+        const std::vector<shared_ptr<hittable>>& source, const std::vector<aabb>& boxes,
+        double split_budget, std::vector<build_node>& tree
+    ) const {
+        std::vector<reference> refs(boxes.size());
+        aabb bounds = aabb::empty;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            refs[i].bbox = boxes[i];
+            refs[i].object = int(i);
+            bounds = aabb(bounds, boxes[i]);
+        }
+
+        tree.reserve(2 * boxes.size());
+        return sbvh_node(source, refs, tree, size_t(split_budget * boxes.size()),
+                         bounds.surface_area(), 0);
+    }
+
+    int sbvh_node(
+        const std::vector<shared_ptr<hittable>>& source, std::vector<reference>& refs,
+        std::vector<build_node>& tree, size_t spare, double root_area, int depth
+    ) const {
+        if (int(refs.size()) <= settings.max_leaf_size)
+            return reference_leaves(refs, 0, refs.size(), tree);
+
+        aabb bounds = aabb::empty;
+        for (const auto& ref : refs)
+            bounds = aabb(bounds, ref.bbox);
+
+        auto split = best_object_split(refs);
+        if (spare > 0 && depth < max_split_depth && split.cost < infinity) {
+            auto shared = overlap(split.left, split.right);
+            if (!shared.is_empty() && shared.surface_area() > min_split_overlap * root_area) {
+                auto spatial = best_spatial_split(source, refs, bounds);
+                if (spatial.cost < split.cost)
+                    split = spatial;
+            }
+        }
+
+        std::vector<reference> left, right;
+        if (split.spatial)
+            partition_spatial(source, refs, bounds, split, spare, left, right);
+        else if (split.cost < infinity)
+            partition_objects(refs, split, left, right);
+
+        if (left.empty() || right.empty()) {
+            // No useful split, as with many identical centroids: halve the list instead.
+            left.assign(refs.begin(), refs.begin() + refs.size()/2);
+            right.assign(refs.begin() + refs.size()/2, refs.end());
+        }
+        std::vector<reference>().swap(refs);
+
+        // Share what is left of the budget in proportion to the size of each side, so the
+        // subtrees built first don't use it all up.
+        auto left_spare = size_t(double(spare) * left.size() / (left.size() + right.size()));
+        auto right_spare = spare - left_spare;
+
+        int index = int(tree.size());
+        tree.push_back(build_node());
+        int l = sbvh_node(source, left, tree, left_spare, root_area, depth + 1);
+        int r = sbvh_node(source, right, tree, right_spare, root_area, depth + 1);
+
+        auto& n = tree[index];
+        n.left = l;
+        n.right = r;
+        n.bbox = aabb(tree[l].bbox, tree[r].bbox);
+        n.count = tree[l].count + tree[r].count;
+        return index;
+    }
+
+    static int reference_leaves(
+        const std::vector<reference>& refs, size_t start, size_t end, std::vector<build_node>& tree
+    ) {
+        // A subtree holding refs[start,end) one per leaf, which flatten() collapses back into
+        // a single leaf.
+        if (end - start == 1) {
+            build_node leaf;
+            leaf.bbox = refs[start].bbox;
+            leaf.object = refs[start].object;
+            tree.push_back(leaf);
+            return int(tree.size()) - 1;
+        }
+
+        int index = int(tree.size());
+        tree.push_back(build_node());
+        auto mid = start + (end - start)/2;
+        int l = reference_leaves(refs, start, mid, tree);
+        int r = reference_leaves(refs, mid, end, tree);
+
+        auto& n = tree[index];
+        n.left = l;
+        n.right = r;
+        n.bbox = aabb(tree[l].bbox, tree[r].bbox);
+        n.count = int(end - start);
+        return index;
+    }
+
+    static int centroid_bin(double c, const interval& range) {
+        auto bin = int(object_bins * (c - range.min) / range.size());
+        return std::max(0, std::min(object_bins - 1, bin));
+    }
+
+    static split_choice best_object_split(const std::vector<reference>& refs) {
+        // Sweeps the boundaries of object_bins equal bins of the centroid range on each axis.
+        aabb centroids = aabb::empty;
+        for (const auto& ref : refs) {
+            auto c = centroid(ref.bbox);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        split_choice best;
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& range = centroids.axis_interval(axis);
+            aabb bin_box[object_bins];
+            int bin_count[object_bins] = {};
+            for (const auto& ref : refs) {
+                int b = centroid_bin(centroid(ref.bbox)[axis], range);
+                bin_box[b] = aabb(bin_box[b], ref.bbox);
+                bin_count[b]++;
+            }
+            evaluate_planes(bin_box, bin_count, bin_count, object_bins, axis, false, best);
+        }
+        return best;
+    }
+
+    static void evaluate_planes(
+        const aabb* bin_box, const int* entries, const int* exits, int bins, int axis,
+        bool spatial, split_choice& best
+    ) {
+        // SAH cost of splitting at each inner bin boundary: what enters a bin to the left
+        // goes left, what leaves a bin to the right goes right.
+        std::vector<aabb> right_box(bins);
+        std::vector<int> right_count(bins);
+        aabb box = aabb::empty;
+        int count = 0;
+        for (int b = bins - 1; b > 0; b--) {
+            box = aabb(box, bin_box[b]);
+            count += exits[b];
+            right_box[b] = box;
+            right_count[b] = count;
+        }
+
+        box = aabb::empty;
+        count = 0;
+        for (int plane = 1; plane < bins; plane++) {
+            box = aabb(box, bin_box[plane - 1]);
+            count += entries[plane - 1];
+            if (count == 0 || right_count[plane] == 0)
+                continue;
+
+            auto cost = box.surface_area() * count
+                      + right_box[plane].surface_area() * right_count[plane];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = plane;
+                best.spatial = spatial;
+                best.left = box;
+                best.right = right_box[plane];
+                best.left_count = count;
+                best.right_count = right_count[plane];
+            }
+        }
+    }
+
+    static void partition_objects(
+        const std::vector<reference>& refs, const split_choice& split,
+        std::vector<reference>& left, std::vector<reference>& right
+    ) {
+        aabb centroids = aabb::empty;
+        for (const auto& ref : refs) {
+            auto c = centroid(ref.bbox);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+        const auto& range = centroids.axis_interval(split.axis);
+        for (const auto& ref : refs) {
+            if (centroid_bin(centroid(ref.bbox)[split.axis], range) < split.plane)
+                left.push_back(ref);
+            else
+                right.push_back(ref);
+        }
+    }
+
+    static aabb with_axis(aabb box, int axis, const interval& range) {
+        // The box cut down to range along one axis.
+        auto& ax = (axis == 0) ? box.x : (axis == 1) ? box.y : box.z;
+        ax = interval(std::fmax(ax.min, range.min), std::fmin(ax.max, range.max));
+        return box;
+    }
+
+    static aabb clip_reference(
+        const std::vector<shared_ptr<hittable>>& source, const reference& ref, int axis,
+        const interval& range
+    ) {
+        auto region = with_axis(ref.bbox, axis, range);
+        if (region.is_empty())
+            return region;
+        return overlap(source[ref.object]->clipped_box(region), region);
+    }
+
+    static split_choice best_spatial_split(
+        const std::vector<shared_ptr<hittable>>& source, const std::vector<reference>& refs,
+        const aabb& bounds
+    ) {
+        // Chops every reference into the spatial_bins equal slabs of the node box it spans and
+        // bins the clipped pieces. A reference counts as entering its first slab and exiting
+        // its last one.
+        split_choice best;
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& range = bounds.axis_interval(axis);
+            auto width = range.size() / spatial_bins;
+            aabb bin_box[spatial_bins];
+            int entries[spatial_bins] = {}, exits[spatial_bins] = {};
+
+            for (const auto& ref : refs) {
+                const auto& extent = ref.bbox.axis_interval(axis);
+                int first = slab_of(extent.min, range.min, width);
+                int last = slab_of(extent.max, range.min, width);
+                entries[first]++;
+                exits[last]++;
+
+                if (first == last) {
+                    bin_box[first] = aabb(bin_box[first], ref.bbox);
+                    continue;
+                }
+                for (int b = first; b <= last; b++) {
+                    auto slab = interval(range.min + b*width, range.min + (b+1)*width);
+                    auto piece = clip_reference(source, ref, axis, slab);
+                    if (!piece.is_empty())
+                        bin_box[b] = aabb(bin_box[b], piece);
+                }
+            }
+            evaluate_planes(bin_box, entries, exits, spatial_bins, axis, true, best);
+        }
+        return best;
+    }
+
+    static int slab_of(double x, double origin, double width) {
+        return std::max(0, std::min(spatial_bins - 1, int((x - origin) / width)));
+    }
+
+    static void partition_spatial(
+        const std::vector<shared_ptr<hittable>>& source, const std::vector<reference>& refs,
+        const aabb& bounds, const split_choice& split, size_t& spare,
+        std::vector<reference>& left, std::vector<reference>& right
+    ) {
+        const auto& range = bounds.axis_interval(split.axis);
+        auto width = range.size() / spatial_bins;
+        auto plane = range.min + split.plane * width;
+        auto left_area = split.left.surface_area();
+        auto right_area = split.right.surface_area();
+
+        for (const auto& ref : refs) {
+            int first = slab_of(ref.bbox.axis_interval(split.axis).min, range.min, width);
+            int last = slab_of(ref.bbox.axis_interval(split.axis).max, range.min, width);
+            if (last < split.plane) {
+                left.push_back(ref);
+                continue;
+            }
+            if (first >= split.plane) {
+                right.push_back(ref);
+                continue;
+            }
+
+            // Straddles the plane. Clip it, unless keeping it whole on one side costs less.
+            auto l = clip_reference(source, ref, split.axis, interval(-infinity, plane));
+            auto r = clip_reference(source, ref, split.axis, interval(plane, +infinity));
+            if (l.is_empty() || r.is_empty()) {
+                (l.is_empty() ? right : left).push_back(ref);
+                continue;
+            }
+
+            auto split_cost = left_area * split.left_count + right_area * split.right_count;
+            auto left_cost = aabb(split.left, ref.bbox).surface_area() * split.left_count
+                           + right_area * (split.right_count - 1);
+            auto right_cost = left_area * (split.left_count - 1)
+                            + aabb(split.right, ref.bbox).surface_area() * split.right_count;
+
+            if (spare > 0 && split_cost < std::min(left_cost, right_cost)) {
+                spare--;
+                left.push_back(reference{l, ref.object});
+                right.push_back(reference{r, ref.object});
+            } else if (left_cost <= right_cost) {
+                left.push_back(ref);
+            } else {
+                right.push_back(ref);
+            }
+        }
+    }
+
+    // Linear BVH construction (Karras, "Maximizing Parallelism in the Construction of BVHs,
+    // Octrees, and k-d Trees", 2012). Every step is a flat parallel loop: quantize centroids
+    // to Morton codes, radix sort them, then find the children of each of the n-1 interior
+    // nodes independently from the common prefixes of neighboring codes, and finally compute
+    // boxes bottom-up.
+
+    int build_lbvh(const std::vector<aabb>& boxes, std::vector<build_node>& tree) const {
+        int n = int(boxes.size());
+        tree.assign(2*size_t(n) - 1, build_node());
+
+        // Interior nodes take indices [0,n-1) with the root at 0, leaves follow in code order.
+        if (n == 1) {
+            tree[0].bbox = boxes[0];
+            tree[0].object = 0;
+            return 0;
+        }
+
+        aabb centroids = aabb::empty;
+        for (const auto& box : boxes) {
+            auto c = centroid(box);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        int bits_per_axis = (settings.morton_bits <= 30) ? 10 : 21;
+        std::vector<morton_key> keys(n);
+        parallel_for(n, [&](size_t i) {
+            keys[i].code = morton_code(centroid(boxes[i]), centroids, bits_per_axis);
+            keys[i].object = int(i);
+        });
+        radix_sort(keys, 3 * bits_per_axis);
+
+        auto leaf = [n](int i) { return n - 1 + i; };
+        std::vector<int> parent(tree.size(), -1);
+
+        parallel_for(n, [&](size_t i) {
+            tree[leaf(int(i))].bbox = boxes[keys[i].object];
+            tree[leaf(int(i))].object = keys[i].object;
+        });
+
+        parallel_for(n - 1, [&](size_t index) {
+            int i = int(index);
+            int first, last, split;
+            find_range_and_split(keys, i, first, last, split);
+
+            auto& node = tree[i];
+            node.left  = (first == split)    ? leaf(split)     : split;
+            node.right = (last == split + 1) ? leaf(split + 1) : split + 1;
+            node.count = last - first + 1;
+            parent[node.left] = i;
+            parent[node.right] = i;
+        });
+
+        // Each leaf walks toward the root. The first thread to reach a node stops there; the
+        // second one knows both children are finished and merges their boxes.
+        std::vector<std::atomic<int>> arrivals(n - 1);
+        for (auto& a : arrivals) a.store(0, std::memory_order_relaxed);
+
+        parallel_for(n, [&](size_t i) {
+            int node = parent[leaf(int(i))];
+            while (node >= 0) {
+                if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    break;
+                tree[node].bbox = aabb(tree[tree[node].left].bbox, tree[tree[node].right].bbox);
+                node = parent[node];
+            }
+        });
+
+        return 0;
+    }
+
+    static uint64_t spread_bits(uint64_t v) {
+        // Moves the low 21 bits of v apart so that two zero bits follow each of them.
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffff;
+        v = (v | v << 16) & 0x1f0000ff0000ff;
+        v = (v | v << 8)  & 0x100f00f00f00f00f;
+        v = (v | v << 4)  & 0x10c30c30c30c30c3;
+        v = (v | v << 2)  & 0x1249249249249249;
+        return v;
+    }
+
+    static uint64_t morton_code(const point3& p, const aabb& bounds, int bits_per_axis) {
+        double cells = double(uint64_t(1) << bits_per_axis);
+        uint64_t code = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& ax = bounds.axis_interval(axis);
+            auto s = (p[axis] - ax.min) / ax.size();
+            auto q = uint64_t(std::fmin(std::fmax(s * cells, 0.0), cells - 1));
+            code |= spread_bits(q) << (2 - axis);
+        }
+        return code;
+    }
+
+    static void radix_sort(std::vector<morton_key>& keys, int key_bits) {
+        // Least significant digit radix sort on 8-bit digits. Each pass counts digits per
+        // chunk in parallel, turns the counts into per-chunk output offsets, and scatters each
+        // chunk in parallel; chunks keep their input order, so every pass is stable.
+        const int radix = 256;
+        size_t n = keys.size();
+        int chunks = (n < 4096) ? 1 : thread_count();
+        std::vector<morton_key> scratch(n);
+        std::vector<size_t> offsets(size_t(chunks) * radix);
+
+        for (int shift = 0; shift < key_bits; shift += 8) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            parallel_chunks(n, chunks, [&](int c, size_t begin, size_t end) {
+                auto* count = &offsets[size_t(c) * radix];
+                for (size_t i = begin; i < end; i++)
+                    count[(keys[i].code >> shift) & 0xff]++;
+            });
+
+            size_t total = 0;
+            for (int digit = 0; digit < radix; digit++) {
+                for (int c = 0; c < chunks; c++) {
+                    auto count = offsets[size_t(c) * radix + digit];
+                    offsets[size_t(c) * radix + digit] = total;
+                    total += count;
+                }
+            }
+
+            parallel_chunks(n, chunks, [&](int c, size_t begin, size_t end) {
+                auto* next = &offsets[size_t(c) * radix];
+                for (size_t i = begin; i < end; i++)
+                    scratch[next[(keys[i].code >> shift) & 0xff]++] = keys[i];
+            });
+
+            keys.swap(scratch);
+        }
+    }
+
+    static int leading_zeros(uint64_t v) {
+        // v must be nonzero.
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, v);
+        return 63 - int(index);
+#else
+        return __builtin_clzll(v);
+#endif
+    }
+
+    static int common_prefix(const std::vector<morton_key>& keys, int i, int j) {
+        // Length of the common prefix of keys i and j, or -1 if j is out of range. Equal codes
+        // are told apart by their positions, as if those were appended to the codes.
+        if (j < 0 || j >= int(keys.size()))
+            return -1;
+        auto a = keys[i].code, b = keys[j].code;
+        if (a == b)
+            return 32 + leading_zeros(uint64_t(i ^ j));
+        return leading_zeros(a ^ b);
+    }
+
+    static void find_range_and_split(
+        const std::vector<morton_key>& keys, int i, int& first, int& last, int& split
+    ) {
+        // Interior node i covers the keys from i to some j, in one direction or the other.
+        // The direction is toward the neighbor sharing the longer prefix; j is found by an
+        // exponential then binary search, and the split sits where the prefix of the range
+        // changes.
+        int d = (common_prefix(keys, i, i+1) - common_prefix(keys, i, i-1)) >= 0 ? 1 : -1;
+        int min_prefix = common_prefix(keys, i, i - d);
+
+        int max_length = 2;
+        while (common_prefix(keys, i, i + max_length*d) > min_prefix)
+            max_length *= 2;
+
+        int length = 0;
+        for (int step = max_length/2; step >= 1; step /= 2)
+            if (common_prefix(keys, i, i + (length + step)*d) > min_prefix)
+                length += step;
+
+        int j = i + length*d;
+        int node_prefix = common_prefix(keys, i, j);
+
+        int offset = 0;
+        int step = length;
+        do {
+            step = (step + 1) / 2;
+            if (common_prefix(keys, i, i + (offset + step)*d) > node_prefix)
+                offset += step;
+        } while (step > 1);
+
+        split = i + offset*d + std::min(d, 0);
+        first = std::min(i, j);
+        last = std::max(i, j);
+    }
+
+    // Treelet restructuring (Karras & Aila, "Fast Parallel Construction of High-Quality
+    // Bounding Volume Hierarchies", 2013). For every interior node, its treelet is grown by
+    // repeatedly opening the largest-area treelet leaf until it has treelet_size leaves; then
+    // the SAH-optimal binary tree over those leaves is found by dynamic programming over leaf
+    // subsets and replaces the treelet if it is cheaper. Nodes are visited children first, so
+    // each treelet's leaves are already optimized when it is.
+
+    double subtree_cost(const aabb& box, int count, double children_cost) const {
+        auto area = box.surface_area();
+        if (count <= settings.max_leaf_size)
+            return intersection_cost * count * area;
+        return traversal_cost * area + children_cost;
+    }
+
+    void optimize_treelets(std::vector<build_node>& tree, int root) const {
+        std::vector<int> postorder;
+        std::vector<int> pending = { root };
+        while (!pending.empty()) {
+            int index = pending.back();
+            pending.pop_back();
+            if (tree[index].left < 0) {
+                tree[index].cost = subtree_cost(tree[index].bbox, 1, 0);
+                continue;
+            }
+            postorder.push_back(index);
+            pending.push_back(tree[index].left);
+            pending.push_back(tree[index].right);
+        }
+        std::reverse(postorder.begin(), postorder.end());
+
+        for (int index : postorder) {
+            auto& n = tree[index];
+            n.cost = subtree_cost(n.bbox, n.count, tree[n.left].cost + tree[n.right].cost);
+            restructure(tree, index);
+        }
+    }
+
+    void restructure(std::vector<build_node>& tree, int root) const {
+        if (tree[root].count <= settings.max_leaf_size)
+            return;   // Collapses into one leaf whatever its shape.
+
+        int leaves[treelet_size] = { tree[root].left, tree[root].right };
+        int internals[treelet_size - 1] = { root };
+        int leaf_count = 2, internal_count = 1;
+
+        while (leaf_count < treelet_size) {
+            int largest = -1;
+            double largest_area = -1;
+            for (int k = 0; k < leaf_count; k++) {
+                if (tree[leaves[k]].left < 0) continue;
+                auto area = tree[leaves[k]].bbox.surface_area();
+                if (area > largest_area) { largest = k; largest_area = area; }
+            }
+            if (largest < 0) break;
+
+            int opened = leaves[largest];
+            internals[internal_count++] = opened;
+            leaves[largest] = tree[opened].left;
+            leaves[leaf_count++] = tree[opened].right;
+        }
+        if (leaf_count < 3)
+            return;
+
+        const int subsets = 1 << leaf_count;
+        aabb box[1 << treelet_size];
+        int count[1 << treelet_size];
+        double cost[1 << treelet_size];
+        int best_split[1 << treelet_size];
+
+        for (int s = 1; s < subsets; s++) {
+            int low = s & -s;
+            if (s == low) {
+                int k = 0;
+                while ((1 << k) != low) k++;
+                box[s] = tree[leaves[k]].bbox;
+                count[s] = tree[leaves[k]].count;
+                cost[s] = tree[leaves[k]].cost;
+                continue;
+            }
+            box[s] = aabb(box[s & ~low], box[low]);
+            count[s] = count[s & ~low] + count[low];
+
+            // Only partitions with the lowest leaf on the left, which covers each one once.
+            double best = infinity;
+            int rest = s & ~low;
+            for (int p = (rest - 1) & rest; ; p = (p - 1) & rest) {
+                int left = p | low;
+                double c = cost[left] + cost[s & ~left];
+                if (c < best) { best = c; best_split[s] = left; }
+                if (p == 0) break;
+            }
+            cost[s] = subtree_cost(box[s], count[s], best);
+        }
+
+        if (cost[subsets - 1] >= tree[root].cost * (1 - 1e-9))
+            return;
+
+        int next_internal = 1;
+        rebuild(tree, root, subsets - 1, leaves, internals, next_internal, box, count, cost, best_split);
+    }
+
+    static void rebuild(
+        std::vector<build_node>& tree, int index, int subset, const int* leaves,
+        const int* internals, int& next_internal, const aabb* box, const int* count,
+        const double* cost, const int* best_split
+    ) {
+        auto child = [&](int s) {
+            if ((s & (s - 1)) == 0) {
+                int k = 0;
+                while ((1 << k) != s) k++;
+                return leaves[k];
+            }
+            int c = internals[next_internal++];
+            rebuild(tree, c, s, leaves, internals, next_internal, box, count, cost, best_split);
+            return c;
+        };
+
+        int left = best_split[subset];
+        auto& n = tree[index];
+        n.bbox = box[subset];
+        n.count = count[subset];
+        n.cost = cost[subset];
+        int l = child(left);
+        int r = child(subset & ~left);
+        tree[index].left = l;
+        tree[index].right = r;
+    }
+
+    void flatten(
+        const std::vector<build_node>& tree, int tree_index, int flat_index,
+        const std::vector<int>& ids, int& next_slot
+    ) {
+        // Writes the subtree at tree_index into nodes[flat_index], appending its descendants
+        // to nodes and its objects to consecutive entries of objects from next_slot on. ids
+        // maps the tree's object numbers to indices in sources. Nodes are written in depth
+        // first order, first child first, from a stack rather than by recursion, as some
+        // builders make deep trees.
+        std::vector<std::pair<int, int>> pending = { { tree_index, flat_index } };
+        while (!pending.empty()) {
+            auto [t, f] = pending.back();
+            pending.pop_back();
+
+            const auto& b = tree[t];
+            nodes[f].bbox = b.bbox;
+            nodes[f].built_area = float(b.bbox.surface_area());
+
+            if (b.left < 0 || b.count <= settings.max_leaf_size) {
+                nodes[f].first = next_slot;
+                nodes[f].count = b.count;
+                nodes[f].axis = 0;
+                gather(tree, t, ids, next_slot);
+                continue;
+            }
+
+            // Put the child with the lower centroid, along the axis that separates them most,
+            // first.
+            int left = b.left, right = b.right;
+            auto offset = centroid(tree[right].bbox) - centroid(tree[left].bbox);
+            int axis = 0;
+            for (int a = 1; a < 3; a++)
+                if (std::fabs(offset[a]) > std::fabs(offset[axis])) axis = a;
+            if (offset[axis] < 0)
+                std::swap(left, right);
+
+            int first = int(nodes.size());
+            nodes.push_back(node());
+            nodes.push_back(node());
+            nodes[f].first = first;
+            nodes[f].count = 0;
+            nodes[f].axis = axis;
+
+            pending.push_back({ right, first + 1 });
+            pending.push_back({ left, first });
+        }
+    }
+
+    void gather(
+        const std::vector<build_node>& tree, int index, const std::vector<int>& ids,
+        int& next_slot
+    ) {
+        // Appends the objects below tree[index], left to right.
+        std::vector<int> pending = { index };
+        while (!pending.empty()) {
+            int i = pending.back();
+            pending.pop_back();
+            if (tree[i].left < 0) {
+                int id = ids[tree[i].object];
+                objects[next_slot] = sources[id];
+                source_of_slot[next_slot] = id;
+                next_slot++;
+                continue;
+            }
+            pending.push_back(tree[i].right);
+            pending.push_back(tree[i].left);
+        }
+    }
+
+    template <bool counted>
+    bool traverse(const ray& r, interval ray_t, hit_record& rec, traversal_counts* counts) const {
+        if (nodes.empty())
+            return false;
+
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+
+        bool hit_anything = false;
+        traverse_nodes(0, [&](int index, int& near, int& far) {
+            const auto& n = nodes[index];
+            if (counted) {
+                counts->nodes++;
+                if (counts->cache) counts->cache->access(&n);
+            }
+
+            auto span = ray_t;
+            if (!n.bbox.hit(r, inv_dir, span))
+                return 0;
+            if (n.count == 0) {
+                // The children are stored side by side, the lower one along the axis first.
+                near = n.first;
+                far  = n.first + 1;
+                if (r.direction()[n.axis] < 0) std::swap(near, far);
+                return 2;
+            }
+            if (counted) counts->objects += n.count;
+            for (int i = n.first; i < n.first + n.count; i++) {
+                if (objects[i]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+            return 0;
+        });
+
+        return hit_anything;
+    }
+
+    std::vector<int> child_pairs(int pair) const {
+        std::vector<int> children;
+        for (int i = pair; i < pair + 2; i++)
+            if (nodes[i].count == 0)
+                children.push_back(nodes[i].first);
+        return children;
+    }
+
+    // The orders below work from explicit stacks and queues rather than by recursion, since a
+    // tree grown by insert() can be as deep as it has objects.
+
+    void depth_first_order(int pair, std::vector<int>& order) const {
+        std::vector<int> pending = { pair };
+        while (!pending.empty()) {
+            int p = pending.back();
+            pending.pop_back();
+            order.push_back(p);
+            auto children = child_pairs(p);
+            pending.insert(pending.end(), children.rbegin(), children.rend());
+        }
+    }
+
+    int pair_height(int pair) const {
+        // Levels of pairs from pair down to its deepest descendant, counted level by level.
+        int height = 0;
+        std::vector<int> frontier = { pair };
+        while (!frontier.empty()) {
+            height++;
+            std::vector<int> next;
+            for (int p : frontier)
+                for (int child : child_pairs(p))
+                    next.push_back(child);
+            frontier.swap(next);
+        }
+        return height;
+    }
+
+    void van_emde_boas_order(int pair, int levels, std::vector<int>& order) const {
+        // The top levels/2 levels below pair first, then each subtree hanging below them, each
+        // part laid out the same way. levels is at least the height of the subtree. The parts
+        // still to lay out wait on a stack, last part at the bottom.
+        std::vector<std::pair<int, int>> pending = { { pair, levels } };
+        while (!pending.empty()) {
+            auto [p, l] = pending.back();
+            pending.pop_back();
+            if (l <= 1) {
+                order.push_back(p);
+                continue;
+            }
+
+            int top = l / 2;
+            std::vector<int> frontier = { p };
+            for (int level = 0; level < top; level++) {
+                std::vector<int> next;
+                for (int q : frontier)
+                    for (int child : child_pairs(q))
+                        next.push_back(child);
+                frontier.swap(next);
+            }
+
+            for (auto q = frontier.rbegin(); q != frontier.rend(); ++q)
+                pending.push_back({ *q, l - top });
+            pending.push_back({ p, top });
+        }
+    }
+
+    void treelet_order(std::vector<int>& order) const {
+        // Greedy clustering: grow each block from its root by always adding the pair with the
+        // largest box among those hanging off the block, which is the one a ray that reached
+        // the block is most likely to visit next. Pairs left hanging off a full block start
+        // new blocks, in the order they were found.
+        const size_t block_pairs = 4096 / (2 * sizeof(node));
+
+        auto pair_area = [this](int pair) {
+            return aabb(nodes[pair].bbox, nodes[pair + 1].bbox).surface_area();
+        };
+
+        std::vector<int> block_roots = { nodes[0].first };
+        for (size_t b = 0; b < block_roots.size(); b++) {
+            std::vector<int> candidates = { block_roots[b] };
+            size_t taken = 0;
+            while (!candidates.empty() && taken < block_pairs) {
+                auto best = std::max_element(candidates.begin(), candidates.end(),
+                    [&](int a, int c) { return pair_area(a) < pair_area(c); });
+                int pair = *best;
+                candidates.erase(best);
+                order.push_back(pair);
+                taken++;
+                for (int child : child_pairs(pair))
+                    candidates.push_back(child);
+            }
+            block_roots.insert(block_roots.end(), candidates.begin(), candidates.end());
+        }
+    }
+};
+
+#endif
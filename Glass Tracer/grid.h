@@ -0,0 +1,363 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "GlassTracer.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "parallel.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+class grid_settings {
+  public:
+    // Top level cells per object. Low values leave most of the work to the second level.
+    double top_density = 0.125;
+
+    // Second level cells per object reference within each top level cell. Zero gives a
+    // uniform grid: one level, with top_density then usually between 1 and 4.
+    double leaf_density = 2.0;
+};
+
+class hittable_grid : public hittable {
+  public:
+    // A two-level grid (Kalojanov, Billeter and Slusallek, "Two-Level Grids for Ray Tracing
+    // on GPUs", 2011): a coarse uniform grid over the scene, where every cell holds a finer
+    // uniform grid of its own sized to the number of objects in it. For dense, even content
+    // such as particles or scattered spheres it builds several times faster than a BVH,
+    // since each level is one parallel counting sort of (cell, object) pairs.
+    //
+    // Rays walk the cells they pass through in order with a 3D-DDA (Amanatides and Woo,
+    // 1987), top level then second level, and stop at the first cell that ends beyond the
+    // closest hit. Objects spanning several cells are tested once per ray, thanks to a small
+    // per-ray mailbox of the objects tested last.
+
+    hittable_grid(const hittable_list& list, const grid_settings& settings = grid_settings())
+      : objects(list.objects)
+    {
+        build(settings);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (objects.empty())
+            return false;
+
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+        if (!bbox.hit(r, inv_dir, ray_t))
+            return false;
+
+        mailbox tested;
+        bool hit_anything = false;
+        walk_grid(r, inv_dir, bbox, top_res, ray_t.min, ray_t.max,
+            [&](int index, const int* coords, double t_enter, double t_exit) {
+                const auto& top = cells[index];
+                int leaves = top.res[0] * top.res[1] * top.res[2];
+                if (leaf_start[top.first_leaf] == leaf_start[top.first_leaf + leaves])
+                    return false;
+
+                if (leaves == 1) {
+                    test_leaf(top.first_leaf, r, ray_t, rec, tested, hit_anything);
+                } else {
+                    aabb box = cell_box(bbox, top_res, coords);
+                    int res[3] = { top.res[0], top.res[1], top.res[2] };
+                    walk_grid(r, inv_dir, box, res, t_enter, std::fmin(t_exit, ray_t.max),
+                        [&](int leaf, const int*, double, double leaf_exit) {
+                            test_leaf(top.first_leaf + leaf, r, ray_t, rec, tested, hit_anything);
+                            return hit_anything && ray_t.max <= leaf_exit;
+                        });
+                }
+                return hit_anything && ray_t.max <= t_exit;
+            });
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t top_cell_count() const { return cells.size(); }
+    size_t leaf_cell_count() const { return leaf_start.size() - 1; }
+    size_t reference_count() const { return refs.size(); }
+
+    size_t memory_usage() const {
+        // Bytes held by the cells and the object references, not counting the objects.
+        return sizeof(*this) + cells.capacity() * sizeof(top_cell)
+             + (leaf_start.capacity() + refs.capacity()) * sizeof(int)
+             + objects.capacity() * sizeof(shared_ptr<hittable>);
+    }
+
+  private:
+    struct top_cell {
+        int     first_leaf;   // First of this cell's second level cells in leaf_start.
+        uint8_t res[3];       // Resolution of its second level grid; 1x1x1 for a single cell.
+    };
+
+    class mailbox {
+      public:
+        // Ids of the last few objects tested along the ray. An object already in it would
+        // give the same result again, the ray interval having only shrunk since.
+        bool test_and_add(int object) {
+            for (int k = 0; k < size; k++)
+                if (ids[k] == object) return true;
+            ids[next] = object;
+            next = (next + 1) % capacity;
+            size = std::min(size + 1, capacity);
+            return false;
+        }
+
+      private:
+        static constexpr int capacity = 16;
+        int ids[capacity];
+        int size = 0;
+        int next = 0;
+    };
+
+    // Grids are coarsened until they hold at most this many references per object, so that
+    // objects much larger than the cells, or all piled up in one place, can't run the
+    // references out of memory.
+    static constexpr int max_overlap = 8;
+    static constexpr int max_top_res = 1024;
+    static constexpr int max_leaf_res = 255;
+
+    std::vector<shared_ptr<hittable>> objects;
+    aabb bbox;
+    int top_res[3] = { 1, 1, 1 };
+    std::vector<top_cell> cells;
+    std::vector<int> leaf_start;   // Start of each second level cell's range in refs, plus end.
+    std::vector<int> refs;         // Object indices, grouped by second level cell.
+
+    void build(const grid_settings& settings) {
+        size_t n = objects.size();
+        leaf_start.assign(1, 0);
+        if (n == 0)
+            return;
+
+        std::vector<aabb> boxes(n);
+        parallel_for(n, [&](size_t i) { boxes[i] = objects[i]->bounding_box(); });
+        bbox = aabb::empty;
+        for (const auto& b : boxes)
+            bbox = aabb(bbox, b);
+
+        bool two_level = settings.leaf_density > 0;
+        resolution(bbox, settings.top_density * n, max_top_res, top_res);
+        parallel_coarsen(bbox, top_res, boxes, n);
+        size_t top_count = size_t(top_res[0]) * top_res[1] * top_res[2];
+
+        // Top level: (cell, object) pairs sorted by cell.
+        std::vector<int> top_start, top_refs;
+        std::vector<int> all_objects(n);
+        for (size_t i = 0; i < n; i++)
+            all_objects[i] = int(i);
+        bucket_objects(boxes, all_objects,
+            [&](int, const aabb& box, int* lo, int* hi) { cell_range(bbox, top_res, box, lo, hi); },
+            [&](int, const int* c) { return (c[2] * top_res[1] + c[1]) * top_res[0] + c[0]; },
+            top_count, top_start, top_refs);
+
+        // Second level resolutions, then the first second level cell of each top cell.
+        cells.resize(top_count);
+        parallel_for(top_count, [&](size_t t) {
+            int count = top_start[t + 1] - top_start[t];
+            int res[3] = { 1, 1, 1 };
+            if (two_level && count > 1) {
+                int coords[3];
+                unpack(int(t), top_res, coords);
+                auto box = cell_box(bbox, top_res, coords);
+                resolution(box, settings.leaf_density * count, max_leaf_res, res);
+                while (res[0] * res[1] * res[2] > 1) {
+                    int64_t total = 0;
+                    for (int k = top_start[t]; k < top_start[t + 1]; k++)
+                        total += overlap_count(box, res, boxes[top_refs[k]]);
+                    if (total <= max_overlap * count)
+                        break;
+                    coarsen(res);
+                }
+            }
+            for (int a = 0; a < 3; a++)
+                cells[t].res[a] = uint8_t(res[a]);
+            cells[t].first_leaf = res[0] * res[1] * res[2];
+        });
+        size_t leaf_count = 0;
+        for (auto& cell : cells) {
+            size_t leaves = size_t(cell.first_leaf);
+            cell.first_leaf = int(leaf_count);
+            leaf_count += leaves;
+        }
+
+        // Second level: the top level references again, each paired with the cells of its
+        // top cell's grid that the object overlaps.
+        std::vector<int> top_of_ref(top_refs.size());
+        parallel_for(top_count, [&](size_t t) {
+            for (int k = top_start[t]; k < top_start[t + 1]; k++)
+                top_of_ref[k] = int(t);
+        });
+        auto leaf_grid = [&](int ref, aabb& box, int* res) {
+            const auto& top = cells[top_of_ref[ref]];
+            int coords[3];
+            unpack(top_of_ref[ref], top_res, coords);
+            box = cell_box(bbox, top_res, coords);
+            for (int a = 0; a < 3; a++)
+                res[a] = top.res[a];
+        };
+        bucket_objects(boxes, top_refs,
+            [&](int ref, const aabb& object_box, int* lo, int* hi) {
+                aabb box;
+                int res[3];
+                leaf_grid(ref, box, res);
+                cell_range(box, res, object_box, lo, hi);
+            },
+            [&](int ref, const int* c) {
+                const auto& top = cells[top_of_ref[ref]];
+                return top.first_leaf + (c[2] * top.res[1] + c[1]) * top.res[0] + c[0];
+            },
+            leaf_count, leaf_start, refs);
+    }
+
+    template <typename Range, typename Key>
+    static void bucket_objects(
+        const std::vector<aabb>& boxes, const std::vector<int>& items,
+        const Range& range, const Key& key, size_t key_count,
+        std::vector<int>& start, std::vector<int>& values
+    ) {
+        // Counting sort of (cell, object) pairs. range(item, box, lo, hi) gives the cells an
+        // item overlaps, key(item, coords) the index of one of them. Items are positions in
+        // the `items` list, whose entries are object indices. Every phase but the prefix sums
+        // runs over all threads; each cell's objects end up in ascending order.
+        size_t n = items.size();
+        std::vector<int64_t> offset(n + 1, 0);
+        parallel_for(n, [&](size_t i) {
+            int lo[3], hi[3];
+            range(int(i), boxes[items[i]], lo, hi);
+            offset[i + 1] = int64_t(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+        });
+        for (size_t i = 0; i < n; i++)
+            offset[i + 1] += offset[i];
+
+        std::vector<int> pair_key(offset[n]), pair_object(offset[n]);
+        parallel_for(n, [&](size_t i) {
+            int lo[3], hi[3], c[3];
+            range(int(i), boxes[items[i]], lo, hi);
+            auto out = offset[i];
+            for (c[2] = lo[2]; c[2] <= hi[2]; c[2]++)
+                for (c[1] = lo[1]; c[1] <= hi[1]; c[1]++)
+                    for (c[0] = lo[0]; c[0] <= hi[0]; c[0]++) {
+                        pair_key[out] = key(int(i), c);
+                        pair_object[out] = items[i];
+                        out++;
+                    }
+        });
+
+        std::vector<std::atomic<int>> counts(key_count);
+        parallel_for(key_count, [&](size_t k) { counts[k].store(0, std::memory_order_relaxed); });
+        parallel_for(pair_key.size(), [&](size_t p) {
+            counts[pair_key[p]].fetch_add(1, std::memory_order_relaxed);
+        });
+
+        start.resize(key_count + 1);
+        start[0] = 0;
+        for (size_t k = 0; k < key_count; k++)
+            start[k + 1] = start[k] + counts[k].load(std::memory_order_relaxed);
+
+        parallel_for(key_count, [&](size_t k) { counts[k].store(start[k], std::memory_order_relaxed); });
+        values.resize(pair_key.size());
+        parallel_for(pair_key.size(), [&](size_t p) {
+            values[counts[pair_key[p]].fetch_add(1, std::memory_order_relaxed)] = pair_object[p];
+        });
+        parallel_for(key_count, [&](size_t k) {
+            std::sort(values.begin() + start[k], values.begin() + start[k + 1]);
+        });
+    }
+
+    static void resolution(const aabb& box, double cells, int max_res, int* res) {
+        // Cubic cells, about `cells` of them over box. Flat boxes get at least one cell across
+        // their thin axes.
+        double extent[3], largest = 0;
+        for (int a = 0; a < 3; a++) {
+            extent[a] = box.axis_interval(a).size();
+            largest = std::fmax(largest, extent[a]);
+        }
+        double volume = 1;
+        for (int a = 0; a < 3; a++)
+            volume *= std::fmax(extent[a], 1e-3 * largest);
+        double scale = std::cbrt(std::fmax(cells, 1.0) / volume);
+        for (int a = 0; a < 3; a++)
+            res[a] = std::clamp(int(extent[a] * scale), 1, max_res);
+    }
+
+    static void parallel_coarsen(const aabb& grid, int* res, const std::vector<aabb>& boxes, size_t n) {
+        // Coarsens the top level until it passes the max_overlap test.
+        while (res[0] * res[1] * res[2] > 1) {
+            int chunks = (n < 4096) ? 1 : thread_count();
+            std::vector<int64_t> totals(chunks, 0);
+            parallel_chunks(n, chunks, [&](int c, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                    totals[c] += overlap_count(grid, res, boxes[i]);
+            });
+            int64_t total = 0;
+            for (auto t : totals)
+                total += t;
+            if (total <= int64_t(max_overlap) * int64_t(n))
+                return;
+            coarsen(res);
+        }
+    }
+
+    static void coarsen(int* res) {
+        for (int a = 0; a < 3; a++)
+            res[a] = std::max(1, res[a] / 2);
+    }
+
+    static int64_t overlap_count(const aabb& grid, const int* res, const aabb& box) {
+        int lo[3], hi[3];
+        cell_range(grid, res, box, lo, hi);
+        return int64_t(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+    }
+
+    static void cell_range(const aabb& grid, const int* res, const aabb& box, int* lo, int* hi) {
+        // Cells of the grid over `grid` that box overlaps, widened by a sliver so that objects
+        // on a cell boundary are found from both sides.
+        for (int a = 0; a < 3; a++) {
+            const auto& g = grid.axis_interval(a);
+            const auto& b = box.axis_interval(a);
+            double cells_per_unit = res[a] / g.size();
+            double slack = 1e-7;
+            lo[a] = std::clamp(int(std::floor((b.min - g.min) * cells_per_unit - slack)), 0, res[a] - 1);
+            hi[a] = std::clamp(int(std::floor((b.max - g.min) * cells_per_unit + slack)), 0, res[a] - 1);
+        }
+    }
+
+    static aabb cell_box(const aabb& grid, const int* res, const int* coords) {
+        point3 lo, hi;
+        for (int a = 0; a < 3; a++) {
+            const auto& g = grid.axis_interval(a);
+            auto size = g.size() / res[a];
+            lo[a] = g.min + coords[a] * size;
+            hi[a] = (coords[a] + 1 == res[a]) ? g.max : g.min + (coords[a] + 1) * size;
+        }
+        return aabb(lo, hi);
+    }
+
+    static void unpack(int index, const int* res, int* coords) {
+        coords[0] = index % res[0];
+        coords[1] = (index / res[0]) % res[1];
+        coords[2] = index / (res[0] * res[1]);
+    }
+
+    void test_leaf(int leaf, const ray& r, interval& ray_t, hit_record& rec, mailbox& tested,
+                   bool& hit_anything) const {
+        for (int k = leaf_start[leaf]; k < leaf_start[leaf + 1]; k++) {
+            int object = refs[k];
+            if (tested.test_and_add(object))
+                continue;
+            if (objects[object]->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "GlassTracer.h"
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+struct guiding_settings {
+    double bsdf_fraction      = 0.5;    // Chance of sampling the material instead of the guide
+    double spatial_threshold  = 4000;   // Records per region, times sqrt(samples/pixel), to split
+    double energy_fraction    = 0.01;   // Share of a region's light per direction cell, to split
+    int    max_direction_depth = 20;    // Deepest subdivision of the directions
+};
+
+class atomic_sum {
+  public:
+    // A float that any number of threads can add to without locks. Copies take the value,
+    // for between passes, when nothing is adding to it.
+    atomic_sum(float value = 0) : value(value) {}
+    atomic_sum(const atomic_sum& other) : value(other.get()) {}
+    atomic_sum& operator=(const atomic_sum& other) { value.store(other.get()); return *this; }
+
+    float get() const { return value.load(std::memory_order_relaxed); }
+
+    void add(float x) {
+        auto old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, old + x, std::memory_order_relaxed))
+            ;
+    }
+
+  private:
+    std::atomic<float> value;
+};
+
+class direction_tree {
+  public:
+    // A distribution over the sphere of directions as a quadtree over the unit square, mapped
+    // to the sphere by the cosine of the angle from +y and the angle around it, which keeps
+    // areas: every part of the square covers 4*pi times its area in solid angle. Each node
+    // holds the light recorded in its four quadrants and is split where much of it falls.
+    //
+    // Records only add to the cell they land in. Once recording is done, normalize() sums
+    // them up the tree and turns each node's weights into the shares of its light in each
+    // quadrant, which is what pdf_value() and random() use. Nodes are kept to 32 bytes, as
+    // a guide holds thousands of trees and every sample walks two or three of them.
+
+    direction_tree() : nodes(1) {}
+
+    // The light recorded, once normalized.
+    double total() const { return sum; }
+
+    void record(const vec3& direction, double value) {
+        // Adds value to direction's cell. Safe to call from many threads at once, as long as
+        // the tree doesn't change shape meanwhile.
+        auto [x, y] = to_square(direction);
+        int i = 0;
+        while (true) {
+            auto q = quadrant(x, y);
+            if (!nodes[i].children[q]) {
+                nodes[i].weights[q].add(float(value));
+                return;
+            }
+            i = nodes[i].children[q];
+        }
+    }
+
+    void normalize() {
+        // Children always come after their parents, so going backward reaches each node's
+        // children before the node itself, keeping their sums until then.
+        std::vector<double> sums(nodes.size());
+        for (auto i = nodes.size(); i-- > 0;) {
+            auto& n = nodes[i];
+            double quadrant_sums[4];
+            for (int q = 0; q < 4; q++) {
+                quadrant_sums[q] = n.children[q] ? sums[n.children[q]] : n.weights[q].get();
+                sums[i] += quadrant_sums[q];
+            }
+            for (int q = 0; q < 4; q++)
+                n.weights[q] = atomic_sum(sums[i] > 0 ? float(quadrant_sums[q] / sums[i]) : 0.0f);
+        }
+        sum = sums[0];
+    }
+
+    double pdf_value(const vec3& direction) const {
+        // Density per unit solid angle, zero if nothing was recorded.
+        auto [x, y] = to_square(direction);
+        double density = 1 / (4 * pi);
+        int i = 0;
+        while (true) {
+            const auto& n = nodes[i];
+            auto q = quadrant(x, y);
+            density *= 4 * n.weights[q].get();
+            if (!n.children[q] || density <= 0)
+                return density;
+            i = n.children[q];
+        }
+    }
+
+    vec3 random() const {
+        // A direction with the density of pdf_value(). Only for trees with total() > 0.
+        double x0 = 0, y0 = 0, size = 1;
+        auto u = random_double();
+        int i = 0;
+        while (true) {
+            const auto& n = nodes[i];
+            double start[5] = { 0 };
+            for (int q = 0; q < 4; q++)
+                start[q+1] = start[q] + n.weights[q].get();
+
+            // Quadrants without light are skipped, since they start where the next one does.
+            int q = (u >= start[1]) + (u >= start[2]) + (u >= start[3]);
+            while (start[q+1] <= start[q] && q > 0)   // Only when rounding runs past the end.
+                q--;
+            u = std::clamp((u - start[q]) / (start[q+1] - start[q]), 0.0, 1 - 1e-12);
+
+            size /= 2;
+            x0 += (q & 1) ? size : 0;
+            y0 += (q & 2) ? size : 0;
+            if (!n.children[q])
+                break;
+            i = n.children[q];
+        }
+        return from_square(x0 + size * random_double(), y0 + size * random_double());
+    }
+
+    direction_tree refined(double energy_fraction, int max_depth) const {
+        // An empty tree for the next pass, split wherever this normalized one's light says it
+        // should be: a cell is split while it holds more than energy_fraction of the total,
+        // assuming the light is spread evenly below where this tree stopped. Cells are merged
+        // again where light no longer falls.
+        direction_tree tree;
+        if (sum <= 0)
+            return tree;
+
+        struct entry { int node; int old; double shares[4]; int depth; };
+        std::vector<entry> pending;
+        pending.push_back({ 0, 0, {}, 1 });
+        for (int q = 0; q < 4; q++)
+            pending.back().shares[q] = nodes[0].weights[q].get();
+
+        while (!pending.empty()) {
+            auto e = pending.back();
+            pending.pop_back();
+            if (e.depth >= max_depth)
+                continue;
+            for (int q = 0; q < 4; q++) {
+                if (e.shares[q] <= energy_fraction)
+                    continue;
+                int child = int(tree.nodes.size());
+                tree.nodes.emplace_back();
+                tree.nodes[e.node].children[q] = child;
+
+                int old_child = (e.old >= 0) ? nodes[e.old].children[q] : 0;
+                entry next{ child, old_child ? old_child : -1, {}, e.depth + 1 };
+                for (int k = 0; k < 4; k++)
+                    next.shares[k] = e.shares[q] * (old_child ? nodes[old_child].weights[k].get() : 0.25);
+                pending.push_back(next);
+            }
+        }
+        return tree;
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+  private:
+    struct node {
+        atomic_sum weights[4];              // Light per quadrant; shares once normalized.
+        int children[4] = { 0, 0, 0, 0 };   // Node index per quadrant; 0 for none.
+    };
+    std::vector<node> nodes;
+    double sum = 0;
+
+    static int quadrant(double& x, double& y) {
+        // The quadrant of (x,y), which becomes its position within that quadrant.
+        int right = (x >= 0.5), lower = (y >= 0.5);
+        x = 2 * x - right;
+        y = 2 * y - lower;
+        return right | (lower << 1);
+    }
+
+    static std::pair<double, double> to_square(const vec3& direction) {
+        auto phi = std::atan2(direction.z(), direction.x());
+        if (phi < 0)
+            phi += 2 * pi;
+        auto cos_theta = direction.y() / direction.length();
+        return { std::clamp((cos_theta + 1) / 2, 0.0, 1 - 1e-12),
+                 std::clamp(phi / (2 * pi), 0.0, 1 - 1e-12) };
+    }
+
+    static vec3 from_square(double x, double y) {
+        auto cos_theta = 2 * x - 1;
+        auto sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+        auto phi = 2 * pi * y;
+        return vec3(sin_theta * std::cos(phi), cos_theta, sin_theta * std::sin(phi));
+    }
+};
+
+class path_guide {
+  public:
+    // Incident light learned while rendering, for sampling directions toward where it comes
+    // from (Müller, Gross and Novák, "Practical Path Guiding for Efficient Light-Transport
+    // Simulation", 2017). The scene's bounding box is split in halves along x, y and z in
+    // turn, as a binary tree, and each region holds a direction_tree for sampling and a
+    // second one collecting the light that paths record during the current pass. After each
+    // pass, refine() makes what was collected the new sampling distribution, splits regions
+    // that took many records, and reshapes the direction trees to what they learned.
+    //
+    // Unlike the paper, each region keeps its trees separately for surfaces facing along
+    // each of +x, -x, +y, -y, +z and -z. Where a floor meets a wall, or a box sits on the
+    // floor, a region holds surfaces facing different ways, and one distribution for all of
+    // them would send many samples below whichever surface is asking.
+    //
+    // Recording only adds to existing nodes, through atomic_sum, so any number of threads
+    // can record and sample during a pass without locks; refine() runs between passes.
+
+    guiding_settings settings;
+
+    path_guide(const aabb& bounds, const guiding_settings& settings)
+      : settings(settings), bounds(bounds), nodes(1), regions(1)
+    {}
+
+    const direction_tree* distribution(const point3& p, const vec3& normal) const {
+        // The sampling distribution for p on a surface with normal, or null before anything
+        // was learned there.
+        const auto& tree = regions[locate(p)].sampling[facing(normal)];
+        return tree.total() > 0 ? &tree : nullptr;
+    }
+
+    void record(const point3& p, const vec3& normal, const vec3& direction, double radiance) {
+        // One sample of light arriving at p from direction, already divided by the pdf the
+        // direction was picked with. The light goes to a point jittered within a box the size
+        // of p's region, spreading records into neighbors so that regions split small don't
+        // learn from too few paths; the record counts toward splitting p's own region.
+        vec3 size;
+        regions[locate(p, &size)].records.fetch_add(1, std::memory_order_relaxed);
+        if (radiance <= 0)
+            return;
+
+        point3 q;
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& extent = bounds.axis_interval(axis);
+            auto jittered = p[axis] + (random_double() - 0.5) * size[axis];
+            q[axis] = std::clamp(jittered, extent.min, extent.max);
+        }
+        regions[locate(q)].collecting[facing(normal)].record(direction, radiance);
+    }
+
+    void refine(int samples_per_pixel) {
+        // Between passes: regions with more than spatial_threshold * sqrt(samples_per_pixel)
+        // records, samples_per_pixel being that of the pass just done, are split until their
+        // halves are under it, each half taking a copy of the region's trees.
+        auto limit = settings.spatial_threshold * std::sqrt(double(samples_per_pixel));
+        std::vector<int> pending = { 0 };
+        while (!pending.empty()) {
+            int i = pending.back();
+            pending.pop_back();
+            int depth = nodes[i].depth;
+            if (nodes[i].children) {
+                pending.push_back(nodes[i].children);
+                pending.push_back(nodes[i].children + 1);
+                continue;
+            }
+            auto& region = regions[nodes[i].region];
+            auto records = region.records.load();
+            if (records <= limit || depth >= 60)
+                continue;
+
+            auto half = region_state(region);
+            half.records = records / 2;
+            int child = int(nodes.size());
+            nodes[i].children = child;
+            nodes.push_back({ 0, nodes[i].region, depth + 1 });
+            nodes.push_back({ 0, int(regions.size()), depth + 1 });
+            regions[nodes[i].region].records = records / 2;
+            regions.push_back(half);
+            pending.push_back(child);
+            pending.push_back(child + 1);
+        }
+
+        for (auto& region : regions) {
+            for (int f = 0; f < 6; f++) {
+                region.sampling[f] = region.collecting[f];
+                region.sampling[f].normalize();
+                region.collecting[f] = region.sampling[f].refined(settings.energy_fraction,
+                                                                  settings.max_direction_depth);
+            }
+            region.records = 0;
+        }
+    }
+
+    size_t region_count() const { return regions.size(); }
+
+  private:
+    struct spatial_node {
+        int children = 0;   // Index of the first of two consecutive children; 0 for a leaf.
+        int region = 0;     // For leaves, index into regions.
+        int depth = 0;      // Splits along axis depth % 3.
+    };
+
+    struct region_state {
+        direction_tree sampling[6], collecting[6];   // By facing().
+        std::atomic<unsigned long long> records{0};
+
+        region_state() {}
+        region_state(const region_state& other) : records(other.records.load()) {
+            std::copy(other.sampling, other.sampling + 6, sampling);
+            std::copy(other.collecting, other.collecting + 6, collecting);
+        }
+    };
+
+    aabb bounds;
+    std::vector<spatial_node> nodes;
+    std::vector<region_state> regions;
+
+    static int facing(const vec3& normal) {
+        // 2*axis for the axis the normal is closest to, plus one if it points backward on it.
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (std::fabs(normal[a]) > std::fabs(normal[axis]))
+                axis = a;
+        return 2 * axis + (normal[axis] < 0 ? 1 : 0);
+    }
+
+    int locate(const point3& p, vec3* size = nullptr) const {
+        // The region holding p, and optionally the size of its box.
+        point3 lo(bounds.x.min, bounds.y.min, bounds.z.min);
+        vec3 extent(bounds.x.size(), bounds.y.size(), bounds.z.size());
+        int i = 0;
+        while (nodes[i].children) {
+            int axis = nodes[i].depth % 3;
+            extent[axis] /= 2;
+            bool upper = p[axis] >= lo[axis] + extent[axis];
+            if (upper)
+                lo[axis] += extent[axis];
+            i = nodes[i].children + (upper ? 1 : 0);
+        }
+        if (size)
+            *size = extent;
+        return nodes[i].region;
+    }
+};
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+
+#include "GlassTracer.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "parallel.h"
+#include "texture.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class density_grid {
+  public:
+    // Densities at the centers of a grid of voxels filling bounds, with trilinear
+    // interpolation between them and zero beyond the outer centers' neighbours. Voxels are
+    // kept in bricks of brick_size^3; only bricks holding some density are stored, so memory
+    // goes with the volume the smoke fills rather than its box.
+    //
+    // Every brick, stored or not, also has a majorant: the largest density anywhere in it,
+    // counting the voxels just outside it that interpolation reaches there. The majorants
+    // form the coarse grid that tracking steps through, skipping bricks whose majorant is
+    // zero without a single density lookup.
+
+    static const int brick_size = 8;
+
+    density_grid(int nx, int ny, int nz, const aabb& bounds, const std::vector<float>& values)
+      : bounds(bounds)
+    {
+        // values holds nx*ny*nz densities, x varying fastest, then y, then z. Without one
+        // voxel along each axis and exactly that many values, the grid is left empty, with no
+        // bricks for rays to walk.
+        if (nx <= 0 || ny <= 0 || nz <= 0 || values.size() != size_t(nx) * ny * nz) {
+            std::cerr << "ERROR: Density grid of " << nx << 'x' << ny << 'x' << nz
+                      << " voxels given " << values.size() << " values.\n";
+            for (int a = 0; a < 3; a++) {
+                size[a] = bricks[a] = 0;
+                voxel_size[a] = 1;
+            }
+            return;
+        }
+
+        size[0] = nx; size[1] = ny; size[2] = nz;
+        for (int a = 0; a < 3; a++) {
+            bricks[a] = (size[a] + brick_size - 1) / brick_size;
+            voxel_size[a] = bounds.axis_interval(a).size() / size[a];
+        }
+        auto brick_count = size_t(bricks[0]) * bricks[1] * bricks[2];
+        auto dense = [&](int x, int y, int z) {
+            return values[(size_t(z) * size[1] + y) * size[0] + x];
+        };
+
+        // Which bricks to keep, in order, so that each one's voxels have a place before
+        // they are copied over in parallel.
+        brick_index.assign(brick_count, -1);
+        int kept = 0;
+        for (size_t b = 0; b < brick_count; b++) {
+            int lo[3], hi[3];
+            brick_range(b, 0, lo, hi);
+            bool occupied = false;
+            for (int z = lo[2]; z < hi[2] && !occupied; z++)
+                for (int y = lo[1]; y < hi[1] && !occupied; y++)
+                    for (int x = lo[0]; x < hi[0] && !occupied; x++)
+                        occupied = dense(x, y, z) != 0;
+            if (occupied)
+                brick_index[b] = kept++;
+        }
+
+        const int per_brick = brick_size * brick_size * brick_size;
+        voxels.assign(size_t(kept) * per_brick, 0.0f);
+        majorants.assign(brick_count, 0.0f);
+        parallel_for(brick_count, [&](size_t b) {
+            int lo[3], hi[3];
+            if (brick_index[b] >= 0) {
+                auto stored = &voxels[size_t(brick_index[b]) * per_brick];
+                brick_range(b, 0, lo, hi);
+                for (int z = lo[2]; z < hi[2]; z++)
+                    for (int y = lo[1]; y < hi[1]; y++)
+                        for (int x = lo[0]; x < hi[0]; x++)
+                            stored[local(x, y, z)] = dense(x, y, z);
+            }
+
+            float largest = 0;
+            brick_range(b, 1, lo, hi);
+            for (int z = lo[2]; z < hi[2]; z++)
+                for (int y = lo[1]; y < hi[1]; y++)
+                    for (int x = lo[0]; x < hi[0]; x++)
+                        largest = std::max(largest, dense(x, y, z));
+            majorants[b] = largest;
+        });
+    }
+
+    const aabb& bounding_box() const { return bounds; }
+
+    bool empty() const { return majorants.empty(); }
+
+    size_t occupied_bricks() const { return voxels.size() / (brick_size * brick_size * brick_size); }
+
+    size_t memory_usage() const {
+        // Bytes held by the brick table, the majorants and the stored bricks.
+        return sizeof(*this)
+             + brick_index.capacity() * sizeof(int)
+             + majorants.capacity() * sizeof(float)
+             + voxels.capacity() * sizeof(float);
+    }
+
+    double voxel(int x, int y, int z) const {
+        // Zero outside the grid and in bricks that weren't stored.
+        if (x < 0 || y < 0 || z < 0 || x >= size[0] || y >= size[1] || z >= size[2])
+            return 0;
+        auto b = (size_t(z / brick_size) * bricks[1] + y / brick_size) * bricks[0] + x / brick_size;
+        auto index = brick_index[b];
+        if (index < 0)
+            return 0;
+        return voxels[size_t(index) * brick_size * brick_size * brick_size + local(x, y, z)];
+    }
+
+    double density(const point3& p) const {
+        // Trilinear between the eight voxel centers around p.
+        int i[3];
+        double f[3];
+        for (int a = 0; a < 3; a++) {
+            auto x = (p[a] - bounds.axis_interval(a).min) / voxel_size[a] - 0.5;
+            i[a] = int(std::floor(x));
+            f[a] = x - i[a];
+        }
+        double sum = 0;
+        for (int corner = 0; corner < 8; corner++) {
+            int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+            auto weight = (dx ? f[0] : 1 - f[0]) * (dy ? f[1] : 1 - f[1]) * (dz ? f[2] : 1 - f[2]);
+            if (weight > 0)
+                sum += weight * voxel(i[0] + dx, i[1] + dy, i[2] + dz);
+        }
+        return sum;
+    }
+
+    template <typename F>
+    void walk(const ray& r, interval ray_t, const F& visit) const {
+        // Calls visit(majorant, t_enter, t_exit) for the bricks r crosses within ray_t,
+        // nearest first, until visit returns true. Bricks whose majorant is zero are skipped
+        // here, so visit only sees those that might hold some density.
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+        if (majorants.empty() || !bounds.hit(r, inv_dir, ray_t))
+            return;
+
+        // The bricks reach past bounds where the last ones are only partly filled.
+        auto lo = point3(bounds.x.min, bounds.y.min, bounds.z.min);
+        auto hi = lo;
+        for (int a = 0; a < 3; a++)
+            hi[a] += bricks[a] * brick_size * voxel_size[a];
+        walk_grid(r, inv_dir, aabb(lo, hi), bricks, ray_t.min, ray_t.max,
+            [&](int index, const int*, double t_enter, double t_exit) {
+                auto majorant = majorants[index];
+                return majorant > 0 && t_exit > t_enter && visit(double(majorant), t_enter, t_exit);
+            });
+    }
+
+  private:
+    aabb bounds;
+    int size[3];                    // Voxels along each axis.
+    int bricks[3];                  // Bricks along each axis, the last ones partly filled.
+    double voxel_size[3];
+    std::vector<int> brick_index;   // Per brick, where its voxels are stored, or -1.
+    std::vector<float> majorants;   // Per brick.
+    std::vector<float> voxels;      // Stored bricks, brick_size^3 each, x varying fastest.
+
+    static int local(int x, int y, int z) {
+        return ((z % brick_size) * brick_size + y % brick_size) * brick_size + x % brick_size;
+    }
+
+    void brick_range(size_t b, int margin, int* lo, int* hi) const {
+        // The voxels of brick b, grown by margin on every side, within the grid.
+        int c[3] = { int(b % bricks[0]), int(b / bricks[0] % bricks[1]),
+                     int(b / (size_t(bricks[0]) * bricks[1])) };
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::max(0, c[a] * brick_size - margin);
+            hi[a] = std::min(size[a], (c[a] + 1) * brick_size + margin);
+        }
+    }
+};
+
+class heterogeneous_medium : public hittable {
+  public:
+    // Smoke whose density varies through its box, from a density_grid times density_scale.
+    // Like constant_medium, a ray hits it where it first scatters, so the rest of the renderer
+    // treats it like any other volume; that point is found by delta tracking (Woodcock et al.,
+    // 1965): tentative collisions at the rate of the brick's majorant, each real with the
+    // chance that the density there makes up of it, and otherwise passed through. Bricks with
+    // no density cost one table lookup, so a ray's work goes with the occupied bricks it
+    // crosses and the density in them, not with the size of the box.
+
+    heterogeneous_medium(shared_ptr<density_grid> grid, double density_scale, shared_ptr<texture> tex)
+      : grid(grid), density_scale(density_scale), phase_function(make_shared<isotropic>(tex))
+    {}
+
+    heterogeneous_medium(shared_ptr<density_grid> grid, double density_scale, const color& albedo)
+      : grid(grid), density_scale(density_scale), phase_function(make_shared<isotropic>(albedo))
+    {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto length = r.direction().length();
+        bool found = false;
+        grid->walk(r, interval(std::fmax(ray_t.min, 0.0), ray_t.max),
+            [&](double majorant, double t_enter, double t_exit) {
+                auto rate = density_scale * majorant * length;   // Collisions per unit of t.
+                auto t = t_enter;
+                while (true) {
+                    t -= std::log(1 - random_double()) / rate;
+                    if (t >= t_exit)
+                        return false;
+                    if (random_double() * majorant < grid->density(r.at(t))) {
+                        rec.t = t;
+                        found = true;
+                        return true;
+                    }
+                }
+            });
+        if (!found)
+            return false;
+
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(1,0,0);  // arbitrary
+        rec.front_face = true;     // also arbitrary
+        rec.mat = phase_function;
+        return true;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const {
+        // An estimate of the fraction of light that gets through along r within ray_t, by
+        // ratio tracking (Novak, Selle and Jarosz, "Residual Ratio Tracking for Estimating
+        // Attenuation in Participating Media", 2014): the same tentative collisions as hit(),
+        // each scaling the estimate by the chance it was not real, rather than ending it at
+        // the first that is. Where hit() can only say all or nothing, this varies far less
+        // for the same work. Once the estimate falls below a tenth, Russian roulette ends it
+        // early, so dense, absorbing smoke doesn't take steps that can add little.
+        auto length = r.direction().length();
+        double estimate = 1;
+        grid->walk(r, interval(std::fmax(ray_t.min, 0.0), ray_t.max),
+            [&](double majorant, double t_enter, double t_exit) {
+                auto rate = density_scale * majorant * length;
+                auto t = t_enter;
+                while (true) {
+                    t -= std::log(1 - random_double()) / rate;
+                    if (t >= t_exit)
+                        return false;
+                    estimate *= 1 - grid->density(r.at(t)) / majorant;
+                    if (estimate < 0.1) {
+                        if (random_double() * 0.1 >= estimate) {
+                            estimate = 0;
+                            return true;
+                        }
+                        estimate = 0.1;
+                    }
+                }
+            });
+        return estimate;
+    }
+
+    aabb bounding_box() const override { return grid->bounding_box(); }
+
+    bool scatters(const hit_record& rec) const {
+        // Whether rec is a collision that hit() found in this medium.
+        return rec.mat == phase_function;
+    }
+
+  private:
+    shared_ptr<density_grid> grid;
+    double density_scale;
+    shared_ptr<material> phase_function;
+};
+
+class medium_list {
+  public:
+    // The heterogeneous media that light samples see through by ratio tracking: a shadow ray
+    // goes on past their collisions, and the light it reaches is scaled by their
+    // transmittance() along it instead. A collision blocks either all of the light or none
+    // of it, where ratio tracking gives the fraction that gets through, so light samples in
+    // and behind smoke vary far less. As for light_list, only media directly in
+    // hittable_list, bvh_node and flat_bvh are found; light samples still stop at the
+    // collisions of any others.
+
+    medium_list() {}
+
+    explicit medium_list(const hittable& world) { gather(world); }
+
+    bool empty() const { return media.empty(); }
+
+    bool passes(const hit_record& rec) const {
+        // Whether rec is a collision in one of the media, for a shadow ray to go on past.
+        for (const auto& medium : media)
+            if (medium->scatters(rec))
+                return true;
+        return false;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const {
+        // Through all of the media along r within ray_t.
+        double product = 1;
+        for (const auto& medium : media) {
+            product *= medium->transmittance(r, ray_t);
+            if (product == 0)
+                break;
+        }
+        return product;
+    }
+
+  private:
+    std::vector<shared_ptr<heterogeneous_medium>> media;
+
+    void gather(const hittable& world) {
+        // As light_list::gather().
+        if (auto list = dynamic_cast<const hittable_list*>(&world)) {
+            for (const auto& object : list->objects)
+                gather(object);
+        } else if (auto node = dynamic_cast<const bvh_node*>(&world)) {
+            gather(node->left_child());
+            if (node->right_child() != node->left_child())
+                gather(node->right_child());
+        } else if (auto bvh = dynamic_cast<const flat_bvh*>(&world)) {
+            auto objects = bvh->leaf_objects();
+            std::sort(objects.begin(), objects.end());
+            objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+            for (const auto& object : objects)
+                if (object)
+                    gather(object);
+        }
+    }
+
+    void gather(const shared_ptr<hittable>& object) {
+        if (auto medium = std::dynamic_pointer_cast<heterogeneous_medium>(object))
+            media.push_back(medium);
+        else
+            gather(*object);
+    }
+};
+
+inline shared_ptr<density_grid> load_density_raw(
+    const std::string& filename, int nx, int ny, int nz, const aabb& bounds
+) {
+    // Reads a grid of nx*ny*nz densities as 32-bit floats in the machine's byte order, x
+    // varying fastest, then y, then z, with no header: the raw layout most volume tools can
+    // export. Returns nullptr if a dimension isn't positive, or if the file can't be opened
+    // or holds too few values.
+
+    if (nx <= 0 || ny <= 0 || nz <= 0) {
+        std::cerr << "ERROR: Density grid of " << nx << 'x' << ny << 'x' << nz
+                  << " voxels for '" << filename << "'.\n";
+        return nullptr;
+    }
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "ERROR: Could not load density file '" << filename << "'.\n";
+        return nullptr;
+    }
+
+    std::vector<float> values(size_t(nx) * ny * nz);
+    file.read(reinterpret_cast<char*>(values.data()), std::streamsize(values.size() * sizeof(float)));
+    if (size_t(file.gcount()) != values.size() * sizeof(float)) {
+        std::cerr << "ERROR: Density file '" << filename << "' holds fewer than "
+                  << values.size() << " values.\n";
+        return nullptr;
+    }
+
+    return make_shared<density_grid>(nx, ny, nz, bounds, values);
+}
+
+#endif
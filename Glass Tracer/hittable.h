@@ -4,8 +4,18 @@
 #include "GlassTracer.h"
 #include "aabb.h"
 
+#include <cstdint>
+
 class material;
 
+inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull) {
+    // 64-bit FNV-1a, continuing from seed.
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+        seed = (seed ^ bytes[i]) * 1099511628211ull;
+    return seed;
+}
+
 class hit_record {
   public:
     point3 p;
@@ -27,6 +37,55 @@ class hit_record {
     }
 };
 
+class motion_bounds {
+  public:
+    // Bounds of an object over a span of ray times. The object at normalized time s in
+    // [0,1] across the span is contained in lerp(start, end, s).
+    aabb start, end;
+
+    motion_bounds() {}
+    motion_bounds(const aabb& start, const aabb& end) : start(start), end(end) {}
+
+    aabb at(double s) const { return lerp(start, end, s); }
+    aabb hull() const { return aabb(start, end); }
+};
+
+class ray_crossings {
+  public:
+    // The first two places along a ray where it crosses a surface: for a closed boundary,
+    // where the ray enters it and where it leaves. Crossings closer together than separation
+    // count as one, so that a ray through the edge shared by two faces doesn't leave where it
+    // entered.
+    static constexpr double separation = 0.0001;
+
+    double entry = infinity;
+    double exit = infinity;
+
+    void add(double t) {
+        if (t < entry) {
+            if (entry > t + separation)
+                exit = entry;
+            entry = t;
+        } else if (t > entry + separation && t < exit) {
+            exit = t;
+        }
+    }
+
+    // Crossings past this point can't change the result, so searches can stop there.
+    double reach() const { return exit; }
+};
+
+class emission_bounds {
+  public:
+    // What a light BVH needs to know about a light: its total emitted power, and the cone of
+    // directions it emits into, as the spread theta_o of its surface normals about axis plus
+    // the spread theta_e of the emission about each normal.
+    double power = 0;
+    vec3   axis = vec3(0,0,1);
+    double theta_o = pi;        // Normals in every direction.
+    double theta_e = pi / 2;    // Diffuse emission, over the hemisphere about each normal.
+};
+
 class hittable {
   public:
     virtual ~hittable() = default;
@@ -34,6 +93,72 @@ class hittable {
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
     virtual aabb bounding_box() const = 0;
+
+    virtual motion_bounds time_bounds(interval time) const {
+        // Moving objects override this with tighter bounds. The default treats the object
+        // as static over the whole time span.
+        auto bbox = bounding_box();
+        return motion_bounds(bbox, bbox);
+    }
+
+    virtual aabb clipped_box(const aabb& region) const {
+        // Bounds of the part of the object inside region, used by builders that split objects
+        // between nodes. The default is the overlap of the bounding box with region, which is
+        // correct but loose for anything that doesn't fill its box.
+        return overlap(bounding_box(), region);
+    }
+
+    virtual void crossings(const ray& r, interval ray_t, ray_crossings& out) const {
+        // Adds the object's first two crossings within ray_t to out, for volumes that need to
+        // know where a ray enters and leaves their boundary. Containers override this to find
+        // both in one pass over their contents; the default asks hit() twice.
+        hit_record rec;
+        ray_t.max = std::fmin(ray_t.max, out.reach());
+        if (!hit(r, ray_t, rec))
+            return;
+        out.add(rec.t);
+        if (hit(r, interval(rec.t + ray_crossings::separation, ray_t.max), rec))
+            out.add(rec.t);
+    }
+
+    // Light sampling, for objects that can be lights (see light_list). pdf_value() is the
+    // density, per unit solid angle, with which random() picks direction from origin.
+
+    virtual double pdf_value(const point3& origin, const vec3& direction) const {
+        return 0.0;
+    }
+
+    virtual vec3 random(const point3& origin) const {
+        return vec3(1,0,0);
+    }
+
+    virtual bool is_light() const { return false; }
+
+    virtual emission_bounds emission() const { return emission_bounds(); }
+
+    // For sampling lights by area: the area random_surface_point() spreads its points over,
+    // or 0 for objects that can't.
+    virtual double surface_area() const { return 0; }
+
+    virtual void random_surface_point(double time, point3& p, vec3& normal) const {
+        // Sets p to a point uniformly distributed over the surface, where it is at time, and
+        // normal to the outward normal there.
+    }
+
+    virtual color random_emission(ray& photon) const {
+        // For photon mapping: sets photon to leave a random point of the light in a direction
+        // distributed as it emits, and returns the power it carries, which is the emitted
+        // radiance over the density of the ray per unit area and projected solid angle.
+        return color(0,0,0);
+    }
+
+    virtual uint64_t shape_hash() const {
+        // Fingerprint of everything bounding_box() and clipped_box() depend on, under which
+        // built acceleration structures are cached. Objects that override clipped_box() must
+        // override this too; the default only covers the bounding box.
+        auto bbox = bounding_box();
+        return hash_bytes(&bbox, sizeof(bbox));
+    }
 };
 
 class translate : public hittable {
@@ -46,7 +171,7 @@ class translate : public hittable {
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // Move the ray backwards by the offset
-        ray offset_r(r.origin() - offset, r.direction(), r.time());
+        ray offset_r(r.origin() - offset, r.direction(), r.time(), r.spread());
 
         // Determine whether an intersection exists along the offset ray (and if so, where)
         if (!object->hit(offset_r, ray_t, rec))
@@ -58,6 +183,10 @@ class translate : public hittable {
         return true;
     }
 
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        object->crossings(ray(r.origin() - offset, r.direction(), r.time(), r.spread()), ray_t, out);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
   private:
@@ -104,20 +233,7 @@ class rotate_y : public hittable {
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
 
         // Transform the ray from world space to object space.
-
-        auto origin = point3(
-            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-            r.origin().y(),
-            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-        );
-
-        auto direction = vec3(
-            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-            r.direction().y(),
-            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-        );
-
-        ray rotated_r(origin, direction, r.time());
+        ray rotated_r = to_object(r);
 
         // Determine whether an intersection exists in object space (and if so, where).
 
@@ -141,6 +257,10 @@ class rotate_y : public hittable {
         return true;
     }
 
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        object->crossings(to_object(r), ray_t, out);
+    }
+
   aabb bounding_box() const override { return bbox; }
 
   private:
@@ -148,6 +268,23 @@ class rotate_y : public hittable {
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    ray to_object(const ray& r) const {
+        // Rotates the ray into object space; t is the same in both.
+        auto origin = point3(
+            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+            r.origin().y(),
+            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
+        );
+
+        auto direction = vec3(
+            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+            r.direction().y(),
+            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
+        );
+
+        return ray(origin, direction, r.time(), r.spread());
+    }
 };
 
 #endif
\ No newline at end of file
@@ -36,6 +36,11 @@ class hittable_list : public hittable {
         return hit_anything;
     }
 
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        for (const auto& object : objects)
+            object->crossings(r, ray_t, out);
+    }
+
   aabb bounding_box() const override { return bbox; }
 
   private:
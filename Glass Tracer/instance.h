@@ -0,0 +1,276 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+
+#include <cassert>
+#include <vector>
+
+class affine_transform {
+  public:
+    // Row-major 3x4 matrix: the left 3x3 block is the linear part, the last column is the
+    // translation. Points are transformed as M*p + t, vectors as M*v.
+    double m[3][4];
+
+    affine_transform() : m{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}} {}
+
+    affine_transform(const vec3& col0, const vec3& col1, const vec3& col2, const vec3& offset)
+      : m{{col0[0], col1[0], col2[0], offset[0]},
+          {col0[1], col1[1], col2[1], offset[1]},
+          {col0[2], col1[2], col2[2], offset[2]}}
+    {}
+
+    static affine_transform translation(const vec3& offset) {
+        return affine_transform(vec3(1,0,0), vec3(0,1,0), vec3(0,0,1), offset);
+    }
+
+    static affine_transform scaling(const vec3& s) {
+        return affine_transform(vec3(s[0],0,0), vec3(0,s[1],0), vec3(0,0,s[2]), vec3(0,0,0));
+    }
+
+    static affine_transform scaling(double s) { return scaling(vec3(s,s,s)); }
+
+    static affine_transform rotation(const vec3& axis, double angle) {
+        // Rotation of `angle` degrees around an arbitrary axis (Rodrigues' formula).
+        auto a = unit_vector(axis);
+        auto radians = degrees_to_radians(angle);
+        auto c = std::cos(radians);
+        auto s = std::sin(radians);
+        auto k = 1 - c;
+
+        affine_transform r;
+        r.m[0][0] = c + a[0]*a[0]*k;      r.m[0][1] = a[0]*a[1]*k - a[2]*s; r.m[0][2] = a[0]*a[2]*k + a[1]*s;
+        r.m[1][0] = a[1]*a[0]*k + a[2]*s; r.m[1][1] = c + a[1]*a[1]*k;      r.m[1][2] = a[1]*a[2]*k - a[0]*s;
+        r.m[2][0] = a[2]*a[0]*k - a[1]*s; r.m[2][1] = a[2]*a[1]*k + a[0]*s; r.m[2][2] = c + a[2]*a[2]*k;
+        return r;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(
+            m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+            m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+            m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]
+        );
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+            m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+            m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]
+        );
+    }
+
+    vec3 transposed_vector(const vec3& v) const {
+        // Multiplies by the transpose of the linear part. Called on the inverse transform,
+        // this maps object space normals to world space.
+        return vec3(
+            m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+            m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+            m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]
+        );
+    }
+
+    aabb box(const aabb& b) const {
+        // Returns the bounding box of the transformed box. Instead of transforming all eight
+        // corners, each output axis takes the min/max contribution of every input axis.
+        interval out[3];
+        for (int i = 0; i < 3; i++) {
+            double lo = m[i][3], hi = m[i][3];
+            for (int j = 0; j < 3; j++) {
+                const interval& ax = b.axis_interval(j);
+                auto e = m[i][j] * ax.min;
+                auto f = m[i][j] * ax.max;
+                lo += std::fmin(e, f);
+                hi += std::fmax(e, f);
+            }
+            out[i] = interval(lo, hi);
+        }
+        return aabb(out[0], out[1], out[2]);
+    }
+
+    affine_transform inverse() const {
+        // Invert the 3x3 linear part through its adjugate, then solve for the translation.
+        auto det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                 - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                 + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        auto inv_det = 1.0 / det;
+
+        affine_transform r;
+        r.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+        r.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+        r.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+        r.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+        r.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+        r.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+        r.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+        r.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+        r.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+        auto t = r.vector(vec3(m[0][3], m[1][3], m[2][3]));
+        r.m[0][3] = -t[0];
+        r.m[1][3] = -t[1];
+        r.m[2][3] = -t[2];
+        return r;
+    }
+};
+
+inline affine_transform operator*(const affine_transform& a, const affine_transform& b) {
+    // Composition: applying the result is the same as applying b, then a.
+    affine_transform r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+        }
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
+
+inline affine_transform lerp(const affine_transform& a, const affine_transform& b, double s) {
+    affine_transform r;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+            r.m[i][j] = a.m[i][j] + s*(b.m[i][j] - a.m[i][j]);
+    return r;
+}
+
+class instance : public hittable {
+  public:
+    // Places a shared piece of geometry (the bottom level, usually a bvh_node built once per
+    // unique object) in the world with a full affine transform. The geometry is never copied,
+    // so many instances cost only their transforms. Putting the instances themselves in a
+    // bvh_node gives the top level of a two-level hierarchy.
+    instance(shared_ptr<hittable> object, const affine_transform& object_to_world)
+      : object(object), object_to_world(object_to_world),
+        world_to_object(object_to_world.inverse())
+    {
+        bbox = object_to_world.box(object->bounding_box());
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // The object space direction is left unnormalized, so ray parameters t are the same
+        // in both spaces and ray_t can be passed through unchanged. The footprint scales
+        // with the direction.
+        auto direction = world_to_object.vector(r.direction());
+        ray object_r(
+            world_to_object.point(r.origin()),
+            direction,
+            r.time(),
+            r.spread() * direction.length() / r.direction().length()
+        );
+
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        // Normals transform with the inverse transpose. The sign of dot(direction, normal) is
+        // preserved by this pair of transforms, so rec.front_face stays valid.
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+
+        return true;
+    }
+
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        // As in hit(), t carries over to object space unchanged.
+        auto direction = world_to_object.vector(r.direction());
+        object->crossings(ray(world_to_object.point(r.origin()), direction, r.time(),
+                              r.spread() * direction.length() / r.direction().length()),
+                          ray_t, out);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void set_transform(const affine_transform& xform) {
+        // Moves the instance, for animation between frames. Not safe while rays are in flight;
+        // any BVH holding the instance needs a refit or rebuild afterward.
+        object_to_world = xform;
+        world_to_object = xform.inverse();
+        bbox = xform.box(object->bounding_box());
+    }
+
+  private:
+    shared_ptr<hittable> object;
+    affine_transform object_to_world;
+    affine_transform world_to_object;
+    aabb bbox;
+};
+
+class motion_transform : public hittable {
+  public:
+    // Keyframed motion for any hittable. The keyframes are spread evenly over the ray time
+    // range [0,1] and the matrices are blended linearly in between, so every point of the
+    // object moves along a straight line within a segment. Rotations should be given enough
+    // keyframes that the blend stays close to rigid. There must be at least one keyframe;
+    // a single one holds the object still.
+    motion_transform(shared_ptr<hittable> object, const std::vector<affine_transform>& keyframes)
+      : object(object), keyframes(keyframes)
+    {
+        assert(!keyframes.empty() && "motion_transform needs at least one keyframe");
+        bbox = aabb::empty;
+        for (const auto& xform : keyframes)
+            bbox = aabb(bbox, xform.box(object->bounding_box()));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto object_to_world = transform_at(r.time());
+        auto world_to_object = object_to_world.inverse();
+
+        auto direction = world_to_object.vector(r.direction());
+        ray object_r(
+            world_to_object.point(r.origin()),
+            direction,
+            r.time(),
+            r.spread() * direction.length() / r.direction().length()
+        );
+
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    motion_bounds time_bounds(interval time) const override {
+        // Inside one segment the transformed points move linearly, so the boxes at the ends
+        // of the span are conservative linear bounds. Spans that cross a keyframe fall back
+        // to the hull of every box along the way.
+        auto box = object->bounding_box();
+        auto start = transform_at(time.min).box(box);
+        auto end = transform_at(time.max).box(box);
+
+        auto segments = double(keyframes.size() - 1);
+        auto first_key = int(std::floor(time.min * segments)) + 1;
+        auto last_key = int(std::ceil(time.max * segments)) - 1;
+        if (first_key > last_key)
+            return motion_bounds(start, end);
+
+        auto hull = aabb(start, end);
+        for (int k = first_key; k <= last_key; k++)
+            hull = aabb(hull, keyframes[k].box(box));
+        return motion_bounds(hull, hull);
+    }
+
+  private:
+    shared_ptr<hittable> object;
+    std::vector<affine_transform> keyframes;
+    aabb bbox;
+
+    affine_transform transform_at(double time) const {
+        if (keyframes.size() == 1)
+            return keyframes[0];
+
+        auto segments = int(keyframes.size()) - 1;
+        auto scaled = interval(0, segments).clamp(time * segments);
+        auto k = std::min(int(scaled), segments - 1);
+        return lerp(keyframes[k], keyframes[k+1], scaled - k);
+    }
+};
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "GlassTracer.h"
+
+#include "aabb.h"
+#include "onb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+struct irradiance_settings {
+    double error       = 0.3;   // Ward's a: how far records reach, and so how much they blur
+    int    rays        = 256;   // Hemisphere rays per record
+    double min_spacing = 2;     // Shortest reach of a record, in pixel widths where it's made
+    double max_spacing = 40;    // Longest reach, likewise
+};
+
+struct irradiance_record {
+    point3 position;
+    vec3   normal;
+    color  irradiance;
+    double radius;            // Harmonic mean distance to what its rays hit, as clamped.
+    vec3   rotation[3];       // Gradient of each channel as the normal turns,
+    vec3   translation[3];    // and as the position moves.
+};
+
+class irradiance_cache {
+  public:
+    // Indirect irradiance at diffuse surfaces, interpolated between records (Ward, Rubinstein
+    // and Clear, "A Ray Tracing Solution for Diffuse Interreflection", 1988). Light reflected
+    // from other surfaces changes slowly across a diffuse surface, so a record of it, made
+    // from a few hundred hemisphere rays, stands for a whole neighbourhood, sized by how far
+    // away the surfaces it sees are. Each record also keeps how its irradiance changes with
+    // position and orientation (Ward and Heckbert, "Irradiance Gradients", 1992), which the
+    // interpolation extrapolates with, so that far fewer records are needed for the same
+    // smoothness. Its error falls with settings.error, which scales how far records reach.
+    //
+    // Records live in an octree, each in the deepest node at least as big as its reach, so a
+    // lookup only visits the nodes around its point. They are added as rendering finds gaps,
+    // by any number of threads at once without locks: nodes and record lists only ever grow,
+    // by compare-and-swap, and nothing is freed until the cache is.
+
+    irradiance_cache(const aabb& bounds, const irradiance_settings& settings)
+      : settings(settings)
+    {
+        // A cube around bounds, padded so that points on its faces are inside.
+        auto size = std::fmax(bounds.x.size(), std::fmax(bounds.y.size(), bounds.z.size()));
+        center = point3(bounds.x.min + bounds.x.max, bounds.y.min + bounds.y.max,
+                        bounds.z.min + bounds.z.max) / 2;
+        half_size = 0.5 * size * 1.001 + 1e-6;
+    }
+
+    irradiance_cache(const irradiance_cache&) = delete;
+    irradiance_cache& operator=(const irradiance_cache&) = delete;
+
+    ~irradiance_cache() { destroy(&root); }
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+    bool contains(const point3& p) const {
+        for (int axis = 0; axis < 3; axis++)
+            if (std::fabs(p[axis] - center[axis]) > half_size)
+                return false;
+        return true;
+    }
+
+    bool lookup(const point3& p, const vec3& normal, color& irradiance) const {
+        // Interpolates the records that reach p with its normal, weighting each by how much
+        // its error estimate, distance over radius plus the turn between the normals, falls
+        // short of settings.error, so that records fade out at the edge of their reach. False
+        // when none reach it.
+        color sum(0,0,0);
+        double weights = 0;
+        visit(&root, center, half_size, p, [&](const irradiance_record& record) {
+            auto offset = p - record.position;
+            auto error = offset.length() / record.radius
+                       + std::sqrt(std::fmax(0.0, 1 - dot(normal, record.normal)));
+            if (error >= settings.error)
+                return;
+
+            // Records in front of p see what p doesn't.
+            if (dot(offset, record.normal + normal) < -0.1 * settings.error * record.radius)
+                return;
+
+            auto turn = cross(record.normal, normal);
+            color value;
+            for (int c = 0; c < 3; c++) {
+                value[c] = record.irradiance[c] + dot(record.rotation[c], turn)
+                         + dot(record.translation[c], offset);
+            }
+            auto weight = 1 / std::fmax(error, 1e-4) - 1 / settings.error;
+            sum += weight * value;
+            weights += weight;
+        });
+        if (weights <= 0)
+            return false;
+        irradiance = sum / weights;
+        for (int c = 0; c < 3; c++)
+            irradiance[c] = std::fmax(0.0, irradiance[c]);
+        return true;
+    }
+
+    void add(const irradiance_record& record) {
+        // Safe to call from many threads at once, and alongside lookup().
+        auto reach = settings.error * record.radius;
+        node* n = &root;
+        auto n_center = center;
+        auto n_half = half_size;
+        while (n_half / 2 >= reach) {
+            int octant = 0;
+            for (int axis = 0; axis < 3; axis++)
+                if (record.position[axis] > n_center[axis])
+                    octant |= 1 << axis;
+            n_half /= 2;
+            for (int axis = 0; axis < 3; axis++)
+                n_center[axis] += (octant & (1 << axis)) ? n_half : -n_half;
+            n = child(n, octant);
+        }
+
+        auto e = new entry{ record, n->records.load(std::memory_order_relaxed) };
+        while (!n->records.compare_exchange_weak(e->next, e, std::memory_order_release,
+                                                 std::memory_order_relaxed))
+            ;
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    template <typename F>
+    irradiance_record make_record(const point3& p, const vec3& normal, double footprint,
+                                  const F& incoming) const {
+        // A record at p from about settings.rays cosine-distributed directions, stratified in
+        // rings of equal share around the normal and sectors around it, with incoming(d, r)
+        // giving the light arriving along d and setting r to how far away it comes from (or
+        // infinity). Its reach is clamped to the spacings in pixels of footprint width.
+        int rings = std::max(2, int(std::sqrt(settings.rays / pi) + 0.5));
+        int sectors = std::max(3, settings.rays / rings);
+        std::vector<color> light(size_t(rings) * sectors);
+        std::vector<double> distance(light.size());
+        onb frame(normal);
+
+        irradiance_record record;
+        record.position = p;
+        record.normal = frame.w();
+        record.irradiance = color(0,0,0);
+        color tilt[2] = { color(0,0,0), color(0,0,0) };   // Along u and v, of L tan(theta).
+        double inverse_distances = 0;
+        for (int k = 0; k < sectors; k++) {
+            for (int j = 0; j < rings; j++) {
+                auto sin_theta = std::sqrt((j + random_double()) / rings);
+                auto cos_theta = std::sqrt(1 - sin_theta * sin_theta);
+                auto phi = 2 * pi * (k + random_double()) / sectors;
+                auto direction = frame.transform(vec3(sin_theta * std::cos(phi),
+                                                      sin_theta * std::sin(phi), cos_theta));
+                auto i = size_t(k) * rings + j;
+                light[i] = incoming(direction, distance[i]);
+                record.irradiance += light[i];
+                inverse_distances += 1 / distance[i];
+
+                auto tan_theta = sin_theta / std::fmax(cos_theta, 1e-3);
+                tilt[0] += std::cos(phi) * tan_theta * light[i];
+                tilt[1] += std::sin(phi) * tan_theta * light[i];
+            }
+        }
+        auto samples = double(rings) * sectors;
+        record.irradiance *= pi / samples;
+
+        // Rotation: turning the normal toward a ray raises its cosine by the sine of the
+        // angle between them, which over the cosine the ray was sampled by is tan(theta).
+        // lookup() turns by cross(record.normal, normal), so the gradient is crossed too.
+        for (int c = 0; c < 3; c++) {
+            auto toward = pi / samples * (tilt[0][c] * frame.u() + tilt[1][c] * frame.v());
+            record.rotation[c] = cross(frame.w(), toward);
+        }
+
+        // Translation: as p moves, the boundaries between the cells shift over what they
+        // see, by how far away that is, trading the light of neighbouring cells.
+        color along_u(0,0,0), along_v(0,0,0);
+        for (int k = 0; k < sectors; k++) {
+            auto phi = 2 * pi * (k + 0.5) / sectors;
+            auto phi_edge = 2 * pi * k / sectors;
+            auto previous = (k + sectors - 1) % sectors;
+            for (int j = 0; j < rings; j++) {
+                auto i = size_t(k) * rings + j;
+                auto sin_lower = std::sqrt(double(j) / rings);
+                auto sin_upper = std::sqrt(double(j + 1) / rings);
+                if (j > 0) {
+                    auto below = i - 1;
+                    auto weight = 2 * pi / sectors * sin_lower * (1 - sin_lower * sin_lower)
+                                / std::fmin(distance[i], distance[below]);
+                    auto change = weight * (light[i] - light[below]);
+                    along_u += std::cos(phi) * change;
+                    along_v += std::sin(phi) * change;
+                }
+                auto beside = size_t(previous) * rings + j;
+                auto weight = (sin_upper - sin_lower) / std::fmin(distance[i], distance[beside]);
+                auto change = weight * (light[i] - light[beside]);
+                along_u += -std::sin(phi_edge) * change;
+                along_v += std::cos(phi_edge) * change;
+            }
+        }
+        for (int c = 0; c < 3; c++)
+            record.translation[c] = along_u[c] * frame.u() + along_v[c] * frame.v();
+
+        // The radius is where the light seen changes most quickly: where the nearest surfaces
+        // are, or where the gradient would change the irradiance by as much as it is.
+        auto radius = (inverse_distances > 0) ? samples / inverse_distances : infinity;
+        auto luminance_gradient = 0.2126 * record.translation[0] + 0.7152 * record.translation[1]
+                                + 0.0722 * record.translation[2];
+        auto gradient = luminance_gradient.length();
+        auto brightness = luminance(record.irradiance);
+        if (gradient > 0)
+            radius = std::fmin(radius, brightness / gradient);
+        auto pixels = footprint / settings.error;
+        record.radius = std::clamp(radius, settings.min_spacing * pixels,
+                                   settings.max_spacing * pixels);
+
+        // Where the radius was raised to the least spacing, keep the extrapolation from
+        // overshooting.
+        if (gradient * record.radius > brightness) {
+            auto scale = brightness / (gradient * record.radius);
+            for (auto& g : record.translation)
+                g *= scale;
+        }
+        return record;
+    }
+
+  private:
+    struct entry {
+        irradiance_record record;
+        entry* next;
+    };
+
+    struct node {
+        std::atomic<node*>  children[8];
+        std::atomic<entry*> records;
+
+        node() : records(nullptr) {
+            for (auto& c : children)
+                c.store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    irradiance_settings settings;
+    point3 center;
+    double half_size;
+    node root;
+    std::atomic<size_t> count{0};
+
+    static node* child(node* n, int octant) {
+        // The child, made if it isn't there yet. Of two threads making it at once, the one
+        // that loses the race throws its copy away.
+        auto c = n->children[octant].load(std::memory_order_acquire);
+        if (c)
+            return c;
+        auto made = new node();
+        if (n->children[octant].compare_exchange_strong(c, made, std::memory_order_acq_rel,
+                                                        std::memory_order_acquire))
+            return made;
+        delete made;
+        return c;
+    }
+
+    template <typename F>
+    static void visit(const node* n, const point3& n_center, double n_half, const point3& p,
+                      const F& f) {
+        // Calls f on the records of every node whose box, grown by half its size, holds p:
+        // those whose records might reach it.
+        for (auto e = n->records.load(std::memory_order_acquire); e; e = e->next)
+            f(e->record);
+        auto child_half = n_half / 2;
+        for (int octant = 0; octant < 8; octant++) {
+            auto c = n->children[octant].load(std::memory_order_acquire);
+            if (!c)
+                continue;
+            point3 c_center = n_center;
+            bool near = true;
+            for (int axis = 0; axis < 3; axis++) {
+                c_center[axis] += (octant & (1 << axis)) ? child_half : -child_half;
+                near = near && std::fabs(p[axis] - c_center[axis]) <= 2 * child_half;
+            }
+            if (near)
+                visit(c, c_center, child_half, p, f);
+        }
+    }
+
+    static void destroy(node* n) {
+        for (auto e = n->records.load(); e;) {
+            auto next = e->next;
+            delete e;
+            e = next;
+        }
+        for (auto& c : n->children) {
+            if (auto child = c.load()) {
+                destroy(child);
+                delete child;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh.h"
+#include "onb.h"
+#include "parallel.h"
+#include "quad.h"
+
+#include <algorithm>
+#include <vector>
+
+struct lightmap_settings {
+    double texel_size  = 8;      // World units across a texel
+    int    max_size    = 256;    // Most texels along either side of a chart
+    int    atlas_width = 1024;   // Texels across the atlas, which grows downward as needed
+    int    rays        = 256;    // Hemisphere rays per texel and face
+};
+
+class lightmap_atlas {
+  public:
+    // Texels of baked irradiance for both faces of every surface added, each surface in a
+    // rectangle of its own (a chart), packed in rows. Charts are looked up by plane or
+    // texture coordinates in [0,1] across them.
+    struct chart {
+        int x, y, width, height;
+    };
+
+    int width = 0;
+    int height = 0;
+    bool baked = false;
+    std::vector<chart> charts;
+    std::vector<color> texels[2];   // Front faces, then back faces, by row.
+
+    int add_chart(int chart_width, int chart_height) {
+        // Places a chart at the end of the current row, or starts a new row below it. A chart
+        // wider than the atlas widens it.
+        width = std::max(width, chart_width);
+        if (row_x + chart_width > width) {
+            row_y = height;
+            row_x = 0;
+        }
+        charts.push_back({ row_x, row_y, chart_width, chart_height });
+        row_x += chart_width;
+        height = std::max(height, row_y + chart_height);
+        return int(charts.size()) - 1;
+    }
+
+    bool lookup(int c, double u, double v, bool front_face, color& irradiance) const {
+        // Bilinear between the four texels nearest (u,v), kept within the chart.
+        if (!baked)
+            return false;
+        const auto& ch = charts[c];
+        auto s = std::clamp(u * ch.width - 0.5, 0.0, ch.width - 1.0);
+        auto t = std::clamp(v * ch.height - 0.5, 0.0, ch.height - 1.0);
+        int i = std::min(int(s), std::max(ch.width - 2, 0));
+        int j = std::min(int(t), std::max(ch.height - 2, 0));
+        int i1 = std::min(i + 1, ch.width - 1);
+        int j1 = std::min(j + 1, ch.height - 1);
+        auto fs = s - i;
+        auto ft = t - j;
+
+        const auto& face = texels[front_face ? 0 : 1];
+        auto at = [&](int x, int y) { return face[size_t(ch.y + y) * width + ch.x + x]; };
+        irradiance = (1 - ft) * ((1 - fs) * at(i, j) + fs * at(i1, j))
+                   + ft * ((1 - fs) * at(i, j1) + fs * at(i1, j1));
+        return true;
+    }
+
+  private:
+    int row_x = 0;
+    int row_y = 0;
+};
+
+class baked_material : public material {
+  public:
+    // A surface's own material, plus the chart of a lightmap_atlas that holds the light
+    // reaching it from other surfaces.
+    baked_material(shared_ptr<material> base, shared_ptr<lightmap_atlas> atlas, int chart)
+      : base(base), atlas(atlas), chart(chart) {}
+
+    color emitted(double u, double v, const point3& p) const override {
+        return base->emitted(u, v, p);
+    }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+    const override {
+        return base->scatter(r_in, rec, attenuation, scattered);
+    }
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return base->pdf(r_in, rec, direction);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return base->eval(r_in, rec, direction);
+    }
+
+    bool is_emissive() const override { return base->is_emissive(); }
+    bool is_surface() const override { return base->is_surface(); }
+    double index_of_refraction() const override { return base->index_of_refraction(); }
+
+    bool baked_irradiance(const hit_record& rec, color& irradiance) const override {
+        return atlas->lookup(chart, rec.u, rec.v, rec.front_face, irradiance);
+    }
+
+  private:
+    shared_ptr<material> base;
+    shared_ptr<lightmap_atlas> atlas;
+    int chart;
+};
+
+class lightmapped : public hittable {
+  public:
+    // An object whose hits report its baked_material instead of its own.
+    lightmapped(shared_ptr<hittable> object, shared_ptr<material> mat) : object(object), mat(mat) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!object->hit(r, ray_t, rec))
+            return false;
+        rec.mat = mat;
+        return true;
+    }
+
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        object->crossings(r, ray_t, out);
+    }
+
+    aabb bounding_box() const override { return object->bounding_box(); }
+
+    aabb clipped_box(const aabb& region) const override { return object->clipped_box(region); }
+
+  private:
+    shared_ptr<hittable> object;
+    shared_ptr<material> mat;
+};
+
+class lightmap {
+  public:
+    // Light between diffuse surfaces, baked once for a static set so that every frame
+    // rendered of it only traces what the camera sees and its direct light. Quads are
+    // charted by the plane coordinates of quad::hit_ab(), one chart each. Meshes get a chart
+    // of square cells, one per triangle, with the triangle over the lower left half of its
+    // cell and a texel of margin around it, so that filtering never reaches a neighbouring
+    // triangle; the hits of a copy of the mesh then report where they fall in that chart as
+    // their texture coordinates, leaving the mesh given, which may be shared, as it was.
+    //
+    // add() returns the object to put in the world instead, which reports baked_material.
+    // Only quads (including tri and the like) and meshes are baked, also inside lists such
+    // as box(); lights and anything else are returned as they were. Objects must be given in
+    // world space, or with the placement that takes them there, so the result is wrapped in
+    // an instance rather than the other way around. camera::bake() then fills the texels.
+
+    lightmap_settings settings;
+
+    lightmap(const lightmap_settings& settings = lightmap_settings())
+      : settings(settings), atlas(make_shared<lightmap_atlas>())
+    {
+        atlas->width = settings.atlas_width;
+    }
+
+    shared_ptr<hittable> add(shared_ptr<hittable> object) {
+        return add_object(object, affine_transform(), false);
+    }
+
+    shared_ptr<hittable> add(shared_ptr<hittable> object, const affine_transform& placement) {
+        return make_shared<instance>(add_object(object, placement, true), placement);
+    }
+
+    size_t texel_count() const { return sites.size(); }
+
+    template <typename F>
+    void bake(const F& irradiance) {
+        // Sets every texel of both faces to irradiance(p, normal), for its center and the
+        // normal of that face, with the texels spread over all hardware threads.
+        atlas->texels[0].assign(size_t(atlas->width) * atlas->height, color(0,0,0));
+        atlas->texels[1].assign(size_t(atlas->width) * atlas->height, color(0,0,0));
+        parallel_for(sites.size(), [&](size_t k) {
+            const auto& s = sites[k];
+            auto index = size_t(s.y) * atlas->width + s.x;
+            atlas->texels[0][index] = irradiance(s.p, s.normal);
+            atlas->texels[1][index] = irradiance(s.p, -s.normal);
+        });
+        atlas->baked = true;
+    }
+
+  private:
+    struct site {
+        int x, y;         // In the atlas.
+        point3 p;         // The texel's center, in world space.
+        vec3 normal;      // Of the front face.
+    };
+
+    shared_ptr<lightmap_atlas> atlas;
+    std::vector<site> sites;
+
+    shared_ptr<hittable> add_object(shared_ptr<hittable> object, const affine_transform& placement,
+                                    bool placed) {
+        if (auto list = std::dynamic_pointer_cast<hittable_list>(object)) {
+            auto baked = make_shared<hittable_list>();
+            for (const auto& item : list->objects)
+                baked->add(add_object(item, placement, placed));
+            return baked;
+        }
+        if (auto q = std::dynamic_pointer_cast<quad>(object))
+            return add_quad(q, placement, placed);
+        if (auto mesh = std::dynamic_pointer_cast<triangle_mesh>(object))
+            return add_mesh(mesh, placement, placed);
+        return object;
+    }
+
+    shared_ptr<hittable> add_quad(shared_ptr<quad> q, const affine_transform& placement, bool placed) {
+        auto mat = q->get_material();
+        if (!mat || mat->is_emissive())
+            return q;
+
+        auto to_world = [&](const point3& p) { return placed ? placement.point(p) : p; };
+        auto corner = to_world(q->point_at(0, 0));
+        auto side_a = to_world(q->point_at(1, 0)) - corner;
+        auto side_b = to_world(q->point_at(0, 1)) - corner;
+        auto normal = world_normal(q->get_normal(), placement, placed);
+
+        auto w = texels_across(side_a.length());
+        auto h = texels_across(side_b.length());
+        auto c = atlas->add_chart(w, h);
+        const auto& ch = atlas->charts[c];
+        for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+                auto p = corner + ((i + 0.5) / w) * side_a + ((j + 0.5) / h) * side_b;
+                sites.push_back({ ch.x + i, ch.y + j, p, normal });
+            }
+        }
+        return make_shared<lightmapped>(q, make_shared<baked_material>(mat, atlas, c));
+    }
+
+    shared_ptr<hittable> add_mesh(shared_ptr<triangle_mesh> mesh, const affine_transform& placement,
+                                  bool placed) {
+        auto mat = mesh->mesh_material();
+        auto count = int(mesh->triangle_count());
+        if (!mat || mat->is_emissive() || count == 0)
+            return mesh;
+
+        const auto& vertices = mesh->vertex_data();
+        const auto& indices = mesh->index_data();
+        auto corner = [&](int t, int k) {
+            const auto& p = vertices[indices[3*t + k]];
+            return placed ? placement.point(p) : p;
+        };
+
+        // Cells as big as the longest edge needs, but no more than fit in the atlas's width.
+        double longest = 0;
+        for (int t = 0; t < count; t++) {
+            for (int k = 0; k < 3; k++)
+                longest = std::fmax(longest, (corner(t, (k + 1) % 3) - corner(t, k)).length());
+        }
+        int columns = int(std::ceil(std::sqrt(double(count))));
+        int rows = (count + columns - 1) / columns;
+        int cell = std::max(3, std::min(texels_across(longest) + 2, settings.atlas_width / columns));
+        auto c = atlas->add_chart(columns * cell, rows * cell);
+        const auto& ch = atlas->charts[c];
+
+        std::vector<double> coordinates(6 * size_t(count));
+        for (int t = 0; t < count; t++) {
+            auto cell_x = (t % columns) * cell;
+            auto cell_y = (t / columns) * cell;
+            double corners[3][2] = { { 1.0, 1.0 }, { cell - 1.0, 1.0 }, { 1.0, cell - 1.0 } };
+            for (int k = 0; k < 3; k++) {
+                coordinates[6*t + 2*k]     = (cell_x + corners[k][0]) / ch.width;
+                coordinates[6*t + 2*k + 1] = (cell_y + corners[k][1]) / ch.height;
+            }
+
+            auto v0 = corner(t, 0);
+            auto e1 = corner(t, 1) - v0;
+            auto e2 = corner(t, 2) - v0;
+            auto normal = unit_vector(cross(e1, e2));
+            for (int j = 0; j < cell; j++) {
+                for (int i = 0; i < cell; i++) {
+                    // Past the triangle's edges, the plane it lies in.
+                    auto a = (i + 0.5 - 1) / (cell - 2);
+                    auto b = (j + 0.5 - 1) / (cell - 2);
+                    sites.push_back({ ch.x + cell_x + i, ch.y + cell_y + j, v0 + a * e1 + b * e2, normal });
+                }
+            }
+        }
+        auto charted = make_shared<triangle_mesh>(*mesh);
+        charted->set_texture_coordinates(coordinates);
+        return make_shared<lightmapped>(charted, make_shared<baked_material>(mat, atlas, c));
+    }
+
+    int texels_across(double length) const {
+        return std::clamp(int(std::ceil(length / settings.texel_size)), 1, settings.max_size);
+    }
+
+    static vec3 world_normal(const vec3& normal, const affine_transform& placement, bool placed) {
+        // Normals transform with the inverse transpose, as in instance::hit().
+        return placed ? unit_vector(placement.inverse().transposed_vector(normal)) : normal;
+    }
+};
+
+#endif
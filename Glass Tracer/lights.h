@@ -0,0 +1,508 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "GlassTracer.h"
+
+#include "bvh.h"
+#include "environment.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <vector>
+
+enum class light_selection {
+    uniform,   // Every light equally likely.
+    power,     // In proportion to emitted power.
+    bvh        // By estimated contribution at the shading point, from the light BVH.
+};
+
+class light_list {
+  public:
+    // The lights the camera samples directly (next-event estimation). Each sample picks one
+    // light, then a direction toward it with the light's own random(); the density of a
+    // direction is the sum over lights of the chance of picking each one times its
+    // pdf_value().
+    //
+    // With many lights, which one gets picked matters most. Under light_selection::bvh the
+    // lights are kept in a hierarchy (Conty Estevez and Kulla, "Importance Sampling of Many
+    // Lights with Adaptive Tree Splitting", 2018) whose nodes bound the power, position and
+    // emission directions of the lights below them. A sample walks down from the root,
+    // choosing between the two children in proportion to an estimate of how much light
+    // each sends toward the shading point, so nearby and bright lights are picked often and
+    // distant ones rarely, for a cost logarithmic in the number of lights. pdf_value() uses
+    // the same tree to visit only the lights the ray passes through, whichever selection is
+    // used.
+    //
+    // Any object with is_light() can be added; emissive quads and spheres can also be
+    // collected from a scene. Collecting looks inside hittable_list, bvh_node and flat_bvh
+    // but not through transforms or other containers, so lights in there are only found
+    // by rays that hit them, as before, which is slower to converge but still correct.
+    //
+    // An environment map can be sampled too. When there are also lights, each sample goes
+    // to the environment with probability environment_chance, and to the lights otherwise.
+
+    light_selection selection = light_selection::bvh;
+    shared_ptr<environment_map> environment;
+    double environment_chance = 0.5;
+
+    light_list() {}
+
+    explicit light_list(const hittable& world, light_selection selection = light_selection::bvh)
+      : selection(selection)
+    {
+        collect(world);
+    }
+
+    // Adds a light. Call build() once all are in, before sampling.
+    void add(shared_ptr<hittable> light) { lights.push_back(light); }
+
+    void collect(const hittable& world) {
+        // Adds every light in world and builds the hierarchy.
+        gather(world);
+        build();
+    }
+
+    void build() {
+        bounds.resize(lights.size());
+        for (size_t i = 0; i < lights.size(); i++) {
+            bounds[i] = lights[i]->emission();
+            bounds[i].power = std::fmax(bounds[i].power, 0.0);
+        }
+
+        // Selection in proportion to power, from the running sums.
+        power_sums.resize(lights.size());
+        double total = 0;
+        for (size_t i = 0; i < lights.size(); i++)
+            power_sums[i] = (total += bounds[i].power);
+
+        nodes.clear();
+        if (lights.empty())
+            return;
+        std::vector<int> order(lights.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = int(i);
+        nodes.emplace_back();
+        build_node(0, order, 0, order.size());
+    }
+
+    bool empty() const { return lights.empty() && !environment; }
+    size_t size() const { return lights.size(); }
+
+    double pdf_value(const point3& origin, const vec3& direction) const {
+        // Walks the tree along the ray: only lights whose boxes it passes through can have a
+        // nonzero pdf_value(). Under bvh selection, the chance of reaching each node is the
+        // product of the choices on the way, as in random().
+        double pdf = nodes.empty() ? 0 : pdf_below(0, 1.0, ray(origin, direction));
+        if (!environment)
+            return pdf;
+        auto chance = chance_of_environment();
+        return chance * environment->pdf_value(direction) + (1 - chance) * pdf;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const {
+        // The closest hit along r with any of the lights, ignoring everything else.
+        return !nodes.empty() && hit_below(0, r, ray_t, rec);
+    }
+
+    vec3 random(const point3& origin) const {
+        // A direction toward a light picked by the selection strategy. When no light can
+        // reach origin, returns a direction pdf_value() gives zero for.
+        if (environment && random_double() < chance_of_environment())
+            return environment->random();
+        int light = pick(origin);
+        if (light < 0)
+            return vec3(0,0,0);
+        return lights[light]->random(origin);
+    }
+
+    const hittable* random_by_power(double& chance) const {
+        // A light picked in proportion to its power, or uniformly when none reports any, and
+        // the chance of picking it. The environment is never picked. Returns nullptr when
+        // there are no lights, or build() hasn't been called since they were added.
+        if (nodes.empty())
+            return nullptr;
+        int light;
+        if (total_power() > 0) {
+            auto target = random_double() * total_power();
+            auto found = std::upper_bound(power_sums.begin(), power_sums.end(), target);
+            light = int(std::min(size_t(found - power_sums.begin()), lights.size() - 1));
+        } else {
+            light = random_int(0, int(lights.size()) - 1);
+        }
+        chance = chance_by_power(light);
+        return lights[light].get();
+    }
+
+    double area_pdf(const ray& r, const hit_record& rec) const {
+        // The density per unit area with which random_by_power() and the light's
+        // random_surface_point() pick the point r hit at rec, or 0 when that isn't on one of
+        // the lights.
+        hit_record light_rec;
+        int light;
+        if (nodes.empty() || !hit_below(0, r, interval(0.001, infinity), light_rec, &light)
+            || std::fabs(light_rec.t - rec.t) > 1e-9 * std::fmax(1.0, rec.t))
+            return 0;
+        auto area = lights[light]->surface_area();
+        return (area > 0) ? chance_by_power(light) / area : 0;
+    }
+
+    color random_photon(ray& photon) const {
+        // A photon from a light picked by random_by_power(), and the power it carries, as in
+        // hittable::random_emission().
+        double chance;
+        auto light = random_by_power(chance);
+        if (!light)
+            return color(0,0,0);
+        return light->random_emission(photon) / chance;
+    }
+
+  private:
+    struct node {
+        aabb   bbox;
+        vec3   axis;      // Emission cone, as in emission_bounds.
+        double theta_o;
+        double theta_e;
+        double power;
+        int    first;     // Leaf: index in lights. Interior: index of the first of two children.
+        int    count;     // 1 for leaves, 0 for interior nodes.
+    };
+
+    std::vector<shared_ptr<hittable>> lights;
+    std::vector<emission_bounds> bounds;   // By light.
+    std::vector<double> power_sums;        // Running sums of the lights' power.
+    std::vector<node> nodes;               // Children after their parent; the root is node 0.
+
+    void gather(const hittable& world) {
+        if (auto list = dynamic_cast<const hittable_list*>(&world)) {
+            for (const auto& object : list->objects)
+                gather(object);
+        } else if (auto node = dynamic_cast<const bvh_node*>(&world)) {
+            gather(node->left_child());
+            if (node->right_child() != node->left_child())
+                gather(node->right_child());
+        } else if (auto bvh = dynamic_cast<const flat_bvh*>(&world)) {
+            // Spatial splits can put an object in several leaves.
+            auto objects = bvh->leaf_objects();
+            std::sort(objects.begin(), objects.end());
+            objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+            for (const auto& object : objects)
+                if (object)
+                    gather(object);
+        }
+    }
+
+    void gather(const shared_ptr<hittable>& object) {
+        if (object->is_light())
+            add(object);
+        else
+            gather(*object);
+    }
+
+    double pdf_below(int i, double chance, const ray& r) const {
+        const auto& n = nodes[i];
+        if (!n.bbox.hit(r, interval(0.001, infinity)))
+            return 0;
+
+        if (n.count > 0) {
+            if (mode() != light_selection::bvh)
+                chance = selection_chance(n.first);
+            return chance * lights[n.first]->pdf_value(r.origin(), r.direction());
+        }
+
+        if (mode() != light_selection::bvh)
+            return pdf_below(n.first, chance, r) + pdf_below(n.first + 1, chance, r);
+
+        auto first_chance = child_chance(r.origin(), n);
+        if (first_chance < 0)
+            return 0;
+        double sum = 0;
+        if (first_chance > 0)
+            sum += pdf_below(n.first, chance * first_chance, r);
+        if (first_chance < 1)
+            sum += pdf_below(n.first + 1, chance * (1 - first_chance), r);
+        return sum;
+    }
+
+    bool hit_below(int i, const ray& r, interval ray_t, hit_record& rec, int* light = nullptr) const {
+        // Optionally sets light to the index of the one hit.
+        const auto& n = nodes[i];
+        if (!n.bbox.hit(r, ray_t))
+            return false;
+        if (n.count > 0) {
+            if (!lights[n.first]->hit(r, ray_t, rec))
+                return false;
+            if (light)
+                *light = n.first;
+            return true;
+        }
+
+        bool hit_first = hit_below(n.first, r, ray_t, rec, light);
+        bool hit_second = hit_below(n.first + 1, r, interval(ray_t.min, hit_first ? rec.t : ray_t.max), rec, light);
+        return hit_first || hit_second;
+    }
+
+    double total_power() const {
+        // Of all the lights, zero when there are none or before build().
+        return power_sums.empty() ? 0.0 : power_sums.back();
+    }
+
+    double chance_by_power(int light) const {
+        // Of random_by_power() picking light.
+        return (total_power() > 0) ? bounds[light].power / total_power() : 1.0 / lights.size();
+    }
+
+    double chance_of_environment() const {
+        return lights.empty() ? 1.0 : environment_chance;
+    }
+
+    light_selection mode() const {
+        // Selection by power means nothing when no light reports any.
+        return (total_power() > 0) ? selection : light_selection::uniform;
+    }
+
+    double selection_chance(int light) const {
+        if (mode() == light_selection::power)
+            return bounds[light].power / total_power();
+        return 1.0 / lights.size();
+    }
+
+    int pick(const point3& origin) const {
+        // A light by the selection strategy, or -1 when there is none to pick.
+        if (nodes.empty())
+            return -1;
+        if (mode() == light_selection::uniform)
+            return random_int(0, int(lights.size()) - 1);
+
+        if (mode() == light_selection::power) {
+            auto target = random_double() * total_power();
+            auto found = std::upper_bound(power_sums.begin(), power_sums.end(), target);
+            return int(std::min(size_t(found - power_sums.begin()), lights.size() - 1));
+        }
+
+        int i = 0;
+        while (nodes[i].count == 0) {
+            auto first_chance = child_chance(origin, nodes[i]);
+            if (first_chance < 0)
+                return -1;
+            i = (random_double() < first_chance) ? nodes[i].first : nodes[i].first + 1;
+        }
+        return nodes[i].first;
+    }
+
+    double child_chance(const point3& origin, const node& parent) const {
+        // Chance of going to the first child rather than the second, or -1 when neither can
+        // light origin.
+        auto first = importance(origin, nodes[parent.first]);
+        auto second = importance(origin, nodes[parent.first + 1]);
+        if (first + second <= 0)
+            return -1;
+        return first / (first + second);
+    }
+
+    static double importance(const point3& p, const node& n) {
+        // Estimate of the light a node sends toward p: its power over the squared distance,
+        // times the cosine of the smallest angle between the direction to p and any direction
+        // the node's lights emit into. As in PBRT (v4, LightBounds::Importance), the squared
+        // distance is kept above half the length of the box diagonal. That only bounds the
+        // estimate very near a small box: a floor of the bounding sphere's squared radius
+        // would give every point inside an upper node's sphere the same distance to it, and
+        // pick between such nodes by power alone.
+        auto center = point3(n.bbox.x.min + n.bbox.x.max, n.bbox.y.min + n.bbox.y.max,
+                             n.bbox.z.min + n.bbox.z.max) / 2;
+        auto diagonal = vec3(n.bbox.x.size(), n.bbox.y.size(), n.bbox.z.size());
+        auto to_p = p - center;
+        auto d2 = std::fmax(to_p.length_squared(), diagonal.length() / 2);
+
+        // Angle the box's bounding sphere covers as seen from p.
+        auto radius2 = diagonal.length_squared() / 4;
+        auto theta_b = (to_p.length_squared() <= radius2) ? pi
+                     : std::asin(std::sqrt(radius2 / to_p.length_squared()));
+
+        auto cos_theta_w = dot(n.axis, to_p) / std::sqrt(std::fmax(to_p.length_squared(), 1e-300));
+        auto theta_w = std::acos(std::clamp(cos_theta_w, -1.0, 1.0));
+        auto theta = std::fmax(0.0, theta_w - n.theta_o - theta_b);
+        if (theta >= n.theta_e)
+            return 0;
+        return n.power * std::cos(theta) / d2;
+    }
+
+    void build_node(int index, std::vector<int>& order, size_t begin, size_t end) {
+        // Fills nodes[index] over order[begin, end), splitting it where the surface area
+        // orientation heuristic (SAOH) is lowest: the SAH weighted by power and by how much
+        // of the sphere of directions the lights emit into.
+        node n;
+        n.bbox = aabb::empty;
+        n.power = 0;
+        bool first = true;
+        for (auto k = begin; k < end; k++) {
+            int light = order[k];
+            n.bbox = aabb(n.bbox, lights[light]->bounding_box());
+            n.power += bounds[light].power;
+            if (first) {
+                n.axis = bounds[light].axis;
+                n.theta_o = bounds[light].theta_o;
+                n.theta_e = bounds[light].theta_e;
+                first = false;
+            } else {
+                merge_cone(n, bounds[light]);
+            }
+        }
+
+        if (end - begin == 1) {
+            n.first = order[begin];
+            n.count = 1;
+            nodes[index] = n;
+            return;
+        }
+
+        auto mid = split(order, begin, end, n);
+        n.first = int(nodes.size());
+        n.count = 0;
+        nodes[index] = n;
+        nodes.emplace_back();
+        nodes.emplace_back();
+        build_node(n.first, order, begin, mid);
+        build_node(n.first + 1, order, mid, end);
+    }
+
+    size_t split(std::vector<int>& order, size_t begin, size_t end, const node& parent) {
+        // Binned over the centroids along each axis. Falls back to the median of the longest
+        // axis when every light falls in one bin.
+        const int bin_count = 12;
+        auto center = [&](int light, int axis) {
+            auto box = lights[light]->bounding_box();
+            const auto& range = box.axis_interval(axis);
+            return (range.min + range.max) / 2;
+        };
+
+        double best_cost = infinity;
+        int best_axis = -1, best_bin = 0;
+        double best_lo = 0, best_width = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            double lo = infinity, hi = -infinity;
+            for (auto k = begin; k < end; k++) {
+                lo = std::fmin(lo, center(order[k], axis));
+                hi = std::fmax(hi, center(order[k], axis));
+            }
+            if (hi <= lo)
+                continue;
+            auto width = (hi - lo) / bin_count;
+
+            node bins[bin_count];
+            bool used[bin_count] = {};
+            for (auto k = begin; k < end; k++) {
+                int light = order[k];
+                int b = std::min(bin_count - 1, int((center(light, axis) - lo) / width));
+                add_light(bins[b], used[b], light);
+            }
+
+            // Cost of splitting after each bin, from both ends.
+            double below[bin_count] = {};
+            node running;
+            bool running_used = false;
+            for (int b = 0; b < bin_count - 1; b++) {
+                if (used[b]) add_node(running, running_used, bins[b]);
+                below[b] = running_used ? saoh(running) : 0;
+            }
+            running_used = false;
+            for (int b = bin_count - 1; b > 0; b--) {
+                if (used[b]) add_node(running, running_used, bins[b]);
+                auto cost = below[b - 1] + (running_used ? saoh(running) : 0);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                    best_lo = lo;
+                    best_width = width;
+                }
+            }
+        }
+
+        if (best_axis >= 0) {
+            auto mid = std::partition(order.begin() + begin, order.begin() + end, [&](int light) {
+                int b = std::min(bin_count - 1, int((center(light, best_axis) - best_lo) / best_width));
+                return b < best_bin;
+            });
+            auto m = size_t(mid - order.begin());
+            if (m > begin && m < end)
+                return m;
+        }
+
+        int axis = parent.bbox.longest_axis();
+        auto mid = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+            [&](int a, int b) { return center(a, axis) < center(b, axis); });
+        return mid;
+    }
+
+    void add_light(node& n, bool& used, int light) const {
+        node leaf;
+        leaf.bbox = lights[light]->bounding_box();
+        leaf.power = bounds[light].power;
+        leaf.axis = bounds[light].axis;
+        leaf.theta_o = bounds[light].theta_o;
+        leaf.theta_e = bounds[light].theta_e;
+        add_node(n, used, leaf);
+    }
+
+    static void add_node(node& n, bool& used, const node& other) {
+        if (!used) {
+            n = other;
+            used = true;
+            return;
+        }
+        n.bbox = aabb(n.bbox, other.bbox);
+        n.power += other.power;
+        emission_bounds cone;
+        cone.axis = other.axis;
+        cone.theta_o = other.theta_o;
+        cone.theta_e = other.theta_e;
+        merge_cone(n, cone);
+    }
+
+    static double saoh(const node& n) {
+        // Power times surface area times the solid angle measure of the emission cone.
+        auto theta_w = std::fmin(n.theta_o + n.theta_e, pi);
+        auto sin_o = std::sin(n.theta_o), cos_o = std::cos(n.theta_o);
+        auto m_omega = 2*pi*(1 - cos_o)
+                     + pi/2 * (2*theta_w*sin_o - std::cos(n.theta_o - 2*theta_w)
+                               - 2*n.theta_o*sin_o + cos_o);
+        return n.power * n.bbox.surface_area() * m_omega;
+    }
+
+    static void merge_cone(node& n, const emission_bounds& b) {
+        // Smallest cone around both n's and b's normal cones.
+        n.theta_e = std::fmax(n.theta_e, b.theta_e);
+        if (n.theta_o >= pi || b.theta_o >= pi) {
+            n.theta_o = pi;
+            return;
+        }
+
+        auto theta_d = std::acos(std::clamp(dot(n.axis, b.axis), -1.0, 1.0));
+        if (std::fmin(theta_d + b.theta_o, pi) <= n.theta_o)
+            return;
+        if (std::fmin(theta_d + n.theta_o, pi) <= b.theta_o) {
+            n.axis = b.axis;
+            n.theta_o = b.theta_o;
+            return;
+        }
+
+        auto theta_o = (n.theta_o + theta_d + b.theta_o) / 2;
+        auto rotation_axis = cross(n.axis, b.axis);
+        if (theta_o >= pi || rotation_axis.length_squared() < 1e-12) {
+            n.theta_o = pi;
+            return;
+        }
+
+        // Turn n's axis toward b's by the part of the angle that centers the new cone.
+        auto theta_r = theta_o - n.theta_o;
+        auto k = unit_vector(rotation_axis);
+        n.axis = std::cos(theta_r) * n.axis + std::sin(theta_r) * cross(k, n.axis)
+               + (1 - std::cos(theta_r)) * dot(k, n.axis) * k;
+        n.theta_o = theta_o;
+    }
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "mesh.h"
+
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+inline shared_ptr<triangle_mesh> simplify(const triangle_mesh& mesh, double cell_size) {
+    // Vertex clustering: every vertex snaps to the average of the vertices in its grid cell,
+    // and triangles that collapse in the process are dropped. The result has no features
+    // smaller than roughly cell_size.
+
+    const auto& vertices = mesh.vertex_data();
+    const auto& indices = mesh.index_data();
+    auto box = mesh.bounding_box();
+    auto origin = point3(box.x.min, box.y.min, box.z.min);
+
+    std::unordered_map<int64_t, int> cluster_of_cell;
+    std::vector<int> cluster_of_vertex(vertices.size());
+    std::vector<point3> sums;
+    std::vector<int> counts;
+
+    for (size_t i = 0; i < vertices.size(); i++) {
+        auto q = (vertices[i] - origin) / cell_size;
+        int64_t key = (int64_t(q.x()) << 42) ^ (int64_t(q.y()) << 21) ^ int64_t(q.z());
+        auto found = cluster_of_cell.find(key);
+        int cluster;
+        if (found == cluster_of_cell.end()) {
+            cluster = int(sums.size());
+            cluster_of_cell[key] = cluster;
+            sums.push_back(point3(0,0,0));
+            counts.push_back(0);
+        } else {
+            cluster = found->second;
+        }
+        cluster_of_vertex[i] = cluster;
+        sums[cluster] += vertices[i];
+        counts[cluster]++;
+    }
+
+    std::vector<point3> new_vertices(sums.size());
+    for (size_t c = 0; c < sums.size(); c++)
+        new_vertices[c] = sums[c] / counts[c];
+
+    std::vector<int> new_indices;
+    std::unordered_set<int64_t> seen;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        int a = cluster_of_vertex[indices[i]];
+        int b = cluster_of_vertex[indices[i+1]];
+        int c = cluster_of_vertex[indices[i+2]];
+        if (a == b || b == c || c == a)
+            continue;
+
+        // Drop duplicates of the same cluster triangle, whatever their winding.
+        int lo = std::min(a, std::min(b, c)), hi = std::max(a, std::max(b, c));
+        int mid = a + b + c - lo - hi;
+        int64_t key = (int64_t(lo) << 42) ^ (int64_t(mid) << 21) ^ int64_t(hi);
+        if (!seen.insert(key).second)
+            continue;
+
+        new_indices.push_back(a);
+        new_indices.push_back(b);
+        new_indices.push_back(c);
+    }
+
+    return make_shared<triangle_mesh>(new_vertices, new_indices, mesh.mesh_material());
+}
+
+class lod_mesh : public hittable {
+  public:
+    // A chain of progressively coarser versions of one mesh. Each ray picks the coarsest level
+    // whose feature size still fits inside the ray's footprint where it reaches the mesh, so
+    // distant copies intersect small BVHs. With `stochastic` set, rays between two levels pick
+    // one at random in proportion to how close they are, which hides the switch.
+    //
+    // The footprint comes from ray::spread(). Rays without one (spread of zero) always use the
+    // full resolution level.
+
+    lod_mesh(const std::vector<shared_ptr<triangle_mesh>>& levels,
+             const std::vector<double>& feature_sizes, bool stochastic = true)
+      : levels(levels), feature_sizes(feature_sizes), stochastic(stochastic),
+        level_rays(levels.size())
+    {
+        bbox = levels[0]->bounding_box();
+    }
+
+    static shared_ptr<lod_mesh> generate(
+        shared_ptr<triangle_mesh> mesh, int level_count, bool stochastic = true
+    ) {
+        // Builds level_count levels by clustering with cells that double at every level,
+        // starting from the mean edge length of the original mesh.
+        std::vector<shared_ptr<triangle_mesh>> levels = { mesh };
+        auto feature = mean_edge_length(*mesh);
+        std::vector<double> sizes = { feature };
+
+        for (int i = 1; i < level_count; i++) {
+            feature *= 2;
+            auto coarse = simplify(*mesh, feature);
+            if (coarse->triangle_count() == 0)
+                break;
+            levels.push_back(coarse);
+            sizes.push_back(feature);
+        }
+
+        return make_shared<lod_mesh>(levels, sizes, stochastic);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto entry = entry_distance(r, ray_t);
+        if (entry < 0)
+            return false;
+
+        auto level = select_level(r.spread() * std::fmax(entry, 0.0));
+        level_rays[level].fetch_add(1, std::memory_order_relaxed);
+        return levels[level]->hit(r, ray_t, rec);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t level_count() const { return levels.size(); }
+    const triangle_mesh& level(size_t i) const { return *levels[i]; }
+
+    std::vector<size_t> level_usage() const {
+        // Rays traced against each level so far.
+        std::vector<size_t> usage;
+        for (const auto& n : level_rays)
+            usage.push_back(n.load(std::memory_order_relaxed));
+        return usage;
+    }
+
+    size_t memory_touched() const {
+        // Bytes of the levels that at least one ray has been traced against.
+        size_t bytes = 0;
+        for (size_t i = 0; i < levels.size(); i++)
+            if (level_rays[i].load(std::memory_order_relaxed) > 0) bytes += levels[i]->memory_usage();
+        return bytes;
+    }
+
+  private:
+    std::vector<shared_ptr<triangle_mesh>> levels;
+    std::vector<double> feature_sizes;
+    bool stochastic;
+    mutable std::vector<std::atomic<size_t>> level_rays;   // Counted from any thread.
+    aabb bbox;
+
+    static double mean_edge_length(const triangle_mesh& mesh) {
+        const auto& v = mesh.vertex_data();
+        const auto& idx = mesh.index_data();
+        double total = 0;
+        for (size_t i = 0; i < idx.size(); i += 3) {
+            total += (v[idx[i+1]] - v[idx[i]]).length()
+                   + (v[idx[i+2]] - v[idx[i+1]]).length()
+                   + (v[idx[i]] - v[idx[i+2]]).length();
+        }
+        return idx.empty() ? 0 : total / idx.size();
+    }
+
+    double entry_distance(const ray& r, interval ray_t) const {
+        // Parameter t where the ray enters the mesh bounds, or -1 if it misses them. This
+        // stands in for the hit distance when sizing the footprint.
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+        if (!bbox.hit(r, inv_dir, ray_t))
+            return -1;
+        return ray_t.min;
+    }
+
+    size_t select_level(double footprint) const {
+        // Continuous level: the position of the footprint between the feature sizes of two
+        // consecutive levels, measured in log space.
+        size_t last = levels.size() - 1;
+        if (footprint <= feature_sizes[0])
+            return 0;
+        if (footprint >= feature_sizes[last])
+            return last;
+
+        size_t i = 0;
+        while (feature_sizes[i+1] < footprint)
+            i++;
+
+        if (!stochastic)
+            return i;
+
+        auto blend = std::log(footprint / feature_sizes[i])
+                   / std::log(feature_sizes[i+1] / feature_sizes[i]);
+        return (random_double() < blend) ? i + 1 : i;
+    }
+};
+
+#endif
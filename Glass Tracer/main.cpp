@@ -1,13 +1,26 @@
 #include "GlassTracer.h"
 
+#include "benchmark.h"
 #include "bvh.h"
 #include "camera.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "quad.h"
 #include "constant_medium.h"
+#include "heterogeneous_medium.h"
+#include "instance.h"
+#include "motion_bvh.h"
+#include "sdf.h"
+#include "lod.h"
+#include "flat_bvh.h"
+#include "compressed_bvh.h"
+#include "bvh_cache.h"
+#include "dynamic_scene.h"
+#include "grid.h"
+#include "bvh_analysis.h"
 
 void bouncing_spheres() {
     hittable_list world;
@@ -61,7 +74,7 @@ void bouncing_spheres() {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(make_shared<motion_bvh>(world));
 
     camera cam;
 
@@ -312,6 +325,1593 @@ void cornell_smoke() {
     cam.render(world);
 }
 
+void instanced_boxes() {
+    hittable_list world;
+
+    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    world.add(make_shared<quad>(point3(-600,0,-600), vec3(1200,0,0), vec3(0,0,1200), ground));
+
+    // Bottom level: the geometry is built into its own BVH exactly once...
+    hittable_list crate;
+    auto wood  = make_shared<lambertian>(color(0.55, 0.35, 0.15));
+    auto metal_trim = make_shared<metal>(color(0.8, 0.8, 0.85), 0.1);
+    crate.add(box(point3(-0.5,0,-0.5), point3(0.5,1,0.5), wood));
+    crate.add(make_shared<sphere>(point3(0,1.3,0), 0.3, metal_trim));
+    auto crate_blas = make_shared<bvh_node>(crate);
+
+    // ...and the top level holds 100k instances of it, each just an affine transform.
+    hittable_list instances;
+    const int side = 316;
+    for (int i = 0; i < side; i++) {
+        for (int j = 0; j < side; j++) {
+            auto offset = vec3(3.5*(i - side/2) + random_double(-1,1), 0,
+                               3.5*(j - side/2) + random_double(-1,1));
+            auto xform = affine_transform::translation(offset)
+                       * affine_transform::rotation(vec3(random_double(-.2,.2), 1, 0), random_double(0,360))
+                       * affine_transform::scaling(random_double(0.6, 1.4));
+            instances.add(make_shared<instance>(crate_blas, xform));
+        }
+    }
+    std::clog << "Instances: " << instances.objects.size()
+              << " (" << sizeof(instance) << " bytes each)\n";
+
+    world.add(make_shared<bvh_node>(instances));
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 20;
+    cam.max_depth         = 20;
+    cam.background        = color(0.70, 0.80, 1.00);
+
+    cam.vfov     = 30;
+    cam.lookfrom = point3(40,25,60);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+void sphere_set_benchmark() {
+    // Compares a million per-object spheres under bvh_node against the same spheres stored
+    // in a single sphere_set.
+    const int side = 1000;
+
+    std::vector<shared_ptr<material>> palette = {
+        make_shared<lambertian>(color(0.8, 0.3, 0.3)),
+        make_shared<metal>(color(0.8, 0.8, 0.8), 0.1),
+        make_shared<dielectric>(1.5),
+    };
+
+    hittable_list objects;
+    auto spheres = make_shared<sphere_set>();
+    for (const auto& mat : palette)
+        spheres->add_material(mat);
+
+    for (int a = 0; a < side; a++) {
+        for (int b = 0; b < side; b++) {
+            point3 center(a - side/2 + 0.7*random_double(), 0.2, b - side/2 + 0.5*random_double());
+            int id = random_int(0, 2);
+            if (id == 0) {
+                auto center2 = center + vec3(0, random_double(0,.5), 0);
+                objects.add(make_shared<sphere>(center, center2, 0.2, palette[id]));
+                spheres->add(center, center2, 0.2, id);
+            } else {
+                objects.add(make_shared<sphere>(center, 0.2, palette[id]));
+                spheres->add(center, 0.2, id);
+            }
+        }
+    }
+
+    stopwatch object_timer;
+    auto object_bvh = make_shared<bvh_node>(objects);
+    auto object_build = object_timer.seconds();
+
+    stopwatch set_timer;
+    spheres->build();
+    auto set_build = set_timer.seconds();
+
+    // Per-object layout: the sphere and its make_shared control block, the list slot, and
+    // one bvh_node (plus control block) per sphere.
+    auto n = double(spheres->size());
+    auto object_bytes = n * (sizeof(sphere) + 16 + sizeof(shared_ptr<hittable>))
+                      + (n - 1) * (sizeof(bvh_node) + 16);
+    objects.clear();
+
+    std::clog << "Spheres: " << spheres->size() << '\n';
+    std::clog << "sphere + bvh_node: " << object_bytes / n << " bytes/sphere, built in "
+              << object_build << " s\n";
+    std::clog << "sphere_set:        " << spheres->memory_usage() / n << " bytes/sphere, built in "
+              << set_build << " s\n";
+
+    auto rays = primary_rays(point3(0,40,-60), point3(0,0,0), 60, 640, 360);
+    report("sphere + bvh_node", trace_rays(*object_bvh, rays));
+    report("sphere_set       ", trace_rays(*spheres, rays));
+}
+
+void motion_blur_benchmark() {
+    // Rays/s for a field of fast, randomly moving spheres under bvh_node and motion_bvh,
+    // against the same spheres standing still.
+    const int side = 300;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    hittable_list moving, still;
+    for (int a = 0; a < side; a++) {
+        for (int b = 0; b < side; b++) {
+            point3 center(a - side/2 + 0.7*random_double(), 0.2, b - side/2 + 0.5*random_double());
+            auto center2 = center + 2.0 * random_unit_vector();
+            moving.add(make_shared<sphere>(center, center2, 0.2, mat));
+            still.add(make_shared<sphere>(center, 0.2, mat));
+        }
+    }
+
+    auto still_bvh = make_shared<bvh_node>(still);
+    auto moving_bvh = make_shared<bvh_node>(moving);
+    auto moving_mbvh = make_shared<motion_bvh>(moving);
+
+    auto rays = primary_rays(point3(0,30,-60), point3(0,0,0), 50, 640, 360);
+    report("static spheres, bvh_node ", trace_rays(*still_bvh, rays));
+    report("moving spheres, bvh_node ", trace_rays(*moving_bvh, rays));
+    report("moving spheres, motion_bvh", trace_rays(*moving_mbvh, rays));
+    std::clog << "motion_bvh nodes: " << moving_mbvh->node_count()
+              << " for " << moving.objects.size() << " spheres\n";
+}
+
+void sdf_benchmark() {
+    // Memory and rays/s of a procedural shape as an sdf_primitive against the same shape
+    // tessellated into triangle meshes of increasing resolution.
+    auto shape = sdf_smooth_union(
+        sdf_subtraction(sdf_sphere(1.0), sdf_box(vec3(0.6, 0.6, 1.2))),
+        sdf_translate(sdf_torus(1.4, 0.25), vec3(0, 0.3, 0)),
+        0.3);
+    shape = sdf_union(shape,
+        sdf_translate(sdf_repeat(sdf_sphere(0.12), vec3(0.4, 0, 0.4), 5, 0, 5), vec3(0, -1.3, 0)));
+
+    auto mat = make_shared<lambertian>(color(0.7, 0.7, 0.7));
+    auto primitive = make_shared<sdf_primitive>(shape, mat);
+    auto rays = primary_rays(point3(0, 2.5, 6), point3(0, -0.2, 0), 40, 320, 240);
+
+    std::clog << "sdf_primitive: " << primitive->memory_usage() << " bytes\n";
+    report("sdf_primitive", trace_rays(*primitive, rays));
+
+    for (int resolution : { 64, 128, 256 }) {
+        stopwatch timer;
+        auto mesh = tessellate(primitive->compiled(), primitive->bounding_box(), resolution, mat);
+        auto seconds = timer.seconds();
+
+        std::clog << "mesh " << resolution << "^3: " << mesh->triangle_count() << " triangles, "
+                  << mesh->memory_usage() << " bytes, tessellated in " << seconds << " s\n";
+        report("mesh", trace_rays(*mesh, rays));
+    }
+}
+
+void lod_benchmark() {
+    // A crowd of instances of one detailed mesh, seen across a long field, with and without
+    // level-of-detail selection.
+    auto mat = make_shared<lambertian>(color(0.6, 0.5, 0.4));
+    auto shape = sdf_smooth_union(sdf_torus(0.8, 0.25),
+                                  sdf_translate(sdf_sphere(0.5), vec3(0, 0.6, 0)), 0.3);
+    auto bounds = shape->bounds();
+    auto mesh = tessellate(sdf_program(*shape), bounds, 96, mat);
+
+    stopwatch timer;
+    auto lod = lod_mesh::generate(mesh, 6);
+    std::clog << "LOD chain built in " << timer.seconds() << " s:";
+    for (size_t i = 0; i < lod->level_count(); i++)
+        std::clog << ' ' << lod->level(i).triangle_count();
+    std::clog << " triangles\n";
+
+    hittable_list full_instances, lod_instances;
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 100; j++) {
+            auto xform = affine_transform::translation(vec3(4.0*(i - 50), 0, 4.0*j))
+                       * affine_transform::rotation(vec3(0,1,0), random_double(0,360));
+            full_instances.add(make_shared<instance>(mesh, xform));
+            lod_instances.add(make_shared<instance>(lod, xform));
+        }
+    }
+    auto full_world = make_shared<bvh_node>(full_instances);
+    auto lod_world = make_shared<bvh_node>(lod_instances);
+
+    auto rays = primary_rays(point3(0, 3, -10), point3(0, 0, 100), 50, 640, 360);
+
+    std::clog << "Full resolution, memory touched: " << mesh->memory_usage() << " bytes\n";
+    report("Full resolution", trace_rays(*full_world, rays));
+
+    auto lod_stats = trace_rays(*lod_world, rays);
+    std::clog << "LOD, memory touched: " << lod->memory_touched() << " bytes, rays per level:";
+    for (auto n : lod->level_usage())
+        std::clog << ' ' << n;
+    std::clog << '\n';
+    report("LOD", lod_stats);
+}
+
+void bvh_build_benchmark() {
+    // Build time, SAH cost and rays/s of each BVH builder over the same cloud of spheres.
+    hittable_list objects;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < 300000; i++) {
+        auto center = point3(random_double(-100,100), random_double(-20,20), random_double(0,200));
+        objects.add(make_shared<sphere>(center, random_double(0.05, 0.4), mat));
+    }
+    auto rays = primary_rays(point3(0,0,-20), point3(0,0,100), 60, 640, 360);
+    std::clog << "Spheres: " << objects.objects.size() << ", threads: " << thread_count() << '\n';
+
+    stopwatch timer;
+    auto reference = make_shared<bvh_node>(objects);
+    std::clog << "bvh_node: built in " << timer.seconds() << " s\n";
+    report("bvh_node", trace_rays(*reference, rays));
+
+    struct variant { const char* label; bvh_builder builder; int bits; int passes; };
+    const variant variants[] = {
+        { "median          ", bvh_builder::median, 63, 0 },
+        { "median+treelets ", bvh_builder::median, 63, 1 },
+        { "lbvh30          ", bvh_builder::lbvh,   30, 0 },
+        { "lbvh63          ", bvh_builder::lbvh,   63, 0 },
+        { "lbvh63+treelets ", bvh_builder::lbvh,   63, 1 },
+        { "lbvh63+treelets3", bvh_builder::lbvh,   63, 3 },
+    };
+
+    for (const auto& v : variants) {
+        bvh_settings settings;
+        settings.builder = v.builder;
+        settings.morton_bits = v.bits;
+        settings.treelet_passes = v.passes;
+
+        stopwatch build_timer;
+        flat_bvh bvh(objects, settings);
+        auto build = build_timer.seconds();
+
+        std::clog << v.label << ": built in " << build << " s, SAH cost " << bvh.sah_cost() << '\n';
+        report(v.label, trace_rays(bvh, rays));
+    }
+}
+
+void sbvh_benchmark() {
+    // Traversal work with and without spatial splits, on a room of long, thin, randomly
+    // turned planks and on a mesh of slanted columns made of long triangles.
+    auto mat = make_shared<lambertian>(color(0.7, 0.7, 0.7));
+
+    hittable_list planks;
+    planks.add(make_shared<quad>(point3(-50,0,-50), vec3(100,0,0), vec3(0,0,100), mat));
+    planks.add(make_shared<quad>(point3(-50,0,50), vec3(100,0,0), vec3(0,40,0), mat));
+    planks.add(make_shared<quad>(point3(-50,0,-50), vec3(0,0,100), vec3(0,40,0), mat));
+    planks.add(make_shared<quad>(point3(50,0,-50), vec3(0,0,100), vec3(0,40,0), mat));
+    for (int i = 0; i < 3000; i++) {
+        auto center = point3(random_double(-45,45), random_double(1,35), random_double(-45,45));
+        auto length = random_unit_vector() * random_double(4, 12);
+        auto width = unit_vector(cross(length, random_unit_vector())) * 0.3;
+        auto depth = unit_vector(cross(length, width)) * 0.05;
+        auto corner = center - (length + width + depth) / 2;
+        planks.add(make_shared<quad>(corner, length, width, mat));
+        planks.add(make_shared<quad>(corner + depth, length, width, mat));
+        planks.add(make_shared<quad>(corner, length, depth, mat));
+        planks.add(make_shared<quad>(corner + width, length, depth, mat));
+    }
+
+    hittable_list columns;
+    for (int i = 0; i < 400; i++) {
+        auto base = point3(random_double(-45,45), 0, random_double(-45,45));
+        auto axis = vec3(random_double(-10,10), random_double(20,40), random_double(-10,10));
+        auto u = unit_vector(cross(axis, vec3(1,0,0))) * 0.5;
+        auto v = unit_vector(cross(axis, u)) * 0.5;
+        const int segments = 12;
+        for (int k = 0; k < segments; k++) {
+            auto a0 = 2*pi*k / segments, a1 = 2*pi*(k+1) / segments;
+            auto p0 = base + std::cos(a0)*u + std::sin(a0)*v;
+            auto p1 = base + std::cos(a1)*u + std::sin(a1)*v;
+            columns.add(make_shared<tri>(p0, p1 - p0, axis, mat));
+            columns.add(make_shared<tri>(p1 + axis, p0 - p1, -axis, mat));
+        }
+    }
+
+    auto rays = primary_rays(point3(0,20,-48), point3(0,15,0), 70, 480, 270);
+
+    struct scene { const char* name; const hittable_list* objects; };
+    const scene scenes[] = { { "planks", &planks }, { "columns", &columns } };
+    struct variant { const char* label; bvh_builder builder; double budget; };
+    const variant variants[] = {
+        { "median    ", bvh_builder::median, 0.0 },
+        { "sah       ", bvh_builder::sbvh,   0.0 },
+        { "sbvh 0.3  ", bvh_builder::sbvh,   0.3 },
+        { "sbvh 1.0  ", bvh_builder::sbvh,   1.0 },
+    };
+
+    for (const auto& sc : scenes) {
+        std::clog << sc.name << ": " << sc.objects->objects.size() << " primitives\n";
+        for (const auto& v : variants) {
+            bvh_settings settings;
+            settings.builder = v.builder;
+            settings.split_budget = v.budget;
+
+            stopwatch timer;
+            flat_bvh bvh(*sc.objects, settings);
+            auto build = timer.seconds();
+
+            std::clog << v.label << ": built in " << build << " s, " << bvh.reference_count()
+                      << " references, SAH cost " << bvh.sah_cost() << '\n';
+            report_traversal(v.label, bvh, rays);
+            report(v.label, trace_rays(bvh, rays));
+        }
+    }
+}
+
+void compressed_bvh_benchmark() {
+    // Memory and rays/s of the flat and compressed node layouts over the same trees, for
+    // growing clouds of spheres at constant density.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    for (int count : { 10000, 100000, 1000000 }) {
+        auto side = 10 * std::cbrt(double(count));
+        hittable_list objects;
+        for (int i = 0; i < count; i++) {
+            auto center = point3(random_double(-side,side), random_double(-side,side),
+                                 random_double(0, 2*side));
+            objects.add(make_shared<sphere>(center, random_double(1, 4), mat));
+        }
+        auto rays = primary_rays(point3(0,0,-side), point3(0,0,side), 60, 640, 360);
+
+        bvh_settings settings;
+        settings.builder = bvh_builder::sbvh;
+        settings.split_budget = 0;
+        flat_bvh flat(objects, settings);
+        compressed_bvh compressed(flat);
+
+        // bvh_node: one node plus its make_shared control block per interior node.
+        auto n = double(count);
+        std::clog << "Spheres: " << count << ", bytes/primitive: bvh_node "
+                  << (n - 1) * (sizeof(bvh_node) + 16) / n
+                  << ", flat " << flat.memory_usage() / n
+                  << ", compressed " << compressed.memory_usage() / n << '\n';
+        report("flat_bvh      ", trace_rays(flat, rays));
+        report("compressed_bvh", trace_rays(compressed, rays));
+    }
+}
+
+void node_layout_benchmark() {
+    // Cache and TLB misses and rays/s of one BVH under each node layout, for coherent camera
+    // rays and for incoherent rays. Every node fills a cache line, so the layout mostly shows
+    // in the pages touched.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    const int count = 1000000;
+    auto side = 10 * std::cbrt(double(count));
+    hittable_list objects;
+    for (int i = 0; i < count; i++) {
+        auto center = point3(random_double(-side,side), random_double(-side,side),
+                             random_double(0, 2*side));
+        objects.add(make_shared<sphere>(center, random_double(1, 4), mat));
+    }
+
+    bvh_settings settings;
+    settings.builder = bvh_builder::lbvh;
+    flat_bvh bvh(objects, settings);
+
+    struct workload { const char* name; std::vector<ray> rays; };
+    const workload workloads[] = {
+        { "camera",    primary_rays(point3(0,0,-side), point3(0,0,side), 60, 640, 360) },
+        { "scattered", scattered_rays(bvh.bounding_box(), 100000) },
+    };
+
+    hardware_counter l1_counter(counter_event::l1d_misses);
+    hardware_counter tlb_counter(counter_event::dtlb_misses);
+    if (!l1_counter.available())
+        std::clog << "Hardware counters unavailable, reporting simulated caches only.\n";
+
+    struct variant { const char* label; bvh_layout layout; };
+    const variant variants[] = {
+        { "depth first  ", bvh_layout::depth_first },
+        { "breadth first", bvh_layout::breadth_first },
+        { "van Emde Boas", bvh_layout::van_emde_boas },
+        { "treelets     ", bvh_layout::treelets },
+    };
+
+    for (const auto& v : variants) {
+        stopwatch timer;
+        bvh.reorder(v.layout);
+        std::clog << v.label << ": reordered in " << timer.seconds() << " s\n";
+
+        for (const auto& w : workloads) {
+            l1_counter.start();
+            tlb_counter.start();
+            auto stats = trace_rays(bvh, w.rays);
+            auto l1_misses = l1_counter.stop();
+            auto tlb_misses = tlb_counter.stop();
+
+            // 32 KB 8-way L1 with 64-byte lines; 64-entry 4-way TLB over 4 KB pages.
+            std::clog << "  " << w.name << ": simulated misses/ray: L1 "
+                      << simulated_misses(bvh, w.rays, 32 << 10, 64, 8) << ", TLB "
+                      << simulated_misses(bvh, w.rays, 64 * 4096, 4096, 4) << '\n';
+            if (l1_counter.available()) {
+                std::clog << "  " << w.name << ": measured misses/ray: L1D "
+                          << double(l1_misses) / w.rays.size() << ", DTLB "
+                          << double(tlb_misses) / w.rays.size() << '\n';
+            }
+            report(std::string("  ") + w.name, stats);
+        }
+    }
+}
+
+void refit_benchmark() {
+    // Keeping a flat_bvh current while objects move: rebuilding it every frame, refitting it
+    // every frame, and refitting with rebuild_degraded() stepping in once the SAH cost has
+    // grown by 30%. Two animations: a field of spheres where only a ring of them turns, refit
+    // by changed index, and an explosion where every sphere moves.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto ball = make_shared<sphere>(point3(0,0,0), 1, mat);
+    const int count = 100000;
+    const int frames = 20;
+    const double dt = 0.1;
+
+    std::vector<point3> start(count);
+    std::vector<vec3> velocity(count);
+    for (int i = 0; i < count; i++) {
+        start[i] = point3(random_double(-200,200), 1, random_double(-200,200));
+        velocity[i] = random_unit_vector() * random_double(20, 60);
+    }
+
+    // The ring: the spheres within 50 of a point to one side turn around it, a full turn over
+    // the frames.
+    const auto pivot = vec3(-80,0,80);
+    std::vector<int> ring;
+    for (int i = 0; i < count; i++)
+        if ((start[i] - pivot - point3(0,1,0)).length_squared() < 50*50) ring.push_back(i);
+
+    auto turntable = [&](std::vector<shared_ptr<instance>>& balls, int frame) {
+        auto spin = affine_transform::translation(pivot)
+                  * affine_transform::rotation(vec3(0,1,0), 360.0 * frame / frames)
+                  * affine_transform::translation(-pivot);
+        for (int i : ring)
+            balls[i]->set_transform(spin * affine_transform::translation(start[i] - point3(0,0,0)));
+    };
+    auto explosion = [&](std::vector<shared_ptr<instance>>& balls, int frame) {
+        // Ballistic flight from a ball of radius 20, bouncing off the floor.
+        auto t = frame * dt;
+        for (int i = 0; i < count; i++) {
+            auto p = 0.1 * (start[i] - point3(0,1,0)) + point3(0,20,0) + t * velocity[i];
+            auto y = p.y() - 4.9 * t * t;
+            p = point3(p.x(), std::fabs(y - 1) + 1, p.z());
+            balls[i]->set_transform(affine_transform::translation(p - point3(0,0,0)));
+        }
+    };
+
+    auto rays = primary_rays(point3(0,120,-320), point3(0,0,0), 50, 320, 180);
+    std::clog << "Spheres: " << count << ", turning: " << ring.size()
+              << ", frames: " << frames << '\n';
+
+    enum class strategy { rebuild, refit, monitored };
+    struct variant { const char* label; strategy how; };
+    const variant variants[] = {
+        { "rebuild  ", strategy::rebuild },
+        { "refit    ", strategy::refit },
+        { "monitored", strategy::monitored },
+    };
+
+    auto run = [&](const char* name, const auto& animate, bool partial) {
+        for (const auto& v : variants) {
+            std::vector<shared_ptr<instance>> balls;
+            hittable_list objects;
+            for (int i = 0; i < count; i++) {
+                auto xform = affine_transform::translation(start[i] - point3(0,0,0));
+                balls.push_back(make_shared<instance>(ball, xform));
+                objects.add(balls.back());
+            }
+            animate(balls, 0);
+
+            bvh_settings settings;
+            settings.builder = bvh_builder::lbvh;
+            flat_bvh bvh(objects, settings);
+
+            double update_time = 0, trace_time = 0, worst = 1;
+            size_t rebuilt = 0;
+            for (int frame = 1; frame <= frames; frame++) {
+                animate(balls, frame);
+
+                stopwatch timer;
+                if (v.how == strategy::rebuild) {
+                    bvh = flat_bvh(objects, settings);
+                } else {
+                    if (partial) bvh.refit(ring); else bvh.refit();
+                    if (v.how == strategy::monitored)
+                        rebuilt += bvh.rebuild_degraded(1.3);
+                }
+                update_time += timer.seconds();
+
+                worst = std::fmax(worst, bvh.degradation());
+                trace_time += trace_rays(bvh, rays).seconds;
+            }
+
+            std::clog << name << ' ' << v.label << ": " << 1000 * update_time / frames
+                      << " ms/frame update, " << rays.size() * frames / trace_time / 1e6
+                      << " Mrays/s, worst degradation " << worst << ", objects rebuilt "
+                      << rebuilt << ", final SAH cost " << bvh.sah_cost() << '\n';
+        }
+    };
+
+    run("turntable", turntable, true);
+    run("explosion", explosion, false);
+}
+
+void bvh_cache_benchmark() {
+    // Time to get a BVH for a large static scene when it has to be built, when an earlier run
+    // left it in the cache, and after one object has moved, which has to miss.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    const int count = 1000000;
+    auto side = 10 * std::cbrt(double(count));
+    hittable_list objects;
+    for (int i = 0; i < count; i++) {
+        auto center = point3(random_double(-side,side), random_double(-side,side),
+                             random_double(0, 2*side));
+        objects.add(make_shared<sphere>(center, random_double(1, 4), mat));
+    }
+    auto rays = primary_rays(point3(0,0,-side), point3(0,0,side), 60, 640, 360);
+
+    bvh_settings settings;
+    settings.builder = bvh_builder::sbvh;
+    settings.split_budget = 0;
+
+    bvh_cache cache("bvh_cache");
+    stopwatch hash_timer;
+    auto key = bvh_cache::scene_key(objects.objects, settings);
+    std::clog << "Spheres: " << count << ", hashed in " << hash_timer.seconds() << " s, cache file "
+              << cache.file_path(key) << '\n';
+    std::error_code error;
+    std::filesystem::remove(cache.file_path(key), error);
+
+    const char* labels[] = { "cold ", "warm ", "moved" };
+    for (int run = 0; run < 3; run++) {
+        if (run == 2)
+            objects.objects[0] = make_shared<sphere>(point3(0,0,side), 2, mat);
+
+        stopwatch timer;
+        auto bvh = cache.build(objects, settings);
+        std::clog << labels[run] << ": ready in " << timer.seconds() << " s (loads "
+                  << cache.loads << ", builds " << cache.builds << "), SAH cost "
+                  << bvh->sah_cost() << '\n';
+        report(labels[run], trace_rays(*bvh, rays));
+    }
+}
+
+void scene_editing_benchmark() {
+    // Cost of single edits to a large dynamic_scene, each followed by commit(), against
+    // building the whole scene again. The scene is a field of crates and balls, as a look-dev
+    // session might have it.
+    auto wood  = make_shared<lambertian>(color(0.55, 0.35, 0.15));
+    auto paint = make_shared<lambertian>(color(0.8, 0.1, 0.1));
+    auto crate = make_shared<flat_bvh>(*box(point3(-0.5,0,-0.5), point3(0.5,1,0.5), wood));
+    auto ball  = make_shared<sphere>(point3(0,0.5,0), 0.5, wood);
+
+    auto placement = [] {
+        return affine_transform::translation(vec3(random_double(-300,300), 0, random_double(-300,300)))
+             * affine_transform::rotation(vec3(0,1,0), random_double(0,360));
+    };
+
+    const int count = 200000;
+    bvh_settings settings;
+    settings.builder = bvh_builder::lbvh;
+    dynamic_scene scene(settings);
+    std::vector<dynamic_scene::handle> handles;
+    for (int i = 0; i < count; i++) {
+        auto shape = (i % 2) ? shared_ptr<hittable>(crate) : shared_ptr<hittable>(ball);
+        handles.push_back(scene.insert(shape, placement()));
+    }
+
+    stopwatch timer;
+    scene.commit();
+    auto full_build = timer.seconds();
+    auto rays = primary_rays(point3(0,40,-350), point3(0,0,0), 50, 480, 270);
+    std::clog << "Objects: " << count << ", full build " << 1000 * full_build << " ms\n";
+    report("before edits", trace_rays(scene, rays));
+
+    const int edits = 2000;
+    struct kind { const char* label; int op; };
+    const kind kinds[] = { { "move    ", 0 }, { "material", 1 }, { "insert  ", 2 }, { "remove  ", 3 } };
+    for (const auto& k : kinds) {
+        double worst = 0, total = 0;
+        size_t rebuilt = 0;
+        for (int e = 0; e < edits; e++) {
+            auto pick = random_int(0, int(handles.size()) - 1);
+            auto h = handles[pick];
+            stopwatch edit_timer;
+            if (k.op == 0) {
+                scene.set_transform(h, placement());
+            } else if (k.op == 1) {
+                scene.set_material(h, paint);
+            } else if (k.op == 2) {
+                handles.push_back(scene.insert(ball, placement()));
+            } else {
+                scene.remove(h);
+            }
+            rebuilt += scene.commit();
+            auto t = edit_timer.seconds();
+            total += t;
+            worst = std::fmax(worst, t);
+
+            if (k.op == 3) {
+                handles[pick] = handles.back();
+                handles.pop_back();
+            }
+        }
+        std::clog << k.label << ": " << 1e6 * total / edits << " us/edit average, "
+                  << 1e6 * worst << " us worst, " << rebuilt << " objects rebuilt, degradation "
+                  << scene.hierarchy().degradation() << '\n';
+    }
+    report("after edits ", trace_rays(scene, rays));
+}
+
+void grid_benchmark() {
+    // Build time, memory and rays/s of the grids against bvh_node and flat_bvh, over two
+    // dense and even scenes: a field of small spheres on the ground, as in bouncing_spheres()
+    // but larger, and a cloud of particles.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    const int count = 250000;
+
+    for (int scene = 0; scene < 2; scene++) {
+        hittable_list objects;
+        point3 lookfrom, lookat;
+        if (scene == 0) {
+            int side = int(std::sqrt(double(count)));
+            for (int a = 0; a < side; a++)
+                for (int b = 0; b < side; b++)
+                    objects.add(make_shared<sphere>(
+                        point3(a - side/2 + 0.9*random_double(), 0.2, b - side/2 + 0.9*random_double()),
+                        0.2, mat));
+            lookfrom = point3(0, 30, -side/2 - 20);
+            lookat = point3(0, 0, 0);
+        } else {
+            auto side = 2 * std::cbrt(double(count));
+            for (int i = 0; i < count; i++) {
+                auto center = point3(random_double(-side,side), random_double(-side,side),
+                                     random_double(-side,side));
+                objects.add(make_shared<sphere>(center, 0.3, mat));
+            }
+            lookfrom = point3(0, 0, -2*side);
+            lookat = point3(0, 0, 0);
+        }
+
+        auto n = double(objects.objects.size());
+        auto primary = primary_rays(lookfrom, lookat, 60, 640, 360);
+        std::clog << (scene == 0 ? "Sphere field" : "Particles") << ": " << objects.objects.size()
+                  << " spheres\n";
+
+        stopwatch node_timer;
+        auto node = make_shared<bvh_node>(objects);
+        auto node_build = node_timer.seconds();
+
+        stopwatch flat_timer;
+        flat_bvh flat(objects);
+        auto flat_build = flat_timer.seconds();
+
+        grid_settings uniform;
+        uniform.top_density = 2;
+        uniform.leaf_density = 0;
+        stopwatch uniform_timer;
+        hittable_grid uniform_grid(objects, uniform);
+        auto uniform_build = uniform_timer.seconds();
+
+        stopwatch two_level_timer;
+        hittable_grid two_level_grid(objects);
+        auto two_level_build = two_level_timer.seconds();
+
+        auto scattered = scattered_rays(flat.bounding_box(), 200000);
+
+        // bvh_node: one node plus its make_shared control block per interior node.
+        auto measure = [&](const std::string& label, const hittable& world, double build,
+                           double bytes) {
+            auto p = trace_rays(world, primary);
+            auto s = trace_rays(world, scattered);
+            std::clog << label << ": built in " << build << " s, " << bytes / n
+                      << " bytes/object, primary " << p.rays_per_second / 1e6
+                      << " Mrays/s, scattered " << s.rays_per_second / 1e6 << " Mrays/s, hits "
+                      << p.hits << " + " << s.hits << '\n';
+        };
+        measure("bvh_node      ", *node, node_build, (n - 1) * (sizeof(bvh_node) + 16));
+        measure("flat_bvh      ", flat, flat_build, flat.memory_usage());
+        measure("uniform grid  ", uniform_grid, uniform_build, uniform_grid.memory_usage());
+        measure("two-level grid", two_level_grid, two_level_build, two_level_grid.memory_usage());
+    }
+}
+
+void bvh_analysis_benchmark() {
+    // Reports on the trees bvh_node and the SAH builder make for a field of small spheres
+    // crossed by a few long, thin slanted panels, whose boxes cover much of the field, and
+    // writes heatmaps of the work the primary rays take.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    hittable_list world;
+    for (int a = -100; a < 100; a++)
+        for (int b = -100; b < 100; b++)
+            world.add(make_shared<sphere>(
+                point3(a + 0.8*random_double(), 0.2, b + 0.8*random_double()), 0.2, mat));
+    for (int k = 0; k < 8; k++) {
+        auto corner = point3(random_double(-100, 60), 0, random_double(-100, 60));
+        world.add(make_shared<quad>(corner, vec3(40, 0, 40), vec3(0, 1, 0), mat));
+    }
+
+    stopwatch node_timer;
+    auto node = make_shared<bvh_node>(world);
+    std::clog << "bvh_node, built in " << node_timer.seconds() << " s\n";
+    analyze_bvh(*node).print(std::clog);
+
+    bvh_settings settings;
+    settings.builder = bvh_builder::sbvh;
+    stopwatch flat_timer;
+    flat_bvh flat(world, settings);
+    std::clog << "flat_bvh (sbvh), built in " << flat_timer.seconds() << " s\n";
+    analyze_bvh(flat).print(std::clog);
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width  = 640;
+    cam.vfov     = 40;
+    cam.lookfrom = point3(0, 30, -120);
+    cam.lookat   = point3(0, 0, 0);
+    cam.render_heatmap(hittable_list(node));
+    cam.render_heatmap(flat, "heatmap_nodes_sbvh.ppm", "heatmap_objects_sbvh.ppm");
+}
+
+void smoke_benchmark() {
+    // The two smoke boxes of cornell_smoke(), traced by themselves with the boundary crossings
+    // found in one pass and, as before ray_crossings, with two calls to the boundary's hit().
+    class hit_only : public hittable {
+      public:
+        // Hides the boundary's crossings(), leaving hittable's two-call default.
+        hit_only(shared_ptr<hittable> object) : object(object) {}
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return object->hit(r, ray_t, rec);
+        }
+        aabb bounding_box() const override { return object->bounding_box(); }
+      private:
+        shared_ptr<hittable> object;
+    };
+
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
+    box1 = make_shared<rotate_y>(box1, 15);
+    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
+    box2 = make_shared<rotate_y>(box2, -18);
+    box2 = make_shared<translate>(box2, vec3(130,0,65));
+
+    hittable_list one_pass, two_pass;
+    one_pass.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
+    one_pass.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
+    two_pass.add(make_shared<constant_medium>(make_shared<hit_only>(box1), 0.01, color(0,0,0)));
+    two_pass.add(make_shared<constant_medium>(make_shared<hit_only>(box2), 0.01, color(1,1,1)));
+
+    // Rays that miss both boxes cost one pass over the boundary either way; the saving is on
+    // the rays that go through a box, so those are timed separately.
+    auto entering = [&](const std::vector<ray>& rays) {
+        std::vector<ray> kept;
+        for (const auto& r : rays) {
+            ray_crossings c1, c2;
+            box1->crossings(r, interval::universe, c1);
+            box2->crossings(r, interval::universe, c2);
+            if (c1.exit < infinity || c2.exit < infinity)
+                kept.push_back(r);
+        }
+        return kept;
+    };
+    auto rays = primary_rays(point3(278, 278, -800), point3(278, 278, 0), 40, 600, 600);
+    auto scattered = scattered_rays(aabb(point3(0,0,0), point3(555,555,555)), 360000);
+    auto through = entering(scattered);
+
+    report("two hit() calls, primary      ", trace_rays(two_pass, rays));
+    report("crossings(),     primary      ", trace_rays(one_pass, rays));
+    report("two hit() calls, scattered    ", trace_rays(two_pass, scattered));
+    report("crossings(),     scattered    ", trace_rays(one_pass, scattered));
+    report("two hit() calls, through a box", trace_rays(two_pass, through));
+    report("crossings(),     through a box", trace_rays(one_pass, through));
+}
+
+void light_sampling_benchmark() {
+    // Render time against error in the Cornell box, plus a small spherical light, with and
+    // without light sampling. Error is the RMS difference from a light sampled reference at
+    // many more samples. Light that reaches diffuse surfaces through mirrors or glass can
+    // still only be found by chance, so scenes with those converge more slowly either way.
+    hittable_list world;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
+    box1 = make_shared<rotate_y>(box1, 15);
+    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    world.add(box1);
+
+    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
+    box2 = make_shared<rotate_y>(box2, -18);
+    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    world.add(box2);
+
+    world.add(make_shared<sphere>(point3(80, 460, 200), 12, make_shared<diffuse_light>(color(60, 50, 30))));
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 64;
+    cam.max_depth    = 10;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+
+    std::clog << "Lights found: " << light_list(world).size() << '\n';
+
+    cam.sample_lights = true;
+    cam.samples_per_pixel = 4096;
+    stopwatch reference_timer;
+    auto reference = cam.render_pixels(world);
+    std::clog << "\rReference: " << cam.samples_per_pixel << " samples/pixel in "
+              << reference_timer.seconds() << " s\n";
+
+    auto rms_error = [&](const std::vector<color>& image) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++)
+            sum += (image[i] - reference[i]).length_squared() / 3;
+        return std::sqrt(sum / image.size());
+    };
+
+    for (bool sample_lights : { false, true }) {
+        cam.sample_lights = sample_lights;
+        for (int spp : { 4, 16, 64, 256 }) {
+            cam.samples_per_pixel = spp;
+            stopwatch timer;
+            auto image = cam.render_pixels(world);
+            auto seconds = timer.seconds();
+            std::clog << '\r' << (sample_lights ? "light + BSDF sampling" : "BSDF sampling only    ")
+                      << std::setw(6) << spp << " samples/pixel: " << std::setw(8) << seconds
+                      << " s, RMS error " << rms_error(image) << '\n';
+        }
+    }
+}
+
+void light_bvh_benchmark() {
+    // Noise against the number of lights, for each way of picking the light to sample. Small
+    // spherical lights of widely varying brightness hang over a plain floor; the camera sees
+    // part of the field, so most lights are far from most of what it sees. Total power is
+    // the same for every light count. Error is the relative mean squared difference in
+    // luminance from a reference rendered with the light BVH at many more samples, which
+    // keeps the few pixels that see a light directly from outweighing the rest.
+    auto floor = make_shared<lambertian>(color(.73, .73, .73));
+    const char* names[] = { "uniform", "power  ", "BVH    " };
+
+    for (int light_count : { 16, 256, 4096 }) {
+        hittable_list objects;
+        objects.add(make_shared<quad>(point3(-1000,0,-1000), vec3(2000,0,0), vec3(0,0,2000), floor));
+        for (int i = 0; i < light_count; i++) {
+            auto brightness = std::pow(10.0, random_double(0, 3)) * 4000.0 / light_count;
+            auto tint = color(random_double(.5, 1), random_double(.5, 1), random_double(.5, 1));
+            auto center = point3(random_double(-500,500), random_double(2,20), random_double(-500,500));
+            objects.add(make_shared<sphere>(center, 1, make_shared<diffuse_light>(brightness * tint)));
+        }
+        hittable_list world(make_shared<bvh_node>(objects));
+
+        camera cam;
+        cam.aspect_ratio = 16.0 / 9.0;
+        cam.image_width  = 64;
+        cam.max_depth    = 2;
+        cam.background   = color(0,0,0);
+        cam.vfov     = 30;
+        cam.lookfrom = point3(0, 60, 150);
+        cam.lookat   = point3(0, 0, 0);
+        cam.sample_lights = true;
+
+        cam.choose_lights = light_selection::bvh;
+        cam.samples_per_pixel = 1024;
+        auto reference = cam.render_pixels(world);
+        std::clog << '\r' << light_count << " lights:                    \n";
+        for (auto selection : { light_selection::uniform, light_selection::power, light_selection::bvh }) {
+            cam.choose_lights = selection;
+            cam.samples_per_pixel = 16;
+            stopwatch timer;
+            auto image = cam.render_pixels(world);
+            auto seconds = timer.seconds();
+            double sum = 0;
+            for (size_t i = 0; i < image.size(); i++) {
+                auto expected = luminance(reference[i]);
+                auto difference = luminance(image[i]) - expected;
+                sum += difference * difference / (expected * expected + 0.01);
+            }
+            std::clog << '\r' << "  " << names[int(selection)] << std::setw(4) << cam.samples_per_pixel
+                      << " samples/pixel: " << std::setw(8) << seconds << " s, relative MSE "
+                      << sum / image.size() << '\n';
+        }
+    }
+}
+
+void environment_benchmark() {
+    // Render time against error for an outdoor scene lit only by a sky, with and without
+    // sampling the sky by its brightness. The sky is made here rather than loaded, a blue
+    // gradient with a small sun that gives most of the light; a captured one would be loaded
+    // with make_shared<environment_map>("sky.hdr"). Error is the relative mean squared
+    // difference in luminance from a reference at many more samples.
+    const int sky_width = 512, sky_height = 256;
+    auto sun = unit_vector(vec3(-1, 0.8, -0.6));
+    std::vector<color> sky(sky_width * sky_height);
+    for (int j = 0; j < sky_height; j++) {
+        auto theta = pi * (j + 0.5) / sky_height;
+        for (int i = 0; i < sky_width; i++) {
+            auto phi = 2 * pi * (i + 0.5) / sky_width;
+            auto d = vec3(-std::cos(phi) * std::sin(theta), std::cos(theta), std::sin(phi) * std::sin(theta));
+            auto height = std::fmax(d.y(), 0.0);
+            color c = (d.y() > 0) ? (1 - height) * color(1.0, 1.0, 1.0) + height * color(0.3, 0.5, 1.0)
+                                  : color(0.2, 0.2, 0.2);
+            if (dot(d, sun) > std::cos(degrees_to_radians(1.0)))
+                c = color(10000, 9000, 7500);
+            sky[j * sky_width + i] = c;
+        }
+    }
+    auto environment = make_shared<environment_map>(sky, sky_width);
+
+    hittable_list objects;
+    objects.add(make_shared<quad>(point3(-50,0,-50), vec3(100,0,0), vec3(0,0,100),
+                                  make_shared<lambertian>(color(.5, .5, .5))));
+    objects.add(make_shared<sphere>(point3(0,1,0), 1, make_shared<lambertian>(color(.7, .3, .2))));
+    objects.add(make_shared<sphere>(point3(-2.2,1,0.5), 1, make_shared<lambertian>(color(.8, .8, .8))));
+    objects.add(make_shared<sphere>(point3(2.2,1,-0.5), 1, make_shared<lambertian>(color(.2, .4, .7))));
+    shared_ptr<hittable> block = box(point3(0,0,0), point3(1.5,2.5,1.5), make_shared<lambertian>(color(.8, .8, .8)));
+    block = make_shared<rotate_y>(block, 30);
+    block = make_shared<translate>(block, vec3(0.5,0,-3));
+    objects.add(block);
+    hittable_list world(make_shared<bvh_node>(objects));
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width  = 64;
+    cam.max_depth    = 6;
+    cam.environment  = environment;
+    cam.vfov     = 40;
+    cam.lookfrom = point3(0, 3, 9);
+    cam.lookat   = point3(0, 1, 0);
+
+    cam.sample_lights = true;
+    cam.samples_per_pixel = 4096;
+    stopwatch reference_timer;
+    auto reference = cam.render_pixels(world);
+    std::clog << "\rReference: " << cam.samples_per_pixel << " samples/pixel in "
+              << reference_timer.seconds() << " s\n";
+
+    for (bool sample_lights : { false, true }) {
+        cam.sample_lights = sample_lights;
+        for (int spp : { 4, 16, 64, 256 }) {
+            cam.samples_per_pixel = spp;
+            stopwatch timer;
+            auto image = cam.render_pixels(world);
+            auto seconds = timer.seconds();
+            double sum = 0;
+            for (size_t i = 0; i < image.size(); i++) {
+                auto expected = luminance(reference[i]);
+                auto difference = luminance(image[i]) - expected;
+                sum += difference * difference / (expected * expected + 0.01);
+            }
+            std::clog << '\r' << (sample_lights ? "sky + BSDF sampling" : "BSDF sampling only ")
+                      << std::setw(6) << spp << " samples/pixel: " << std::setw(8) << seconds
+                      << " s, relative MSE " << sum / image.size() << '\n';
+        }
+    }
+}
+
+void restir_benchmark() {
+    // Direct light from many lights at one to four samples per pixel: light sampling from the
+    // light BVH, against reservoir resampling with more and more reuse. Boxes on the floor
+    // cast shadows, which is where reuse between pixels goes wrong without bias correction.
+    // Then the camera orbits for a few frames at one sample each, to compare the last frame
+    // with and without reuse from earlier frames. Error is the relative mean squared
+    // difference in luminance from a reference rendered with the light BVH.
+    hittable_list objects;
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    objects.add(make_shared<quad>(point3(-200,0,-200), vec3(400,0,0), vec3(0,0,400), white));
+    for (int i = 0; i < 40; i++) {
+        auto corner = point3(random_double(-60,60), 0, random_double(-60,60));
+        auto size = vec3(random_double(2,8), random_double(2,12), random_double(2,8));
+        objects.add(box(corner, corner + size, white));
+    }
+    for (int i = 0; i < 256; i++) {
+        auto brightness = std::pow(10.0, random_double(0, 2)) * 40.0;
+        auto tint = color(random_double(.5, 1), random_double(.5, 1), random_double(.5, 1));
+        auto center = point3(random_double(-100,100), random_double(15,25), random_double(-100,100));
+        objects.add(make_shared<sphere>(center, 0.5, make_shared<diffuse_light>(brightness * tint)));
+    }
+    hittable_list world(make_shared<bvh_node>(objects));
+
+    // Below the lights and looking down, so that they light the picture without being in it:
+    // what a light seen directly looks like doesn't depend on how lights are sampled.
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width  = 64;
+    cam.max_depth    = 2;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 50;
+    cam.sample_lights = true;
+    cam.resampling.spatial_radius = 5;   // Neighbors much farther away across this small an
+                                         // image see quite different lights.
+
+    auto place = [&](double degrees) {
+        auto angle = degrees_to_radians(degrees);
+        cam.lookfrom = point3(80 * std::sin(angle), 12, 80 * std::cos(angle));
+        cam.lookat   = point3(0, -40, 0);
+    };
+    auto reference_for = [&]() {
+        cam.resample_lights = false;
+        cam.samples_per_pixel = 1024;
+        return cam.render_pixels(world);
+    };
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    struct variant { const char* name; bool resample, temporal; int spatial; bias_correction correction; };
+    const variant variants[] = {
+        { "light BVH sampling           ", false, false, 0, bias_correction::basic },
+        { "resampling, no reuse         ", true,  false, 0, bias_correction::basic },
+        { "spatial reuse                ", true,  false, 2, bias_correction::basic },
+        { "spatiotemporal, uncorrected  ", true,  true,  2, bias_correction::none },
+        { "spatiotemporal               ", true,  true,  2, bias_correction::basic },
+        { "spatiotemporal, ray traced   ", true,  true,  2, bias_correction::ray_traced },
+    };
+    auto configure = [&](const variant& v) {
+        cam.resample_lights = v.resample;
+        cam.resampling.temporal_reuse = v.temporal;
+        cam.resampling.spatial_passes = v.spatial;
+        cam.resampling.correction = v.correction;
+        cam.reset_history();
+    };
+
+    place(0);
+    auto reference = reference_for();
+    std::clog << "\rStill camera:                    \n";
+    for (const auto& v : variants) {
+        for (int spp : { 1, 4 }) {
+            configure(v);
+            cam.samples_per_pixel = spp;
+            stopwatch timer;
+            auto image = cam.render_pixels(world);
+            auto seconds = timer.seconds();
+            std::clog << "\r  " << v.name << spp << " samples/pixel: " << std::setw(8) << seconds
+                      << " s, relative MSE " << relative_mse(image, reference) << '\n';
+        }
+    }
+
+    const int frames = 8;
+    place(2.0 * (frames - 1));
+    reference = reference_for();
+    std::clog << "\rOrbiting camera, frame " << frames << " at 1 sample/pixel:      \n";
+    for (const auto& v : variants) {
+        configure(v);
+        cam.samples_per_pixel = 1;
+        std::vector<color> image;
+        for (int frame = 0; frame < frames; frame++) {
+            place(2.0 * frame);
+            image = cam.render_pixels(world);
+        }
+        std::clog << "\r  " << v.name << "relative MSE " << relative_mse(image, reference) << '\n';
+    }
+}
+
+void path_guiding_benchmark() {
+    // The Cornell box split in two by a wall with a doorway, the light on the ceiling of the
+    // back room, out of the camera's sight. Everything the camera sees is lit through the
+    // doorway, off the back room's walls and floor, which cosine-weighted bounces seldom
+    // find and light samples can't reach. Path tracing with and without path guiding at
+    // equal time, the unguided render getting as many samples as fit in the time the guided
+    // one took; both spread their rows over all hardware threads. Error is the relative mean
+    // squared difference in luminance from a long unguided render.
+    hittable_list world;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(300, 300, 300));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(343, 554, 532), vec3(-130,0,0), vec3(0,0,-105), light));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    // The wall, around a doorway from x = 200 to 355 and up to y = 250.
+    world.add(make_shared<quad>(point3(0,0,400), vec3(200,0,0), vec3(0,555,0), white));
+    world.add(make_shared<quad>(point3(355,0,400), vec3(200,0,0), vec3(0,555,0), white));
+    world.add(make_shared<quad>(point3(200,250,400), vec3(155,0,0), vec3(0,305,0), white));
+
+    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,165,165), white);
+    box1 = make_shared<rotate_y>(box1, -18);
+    box1 = make_shared<translate>(box1, vec3(130,0,65));
+    world.add(box1);
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 96;
+    cam.max_depth    = 8;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.sample_lights = true;
+
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    cam.samples_per_pixel = 4096;
+    auto reference = cam.render_pixels(world);
+
+    // Time per sample without guiding, to size the equal-time renders.
+    cam.samples_per_pixel = 64;
+    stopwatch unguided_timer;
+    cam.render_pixels(world);
+    auto seconds_per_sample = unguided_timer.seconds() / cam.samples_per_pixel;
+
+    for (int spp : { 32, 128, 512 }) {
+        cam.guide_paths = true;
+        cam.samples_per_pixel = spp;
+        stopwatch guided_timer;
+        auto guided = cam.render_pixels(world);
+        auto seconds = guided_timer.seconds();
+
+        cam.guide_paths = false;
+        cam.samples_per_pixel = std::max(1, int(seconds / seconds_per_sample + 0.5));
+        auto unguided = cam.render_pixels(world);
+
+        std::clog << "\r" << std::setw(8) << seconds << " s: guided " << std::setw(4) << spp
+                  << " samples/pixel, relative MSE " << relative_mse(guided, reference)
+                  << "; unguided " << std::setw(4) << cam.samples_per_pixel
+                  << " samples/pixel, relative MSE " << relative_mse(unguided, reference) << '\n';
+    }
+}
+
+void caustics_benchmark() {
+    // A glass sphere held above the floor of the Cornell box, under a small light, focusing
+    // it into a bright spot on the floor and a caustic rim around the sphere's shadow. Path
+    // tracing alone, and with the caustics from photons, at equal time; both spread their
+    // rows over all hardware threads. Error is the relative mean squared difference in
+    // luminance from a long render by path tracing alone, so that the reference owes nothing
+    // to the photons' bias.
+    hittable_list world;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(60, 60, 60));
+    auto glass = make_shared<dielectric>(1.5);
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(318, 554, 318), vec3(-80,0,0), vec3(0,0,-80), light));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(make_shared<sphere>(point3(278, 220, 278), 100, glass));
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 96;
+    cam.max_depth    = 8;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.sample_lights = true;
+    cam.caustics.photons_per_pass = 20000;
+
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    cam.map_caustics = false;
+    cam.samples_per_pixel = 8192;
+    auto reference = cam.render_pixels(world);
+
+    for (int spp : { 16, 64, 256 }) {
+        cam.map_caustics = true;
+        cam.samples_per_pixel = spp;
+        stopwatch mapped_timer;
+        auto mapped = cam.render_pixels(world);
+        auto seconds = mapped_timer.seconds();
+
+        // Path tracing at as many samples as fit in the same time.
+        cam.map_caustics = false;
+        cam.samples_per_pixel = 16;
+        stopwatch traced_timer;
+        cam.render_pixels(world);
+        cam.samples_per_pixel = std::max(1, int(seconds / traced_timer.seconds() * 16 + 0.5));
+        auto traced = cam.render_pixels(world);
+
+        std::clog << "\r" << std::setw(8) << seconds << " s: photons " << std::setw(4) << spp
+                  << " passes, relative MSE " << relative_mse(mapped, reference)
+                  << "; path tracing " << std::setw(5) << cam.samples_per_pixel
+                  << " samples/pixel, relative MSE " << relative_mse(traced, reference) << '\n';
+    }
+}
+
+void manifold_benchmark() {
+    // The scene of caustics_benchmark() with a quarter-width light of the same power, so
+    // that paths from the floor almost never refract into it. Path tracing alone, and with
+    // light samples through the sphere, at equal time. Error is the relative mean squared
+    // difference in luminance from a long render with the light samples.
+    hittable_list world;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(960, 960, 960));
+    auto glass = make_shared<dielectric>(1.5);
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(288, 554, 288), vec3(-20,0,0), vec3(0,0,-20), light));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(make_shared<sphere>(point3(278, 220, 278), 100, glass));
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 96;
+    cam.max_depth    = 8;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.sample_lights = true;
+
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    cam.sample_caustics = true;
+    cam.samples_per_pixel = 1024;
+    auto reference = cam.render_pixels(world);
+
+    for (int spp : { 16, 64, 256 }) {
+        cam.sample_caustics = true;
+        cam.samples_per_pixel = spp;
+        stopwatch sampled_timer;
+        auto sampled = cam.render_pixels(world);
+        auto seconds = sampled_timer.seconds();
+
+        // Path tracing at as many samples as fit in the same time.
+        cam.sample_caustics = false;
+        cam.samples_per_pixel = 16;
+        stopwatch traced_timer;
+        cam.render_pixels(world);
+        cam.samples_per_pixel = std::max(1, int(seconds / traced_timer.seconds() * 16 + 0.5));
+        auto traced = cam.render_pixels(world);
+
+        std::clog << "\r" << std::setw(8) << seconds << " s: through glass " << std::setw(4) << spp
+                  << " samples/pixel, relative MSE " << relative_mse(sampled, reference)
+                  << "; path tracing " << std::setw(5) << cam.samples_per_pixel
+                  << " samples/pixel, relative MSE " << relative_mse(traced, reference) << '\n';
+    }
+}
+
+void irradiance_cache_benchmark() {
+    // The Cornell box, whose walls take much of their light from each other. Path tracing
+    // with the light between diffuse surfaces from an irradiance cache, at a few error
+    // settings, and path tracing alone at equal time; both spread their rows over all
+    // hardware threads. Error is the relative mean squared difference in luminance from a
+    // long render without the cache.
+    hittable_list world;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
+    box1 = make_shared<rotate_y>(box1, 15);
+    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    world.add(box1);
+
+    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
+    box2 = make_shared<rotate_y>(box2, -18);
+    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    world.add(box2);
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 96;
+    cam.max_depth    = 16;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.sample_lights = true;
+
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    cam.samples_per_pixel = 2048;
+    auto reference = cam.render_pixels(world);
+
+    for (double error : { 0.4, 0.2, 0.1 }) {
+        cam.cache_irradiance = true;
+        cam.irradiance.error = error;
+        cam.samples_per_pixel = 16;
+        stopwatch cached_timer;
+        auto cached = cam.render_pixels(world);
+        auto seconds = cached_timer.seconds();
+
+        // Path tracing at as many samples as fit in the same time.
+        cam.cache_irradiance = false;
+        cam.samples_per_pixel = 16;
+        stopwatch traced_timer;
+        cam.render_pixels(world);
+        cam.samples_per_pixel = std::max(1, int(seconds / traced_timer.seconds() * 16 + 0.5));
+        auto traced = cam.render_pixels(world);
+
+        std::clog << "\r" << std::setw(8) << seconds << " s: cache error " << error
+                  << ", relative MSE " << relative_mse(cached, reference)
+                  << "; path tracing " << std::setw(5) << cam.samples_per_pixel
+                  << " samples/pixel, relative MSE " << relative_mse(traced, reference) << '\n';
+    }
+}
+
+void lightmap_benchmark() {
+    // A walkthrough of the Cornell box, with a pyramid mesh beside the boxes: its walls,
+    // boxes and pyramid baked into lightmaps once, then frames from along the walk drawn with
+    // the light between them from the maps, against path tracing alone at equal time per
+    // frame. Error is the relative mean squared difference in luminance from a long render
+    // of each frame without the maps.
+    hittable_list world;
+    lightmap maps;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    world.add(maps.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green)));
+    world.add(maps.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red)));
+    world.add(maps.add(make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light)));
+    world.add(maps.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white)));
+    world.add(maps.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white)));
+    world.add(maps.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white)));
+
+    world.add(maps.add(box(point3(0,0,0), point3(165,330,165), white),
+                       affine_transform::translation(vec3(265,0,295))
+                     * affine_transform::rotation(vec3(0,1,0), 15)));
+    world.add(maps.add(box(point3(0,0,0), point3(165,165,165), white),
+                       affine_transform::translation(vec3(130,0,65))
+                     * affine_transform::rotation(vec3(0,1,0), -18)));
+
+    std::vector<point3> vertices = { point3(400,0,60), point3(520,0,60), point3(520,0,180),
+                                     point3(400,0,180), point3(460,140,120) };
+    std::vector<int> indices = { 0,4,1, 1,4,2, 2,4,3, 3,4,0 };
+    world.add(maps.add(make_shared<triangle_mesh>(vertices, indices, white)));
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 96;
+    cam.max_depth    = 16;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 40;
+    cam.sample_lights = true;
+
+    stopwatch bake_timer;
+    cam.bake(world, maps);
+    std::clog << "\rBaked " << maps.texel_count() << " texels in " << bake_timer.seconds() << " s\n";
+
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    for (int frame = 0; frame < 3; frame++) {
+        cam.lookfrom = point3(278 - 120 * (frame - 1), 278, -800 + 150 * frame);
+        cam.lookat   = point3(278, 200, 278);
+
+        cam.use_lightmaps = false;
+        cam.samples_per_pixel = 1024;
+        auto reference = cam.render_pixels(world);
+
+        cam.use_lightmaps = true;
+        cam.samples_per_pixel = 16;
+        stopwatch baked_timer;
+        auto baked = cam.render_pixels(world);
+        auto seconds = baked_timer.seconds();
+
+        // Path tracing at as many samples as fit in the same time.
+        cam.use_lightmaps = false;
+        stopwatch traced_timer;
+        cam.render_pixels(world);
+        cam.samples_per_pixel = std::max(1, int(seconds / traced_timer.seconds() * 16 + 0.5));
+        auto traced = cam.render_pixels(world);
+
+        std::clog << "\rFrame " << frame << ": " << std::setw(8) << seconds
+                  << " s with lightmaps, relative MSE " << relative_mse(baked, reference)
+                  << "; path tracing " << std::setw(5) << cam.samples_per_pixel
+                  << " samples/pixel, relative MSE " << relative_mse(traced, reference) << '\n';
+    }
+}
+
+void heterogeneous_medium_benchmark() {
+    // A lumpy cloud of 64^3 voxels, saved as raw floats and loaded back, then set in grids
+    // padded with more and more empty space: the rays through it should cost about the same
+    // in each, as should the memory. Then the transmittance along rays through the cloud,
+    // estimated by ratio tracking and by whether hit() finds a collision, against a long run
+    // of the former. Last, the cloud over a floor under a small light, rendered with light
+    // samples that take the cloud's transmittance either way, at equal samples. Error is
+    // the relative mean squared difference in luminance from a long render.
+    const int cloud = 64;
+    perlin noise;
+    std::vector<float> values(size_t(cloud) * cloud * cloud);
+    for (int z = 0; z < cloud; z++) {
+        for (int y = 0; y < cloud; y++) {
+            for (int x = 0; x < cloud; x++) {
+                auto p = point3(x + 0.5, y + 0.5, z + 0.5) / cloud;
+                auto r = (p - point3(0.5, 0.5, 0.5)).length() / 0.45;
+                auto d = (r < 1) ? 1.5 * (1 - r) + 0.6 * noise.turb(6 * p, 4) - 0.3 : 0.0;
+                values[(size_t(z) * cloud + y) * cloud + x] = float(std::fmax(0.0, d));
+            }
+        }
+    }
+    {
+        std::ofstream file("cloud.raw", std::ios::binary);
+        file.write(reinterpret_cast<const char*>(values.data()), std::streamsize(values.size() * sizeof(float)));
+    }
+    auto half = cloud / 2.0;
+    auto loaded = load_density_raw("cloud.raw", cloud, cloud, cloud,
+                                   aabb(point3(-half,-half,-half), point3(half,half,half)));
+    if (!loaded)
+        return;
+
+    auto rays = primary_rays(point3(0, 20, -160), point3(0, 0, 0), 30, 256, 256);
+    for (int padded : { 64, 128, 256 }) {
+        // The same voxels, in the middle of a grid padded voxels wide.
+        std::vector<float> grid_values(size_t(padded) * padded * padded, 0.0f);
+        auto offset = (padded - cloud) / 2;
+        for (int z = 0; z < cloud; z++)
+            for (int y = 0; y < cloud; y++)
+                for (int x = 0; x < cloud; x++)
+                    grid_values[(size_t(z + offset) * padded + y + offset) * padded + x + offset]
+                        = values[(size_t(z) * cloud + y) * cloud + x];
+        auto extent = padded / 2.0;
+        auto grid = make_shared<density_grid>(padded, padded, padded,
+            aabb(point3(-extent,-extent,-extent), point3(extent,extent,extent)), grid_values);
+        heterogeneous_medium smoke(grid, 0.2, color(0,0,0));
+
+        std::clog << "grid " << padded << "^3: " << grid->occupied_bricks() << " bricks stored, "
+                  << grid->memory_usage() << " bytes\n";
+        report("  absorbing cloud", trace_rays(smoke, rays));
+    }
+
+    heterogeneous_medium smoke(loaded, 0.05, color(1,1,1));
+    std::vector<ray> through;
+    for (const auto& r : rays) {
+        if (smoke.transmittance(r, interval(0, infinity)) < 1 && through.size() < 2000)
+            through.push_back(r);
+    }
+
+    std::vector<double> expected(through.size());
+    for (size_t i = 0; i < through.size(); i++) {
+        double sum = 0;
+        for (int k = 0; k < 1024; k++)
+            sum += smoke.transmittance(through[i], interval(0, infinity));
+        expected[i] = sum / 1024;
+    }
+
+    const int estimates = 64;
+    double ratio_error = 0, delta_error = 0;
+    stopwatch ratio_timer;
+    for (size_t i = 0; i < through.size(); i++) {
+        for (int k = 0; k < estimates; k++) {
+            auto difference = smoke.transmittance(through[i], interval(0, infinity)) - expected[i];
+            ratio_error += difference * difference;
+        }
+    }
+    auto ratio_seconds = ratio_timer.seconds();
+    stopwatch delta_timer;
+    for (size_t i = 0; i < through.size(); i++) {
+        for (int k = 0; k < estimates; k++) {
+            hit_record rec;
+            auto difference = (smoke.hit(through[i], interval(0, infinity), rec) ? 0.0 : 1.0) - expected[i];
+            delta_error += difference * difference;
+        }
+    }
+    auto delta_seconds = delta_timer.seconds();
+
+    auto count = double(through.size()) * estimates;
+    std::clog << "transmittance, ratio tracking: mean squared error " << ratio_error / count
+              << ", " << 1e6 * ratio_seconds / count << " us each\n"
+              << "transmittance, delta tracking: mean squared error " << delta_error / count
+              << ", " << 1e6 * delta_seconds / count << " us each\n";
+
+    hittable_list world;
+    world.add(make_shared<heterogeneous_medium>(loaded, 0.05, color(.8, .8, .8)));
+    world.add(make_shared<quad>(point3(-100,-half,-100), vec3(200,0,0), vec3(0,0,200),
+                                make_shared<lambertian>(color(.73, .73, .73))));
+    world.add(make_shared<quad>(point3(-15,80,-15), vec3(30,0,0), vec3(0,0,30),
+                                make_shared<diffuse_light>(color(40, 40, 40))));
+
+    camera cam;
+    cam.aspect_ratio = 1.0;
+    cam.image_width  = 64;
+    cam.max_depth    = 8;
+    cam.background   = color(0,0,0);
+    cam.vfov     = 50;
+    cam.lookfrom = point3(0, 20, -120);
+    cam.lookat   = point3(0, -10, 0);
+    cam.sample_lights = true;
+
+    auto relative_mse = [](const std::vector<color>& image, const std::vector<color>& reference) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            auto expected = luminance(reference[i]);
+            auto difference = luminance(image[i]) - expected;
+            sum += difference * difference / (expected * expected + 0.01);
+        }
+        return sum / image.size();
+    };
+
+    cam.samples_per_pixel = 1024;
+    auto reference = cam.render_pixels(world);
+    for (bool tracked : { false, true }) {
+        cam.track_transmittance = tracked;
+        cam.samples_per_pixel = 16;
+        stopwatch timer;
+        auto image = cam.render_pixels(world);
+        auto seconds = timer.seconds();
+        std::clog << '\r' << (tracked ? "light samples, ratio tracking" : "light samples, collisions    ")
+                  << ": " << std::setw(8) << seconds << " s, relative MSE "
+                  << relative_mse(image, reference) << '\n';
+    }
+}
+
 int main() {
     switch (8) {
         case 1:  bouncing_spheres();   break;
@@ -322,5 +1922,30 @@ int main() {
         case 6:  simple_light();       break;
         case 7:  cornell_box();        break;
         case 8:  cornell_smoke();      break;
+        case 9:  instanced_boxes();    break;
+        case 10: sphere_set_benchmark(); break;
+        case 11: motion_blur_benchmark(); break;
+        case 12: sdf_benchmark();      break;
+        case 13: lod_benchmark();      break;
+        case 14: bvh_build_benchmark(); break;
+        case 15: sbvh_benchmark();     break;
+        case 16: compressed_bvh_benchmark(); break;
+        case 17: node_layout_benchmark(); break;
+        case 18: refit_benchmark();    break;
+        case 19: bvh_cache_benchmark(); break;
+        case 20: scene_editing_benchmark(); break;
+        case 21: grid_benchmark();     break;
+        case 22: bvh_analysis_benchmark(); break;
+        case 23: smoke_benchmark();    break;
+        case 24: light_sampling_benchmark(); break;
+        case 25: light_bvh_benchmark(); break;
+        case 26: environment_benchmark(); break;
+        case 27: restir_benchmark();   break;
+        case 28: path_guiding_benchmark(); break;
+        case 29: caustics_benchmark(); break;
+        case 30: manifold_benchmark(); break;
+        case 31: irradiance_cache_benchmark(); break;
+        case 32: lightmap_benchmark(); break;
+        case 33: heterogeneous_medium_benchmark(); break;
     }
 }
\ No newline at end of file
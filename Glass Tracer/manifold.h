@@ -0,0 +1,454 @@
+#ifndef MANIFOLD_H
+#define MANIFOLD_H
+
+#include "GlassTracer.h"
+
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "material.h"
+#include "onb.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <vector>
+
+struct refraction_chain {
+    // A path as ray_color() follows it from a surface that scatters diffusely, through
+    // refractions at glass, for manifold_nee::pdf_value().
+    point3 origin;
+    double pdf = 0;   // Of the direction it was scattered in there.
+    point3 vertices[2];
+    int    count = 0;
+};
+
+struct manifold_sample {
+    vec3   direction;   // Leaving the shading point.
+    color  value;       // The BSDF times the light arriving along the path.
+    double pdf;         // Per solid angle, of manifold_nee::sample() picking the path.
+};
+
+class manifold_nee {
+  public:
+    // Light samples through glass spheres by manifold next-event estimation (Hanika, Droske
+    // and Fascione, "Manifold Next Event Estimation", 2015). A shadow ray from under a glass
+    // sphere toward a light is blocked by the glass, so the light focused through it only
+    // arrives when a scattered ray happens to refract into the light, which for a small
+    // light is almost never. Instead, a point on a light is sampled as usual, and Newton's
+    // method finds the paths to it that refract into and out of a sphere (or just once,
+    // when one end is inside it), whose contributions are then evaluated directly.
+    //
+    // The paper solves for all the refraction points at once, starting from where the
+    // straight line to the light crosses the glass. Under a sphere that start usually lies
+    // in the wrong basin: the light reaching a point in a caustic mostly comes through the
+    // edge of the sphere, not its middle. A path through a sphere stays in the plane through
+    // its two ends and the center, though, so here the only unknown is the angle it leaves
+    // the surface at, within that plane. The angles are scanned for where the path turns
+    // from passing the light point on one side to the other, and Newton's method, falling
+    // back on bisection, pins each one down. That finds every path that isn't too close to
+    // another to tell apart in the scan. The paths leaving the shading point look the same
+    // in every plane through the center, so the scan is traced once and shared by several
+    // light points, which only need to check which side of each the scanned paths pass.
+    //
+    // The light sample covers an area of the light, so each path's contribution is weighted
+    // by how much solid angle that area fills as seen from the shading point, through the
+    // glass. The same symmetry gives that: moving the light point within the plane turns the
+    // path as a Newton step would, and moving it out of the plane swings the whole plane
+    // around the line from the shading point through the center.
+    //
+    // That weight grows without bound near the edges of the caustic, where paths through
+    // neighbouring parts of the sphere converge, so on its own the estimate would be
+    // riddled with rare, huge samples. Paths through the same glass still reach lights by
+    // chance in ray_color(), and there they are well behaved, so the two are weighted
+    // against each other by their pdfs as for any light sample (pdf_value()). Only spheres
+    // directly in hittable_list, bvh_node and flat_bvh are found, as for light_list; paths
+    // through other glass, or through more than one sphere, are left to ray_color() as
+    // before.
+
+    manifold_nee() {}
+
+    explicit manifold_nee(const hittable& world) { gather(world); }
+
+    bool empty() const { return spheres.empty(); }
+
+    static const int light_samples = 4;   // Points on lights per call to sample().
+    static const int max_paths = 8;       // Found through a sphere to one light point.
+    static const int max_samples = light_samples * max_paths;
+
+    int sample(
+        const ray& r, const hit_record& rec, const hittable& world, const light_list& lights,
+        int depth, manifold_sample* samples
+    ) const {
+        // Paths through one glass sphere, picked uniformly, to light_samples points on lights
+        // that carry light to rec.p, leaving out those longer than depth surfaces. Returns how
+        // many it put in samples, up to max_samples. Their pdfs count every light point, so
+        // the sum of value over pdf averages over them.
+        if (spheres.empty())
+            return 0;
+        profile pr;
+        scan(rec.p, r.time(), random_int(0, int(spheres.size()) - 1), pr);
+
+        int count = 0;
+        for (int n = 0; n < light_samples; n++) {
+            double chance;
+            auto light = lights.random_by_power(chance);
+            if (!light)
+                return count;
+            auto area = light->surface_area();
+            if (area <= 0)
+                continue;
+            point3 y;
+            vec3 light_normal;
+            light->random_surface_point(r.time(), y, light_normal);
+
+            fan f;
+            chain paths[max_paths];
+            auto found = search(pr, y, f, paths);
+            auto area_pdf = light_samples * chance / (area * spheres.size());
+            for (int k = 0; k < found; k++) {
+                const auto& c = paths[k];
+                if (depth < c.count + 2)
+                    continue;
+                auto solid_angle = solid_angle_per_area(f, light_normal, c);
+                if (solid_angle <= 0)
+                    continue;
+                auto value = transmitted(r, rec, world, f, c);
+                if (value.length_squared() > 0)
+                    samples[count++] = { c.direction, value, area_pdf / solid_angle };
+            }
+        }
+        return count;
+    }
+
+    double pdf_value(const refraction_chain& followed, const ray& r, const hit_record& rec,
+                     const light_list& lights) const {
+        // The pdf per solid angle of sample() picking the path followed continues with r,
+        // which hit a light at rec, or 0 when it wouldn't find it.
+        auto area_pdf = lights.area_pdf(r, rec);
+        if (area_pdf <= 0)
+            return 0;
+        const auto& first = followed.vertices[0];
+        for (int s = 0; s < int(spheres.size()); s++) {
+            auto radius = spheres[s]->get_radius();
+            auto tolerance = 1e-5 * radius;
+            if (std::fabs((first - spheres[s]->center_at(r.time())).length() - radius) > tolerance)
+                continue;
+            profile pr;
+            scan(followed.origin, r.time(), s, pr);
+            fan f;
+            chain paths[max_paths];
+            auto found = search(pr, rec.p, f, paths);
+            for (int k = 0; k < found; k++) {
+                if (paths[k].count != followed.count)
+                    continue;
+                bool same = true;
+                for (int i = 0; i < followed.count; i++)
+                    same = same && (paths[k].p[i] - followed.vertices[i]).length() < tolerance;
+                if (!same)
+                    continue;
+                auto solid_angle = solid_angle_per_area(f, rec.normal, paths[k]);
+                return (solid_angle > 0)
+                     ? light_samples * area_pdf / (spheres.size() * solid_angle) : 0;
+            }
+        }
+        return 0;
+    }
+
+  private:
+    static const int scan_steps = 16;
+
+    struct profile {
+        // The paths leaving x through a sphere at the scan's angles. They look the same in
+        // every plane through x and the center, so they are traced once, in that plane's
+        // coordinates (along axis, then across it, with x at the origin), and each light
+        // point only has to check which side of it they pass.
+        point3 x, center;
+        double radius;
+        double ior;
+        double distance;   // From x to the center.
+        vec3   axis;       // Unit length, from x toward the center.
+        bool   inside;     // Whether x is in the sphere.
+        double angle[scan_steps + 1];
+        int    reached[scan_steps + 1];       // How many refractions the path got through.
+        vec3   p[scan_steps + 1][2];          // Where, in plane coordinates,
+        vec3   leaving[scan_steps + 1][2];    // and its direction after each.
+    };
+
+    struct fan {
+        // The plane through a path's two ends and a sphere's center, which the paths between
+        // them through the sphere stay in.
+        point3 y;
+        vec3   local;      // y in plane coordinates.
+        vec3   side;       // Unit length, across axis toward y.
+        vec3   normal;     // Of the plane.
+        double offset;     // How far y is from the line along axis.
+        int    count;      // Refractions: two when x and y are both outside, else one.
+    };
+
+    struct chain {
+        double angle;       // Leaving x, from axis toward side.
+        vec3   direction;   // Unit length, leaving x.
+        int    count = 0;
+        point3 p[2];
+        vec3   leaving;     // Unit length, leaving the last point.
+        double miss;        // Sine of the angle by which it passes y, toward side.
+        double slope = 0;   // Of miss with angle.
+    };
+
+    std::vector<shared_ptr<sphere>> spheres;   // Those made of glass.
+
+    void gather(const hittable& world) {
+        // As light_list::gather().
+        if (auto list = dynamic_cast<const hittable_list*>(&world)) {
+            for (const auto& object : list->objects)
+                gather(object);
+        } else if (auto node = dynamic_cast<const bvh_node*>(&world)) {
+            gather(node->left_child());
+            if (node->right_child() != node->left_child())
+                gather(node->right_child());
+        } else if (auto bvh = dynamic_cast<const flat_bvh*>(&world)) {
+            auto objects = bvh->leaf_objects();
+            std::sort(objects.begin(), objects.end());
+            objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+            for (const auto& object : objects)
+                if (object)
+                    gather(object);
+        }
+    }
+
+    void gather(const shared_ptr<hittable>& object) {
+        if (auto s = std::dynamic_pointer_cast<sphere>(object)) {
+            auto mat = s->get_material();
+            if (mat && mat->index_of_refraction() > 0 && s->get_radius() > 0)
+                spheres.push_back(s);
+        } else {
+            gather(*object);
+        }
+    }
+
+    void scan(const point3& x, double time, int s, profile& pr) const {
+        // Traces the paths leaving x through sphere s at the scan's angles: from outside,
+        // only those that meet the sphere, more closely toward its rim, where the paths bend
+        // most; from inside, all of them.
+        pr.x = x;
+        pr.center = spheres[s]->center_at(time);
+        pr.radius = spheres[s]->get_radius();
+        pr.ior = spheres[s]->get_material()->index_of_refraction();
+        auto to_center = pr.center - x;
+        pr.distance = to_center.length();
+        pr.inside = pr.distance < pr.radius;
+        pr.axis = to_center / pr.distance;
+        for (int k = 0; k <= scan_steps; k++) {
+            if (pr.inside) {
+                pr.angle[k] = -pi + 2 * pi * k / scan_steps;
+            } else if (k == 0 || k == scan_steps) {
+                pr.angle[k] = 0;
+                pr.reached[k] = 0;
+                continue;
+            } else {
+                auto across = std::sin(pi * k / scan_steps - pi / 2);
+                pr.angle[k] = std::asin(across * pr.radius / pr.distance);
+            }
+            pr.reached[k] = trace(pr, pr.angle[k], pr.inside ? 1 : 2, pr.p[k], pr.leaving[k]);
+        }
+    }
+
+    int search(const profile& pr, const point3& y, fan& f, chain* paths) const {
+        // The paths from pr.x to y through pr's sphere, up to max_paths, in order of angle.
+        f.y = y;
+        bool y_inside = (y - pr.center).length_squared() < pr.radius * pr.radius;
+        if (pr.inside && y_inside)
+            return 0;
+        f.count = (pr.inside || y_inside) ? 1 : 2;
+
+        // With y on the line through x and the center, the paths make a cone instead, which
+        // no single sample lands on.
+        auto along = dot(y - pr.x, pr.axis);
+        auto across = (y - pr.x) - along * pr.axis;
+        f.offset = across.length();
+        if (f.offset < 1e-9 * (y - pr.x).length())
+            return 0;
+        f.side = across / f.offset;
+        f.normal = cross(pr.axis, f.side);
+        f.local = vec3(along, f.offset, 0);
+
+        // Neighbouring angles whose paths pass y on opposite sides hold one between them that
+        // goes through it.
+        double previous_miss = 0;
+        bool previous_valid = false;
+        int found = 0;
+        for (int k = 0; k <= scan_steps && found < max_paths; k++) {
+            double miss = 0;
+            auto last = f.count - 1;
+            bool valid = pr.reached[k] >= f.count && passes(f, pr.p[k][last], pr.leaving[k][last], miss);
+            if (valid && previous_valid && (previous_miss < 0) != (miss < 0))
+                if (refine(pr, f, pr.angle[k-1], previous_miss, pr.angle[k], miss, paths[found]))
+                    found++;
+            previous_miss = miss;
+            previous_valid = valid;
+        }
+        return found;
+    }
+
+    static int trace(const profile& pr, double angle, int count, vec3* p, vec3* leaving) {
+        // Follows the path leaving x at angle, in plane coordinates, refracting where it
+        // crosses the sphere, for up to count refractions. Returns how many it got through
+        // before it missed the sphere or reflected totally.
+        vec3 center(pr.distance, 0, 0);
+        vec3 from(0, 0, 0);
+        vec3 d(std::cos(angle), std::sin(angle), 0);
+        bool entering = !pr.inside;
+        for (int i = 0; i < count; i++) {
+            auto oc = center - from;
+            auto h = dot(d, oc);
+            auto discriminant = h*h - (oc.length_squared() - pr.radius*pr.radius);
+            if (discriminant < 0)
+                return i;
+            auto t = entering ? h - std::sqrt(discriminant) : h + std::sqrt(discriminant);
+            if (t <= 1e-9 * pr.radius)
+                return i;
+            p[i] = from + t * d;
+
+            // As refract(), but as d and normal are unit length, so is the result.
+            auto normal = (entering ? 1 / pr.radius : -1 / pr.radius) * (p[i] - center);
+            auto ri = entering ? 1 / pr.ior : pr.ior;
+            auto cos_theta = dot(-d, normal);
+            auto k = 1 - ri * ri * (1 - cos_theta*cos_theta);
+            if (cos_theta <= 0 || k < 0)
+                return i;
+            d = ri * d + (ri * cos_theta - std::sqrt(k)) * normal;
+            leaving[i] = d;
+            from = p[i];
+            entering = !entering;
+        }
+        return count;
+    }
+
+    static bool passes(const fan& f, const vec3& p, const vec3& leaving, double& miss) {
+        // Sets miss for a path leaving p, in plane coordinates. False if it leaves away from y.
+        auto toward = unit_vector(f.local - p);
+        if (dot(leaving, toward) <= 0)
+            return false;
+        miss = cross(leaving, toward).z();
+        return true;
+    }
+
+    bool shoot(const profile& pr, const fan& f, double angle, chain& c) const {
+        // The path leaving x at angle through the sphere, in world coordinates. False if it
+        // doesn't get through it, or leaves away from y.
+        vec3 p[2], leaving[2];
+        if (trace(pr, angle, f.count, p, leaving) < f.count)
+            return false;
+        if (!passes(f, p[f.count - 1], leaving[f.count - 1], c.miss))
+            return false;
+        c.angle = angle;
+        c.direction = std::cos(angle) * pr.axis + std::sin(angle) * f.side;
+        c.count = f.count;
+        for (int i = 0; i < f.count; i++)
+            c.p[i] = pr.x + p[i].x() * pr.axis + p[i].y() * f.side;
+        auto last = leaving[f.count - 1];
+        c.leaving = last.x() * pr.axis + last.y() * f.side;
+        return true;
+    }
+
+    bool find_slope(const profile& pr, const fan& f, chain& c) const {
+        // Sets c.slope, by central differences.
+        const double delta = 1e-7;
+        chain above, below;
+        if (!shoot(pr, f, c.angle + delta, above) || !shoot(pr, f, c.angle - delta, below))
+            return false;
+        c.slope = (above.miss - below.miss) / (2 * delta);
+        return c.slope != 0;
+    }
+
+    bool refine(const profile& pr, const fan& f, double a, double miss_a, double b, double miss_b,
+                chain& root) const {
+        // Newton's method for the angle between a and b where the path passes through y,
+        // starting where the line between their misses crosses zero, and bisecting instead
+        // whenever a step would leave the bracket.
+        const int max_iterations = 60;
+        const double tolerance = 1e-12;
+        bool rising = miss_a < 0;
+        auto angle = a - miss_a * (b - a) / (miss_b - miss_a);
+        if (!(angle > a && angle < b))
+            angle = 0.5 * (a + b);
+        for (int iteration = 0; iteration < max_iterations; iteration++) {
+            chain c;
+            if (!shoot(pr, f, angle, c))
+                return false;
+            bool has_slope = find_slope(pr, f, c);
+            if (std::fabs(c.miss) < tolerance || b - a < tolerance) {
+                root = c;
+                return has_slope;
+            }
+            if ((c.miss < 0) == rising)
+                a = angle;
+            else
+                b = angle;
+            auto next = has_slope ? angle - c.miss / c.slope : a;
+            angle = (next > a && next < b) ? next : 0.5 * (a + b);
+        }
+        return false;
+    }
+
+    color transmitted(const ray& r, const hit_record& rec, const hittable& world, const fan& f, const chain& c) const {
+        // The BSDF at rec.p times the light from f.y reaching it along path c.
+        color bsdf = rec.mat->eval(r, rec, c.direction);
+        if (bsdf.length_squared() == 0)
+            return color(0,0,0);
+
+        // The path must be open, crossing nothing but the glass where solved, and reach the
+        // light at y. Each refraction passes what dielectric::scatter() doesn't reflect.
+        double transmittance = 1;
+        auto time = r.time();
+        point3 from = rec.p;
+        for (int i = 0; i < c.count; i++) {
+            hit_record glass_rec;
+            ray segment(from, c.p[i] - from, time);
+            if (!reaches(world, segment, glass_rec))
+                return color(0,0,0);
+            auto ior = glass_rec.mat->index_of_refraction();
+            auto ri = glass_rec.front_face ? 1 / ior : ior;
+            auto cos_theta = std::fmin(dot(-unit_vector(segment.direction()), glass_rec.normal), 1.0);
+            transmittance *= 1 - dielectric::reflectance(cos_theta, ri);
+            from = c.p[i];
+        }
+        hit_record light_rec;
+        if (!reaches(world, ray(from, f.y - from, time), light_rec))
+            return color(0,0,0);
+        auto emission = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+        if (emission.length_squared() == 0)
+            return color(0,0,0);
+
+        return transmittance * bsdf * emission;
+    }
+
+    static double solid_angle_per_area(const fan& f, const vec3& light_normal, const chain& c) {
+        // Solid angle seen from x per unit area of the light at y, through the glass, from
+        // how far the path's direction leaving x moves as y moves along the light. Within the
+        // plane, the miss changes as the direction toward y from the last point turns, and the
+        // angle makes up for it by that over the slope. Out of the plane, y swings around the
+        // line along axis, and the path swings with it, by sin(angle) of that.
+        onb light(light_normal);
+        auto to_y = f.y - c.p[c.count - 1];
+        auto length = to_y.length();
+        auto toward = to_y / length;
+        double moved[2][2];
+        for (int k = 0; k < 2; k++) {
+            auto along = k ? light.v() : light.u();
+            auto turned = (along - dot(along, toward) * toward) / length;
+            moved[0][k] = -dot(cross(c.leaving, turned), f.normal) / c.slope;
+            moved[1][k] = std::sin(c.angle) * dot(along, f.normal) / f.offset;
+        }
+        return std::fabs(moved[0][0] * moved[1][1] - moved[0][1] * moved[1][0]);
+    }
+
+    static bool reaches(const hittable& world, const ray& segment, hit_record& rec) {
+        // Whether the first thing segment hits is at its end.
+        return world.hit(segment, interval(0.001, infinity), rec) && std::fabs(rec.t - 1) < 1e-4;
+    }
+};
+
+#endif
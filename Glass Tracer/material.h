@@ -17,6 +17,32 @@ class material {
     ) const {
         return false;
     }
+
+    // For light sampling. pdf() is the density, per unit solid angle, with which scatter()
+    // picks direction; eval() is the BSDF times the cosine at the surface, so that for a
+    // direction scatter() picked, eval() / pdf() is its attenuation. Materials that scatter
+    // into single directions, like mirrors and glass, keep the zero defaults and get no
+    // light samples.
+    virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return 0.0;
+    }
+
+    virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return color(0,0,0);
+    }
+
+    virtual bool is_emissive() const { return false; }
+
+    // False for phase functions, which scatter inside volumes (constant_medium), where hits
+    // have no real surface or normal.
+    virtual bool is_surface() const { return true; }
+
+    // For manifold next-event estimation: the index of refraction of materials that refract
+    // into single directions, or 0 for the rest.
+    virtual double index_of_refraction() const { return 0.0; }
+
+    // For lightmaps: the indirect irradiance baked for the point hit, if there is one.
+    virtual bool baked_irradiance(const hit_record& rec, color& irradiance) const { return false; }
 };
 
 //Clase para manejar reflectancia difusa
@@ -38,6 +64,16 @@ class lambertian : public material {
         return true;
     }
 
+    // The normal plus a random unit vector is cosine distributed about the normal.
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        auto cosine = dot(rec.normal, unit_vector(direction));
+        return cosine < 0 ? 0 : cosine / pi;
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return pdf(r_in, rec, direction) * tex->value(rec.u, rec.v, rec.p);
+    }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -90,9 +126,7 @@ class dielectric : public material {
         return true;
     }
 
-  private:
-    // Indice de refractacion del material dado
-    double refraction_index;
+    double index_of_refraction() const override { return refraction_index; }
 
     static double reflectance(double cosine, double refraction_index) {
         // Aproximacion Schlick para considerar variacion en reflectancia dependiendo del angulo
@@ -100,6 +134,10 @@ class dielectric : public material {
         r0 = r0*r0;
         return r0 + (1-r0)*std::pow((1 - cosine),5);
     }
+
+  private:
+    // Indice de refractacion del material dado
+    double refraction_index;
 };
 
 class diffuse_light : public material {
@@ -111,6 +149,8 @@ class diffuse_light : public material {
         return tex->value(u, v, p);
     }
 
+    bool is_emissive() const override { return true; }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -127,6 +167,16 @@ class isotropic : public material {
         return true;
     }
 
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return 1 / (4 * pi);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return tex->value(rec.u, rec.v, rec.p) / (4 * pi);
+    }
+
+    bool is_surface() const override { return false; }
+
   private:
     shared_ptr<texture> tex;
 };
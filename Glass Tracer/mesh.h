@@ -0,0 +1,282 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class triangle_mesh : public hittable {
+  public:
+    // Indexed triangle mesh with a single material. Vertices are shared between triangles
+    // and the mesh carries its own flat BVH over the triangles, so a mesh costs a few dozen
+    // bytes per triangle instead of one `tri` object each. Hits report barycentric
+    // coordinates as u and v, or, once set_texture_coordinates() has been given a (u,v) for
+    // every corner of every triangle, those interpolated.
+    triangle_mesh(
+        const std::vector<point3>& vertices, const std::vector<int>& indices, shared_ptr<material> mat
+    ) : vertices(vertices), indices(indices), mat(mat)
+    {
+        build();
+    }
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    const std::vector<point3>& vertex_data() const { return vertices; }
+    const std::vector<int>& index_data() const { return indices; }
+    shared_ptr<material> mesh_material() const { return mat; }
+
+    void set_texture_coordinates(const std::vector<double>& coordinates) {
+        // Six values per triangle: u and v at each of its corners, in order.
+        texture_coordinates = coordinates;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+
+        int hit_tri = -1;
+        double hit_u = 0, hit_v = 0;
+        traverse_nodes(0, [&](int index, int& near, int& far) {
+            const auto& n = nodes[index];
+            auto span = ray_t;
+            if (!n.bbox.hit(r, inv_dir, span))
+                return 0;
+            if (n.count == 0) {
+                near = index + 1;
+                far  = n.first;
+                if (r.direction()[n.axis] < 0) std::swap(near, far);
+                return 2;
+            }
+            for (int i = n.first; i < n.first + n.count; i++) {
+                double t, u, v;
+                if (hit_triangle(tri_order[i], r, ray_t, t, u, v)) {
+                    ray_t.max = t;
+                    hit_tri = tri_order[i];
+                    hit_u = u;
+                    hit_v = v;
+                }
+            }
+            return 0;
+        });
+
+        if (hit_tri < 0)
+            return false;
+
+        const auto& v0 = vertices[indices[3*hit_tri]];
+        const auto& v1 = vertices[indices[3*hit_tri + 1]];
+        const auto& v2 = vertices[indices[3*hit_tri + 2]];
+
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(r, unit_vector(cross(v1 - v0, v2 - v0)));
+        if (texture_coordinates.empty()) {
+            rec.u = hit_u;
+            rec.v = hit_v;
+        } else {
+            const auto* uv = &texture_coordinates[6*size_t(hit_tri)];
+            auto hit_w = 1 - hit_u - hit_v;
+            rec.u = hit_w * uv[0] + hit_u * uv[2] + hit_v * uv[4];
+            rec.v = hit_w * uv[1] + hit_u * uv[3] + hit_v * uv[5];
+        }
+        rec.mat = mat;
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t memory_usage() const {
+        // Bytes held by the vertex and index buffers and the BVH.
+        return sizeof(*this)
+             + vertices.capacity() * sizeof(point3)
+             + indices.capacity() * sizeof(int)
+             + tri_order.capacity() * sizeof(int)
+             + nodes.capacity() * sizeof(node)
+             + texture_coordinates.capacity() * sizeof(double);
+    }
+
+  private:
+    struct node {
+        aabb bbox;
+        int  first;   // Leaf: first entry in tri_order. Interior: index of the right child.
+        int  count;   // Number of triangles in a leaf, zero for interior nodes.
+        int  axis;    // Split axis, used to order the traversal.
+    };
+
+    static const int max_leaf_size = 4;
+
+    std::vector<point3> vertices;
+    std::vector<int> indices;
+    std::vector<int> tri_order;
+    std::vector<node> nodes;
+    std::vector<double> texture_coordinates;
+    shared_ptr<material> mat;
+    aabb bbox;
+
+    aabb triangle_box(int tri) const {
+        const auto& v0 = vertices[indices[3*tri]];
+        const auto& v1 = vertices[indices[3*tri + 1]];
+        const auto& v2 = vertices[indices[3*tri + 2]];
+        return aabb(aabb(v0, v1), aabb(v2, v2));
+    }
+
+    point3 triangle_centroid(int tri) const {
+        return (vertices[indices[3*tri]] + vertices[indices[3*tri + 1]]
+                + vertices[indices[3*tri + 2]]) / 3;
+    }
+
+    void build() {
+        tri_order.resize(triangle_count());
+        std::iota(tri_order.begin(), tri_order.end(), 0);
+        nodes.clear();
+        nodes.reserve(2 * triangle_count() / max_leaf_size + 1);
+
+        bbox = aabb::empty;
+        if (!tri_order.empty())
+            build_node(0, tri_order.size());
+    }
+
+    void build_node(size_t start, size_t end) {
+        int index = int(nodes.size());
+        nodes.push_back(node());
+
+        aabb box = aabb::empty;
+        aabb centroids = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            box = aabb(box, triangle_box(tri_order[i]));
+            auto c = triangle_centroid(tri_order[i]);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        if (index == 0) bbox = box;
+        nodes[index].bbox = box;
+        int axis = centroids.longest_axis();
+        nodes[index].axis = axis;
+
+        size_t span = end - start;
+        if (span <= max_leaf_size) {
+            nodes[index].first = int(start);
+            nodes[index].count = int(span);
+            return;
+        }
+
+        auto mid = start + span/2;
+        std::nth_element(tri_order.begin() + start, tri_order.begin() + mid,
+                         tri_order.begin() + end,
+            [this, axis](int a, int b) {
+                return triangle_centroid(a)[axis] < triangle_centroid(b)[axis];
+            });
+
+        build_node(start, mid);
+        nodes[index].first = int(nodes.size());
+        nodes[index].count = 0;
+        build_node(mid, end);
+    }
+
+    bool hit_triangle(int tri, const ray& r, interval ray_t, double& t, double& u, double& v) const {
+        // Moller-Trumbore ray/triangle intersection. Returns the barycentric coordinates of
+        // the hit in u and v.
+        const auto& v0 = vertices[indices[3*tri]];
+        const auto& v1 = vertices[indices[3*tri + 1]];
+        const auto& v2 = vertices[indices[3*tri + 2]];
+
+        auto edge1 = v1 - v0;
+        auto edge2 = v2 - v0;
+        auto pvec = cross(r.direction(), edge2);
+        auto det = dot(edge1, pvec);
+        if (std::fabs(det) < 1e-12)
+            return false;
+
+        auto inv_det = 1.0 / det;
+        auto tvec = r.origin() - v0;
+        u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || u > 1)
+            return false;
+
+        auto qvec = cross(tvec, edge1);
+        v = dot(r.direction(), qvec) * inv_det;
+        if (v < 0 || u + v > 1)
+            return false;
+
+        t = dot(edge2, qvec) * inv_det;
+        return ray_t.surrounds(t);
+    }
+};
+
+inline shared_ptr<triangle_mesh> load_obj(const std::string& filename, shared_ptr<material> mat) {
+    // Reads the vertex positions and faces of a Wavefront OBJ file. Texture coordinates,
+    // normals, groups and materials are ignored, and polygons are split into triangle fans.
+    // Returns nullptr if the file can't be opened, or if a vertex or face can't be read or a
+    // face refers to a vertex not yet given.
+
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "ERROR: Could not load mesh file '" << filename << "'.\n";
+        return nullptr;
+    }
+
+    std::vector<point3> vertices;
+    std::vector<int> indices;
+    std::string line;
+    int line_number = 0;
+
+    auto malformed = [&](const std::string& what) {
+        std::cerr << "ERROR: Mesh file '" << filename << "', line " << line_number
+                  << ": " << what << ".\n";
+        return nullptr;
+    };
+
+    while (std::getline(file, line)) {
+        line_number++;
+        std::stringstream ss(line);
+        std::string prefix;
+        ss >> prefix;
+
+        if (prefix == "v") {
+            double x, y, z;
+            if (!(ss >> x >> y >> z))
+                return malformed("bad vertex");
+            vertices.push_back(point3(x, y, z));
+        } else if (prefix == "f") {
+            // Each corner is v, v/vt, v//vn or v/vt/vn; negative indices count from the end.
+            std::vector<int> face;
+            std::string corner;
+            while (ss >> corner) {
+                const char* start = corner.c_str();
+                char* end;
+                errno = 0;
+                long index = std::strtol(start, &end, 10);
+                if (end == start || (*end != '\0' && *end != '/') || errno == ERANGE)
+                    return malformed("bad face corner '" + corner + "'");
+
+                auto count = long(vertices.size());
+                if (index == 0 || index > count || index < -count)
+                    return malformed("face corner '" + corner + "' refers to no vertex");
+                face.push_back(int(index < 0 ? count + index : index - 1));
+            }
+            if (face.size() < 3)
+                return malformed("face with fewer than three corners");
+            for (size_t i = 2; i < face.size(); i++) {
+                indices.push_back(face[0]);
+                indices.push_back(face[i-1]);
+                indices.push_back(face[i]);
+            }
+        }
+    }
+
+    return make_shared<triangle_mesh>(vertices, indices, mat);
+}
+
+#endif
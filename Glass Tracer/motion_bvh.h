@@ -0,0 +1,193 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+class motion_bvh : public hittable {
+  public:
+    // A BVH for scenes with motion blur. Every node stores the bounds of its subtree at the
+    // start and end of a time span, and traversal blends them to the ray's time, so a fast
+    // mover only widens the boxes it actually sweeps through at that instant. When objects in
+    // a node move apart so that the blended box stops fitting them, the node is split in time
+    // instead of space: each half gets its own subtree over the same objects, and a ray only
+    // descends into the half that contains its time.
+
+    motion_bvh(const hittable_list& list, int max_time_splits = 4)
+      : objects(list.objects), max_time_splits(max_time_splits)
+    {
+        std::vector<int> indices(objects.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        nodes.reserve(2 * objects.size());
+        if (!objects.empty())
+            build(indices, 0, indices.size(), interval(0, 1), max_time_splits);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+
+        bool hit_anything = false;
+        traverse_nodes(0, [&](int index, int& near, int& far) {
+            const auto& n = nodes[index];
+            auto span = ray_t;
+            if (!blended_bounds(n, r.time()).hit(r, inv_dir, span))
+                return 0;
+            if (n.kind == time_split) {
+                near = (r.time() < n.split_time) ? index + 1 : n.payload;
+                return 1;
+            }
+            if (n.kind == space_split) {
+                near = index + 1;
+                far  = n.payload;
+                if (r.direction()[n.axis] < 0) std::swap(near, far);
+                return 2;
+            }
+            for (int i = n.payload; i < n.payload + n.count; i++) {
+                if (objects[leaf_objects[i]]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+            return 0;
+        });
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb::empty : nodes[0].bounds.hull();
+    }
+
+    motion_bounds time_bounds(interval time) const override {
+        if (nodes.empty())
+            return motion_bounds(aabb::empty, aabb::empty);
+        const auto& root = nodes[0];
+        if (root.kind == time_split)
+            return hittable::time_bounds(time);
+        return motion_bounds(root.bounds.at(time.min), root.bounds.at(time.max));
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+  private:
+    enum node_kind { leaf, space_split, time_split };
+
+    struct node {
+        motion_bounds bounds;  // Linear bounds over `time`
+        interval time;         // Time span this node's bounds are valid for
+        double split_time;     // Time split: boundary between the two children
+        int payload;           // Leaf: first entry in leaf_objects. Interior: second child.
+        int count;             // Leaf: number of objects
+        int axis;              // Space split: axis used to order the traversal
+        node_kind kind;
+    };
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<node> nodes;
+    std::vector<int> leaf_objects;
+    int max_time_splits;
+
+    // Largest number of objects tested directly in a leaf.
+    static const int max_leaf_size = 2;
+
+    // Once the blended box at mid-span has this much more surface than the objects it holds,
+    // the node is split in time instead.
+    static constexpr double time_split_bloat = 1.25;
+
+    static aabb blended_bounds(const node& n, double time) {
+        // The node bounds blended to time, left unpadded as they are only for ray tests.
+        auto s = (time - n.time.min) / n.time.size();
+        auto blend = [s](const interval& a, const interval& b) {
+            return interval(a.min + s*(b.min - a.min), a.max + s*(b.max - a.max));
+        };
+        aabb box;
+        box.x = blend(n.bounds.start.x, n.bounds.end.x);
+        box.y = blend(n.bounds.start.y, n.bounds.end.y);
+        box.z = blend(n.bounds.start.z, n.bounds.end.z);
+        return box;
+    }
+
+    static double mid_centroid(const motion_bounds& b, int axis) {
+        auto box = b.at(0.5);
+        const auto& ax = box.axis_interval(axis);
+        return ax.min + ax.max;
+    }
+
+    int build(std::vector<int>& indices, size_t start, size_t end, interval time, int splits_left) {
+        int index = int(nodes.size());
+        nodes.push_back(node());
+
+        std::vector<motion_bounds> prim_bounds(end - start);
+        motion_bounds bounds(aabb::empty, aabb::empty);
+        aabb actual_mid = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            auto b = objects[indices[i]]->time_bounds(time);
+            prim_bounds[i - start] = b;
+            bounds.start = aabb(bounds.start, b.start);
+            bounds.end = aabb(bounds.end, b.end);
+            actual_mid = aabb(actual_mid, b.at(0.5));
+        }
+
+        nodes[index].bounds = bounds;
+        nodes[index].time = time;
+
+        size_t span = end - start;
+        if (span <= max_leaf_size) {
+            nodes[index].kind = leaf;
+            nodes[index].payload = int(leaf_objects.size());
+            nodes[index].count = int(span);
+            for (size_t i = start; i < end; i++)
+                leaf_objects.push_back(indices[i]);
+            return index;
+        }
+
+        if (splits_left > 0
+            && bounds.at(0.5).surface_area() > time_split_bloat * actual_mid.surface_area())
+        {
+            auto mid_time = 0.5 * (time.min + time.max);
+            nodes[index].kind = time_split;
+            nodes[index].split_time = mid_time;
+
+            build(indices, start, end, interval(time.min, mid_time), splits_left - 1);
+            auto second = build(indices, start, end, interval(mid_time, time.max), splits_left - 1);
+            nodes[index].payload = second;
+            return index;
+        }
+
+        aabb centroids = aabb::empty;
+        for (const auto& b : prim_bounds) {
+            auto c = b.at(0.5);
+            auto p = point3(c.x.min + c.x.max, c.y.min + c.y.max, c.z.min + c.z.max);
+            centroids = aabb(centroids, aabb(p, p));
+        }
+        int axis = centroids.longest_axis();
+
+        // Sort by the centroid at mid-span. The object bounds are recomputed for the children,
+        // so only the order matters here.
+        std::vector<std::pair<double, int>> keyed(span);
+        for (size_t i = 0; i < span; i++)
+            keyed[i] = { mid_centroid(prim_bounds[i], axis), indices[start + i] };
+        auto mid = span / 2;
+        std::nth_element(keyed.begin(), keyed.begin() + mid, keyed.end());
+        for (size_t i = 0; i < span; i++)
+            indices[start + i] = keyed[i].second;
+
+        nodes[index].kind = space_split;
+        nodes[index].axis = axis;
+        build(indices, start, start + mid, time, splits_left);
+        auto second = build(indices, start + mid, end, time, splits_left);
+        nodes[index].payload = second;
+        return index;
+    }
+};
+
+#endif
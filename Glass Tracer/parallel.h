@@ -0,0 +1,47 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Minimal fork/join helpers on std::thread, for build passes that split cleanly by index.
+
+inline int thread_count() {
+    auto n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : int(n);
+}
+
+template <typename F>
+void parallel_chunks(size_t count, int chunks, const F& body) {
+    // Splits [0,count) into `chunks` contiguous ranges and calls body(chunk, begin, end) for
+    // each one on its own thread. Returns once all of them have finished.
+    chunks = std::max(1, std::min(chunks, int(count)));
+    if (chunks == 1) {
+        body(0, size_t(0), count);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(chunks);
+    for (int c = 0; c < chunks; c++) {
+        size_t begin = count * c / chunks;
+        size_t end = count * (c + 1) / chunks;
+        workers.emplace_back([&body, c, begin, end] { body(c, begin, end); });
+    }
+    for (auto& w : workers)
+        w.join();
+}
+
+template <typename F>
+void parallel_for(size_t count, const F& body) {
+    // Calls body(i) for every i in [0,count), spread over all hardware threads. Small
+    // ranges run on the calling thread.
+    int chunks = (count < 4096) ? 1 : thread_count();
+    parallel_chunks(count, chunks, [&body](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            body(i);
+    });
+}
+
+#endif
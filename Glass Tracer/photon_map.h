@@ -0,0 +1,297 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct caustic_settings {
+    int    photons_per_pass = 100000;   // Photons traced for each sample per pixel
+    double initial_radius   = 0;        // Gather radius to start from; 0 for two pixels' width
+    double alpha            = 2.0 / 3;  // Share of each pass's photons kept as radii shrink
+};
+
+struct photon {
+    point3 position;
+    vec3   direction;   // Unit length, the way the photon was going.
+    color  power;
+};
+
+struct visible_point {
+    bool       valid = false;   // False where the camera path found no surface to gather at.
+    ray        r;               // The ray that hit it, for the material's eval().
+    hit_record rec;
+    color      weight;          // What the camera path multiplies light leaving it by.
+};
+
+class photon_map {
+  public:
+    // Photons in a hash grid of cubes cell_size wide, so that a search within half a cell
+    // looks at no more than eight cells. The photons are sorted by bucket with a counting
+    // sort, split over threads: each counts its share, and then writes it to the places the
+    // counts give it.
+
+    photon_map() {}
+
+    photon_map(const std::vector<photon>& unsorted, double cell_size)
+      : cell_size(cell_size)
+    {
+        size_t buckets = 1;
+        while (buckets < unsorted.size())
+            buckets *= 2;
+        mask = buckets - 1;
+        starts.assign(buckets + 1, 0);
+        if (unsorted.empty())
+            return;
+
+        auto count = unsorted.size();
+        int chunks = std::max(1, std::min((count < 4096) ? 1 : thread_count(), int(count)));
+        std::vector<uint32_t> keys(count);
+        std::vector<std::vector<uint32_t>> offsets(chunks, std::vector<uint32_t>(buckets, 0));
+        parallel_chunks(count, chunks, [&](int c, size_t begin, size_t end) {
+            for (auto i = begin; i < end; i++) {
+                keys[i] = uint32_t(bucket(cell(unsorted[i].position)));
+                offsets[c][keys[i]]++;
+            }
+        });
+
+        // Each chunk's photons in a bucket go after those of the chunks before it.
+        uint32_t next = 0;
+        for (size_t b = 0; b < buckets; b++) {
+            starts[b] = next;
+            for (int c = 0; c < chunks; c++) {
+                auto n = offsets[c][b];
+                offsets[c][b] = next;
+                next += n;
+            }
+        }
+        starts[buckets] = next;
+
+        photons.resize(count);
+        parallel_chunks(count, chunks, [&](int c, size_t begin, size_t end) {
+            for (auto i = begin; i < end; i++)
+                photons[offsets[c][keys[i]]++] = unsorted[i];
+        });
+    }
+
+    size_t size() const { return photons.size(); }
+
+    template <typename F>
+    void gather(const point3& p, double radius, const F& visit) const {
+        // Calls visit(photon) for every photon within radius of p, which must be at most half
+        // of cell_size.
+        if (photons.empty())
+            return;
+        auto lo = cell(p - vec3(radius, radius, radius));
+        auto hi = cell(p + vec3(radius, radius, radius));
+
+        // Different cells can share a bucket; each is searched once.
+        size_t searched[8];
+        int searched_count = 0;
+        for (auto x = lo.x; x <= hi.x; x++) {
+            for (auto y = lo.y; y <= hi.y; y++) {
+                for (auto z = lo.z; z <= hi.z; z++) {
+                    auto b = bucket({ x, y, z });
+                    if (std::find(searched, searched + searched_count, b) != searched + searched_count)
+                        continue;
+                    searched[searched_count++] = b;
+                    for (auto i = starts[b]; i < starts[b + 1]; i++)
+                        if ((photons[i].position - p).length_squared() <= radius * radius)
+                            visit(photons[i]);
+                }
+            }
+        }
+    }
+
+  private:
+    struct cell_index { int64_t x, y, z; };
+
+    double cell_size = 1;
+    size_t mask = 0;
+    std::vector<photon> photons;     // By bucket.
+    std::vector<uint32_t> starts;    // Where each bucket's photons begin, and one past the end.
+
+    cell_index cell(const point3& p) const {
+        return { int64_t(std::floor(p.x() / cell_size)), int64_t(std::floor(p.y() / cell_size)),
+                 int64_t(std::floor(p.z() / cell_size)) };
+    }
+
+    size_t bucket(const cell_index& c) const {
+        auto h = uint64_t(c.x) * 73856093u ^ uint64_t(c.y) * 19349663u ^ uint64_t(c.z) * 83492791u;
+        return size_t(h) & mask;
+    }
+};
+
+class caustic_photons {
+  public:
+    // Caustics by stochastic progressive photon mapping (Hachisuka and Jensen, "Stochastic
+    // Progressive Photon Mapping", 2009). Light focused through glass or off mirrors onto a
+    // diffuse surface is nearly impossible for paths from the camera to find, as they must
+    // leave the surface in just the direction that refracts into the light. Photons traced
+    // from the lights find it easily, so they take over that light: each pass stores the
+    // photons that reach a diffuse surface after one or more mirror or glass bounces (but
+    // none before them), and camera paths estimate it from those within a radius wherever
+    // they meet a diffuse surface.
+    //
+    // Each pixel's visible point, where its camera path first meets a diffuse surface, keeps
+    // a radius of its own. It shrinks with each pass that finds photons, keeping only alpha
+    // of them in the running count, while the power gathered so far is scaled down with the
+    // area, so the estimate starts out blurred but converges without storing more than one
+    // pass's photons. Surfaces further along the paths, which show caustics only in the light
+    // they pass on, share one radius, shrunk after every pass by the same alpha (Knaus and
+    // Zwicker, "Progressive Photon Mapping: A Probabilistic Approach", 2011).
+    //
+    // The camera's paths must leave out the same light: whatever reaches a diffuse surface
+    // through mirrors and glass alone from one of the lights the photons come from.
+
+    caustic_settings settings;
+
+    void reset(const std::vector<double>& footprints) {
+        // Starts over for an image whose pixels are footprints wide where they first meet the
+        // scene, or zero where they don't.
+        double sum = 0;
+        int count = 0;
+        for (auto footprint : footprints) {
+            if (footprint > 0) {
+                sum += footprint;
+                count++;
+            }
+        }
+        shared_radius = (settings.initial_radius > 0) ? settings.initial_radius
+                      : 2 * ((count > 0) ? sum / count : 1.0);
+
+        pixels.assign(footprints.size(), pixel_state());
+        for (size_t k = 0; k < footprints.size(); k++) {
+            pixels[k].radius = (settings.initial_radius > 0 || footprints[k] <= 0)
+                             ? shared_radius : 2 * footprints[k];
+        }
+        passes = 0;
+        map = photon_map();
+    }
+
+    void trace(const hittable& world, const light_list& lights, int max_depth) {
+        // A pass of photons, for estimate() and then gather(), sorted into cells big enough
+        // for the largest radius.
+        double largest = shared_radius;
+        for (const auto& pixel : pixels)
+            largest = std::fmax(largest, pixel.radius);
+        map = photon_map(trace_photons(world, lights, max_depth), 2 * largest);
+    }
+
+    color estimate(const ray& r, const hit_record& rec) const {
+        // Caustic light leaving rec.p back along r, from this pass's photons within the shared
+        // radius.
+        auto flux = photon_flux(r, rec, shared_radius, nullptr);
+        return flux / (settings.photons_per_pass * pi * shared_radius * shared_radius);
+    }
+
+    void gather(const std::vector<visible_point>& points) {
+        // Adds this pass's photons around each pixel's visible point, then shrinks the radii.
+        parallel_for(points.size(), [&](size_t k) {
+            if (points[k].valid)
+                gather(points[k], pixels[k]);
+        });
+        passes++;
+        shared_radius *= std::sqrt((passes + settings.alpha) / (passes + 1));
+    }
+
+    color radiance(size_t k) const {
+        // The caustic light leaving pixel k's visible points toward the camera, times their
+        // weights, estimated from all passes so far.
+        const auto& pixel = pixels[k];
+        if (passes == 0)
+            return color(0,0,0);
+        auto emitted = double(passes) * settings.photons_per_pass;
+        return pixel.flux / (emitted * pi * pixel.radius * pixel.radius);
+    }
+
+  private:
+    struct pixel_state {
+        double radius = 0;
+        double count = 0;   // Photons found, as thinned by alpha.
+        color  flux = color(0,0,0);
+    };
+
+    std::vector<pixel_state> pixels;
+    double shared_radius = 1;
+    int passes = 0;
+    photon_map map;   // This pass's photons.
+
+    std::vector<photon> trace_photons(const hittable& world, const light_list& lights, int max_depth) const {
+        // Photons from the lights through any number of mirror and glass bounces, kept where
+        // they then land on a diffuse surface. One list per thread, joined at the end.
+        int threads = thread_count();
+        std::vector<std::vector<photon>> found(threads);
+        parallel_chunks(size_t(settings.photons_per_pass), threads, [&](int c, size_t begin, size_t end) {
+            for (auto i = begin; i < end; i++) {
+                ray r;
+                auto power = lights.random_photon(r);
+                if (power.length_squared() == 0)
+                    continue;
+
+                bool specular = false;
+                for (int depth = 0; depth < max_depth; depth++) {
+                    hit_record rec;
+                    if (!world.hit(r, interval(0.001, infinity), rec))
+                        break;
+                    ray scattered;
+                    color attenuation;
+                    if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                        break;
+                    if (rec.mat->pdf(r, rec, scattered.direction()) > 0) {
+                        if (specular && rec.mat->is_surface())
+                            found[c].push_back({ rec.p, unit_vector(r.direction()), power });
+                        break;
+                    }
+                    specular = true;
+                    power = power * attenuation;
+                    r = scattered;
+                }
+            }
+        });
+
+        std::vector<photon> photons;
+        for (const auto& list : found)
+            photons.insert(photons.end(), list.begin(), list.end());
+        return photons;
+    }
+
+    color photon_flux(const ray& r, const hit_record& rec, double radius, double* found) const {
+        // The power of this pass's photons within radius of rec.p, each times the BSDF toward
+        // where it came from, and optionally how many there were.
+        color flux(0,0,0);
+        map.gather(rec.p, radius, [&](const photon& ph) {
+            auto cosine = -dot(rec.normal, ph.direction);
+            if (cosine <= 0)
+                return;
+            flux += rec.mat->eval(r, rec, -ph.direction) / cosine * ph.power;
+            if (found)
+                *found += 1;
+        });
+        return flux;
+    }
+
+    void gather(const visible_point& point, pixel_state& pixel) const {
+        // Hachisuka and Jensen's progressive radiance estimate.
+        double found = 0;
+        auto flux = photon_flux(point.r, point.rec, pixel.radius, &found);
+        if (found == 0)
+            return;
+
+        auto count = pixel.count + settings.alpha * found;
+        auto radius = pixel.radius * std::sqrt(count / (pixel.count + found));
+        auto shrink = (radius * radius) / (pixel.radius * pixel.radius);
+        pixel.flux = (pixel.flux + point.weight * flux) * shrink;
+        pixel.count = count;
+        pixel.radius = radius;
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "material.h"
 
 class quad : public hittable {
   public:
@@ -13,6 +14,7 @@ class quad : public hittable {
         normal = unit_vector(n);
         D = -dot(normal, corner);
         w = n / dot(n,n);
+        area = n.length();
 
         set_bounding_box();
     }
@@ -26,6 +28,17 @@ class quad : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    point3 point_at(double a, double b) const { return corner + a * side_A + b * side_B; }
+    const vec3& get_normal() const { return normal; }
+    shared_ptr<material> get_material() const { return mat; }
+
+    aabb clipped_box(const aabb& region) const override {
+        return clipped_polygon_box(
+            { corner, corner + side_A, corner + side_A + side_B, corner + side_B }, region);
+    }
+
+    uint64_t shape_hash() const override { return polygon_hash(4); }
+
     virtual bool hit_ab(double a, double b, hit_record& rec) const {
         // Given the hit point in plane coordinates, return false if it is outside the
         // primitive, otherwise set the hit record UV coordinates and return true.
@@ -39,24 +52,9 @@ class quad : public hittable {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto denom = dot(normal, r.direction());
-
-        // No hit if the ray is parallel to the plane.
-        if (fabs(denom) < 1e-8)
-            return false;
-
-        // Return false if the hit point parameter t is outside the ray interval.
-        auto t = (-D - dot(normal, r.origin())) / denom;
-        if (!ray_t.contains(t))
-            return false;
-
-        // Determine the hit point lies within the planar shape using its plane coordinates.
-        auto intersection = r.at(t);
-        vec3 planar_hitpt_vector = intersection - corner;
-        auto a = dot(w, cross(planar_hitpt_vector, side_B));
-        auto b = dot(w, cross(side_A, planar_hitpt_vector));
-
-        if (!hit_ab(a, b, rec))
+        double t;
+        point3 intersection;
+        if (!plane_hit(r, ray_t, rec, t, intersection))
             return false;
 
         // Ray hits the 2D shape; set the rest of the hit record and return true.
@@ -68,6 +66,64 @@ class quad : public hittable {
         return true;
     }
 
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        // Uniform over the area, converted to solid angle at origin.
+        hit_record rec;
+        if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            return 0;
+
+        auto distance_squared = rec.t * rec.t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, rec.normal) / direction.length());
+        return distance_squared / (cosine * area);
+    }
+
+    vec3 random(const point3& origin) const override {
+        auto p = corner + (random_double() * side_A) + (random_double() * side_B);
+        return p - origin;
+    }
+
+    bool is_light() const override { return mat && mat->is_emissive(); }
+
+    emission_bounds emission() const override {
+        // diffuse_light emits from both faces, so the normals cover both directions; the
+        // radiance is taken at the center.
+        emission_bounds bounds;
+        auto radiance = mat->emitted(0.5, 0.5, corner + 0.5*side_A + 0.5*side_B);
+        bounds.power = 2 * pi * area * luminance(radiance);
+        bounds.axis = normal;
+        return bounds;
+    }
+
+    double surface_area() const override { return area; }
+
+    void random_surface_point(double time, point3& p, vec3& normal) const override {
+        p = random(point3(0,0,0));
+        normal = this->normal;
+    }
+
+    color random_emission(ray& photon) const override {
+        // A point from random(), uniform over the shape, and a cosine-distributed direction
+        // from either face.
+        point3 p = random(point3(0,0,0));
+        auto a = dot(w, cross(p - corner, side_B));
+        auto b = dot(w, cross(side_A, p - corner));
+        auto side = (random_double() < 0.5) ? normal : -normal;
+        auto direction = side + random_unit_vector();
+        if (direction.near_zero())
+            direction = side;
+        photon = ray(p, direction, random_double());
+        return 2 * pi * area * mat->emitted(a, b, p);
+    }
+
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        // A plane is crossed once.
+        hit_record rec;
+        double t;
+        point3 intersection;
+        if (plane_hit(r, ray_t, rec, t, intersection))
+            out.add(t);
+    }
+
   protected:
     point3 corner;
     vec3 side_A, side_B;
@@ -75,7 +131,77 @@ class quad : public hittable {
     vec3 normal;
     double D;
     vec3 w;
+    double area;
     aabb bbox;
+
+    bool plane_hit(const ray& r, interval ray_t, hit_record& rec, double& t, point3& intersection) const {
+        auto denom = dot(normal, r.direction());
+
+        // No hit if the ray is parallel to the plane.
+        if (fabs(denom) < 1e-8)
+            return false;
+
+        // Return false if the hit point parameter t is outside the ray interval.
+        t = (-D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        // Determine the hit point lies within the planar shape using its plane coordinates.
+        intersection = r.at(t);
+        vec3 planar_hitpt_vector = intersection - corner;
+        auto a = dot(w, cross(planar_hitpt_vector, side_B));
+        auto b = dot(w, cross(side_A, planar_hitpt_vector));
+
+        return hit_ab(a, b, rec);
+    }
+
+    uint64_t polygon_hash(uint64_t vertex_count) const {
+        point3 shape[3] = { corner, side_A, side_B };
+        return hash_bytes(shape, sizeof(shape), hash_bytes(&vertex_count, sizeof(vertex_count)));
+    }
+
+    static aabb clipped_polygon_box(std::initializer_list<point3> vertices, const aabb& region) {
+        // Clips a convex planar polygon against each side of region in turn (Sutherland-Hodgman)
+        // and returns the bounds of what remains. Each of the six planes adds at most one
+        // vertex.
+        point3 polygon[2][16];
+        int count = 0;
+        for (const auto& v : vertices)
+            polygon[0][count++] = v;
+
+        int current = 0;
+        for (int axis = 0; axis < 3 && count > 0; axis++) {
+            const auto& ax = region.axis_interval(axis);
+            count = clip_polygon(polygon[current], count, polygon[1 - current], axis, ax.min, +1);
+            current = 1 - current;
+            count = clip_polygon(polygon[current], count, polygon[1 - current], axis, ax.max, -1);
+            current = 1 - current;
+        }
+
+        aabb box = aabb::empty;
+        for (int i = 0; i < count; i++)
+            box = aabb(box, aabb(polygon[current][i], polygon[current][i]));
+        return box;
+    }
+
+    static int clip_polygon(
+        const point3* polygon, int count, point3* result, int axis, double plane, double side
+    ) {
+        // Writes the part of the polygon where side * (p[axis] - plane) >= 0 to result and
+        // returns its vertex count.
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            const auto& a = polygon[i];
+            const auto& b = polygon[(i + 1) % count];
+            auto da = side * (a[axis] - plane);
+            auto db = side * (b[axis] - plane);
+            if (da >= 0)
+                result[kept++] = a;
+            if ((da >= 0) != (db >= 0))
+                result[kept++] = a + (da / (da - db)) * (b - a);
+        }
+        return kept;
+    }
 };
 
 
@@ -108,7 +234,15 @@ class tri : public quad {
   public:
     tri(const point3& o, const vec3& aa, const vec3& ab, shared_ptr<material> m)
       : quad(o, aa, ab, m)
-    {}
+    {
+        area /= 2;
+    }
+
+    aabb clipped_box(const aabb& region) const override {
+        return clipped_polygon_box({ corner, corner + side_A, corner + side_B }, region);
+    }
+
+    uint64_t shape_hash() const override { return polygon_hash(3); }
 
     virtual bool hit_ab(double a, double b, hit_record& rec) const override {
         if ((a < 0) || (b < 0) || (a + b > 1))
@@ -118,6 +252,18 @@ class tri : public quad {
         rec.v = b;
         return true;
     }
+
+    vec3 random(const point3& origin) const override {
+        // A point of the parallelogram, folded back into the triangle when it's past the
+        // diagonal.
+        auto a = random_double();
+        auto b = random_double();
+        if (a + b > 1) {
+            a = 1 - a;
+            b = 1 - b;
+        }
+        return corner + (a * side_A) + (b * side_B) - origin;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -13,11 +13,18 @@ class ray {
     ray(const point3& origin, const vec3& direction)
       : ray(origin, direction, 0) {}
 
+    ray(const point3& origin, const vec3& direction, double time, double spread)
+      : orig(origin), dir(direction), tm(time), spr(spread) {}
+
     const point3& origin() const  { return orig; }
     const vec3& direction() const { return dir; }
 
     double time() const { return tm; }
 
+    // Width of the ray's footprint per unit of t, so the footprint at parameter t is
+    // spread()*t. Camera rays carry their pixel footprint; other rays leave it at zero.
+    double spread() const { return spr; }
+
     point3 at(double t) const {
         return orig + t*dir;
     }
@@ -26,6 +33,7 @@ class ray {
     point3 orig;
     vec3 dir;
     double tm;
+    double spr = 0;
 };
 
 #endif
\ No newline at end of file
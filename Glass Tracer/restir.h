@@ -0,0 +1,362 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+
+#include <vector>
+
+enum class bias_correction {
+    none,         // Fastest; darkens where neighbors see different lights, as at shadow edges.
+    basic,        // Weights each reservoir by how likely its pixel was to pick each light.
+    ray_traced    // Same, shadows included: a shadow ray between every pair of pixels reused.
+};
+
+struct restir_settings {
+    int    candidates        = 8;     // Light samples drawn per pixel and frame
+    bool   visibility_reuse  = true;  // Drop a pixel's pick before reuse if it is in shadow
+    bool   temporal_reuse    = true;  // Reuse each pixel's reservoir from the previous frame
+    double history_limit     = 20;    // Most frames' worth of samples carried between frames
+    int    spatial_passes    = 1;     // Rounds of reuse from neighboring pixels
+    int    spatial_neighbors = 5;     // Neighbors tried per pixel and round
+    double spatial_radius    = 10;    // Farthest neighbor, in pixels
+    bias_correction correction = bias_correction::basic;
+};
+
+struct light_sample {
+    point3 position;     // On the light; for the environment, the unit direction to it.
+    vec3   normal;
+    color  emission;
+    bool   at_infinity = false;
+};
+
+struct shading_point {
+    bool       valid = false;   // False where the camera ray hit nothing that scatters light.
+    ray        r;
+    hit_record rec;
+};
+
+struct camera_view {
+    // Enough of a camera to find the pixel a point is seen in.
+    point3 center;
+    point3 pixel00_loc;
+    vec3   pixel_delta_u;
+    vec3   pixel_delta_v;
+};
+
+class reservoir {
+  public:
+    // Weighted reservoir sampling: of the light samples passed to update(), keeps one, each
+    // with probability in proportion to its weight, without storing the others.
+    light_sample sample;
+    double weight_sum = 0;
+    double count = 0;                 // Samples seen; fractional once history is capped.
+    double target = 0;                // The target function for sample where it was kept.
+    double contribution_weight = 0;   // Stands in for 1/pdf of sample in the estimate.
+
+    bool update(const light_sample& x, double weight, double x_target, double m = 1) {
+        count += m;
+        if (weight <= 0)
+            return false;
+        weight_sum += weight;
+        if (random_double() * weight_sum >= weight)
+            return false;
+        sample = x;
+        target = x_target;
+        return true;
+    }
+};
+
+class light_resampler {
+  public:
+    // Direct light at camera ray hits by spatiotemporal reservoir resampling (Bitterli et al.,
+    // "Spatiotemporal Reservoir Resampling for Real-Time Ray Tracing with Dynamic Direct
+    // Lighting", 2020). Each pixel draws candidates from the light_list and keeps one, chosen
+    // in proportion to its unshadowed contribution (resampled importance sampling). It then
+    // merges its reservoir with the one from the same surface in the previous frame and with
+    // those of nearby pixels on similar surfaces, so each pixel's pick is effectively the best
+    // of hundreds of candidates for the price of a handful. Only the final pick gets a shadow
+    // ray, plus the pixel's own pick before reuse with visibility_reuse.
+    //
+    // Reuse moves samples between shading points whose target functions differ; the
+    // bias_correction setting chooses how carefully that is accounted for. Short of
+    // ray_traced, visibility_reuse trades a little darkening near shadows for less noise
+    // in them. Every frame
+    // passed to direct_light() counts as the next one: the camera can move between them, and
+    // the previous frame is found by projecting each hit into the previous view.
+
+    restir_settings settings;
+
+    // Forgets the previous frame, as after a cut.
+    void reset() { previous.clear(); }
+
+    std::vector<color> direct_light(
+        const std::vector<shading_point>& points, int width, const camera_view& view,
+        const hittable& world, const light_list& lights
+    ) {
+        // Light reaching each of points, a frame's first hits in scanline order, directly from
+        // the lights, already weighted by the surface's BSDF.
+        int height = int(points.size()) / width;
+        std::vector<reservoir> current(points.size());
+        for (size_t k = 0; k < points.size(); k++)
+            if (points[k].valid)
+                current[k] = initial(points[k], world, lights);
+
+        if (settings.temporal_reuse && previous.size() == points.size()) {
+            for (size_t k = 0; k < points.size(); k++) {
+                auto earlier = reproject(points[k]);
+                if (earlier < 0)
+                    continue;
+                auto history = previous[earlier];
+                history.count = std::fmin(history.count, settings.history_limit * current[k].count);
+                const reservoir* inputs[] = { &current[k], &history };
+                const shading_point* owners[] = { &points[k], &previous_points[earlier] };
+                current[k] = combine(points[k], inputs, owners, 2, world);
+            }
+        }
+
+        std::vector<const reservoir*> inputs;
+        std::vector<const shading_point*> owners;
+        for (int pass = 0; pass < settings.spatial_passes; pass++) {
+            auto next = current;
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto k = size_t(j) * width + i;
+                    if (!points[k].valid)
+                        continue;
+                    inputs.assign(1, &current[k]);
+                    owners.assign(1, &points[k]);
+                    for (int n = 0; n < settings.spatial_neighbors; n++) {
+                        auto offset = settings.spatial_radius * random_in_unit_disk();
+                        int ni = i + int(std::round(offset.x()));
+                        int nj = j + int(std::round(offset.y()));
+                        if (ni < 0 || ni >= width || nj < 0 || nj >= height || (ni == i && nj == j))
+                            continue;
+                        auto nk = size_t(nj) * width + ni;
+                        if (!similar(points[k], points[nk], view.center))
+                            continue;
+                        inputs.push_back(&current[nk]);
+                        owners.push_back(&points[nk]);
+                    }
+                    next[k] = combine(points[k], inputs.data(), owners.data(), inputs.size(), world);
+                }
+            }
+            current.swap(next);
+        }
+
+        std::vector<color> direct(points.size(), color(0,0,0));
+        for (size_t k = 0; k < points.size(); k++) {
+            const auto& r = current[k];
+            if (!points[k].valid || r.contribution_weight <= 0)
+                continue;
+            vec3 direction;
+            double distance;
+            auto c = contribution(points[k], r.sample, direction, distance);
+            if (visible(points[k], direction, distance, world))
+                direct[k] = r.contribution_weight * c;
+        }
+
+        previous.swap(current);
+        previous_points = points;
+        previous_view = view;
+        previous_width = width;
+        return direct;
+    }
+
+  private:
+    std::vector<reservoir> previous;           // The last frame's, by pixel.
+    std::vector<shading_point> previous_points;
+    camera_view previous_view;
+    int previous_width = 0;
+
+    reservoir initial(const shading_point& s, const hittable& world, const light_list& lights) const {
+        reservoir r;
+        for (int c = 0; c < settings.candidates; c++) {
+            light_sample x;
+            double source_pdf;
+            if (!draw(s.rec.p, lights, x, source_pdf)) {
+                r.count += 1;
+                continue;
+            }
+            auto t = target(s, x);
+            r.update(x, t / source_pdf, t);
+        }
+        if (r.weight_sum <= 0)
+            return r;
+
+        r.contribution_weight = r.weight_sum / (r.count * r.target);
+        if (settings.visibility_reuse) {
+            vec3 direction;
+            double distance;
+            contribution(s, r.sample, direction, distance);
+            if (!visible(s, direction, distance, world))
+                r.contribution_weight = 0;
+        }
+        return r;
+    }
+
+    reservoir combine(
+        const shading_point& s, const reservoir* const* inputs, const shading_point* const* owners,
+        size_t n, const hittable& world
+    ) const {
+        // Merges the reservoirs of several shading points into one for s, inputs[0] being its
+        // own. Each is weighted by how much s would want its sample times how many samples it
+        // stands for; the result's contribution weight then divides by the samples seen, as
+        // if all the inputs could have produced the one kept, which is where the bias is.
+        if (settings.correction != bias_correction::none)
+            return combine_weighted(s, inputs, owners, n, world);
+
+        reservoir out;
+        for (size_t i = 0; i < n; i++) {
+            const auto& in = *inputs[i];
+            auto t = (i == 0) ? in.target : target(s, in.sample);
+            out.update(in.sample, t * in.contribution_weight * in.count, t, in.count);
+        }
+        if (out.weight_sum > 0)
+            out.contribution_weight = out.weight_sum / (out.count * out.target);
+        return out;
+    }
+
+    reservoir combine_weighted(
+        const shading_point& s, const reservoir* const* inputs, const shading_point* const* owners,
+        size_t n, const hittable& world
+    ) const {
+        // As combine(), with each input's weight multiplied by the balance heuristic over the
+        // inputs' targets for its sample (generalized RIS, Lin et al. 2022) instead of dividing
+        // by a count at the end. Dividing by the count of inputs that could have produced the
+        // sample is also unbiased, but much noisier when the targets differ, and when shadows
+        // are counted, its weights can grow without bound as they are carried across frames.
+        reservoir out;
+        for (size_t i = 0; i < n; i++) {
+            const auto& in = *inputs[i];
+            if (in.contribution_weight <= 0) {
+                out.count += in.count;
+                continue;
+            }
+            double own = 0, sum = 0;
+            for (size_t j = 0; j < n; j++) {
+                auto weighted = inputs[j]->count * ((settings.correction == bias_correction::ray_traced)
+                                                    ? shadowed_target(*owners[j], in.sample, world)
+                                                    : target(*owners[j], in.sample));
+                sum += weighted;
+                if (j == i)
+                    own = weighted;
+            }
+            auto t = (i == 0) ? in.target : target(s, in.sample);
+            auto mis = (sum > 0) ? own / sum : 0;
+            out.update(in.sample, mis * t * in.contribution_weight, t, in.count);
+        }
+        out.contribution_weight = (out.weight_sum > 0) ? out.weight_sum / out.target : 0;
+        return out;
+    }
+
+    long reproject(const shading_point& s) const {
+        // The pixel that saw the same surface in the previous frame, or -1.
+        if (!s.valid || previous_width <= 0)
+            return -1;
+        const auto& v = previous_view;
+        auto plane_normal = cross(v.pixel_delta_u, v.pixel_delta_v);
+        auto to_p = s.rec.p - v.center;
+        auto denominator = dot(to_p, plane_normal);
+        if (denominator == 0)
+            return -1;
+        auto t = dot(v.pixel00_loc - v.center, plane_normal) / denominator;
+        if (t <= 0)
+            return -1;
+
+        auto on_plane = v.center + t * to_p - v.pixel00_loc;
+        int i = int(std::round(dot(on_plane, v.pixel_delta_u) / v.pixel_delta_u.length_squared()));
+        int j = int(std::round(dot(on_plane, v.pixel_delta_v) / v.pixel_delta_v.length_squared()));
+        int height = int(previous.size()) / previous_width;
+        if (i < 0 || i >= previous_width || j < 0 || j >= height)
+            return -1;
+
+        auto k = long(j) * previous_width + i;
+        return similar(s, previous_points[k], v.center) ? k : -1;
+    }
+
+    static bool similar(const shading_point& a, const shading_point& b, const point3& eye) {
+        // Whether b is on much the same surface as a, as seen from eye: facing within about
+        // 25 degrees, and no more than 10% nearer or farther.
+        if (!b.valid || dot(a.rec.normal, b.rec.normal) < 0.9)
+            return false;
+        auto da = (a.rec.p - eye).length();
+        auto db = (b.rec.p - eye).length();
+        return std::fabs(da - db) <= 0.1 * da;
+    }
+
+    static bool draw(const point3& p, const light_list& lights, light_sample& x, double& source_pdf) {
+        // A light sample from the list's own strategy, with its density in the measure the
+        // sample lives in: per unit area on a light, per unit solid angle for the environment.
+        auto direction = lights.random(p);
+        if (direction.length_squared() == 0)
+            return false;
+        auto pdf = lights.pdf_value(p, direction);
+        if (pdf <= 0)
+            return false;
+        direction = unit_vector(direction);
+
+        hit_record rec;
+        if (lights.hit(ray(p, direction), interval(0.001, infinity), rec)) {
+            auto cosine = std::fabs(dot(rec.normal, direction));
+            if (cosine <= 0)
+                return false;
+            x = { rec.p, rec.normal, rec.mat->emitted(rec.u, rec.v, rec.p), false };
+            source_pdf = pdf * cosine / (rec.p - p).length_squared();
+            return true;
+        }
+        if (!lights.environment)
+            return false;
+        x = { direction, vec3(), lights.environment->value(direction), true };
+        source_pdf = pdf;
+        return true;
+    }
+
+    static color contribution(
+        const shading_point& s, const light_sample& y, vec3& direction, double& distance
+    ) {
+        // Light from y reflected by s toward the camera, ignoring shadows, in the measure of
+        // y: the BSDF and cosine at s, times the geometry term for points on lights.
+        double geometry = 1;
+        if (y.at_infinity) {
+            direction = y.position;
+            distance = infinity;
+        } else {
+            auto to_y = y.position - s.rec.p;
+            auto distance_squared = to_y.length_squared();
+            if (distance_squared <= 0)
+                return color(0,0,0);
+            distance = std::sqrt(distance_squared);
+            direction = to_y / distance;
+            geometry = std::fabs(dot(y.normal, direction)) / distance_squared;
+        }
+        return s.rec.mat->eval(s.r, s.rec, direction) * y.emission * geometry;
+    }
+
+    static double target(const shading_point& s, const light_sample& y) {
+        vec3 direction;
+        double distance;
+        return std::fmax(0.0, luminance(contribution(s, y, direction, distance)));
+    }
+
+    static double shadowed_target(const shading_point& s, const light_sample& y, const hittable& world) {
+        vec3 direction;
+        double distance;
+        auto t = std::fmax(0.0, luminance(contribution(s, y, direction, distance)));
+        return (t > 0 && visible(s, direction, distance, world)) ? t : 0;
+    }
+
+    static bool visible(
+        const shading_point& s, const vec3& direction, double distance, const hittable& world
+    ) {
+        // Stops just short of the light itself.
+        hit_record rec;
+        auto far = std::isinf(distance) ? infinity : distance * 0.9999;
+        return !world.hit(ray(s.rec.p, direction, s.r.time()), interval(0.001, far), rec);
+    }
+};
+
+#endif
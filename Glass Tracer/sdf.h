@@ -0,0 +1,638 @@
+#ifndef SDF_H
+#define SDF_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Signed distance fields. Shapes are described by a tree of sdf_node objects built with the
+// sdf_* helper functions below, e.g.
+//
+//     auto shape = sdf_smooth_union(sdf_sphere(1), sdf_translate(sdf_torus(1.5, .3), vec3(0,1,0)), .4);
+//
+// An sdf_primitive compiles the tree into a flat list of instructions and renders it by
+// sphere tracing. The tree must stay a valid distance bound (Lipschitz constant at most one)
+// for sphere tracing to be safe; all the operations provided here keep that property, as
+// long as each repeated cell fully contains its copy of the child shape.
+
+class sdf_node {
+  public:
+    enum kind_t {
+        sphere, box, torus, capsule,
+        op_union, op_smooth_union, op_intersection, op_subtraction,
+        op_translate, op_scale, op_repeat
+    };
+
+    kind_t kind;
+    vec3 a, b;         // Shape or operation parameters, see the sdf_* helpers
+    double k = 0;      // Radius, smoothing width or scale factor
+    shared_ptr<sdf_node> lhs, rhs;
+
+    sdf_node(kind_t kind) : kind(kind) {}
+
+    aabb bounds() const {
+        // Conservative bounds of the zero level set of this subtree.
+        switch (kind) {
+            case sphere:  return aabb(-vec3(k,k,k), vec3(k,k,k));
+            case box:     return aabb(-a, a);
+            case torus: {
+                auto outer = a.x() + k;
+                return aabb(point3(-outer, -k, -outer), point3(outer, k, outer));
+            }
+            case capsule: return grow(aabb(a, b), k);
+            case op_union:
+                return aabb(lhs->bounds(), rhs->bounds());
+            case op_smooth_union:
+                // The polynomial smooth minimum never undercuts min(d1,d2) by more than k/4.
+                return grow(aabb(lhs->bounds(), rhs->bounds()), k/4);
+            case op_intersection: {
+                auto l = lhs->bounds(), r = rhs->bounds();
+                return aabb(overlap(l.x, r.x), overlap(l.y, r.y), overlap(l.z, r.z));
+            }
+            case op_subtraction:
+                return lhs->bounds();
+            case op_translate:
+                return lhs->bounds() + a;
+            case op_scale: {
+                auto l = lhs->bounds();
+                return aabb(point3(l.x.min, l.y.min, l.z.min) * k, point3(l.x.max, l.y.max, l.z.max) * k);
+            }
+            case op_repeat: {
+                auto l = lhs->bounds();
+                auto spread = a * b;
+                return aabb(point3(l.x.min, l.y.min, l.z.min) - spread,
+                            point3(l.x.max, l.y.max, l.z.max) + spread);
+            }
+        }
+        return aabb::empty;
+    }
+
+  private:
+    static aabb grow(const aabb& box, double delta) {
+        return aabb(box.x.expand(2*delta), box.y.expand(2*delta), box.z.expand(2*delta));
+    }
+
+    static interval overlap(const interval& a, const interval& b) {
+        return interval(std::fmax(a.min, b.min), std::fmin(a.max, b.max));
+    }
+};
+
+inline shared_ptr<sdf_node> sdf_sphere(double radius) {
+    auto n = make_shared<sdf_node>(sdf_node::sphere);
+    n->k = radius;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_box(const vec3& half_size) {
+    auto n = make_shared<sdf_node>(sdf_node::box);
+    n->a = half_size;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_torus(double major_radius, double minor_radius) {
+    // Torus around the Y axis.
+    auto n = make_shared<sdf_node>(sdf_node::torus);
+    n->a = vec3(major_radius, 0, 0);
+    n->k = minor_radius;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_capsule(const point3& a, const point3& b, double radius) {
+    auto n = make_shared<sdf_node>(sdf_node::capsule);
+    n->a = a;
+    n->b = b;
+    n->k = radius;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_binary(
+    sdf_node::kind_t kind, shared_ptr<sdf_node> lhs, shared_ptr<sdf_node> rhs, double k = 0
+) {
+    auto n = make_shared<sdf_node>(kind);
+    n->lhs = lhs;
+    n->rhs = rhs;
+    n->k = k;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_union(shared_ptr<sdf_node> lhs, shared_ptr<sdf_node> rhs) {
+    return sdf_binary(sdf_node::op_union, lhs, rhs);
+}
+
+inline shared_ptr<sdf_node> sdf_smooth_union(
+    shared_ptr<sdf_node> lhs, shared_ptr<sdf_node> rhs, double smoothing
+) {
+    return sdf_binary(sdf_node::op_smooth_union, lhs, rhs, std::fmax(smoothing, 1e-8));
+}
+
+inline shared_ptr<sdf_node> sdf_intersection(shared_ptr<sdf_node> lhs, shared_ptr<sdf_node> rhs) {
+    return sdf_binary(sdf_node::op_intersection, lhs, rhs);
+}
+
+inline shared_ptr<sdf_node> sdf_subtraction(shared_ptr<sdf_node> lhs, shared_ptr<sdf_node> rhs) {
+    // The shape lhs with rhs carved out of it.
+    return sdf_binary(sdf_node::op_subtraction, lhs, rhs);
+}
+
+inline shared_ptr<sdf_node> sdf_translate(shared_ptr<sdf_node> child, const vec3& offset) {
+    auto n = make_shared<sdf_node>(sdf_node::op_translate);
+    n->lhs = child;
+    n->a = offset;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_scale(shared_ptr<sdf_node> child, double factor) {
+    auto n = make_shared<sdf_node>(sdf_node::op_scale);
+    n->lhs = child;
+    n->k = factor;
+    return n;
+}
+
+inline shared_ptr<sdf_node> sdf_repeat(
+    shared_ptr<sdf_node> child, const vec3& period, int count_x, int count_y, int count_z
+) {
+    // Domain repetition: copies of child every `period` along each axis, `count` copies to
+    // either side of the original (so 2*count+1 in total). An axis with count 0 is left alone.
+    auto n = make_shared<sdf_node>(sdf_node::op_repeat);
+    n->lhs = child;
+    n->a = period;
+    n->b = vec3(count_x, count_y, count_z);
+    return n;
+}
+
+class sdf_program {
+  public:
+    // The tree flattened into postfix order. Domain operations push a transformed point for
+    // their subtree and pop it afterwards; shapes push a distance and combiners pop two.
+    // Evaluation works on `lanes` points at once in structure-of-arrays form, with no branches
+    // inside the per-lane loops, so the same code serves single points and point packets.
+    //
+    // Both stacks hold max_depth entries. compile() orders the children of unions and
+    // intersections so that the value stack stays shallow, but a tree that still needs more,
+    // such as one nesting domain operations over max_depth - 1 deep, can't be evaluated: it
+    // is reported and compiles to an empty program, which is everywhere at infinite distance.
+
+    static const int max_depth = 32;
+
+    enum opcode {
+        sphere, box, torus, capsule,
+        combine_min, combine_smooth_min, combine_max, combine_subtract,
+        push_translate, push_scale, push_repeat, pop_point, pop_scale
+    };
+
+    struct instruction {
+        opcode op;
+        vec3 a, b;
+        double k;
+    };
+
+    std::vector<instruction> code;
+
+    sdf_program() {}
+    sdf_program(const sdf_node& root) {
+        compile(root);
+        if (point_depth > max_depth || value_depth > max_depth) {
+            std::cerr << "ERROR: SDF tree needs more than " << max_depth
+                      << " entries on its evaluation stacks.\n";
+            code.clear();
+        }
+    }
+
+    size_t memory_usage() const {
+        return sizeof(*this) + code.capacity() * sizeof(instruction);
+    }
+
+    double eval(const point3& p) const {
+        double x[1] = { p.x() }, y[1] = { p.y() }, z[1] = { p.z() }, d[1];
+        eval<1>(x, y, z, d);
+        return d[0];
+    }
+
+    template <int lanes>
+    void eval(const double* px, const double* py, const double* pz, double* out) const {
+        if (code.empty()) {
+            for (int l = 0; l < lanes; l++)
+                out[l] = infinity;
+            return;
+        }
+
+        double xs[max_depth][lanes], ys[max_depth][lanes], zs[max_depth][lanes];
+        double values[max_depth][lanes];
+        int point_top = 0, value_top = 0;
+
+        for (int l = 0; l < lanes; l++) {
+            xs[0][l] = px[l];
+            ys[0][l] = py[l];
+            zs[0][l] = pz[l];
+        }
+
+        for (const auto& in : code) {
+            const double* x = xs[point_top];
+            const double* y = ys[point_top];
+            const double* z = zs[point_top];
+
+            switch (in.op) {
+                case sphere: {
+                    double* d = values[value_top++];
+                    for (int l = 0; l < lanes; l++)
+                        d[l] = std::sqrt(x[l]*x[l] + y[l]*y[l] + z[l]*z[l]) - in.k;
+                    break;
+                }
+                case box: {
+                    double* d = values[value_top++];
+                    for (int l = 0; l < lanes; l++) {
+                        double qx = std::fabs(x[l]) - in.a[0];
+                        double qy = std::fabs(y[l]) - in.a[1];
+                        double qz = std::fabs(z[l]) - in.a[2];
+                        double ox = std::fmax(qx, 0), oy = std::fmax(qy, 0), oz = std::fmax(qz, 0);
+                        d[l] = std::sqrt(ox*ox + oy*oy + oz*oz)
+                             + std::fmin(std::fmax(qx, std::fmax(qy, qz)), 0.0);
+                    }
+                    break;
+                }
+                case torus: {
+                    double* d = values[value_top++];
+                    for (int l = 0; l < lanes; l++) {
+                        double qx = std::sqrt(x[l]*x[l] + z[l]*z[l]) - in.a[0];
+                        d[l] = std::sqrt(qx*qx + y[l]*y[l]) - in.k;
+                    }
+                    break;
+                }
+                case capsule: {
+                    double* d = values[value_top++];
+                    auto ba = in.b - in.a;
+                    auto inv_len_sq = 1.0 / dot(ba, ba);
+                    for (int l = 0; l < lanes; l++) {
+                        double pax = x[l] - in.a[0], pay = y[l] - in.a[1], paz = z[l] - in.a[2];
+                        double h = (pax*ba[0] + pay*ba[1] + paz*ba[2]) * inv_len_sq;
+                        h = std::fmin(std::fmax(h, 0.0), 1.0);
+                        double dx = pax - ba[0]*h, dy = pay - ba[1]*h, dz = paz - ba[2]*h;
+                        d[l] = std::sqrt(dx*dx + dy*dy + dz*dz) - in.k;
+                    }
+                    break;
+                }
+                case combine_min: {
+                    const double* rhs = values[--value_top];
+                    double* lhs = values[value_top - 1];
+                    for (int l = 0; l < lanes; l++)
+                        lhs[l] = std::fmin(lhs[l], rhs[l]);
+                    break;
+                }
+                case combine_smooth_min: {
+                    // Polynomial smooth minimum with blend width k.
+                    const double* rhs = values[--value_top];
+                    double* lhs = values[value_top - 1];
+                    for (int l = 0; l < lanes; l++) {
+                        double h = std::fmax(in.k - std::fabs(lhs[l] - rhs[l]), 0.0) / in.k;
+                        lhs[l] = std::fmin(lhs[l], rhs[l]) - h*h*in.k*0.25;
+                    }
+                    break;
+                }
+                case combine_max: {
+                    const double* rhs = values[--value_top];
+                    double* lhs = values[value_top - 1];
+                    for (int l = 0; l < lanes; l++)
+                        lhs[l] = std::fmax(lhs[l], rhs[l]);
+                    break;
+                }
+                case combine_subtract: {
+                    const double* rhs = values[--value_top];
+                    double* lhs = values[value_top - 1];
+                    for (int l = 0; l < lanes; l++)
+                        lhs[l] = std::fmax(lhs[l], -rhs[l]);
+                    break;
+                }
+                case push_translate: {
+                    point_top++;
+                    for (int l = 0; l < lanes; l++) {
+                        xs[point_top][l] = x[l] - in.a[0];
+                        ys[point_top][l] = y[l] - in.a[1];
+                        zs[point_top][l] = z[l] - in.a[2];
+                    }
+                    break;
+                }
+                case push_scale: {
+                    point_top++;
+                    auto inv_k = 1.0 / in.k;
+                    for (int l = 0; l < lanes; l++) {
+                        xs[point_top][l] = x[l] * inv_k;
+                        ys[point_top][l] = y[l] * inv_k;
+                        zs[point_top][l] = z[l] * inv_k;
+                    }
+                    break;
+                }
+                case push_repeat: {
+                    point_top++;
+                    for (int l = 0; l < lanes; l++) {
+                        xs[point_top][l] = repeat(x[l], in.a[0], in.b[0]);
+                        ys[point_top][l] = repeat(y[l], in.a[1], in.b[1]);
+                        zs[point_top][l] = repeat(z[l], in.a[2], in.b[2]);
+                    }
+                    break;
+                }
+                case pop_point:
+                    point_top--;
+                    break;
+                case pop_scale: {
+                    point_top--;
+                    double* d = values[value_top - 1];
+                    for (int l = 0; l < lanes; l++)
+                        d[l] *= in.k;
+                    break;
+                }
+            }
+        }
+
+        for (int l = 0; l < lanes; l++)
+            out[l] = values[0][l];
+    }
+
+    vec3 gradient(const point3& p, double h) const {
+        // Tetrahedral central differences: four evaluations done as one 4-lane packet.
+        static const double kx[4] = { 1, -1, -1, 1 };
+        static const double ky[4] = { -1, -1, 1, 1 };
+        static const double kz[4] = { -1, 1, -1, 1 };
+
+        double x[4], y[4], z[4], d[4];
+        for (int l = 0; l < 4; l++) {
+            x[l] = p.x() + h*kx[l];
+            y[l] = p.y() + h*ky[l];
+            z[l] = p.z() + h*kz[l];
+        }
+        eval<4>(x, y, z, d);
+
+        vec3 g(0,0,0);
+        for (int l = 0; l < 4; l++)
+            g += d[l] * vec3(kx[l], ky[l], kz[l]);
+        return g;
+    }
+
+  private:
+    int point_depth = 1;    // Most points on the point stack at once, counting the query point.
+    int value_depth = 0;    // Most distances on the value stack at once.
+    int point_height = 1;   // While compiling, how many of each are on the stacks.
+    int value_height = 0;
+
+    static double repeat(double x, double period, double count) {
+        // Folds x into the cell nearest the origin, limited to `count` cells on either side.
+        // An axis with count 0 clamps every point to cell 0 and is left unchanged.
+        double cell = std::round(x / std::fmax(period, 1e-12));
+        cell = std::fmin(std::fmax(cell, -count), count);
+        return x - period*cell;
+    }
+
+    void compile(const sdf_node& n) {
+        switch (n.kind) {
+            case sdf_node::sphere:  emit(sphere, n); break;
+            case sdf_node::box:     emit(box, n); break;
+            case sdf_node::torus:   emit(torus, n); break;
+            case sdf_node::capsule: emit(capsule, n); break;
+
+            case sdf_node::op_union:
+            case sdf_node::op_smooth_union:
+            case sdf_node::op_intersection:
+            case sdf_node::op_subtraction: {
+                // min and max don't mind the order of their operands, so the child needing
+                // the deeper value stack goes first, while the stack is shallow.
+                bool swap = n.kind != sdf_node::op_subtraction
+                         && value_need(*n.rhs) > value_need(*n.lhs);
+                compile(swap ? *n.rhs : *n.lhs);
+                compile(swap ? *n.lhs : *n.rhs);
+                emit(n.kind == sdf_node::op_union ? combine_min
+                   : n.kind == sdf_node::op_smooth_union ? combine_smooth_min
+                   : n.kind == sdf_node::op_intersection ? combine_max
+                                                          : combine_subtract, n);
+                break;
+            }
+
+            case sdf_node::op_translate:
+                emit(push_translate, n);
+                compile(*n.lhs);
+                emit(pop_point, n);
+                break;
+
+            case sdf_node::op_scale:
+                emit(push_scale, n);
+                compile(*n.lhs);
+                emit(pop_scale, n);
+                break;
+
+            case sdf_node::op_repeat:
+                emit(push_repeat, n);
+                compile(*n.lhs);
+                emit(pop_point, n);
+                break;
+        }
+    }
+
+    static int value_need(const sdf_node& n) {
+        // How deep the value stack gets while evaluating n, with compile()'s ordering.
+        switch (n.kind) {
+            case sdf_node::op_union:
+            case sdf_node::op_smooth_union:
+            case sdf_node::op_intersection: {
+                auto a = value_need(*n.lhs), b = value_need(*n.rhs);
+                return (a == b) ? a + 1 : std::max(a, b);
+            }
+            case sdf_node::op_subtraction:
+                return std::max(value_need(*n.lhs), value_need(*n.rhs) + 1);
+            case sdf_node::op_translate:
+            case sdf_node::op_scale:
+            case sdf_node::op_repeat:
+                return value_need(*n.lhs);
+            default:
+                return 1;
+        }
+    }
+
+    void emit(opcode op, const sdf_node& n) {
+        code.push_back({ op, n.a, n.b, n.k });
+
+        // Follow the stack heights the instruction leaves, for the constructor to check.
+        switch (op) {
+            case sphere: case box: case torus: case capsule:
+                value_height++;
+                break;
+            case combine_min: case combine_smooth_min: case combine_max: case combine_subtract:
+                value_height--;
+                break;
+            case push_translate: case push_scale: case push_repeat:
+                point_height++;
+                break;
+            case pop_point: case pop_scale:
+                point_height--;
+                break;
+        }
+        point_depth = std::max(point_depth, point_height);
+        value_depth = std::max(value_depth, value_height);
+    }
+};
+
+class sdf_primitive : public hittable {
+  public:
+    sdf_primitive(shared_ptr<sdf_node> shape, shared_ptr<material> mat, int max_steps = 256)
+      : program(*shape), mat(mat), max_steps(max_steps)
+    {
+        auto bounds = shape->bounds();
+        auto diagonal = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length();
+        epsilon = 1e-5 * diagonal;
+
+        // Pad the bounds so surfaces lying on them are reached before the march runs out.
+        bbox = aabb(bounds.x.expand(16*epsilon), bounds.y.expand(16*epsilon), bounds.z.expand(16*epsilon));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Clip the ray to the bounds, then sphere trace. A ray that starts inside the shape
+        // (refraction through glass, for instance) traces the negated distance instead.
+        auto start = ray_t.min;
+        if (!clip(r, ray_t))
+            return false;
+
+        auto dir_len = r.direction().length();
+        auto t = ray_t.min;
+        auto d = program.eval(r.at(t));
+        auto side = 1.0;
+
+        if (t == start) {
+            // The ray starts within the bounds, possibly on the surface it is leaving. Step
+            // off that surface before deciding which side the ray is on.
+            for (int nudge = 0; nudge < 8 && std::fabs(d) < 2*epsilon; nudge++) {
+                t += 4*epsilon / dir_len;
+                d = program.eval(r.at(t));
+            }
+            side = (d < 0) ? -1.0 : 1.0;
+        }
+
+        for (int step = 0; step < max_steps && t < ray_t.max; step++) {
+            auto dist = side * d;
+            if (dist < epsilon) {
+                rec.t = t;
+                rec.p = r.at(t);
+                rec.set_face_normal(r, unit_vector(program.gradient(rec.p, 4*epsilon)));
+                rec.u = 0;
+                rec.v = 0;
+                rec.mat = mat;
+                return true;
+            }
+            t += dist / dir_len;
+            d = program.eval(r.at(t));
+        }
+
+        return false;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    const sdf_program& compiled() const { return program; }
+
+    size_t memory_usage() const { return sizeof(*this) + program.memory_usage() - sizeof(program); }
+
+  private:
+    sdf_program program;
+    shared_ptr<material> mat;
+    int max_steps;
+    double epsilon;
+    aabb bbox;
+
+    bool clip(const ray& r, interval& ray_t) const {
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+        return bbox.hit(r, inv_dir, ray_t);
+    }
+};
+
+inline shared_ptr<triangle_mesh> tessellate(
+    const sdf_program& program, const aabb& bounds, int resolution, shared_ptr<material> mat
+) {
+    // Extracts the zero level set on a resolution^3 grid by marching tetrahedra. Vertices on
+    // shared grid edges are welded, so the result is an indexed mesh.
+    int n = resolution;
+    auto cell = vec3(bounds.x.size() / n, bounds.y.size() / n, bounds.z.size() / n);
+    auto origin = point3(bounds.x.min, bounds.y.min, bounds.z.min);
+
+    auto grid_index = [n](int x, int y, int z) { return int64_t(x) + (n+1)*(int64_t(y) + (n+1)*int64_t(z)); };
+    auto grid_point = [&](int64_t g) {
+        int x = int(g % (n+1)), y = int((g / (n+1)) % (n+1)), z = int(g / ((n+1)*(n+1)));
+        return origin + vec3(x*cell[0], y*cell[1], z*cell[2]);
+    };
+
+    std::vector<double> values(size_t(n+1) * (n+1) * (n+1));
+    for (int z = 0; z <= n; z++)
+        for (int y = 0; y <= n; y++)
+            for (int x = 0; x <= n; x++)
+                values[grid_index(x,y,z)] = program.eval(grid_point(grid_index(x,y,z)));
+
+    std::vector<point3> vertices;
+    std::vector<int> indices;
+    std::unordered_map<int64_t, int> edge_vertex;
+
+    auto vertex_on_edge = [&](int64_t g0, int64_t g1) {
+        if (g0 > g1) std::swap(g0, g1);
+        auto key = g0 * int64_t(n+1)*(n+1)*(n+1) + g1;
+        auto found = edge_vertex.find(key);
+        if (found != edge_vertex.end())
+            return found->second;
+        auto v0 = values[g0], v1 = values[g1];
+        auto s = v0 / (v0 - v1);
+        vertices.push_back(grid_point(g0) + s * (grid_point(g1) - grid_point(g0)));
+        edge_vertex[key] = int(vertices.size()) - 1;
+        return int(vertices.size()) - 1;
+    };
+
+    auto emit = [&](int64_t inside, int64_t outside, int a, int b, int c) {
+        // Wind the triangle so its normal points from inside to outside.
+        auto normal = cross(vertices[b] - vertices[a], vertices[c] - vertices[a]);
+        if (dot(normal, grid_point(outside) - grid_point(inside)) < 0) std::swap(b, c);
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    };
+
+    static const int tets[6][4] = {
+        {0,1,3,7}, {0,3,2,7}, {0,2,6,7}, {0,6,4,7}, {0,4,5,7}, {0,5,1,7}
+    };
+
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                int64_t corner[8];
+                for (int c = 0; c < 8; c++)
+                    corner[c] = grid_index(x + (c & 1), y + ((c >> 1) & 1), z + ((c >> 2) & 1));
+
+                for (const auto& tet : tets) {
+                    int64_t in[4], out[4];
+                    int in_count = 0, out_count = 0;
+                    for (int v : tet) {
+                        if (values[corner[v]] < 0) in[in_count++] = corner[v];
+                        else                        out[out_count++] = corner[v];
+                    }
+
+                    if (in_count == 1 || in_count == 3) {
+                        auto lone = (in_count == 1) ? in[0] : out[0];
+                        auto* others = (in_count == 1) ? out : in;
+                        int a = vertex_on_edge(lone, others[0]);
+                        int b = vertex_on_edge(lone, others[1]);
+                        int c = vertex_on_edge(lone, others[2]);
+                        emit(in[0], out[0], a, b, c);
+                    } else if (in_count == 2) {
+                        int a = vertex_on_edge(in[0], out[0]);
+                        int b = vertex_on_edge(in[0], out[1]);
+                        int c = vertex_on_edge(in[1], out[1]);
+                        int d = vertex_on_edge(in[1], out[0]);
+                        emit(in[0], out[0], a, b, c);
+                        emit(in[0], out[0], a, c, d);
+                    }
+                }
+            }
+        }
+    }
+
+    return make_shared<triangle_mesh>(vertices, indices, mat);
+}
+
+#endif
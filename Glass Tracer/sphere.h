@@ -4,6 +4,8 @@
 #include "GlassTracer.h"
 
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 
 class sphere : public hittable {
   public:
@@ -60,13 +62,94 @@ class sphere : public hittable {
         return true;
     }
 
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        // Uniform over the cone of directions the sphere covers from origin, or over all
+        // directions from inside it. Moving spheres are sampled where they are at time 0.
+        hit_record rec;
+        if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            return 0;
+
+        auto distance_squared = (center.at(0) - origin).length_squared();
+        if (distance_squared <= radius*radius)
+            return 1 / (4*pi);
+
+        auto cos_theta_max = std::sqrt(1 - radius*radius/distance_squared);
+        auto solid_angle = 2*pi*(1 - cos_theta_max);
+        return 1 / solid_angle;
+    }
+
+    vec3 random(const point3& origin) const override {
+        vec3 direction = center.at(0) - origin;
+        auto distance_squared = direction.length_squared();
+        if (distance_squared <= radius*radius)
+            return random_unit_vector();
+
+        onb uvw(direction);
+        return uvw.transform(random_to_sphere(radius, distance_squared));
+    }
+
+    bool is_light() const override { return mat && mat->is_emissive(); }
+
+    emission_bounds emission() const override {
+        emission_bounds bounds;
+        auto radiance = mat->emitted(0.5, 0.5, center.at(0));
+        bounds.power = 4 * pi * pi * radius * radius * luminance(radiance);
+        return bounds;
+    }
+
+    double surface_area() const override { return 4 * pi * radius * radius; }
+
+    void random_surface_point(double time, point3& p, vec3& normal) const override {
+        normal = random_unit_vector();
+        p = center.at(time) + radius * normal;
+    }
+
+    color random_emission(ray& photon) const override {
+        // A point uniform over the surface, where it is at the photon's time, and a
+        // cosine-distributed direction outward.
+        auto time = random_double();
+        auto normal = random_unit_vector();
+        auto p = center.at(time) + radius * normal;
+        auto direction = normal + random_unit_vector();
+        if (direction.near_zero())
+            direction = normal;
+        double u, v;
+        get_sphere_uv(normal, u, v);
+        photon = ray(p, direction, time);
+        return 4 * pi * pi * radius * radius * mat->emitted(u, v, p);
+    }
+
+    void crossings(const ray& r, interval ray_t, ray_crossings& out) const override {
+        // Both roots from one solve.
+        point3 current_center = center.at(r.time());
+        vec3 oc = current_center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return;
+
+        auto sqrtd = std::sqrt(discriminant);
+        for (auto root : { (h - sqrtd) / a, (h + sqrtd) / a })
+            if (ray_t.surrounds(root))
+                out.add(root);
+    }
+
      aabb bounding_box() const override { return bbox; }
 
-  private:
-    ray center;
-    double radius;
-    shared_ptr<material> mat;
-    aabb bbox;
+    point3 center_at(double time) const { return center.at(time); }
+    double get_radius() const { return radius; }
+    shared_ptr<material> get_material() const { return mat; }
+
+    motion_bounds time_bounds(interval time) const override {
+        // The center moves linearly, so the boxes at the ends of the span bound it exactly.
+        auto rvec = vec3(radius, radius, radius);
+        auto c0 = center.at(time.min);
+        auto c1 = center.at(time.max);
+        return motion_bounds(aabb(c0 - rvec, c0 + rvec), aabb(c1 - rvec, c1 + rvec));
+    }
 
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
@@ -82,6 +165,26 @@ class sphere : public hittable {
         u = phi / (2*pi);
         v = theta / pi;
     }
+
+  private:
+    ray center;
+    double radius;
+    shared_ptr<material> mat;
+    aabb bbox;
+
+    static vec3 random_to_sphere(double radius, double distance_squared) {
+        // A direction uniformly distributed in the cone toward a sphere of the given radius at
+        // the given squared distance, about the z axis.
+        auto r1 = random_double();
+        auto r2 = random_double();
+        auto z = 1 + r2*(std::sqrt(1 - radius*radius/distance_squared) - 1);
+
+        auto phi = 2*pi*r1;
+        auto x = std::cos(phi) * std::sqrt(1 - z*z);
+        auto y = std::sin(phi) * std::sqrt(1 - z*z);
+
+        return vec3(x, y, z);
+    }
 };
 
 #endif
\ No newline at end of file
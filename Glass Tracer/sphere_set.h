@@ -0,0 +1,258 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "GlassTracer.h"
+
+#include "hittable.h"
+#include "sphere.h"
+#include "traversal.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+class sphere_set : public hittable {
+  public:
+    // A large population of spheres stored as structure-of-arrays instead of one `sphere`
+    // object each. Materials live in a small palette and are referenced by index. The set
+    // carries its own BVH whose leaves hold up to `lanes` spheres laid out contiguously, so
+    // a leaf is tested with one fixed-width loop the compiler can vectorize.
+    //
+    // Add spheres, then call build() once before rendering. build() reorders and pads the
+    // arrays to suit its leaves, so spheres can't be added after it: add() then returns false
+    // and adds nothing, and a second build() does nothing.
+
+    static const int lanes = 4;
+
+    int add_material(shared_ptr<material> mat) {
+        materials.push_back(mat);
+        return int(materials.size()) - 1;
+    }
+
+    // Stationary Sphere
+    bool add(const point3& center, double radius, int material_id) {
+        return add(center, center, radius, material_id);
+    }
+
+    // Moving Sphere
+    bool add(const point3& center1, const point3& center2, double radius, int material_id) {
+        if (built)
+            return false;
+        auto motion = center2 - center1;
+        for (int a = 0; a < 3; a++) {
+            center[a].push_back(center1[a]);
+            move[a].push_back(motion[a]);
+        }
+        radii.push_back(std::fmax(0, radius));
+        mat_id.push_back(material_id);
+
+        bbox = aabb(bbox, sphere_box(radii.size() - 1));
+        return true;
+    }
+
+    size_t size() const { return count; }
+
+    void build() {
+        // Builds the BVH, then permutes the sphere arrays so that every leaf starts on a
+        // multiple of `lanes`. Short leaves are padded with zero-radius spheres.
+        if (built)
+            return;
+        built = true;
+        count = radii.size();
+        nodes.clear();
+        nodes.reserve(2 * (count / lanes + 1));
+
+        std::vector<int> order(count);
+        std::iota(order.begin(), order.end(), 0);
+
+        std::vector<int> packed;
+        packed.reserve(count + count / 2);
+        build_node(order, 0, count, packed);
+
+        auto permute = [&packed](auto& v, auto pad) {
+            std::remove_reference_t<decltype(v)> out(packed.size());
+            for (size_t i = 0; i < packed.size(); i++)
+                out[i] = (packed[i] < 0) ? pad : v[packed[i]];
+            v.swap(out);
+        };
+
+        for (int a = 0; a < 3; a++) {
+            permute(center[a], 0.0);
+            permute(move[a], 0.0);
+        }
+        permute(radii, 0.0);
+        permute(mat_id, 0);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+
+        int hit_index = -1;
+        traverse_nodes(0, [&](int index, int& near, int& far) {
+            const auto& n = nodes[index];
+            auto span = ray_t;
+            if (!n.bbox.hit(r, inv_dir, span))
+                return 0;
+            if (n.count == 0) {
+                // Visit the near child first, so closer hits shrink ray_t sooner.
+                near = index + 1;
+                far  = n.first;
+                if (r.direction()[n.axis] < 0) std::swap(near, far);
+                return 2;
+            }
+            int found = hit_leaf(n.first, n.count, r, ray_t);
+            if (found >= 0) hit_index = found;
+            return 0;
+        });
+
+        if (hit_index < 0)
+            return false;
+
+        point3 current_center = center_at(hit_index, r.time());
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - current_center) / radii[hit_index];
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = materials[mat_id[hit_index]];
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t memory_usage() const {
+        // Bytes held by the sphere arrays (including padding), the BVH and the palette.
+        size_t bytes = sizeof(*this);
+        bytes += radii.capacity() * (7 * sizeof(double) + sizeof(int));
+        bytes += nodes.capacity() * sizeof(node);
+        bytes += materials.capacity() * sizeof(shared_ptr<material>);
+        return bytes;
+    }
+
+  private:
+    struct node {
+        aabb bbox;
+        int  first;   // Leaf: first sphere. Interior: index of the right child.
+        int  count;   // Number of spheres in a leaf, zero for interior nodes.
+        int  axis;    // Split axis, used to order the traversal.
+    };
+
+    std::vector<double> center[3];
+    std::vector<double> move[3];
+    std::vector<double> radii;
+    std::vector<int> mat_id;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<node> nodes;
+    size_t count = 0;
+    bool built = false;
+    aabb bbox;
+
+    point3 center_at(size_t i, double time) const {
+        return point3(center[0][i] + time*move[0][i],
+                      center[1][i] + time*move[1][i],
+                      center[2][i] + time*move[2][i]);
+    }
+
+    aabb sphere_box(size_t i) const {
+        // Box covering the sphere at both ends of its motion.
+        auto rvec = vec3(radii[i], radii[i], radii[i]);
+        auto c0 = center_at(i, 0);
+        auto c1 = center_at(i, 1);
+        return aabb(aabb(c0 - rvec, c0 + rvec), aabb(c1 - rvec, c1 + rvec));
+    }
+
+    void build_node(std::vector<int>& order, size_t start, size_t end, std::vector<int>& packed) {
+        int index = int(nodes.size());
+        nodes.push_back(node());
+
+        aabb box = aabb::empty;
+        aabb centroids = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            auto b = sphere_box(order[i]);
+            box = aabb(box, b);
+            centroids = aabb(centroids, aabb(centroid(b), centroid(b)));
+        }
+
+        nodes[index].bbox = box;
+        int axis = centroids.longest_axis();
+        nodes[index].axis = axis;
+
+        size_t span = end - start;
+        if (span <= lanes) {
+            nodes[index].first = int(packed.size());
+            nodes[index].count = int(span);
+            for (size_t i = start; i < end; i++)
+                packed.push_back(order[i]);
+            while (packed.size() % lanes != 0)
+                packed.push_back(-1);
+            return;
+        }
+
+        // Median split, rounded to a multiple of the lane width so leaves come out full.
+        size_t mid = start + ((span / 2 + lanes - 1) / lanes) * lanes;
+        if (mid >= end) mid = start + span / 2;
+
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+            [this, axis](int a, int b) {
+                return center[axis][a] + 0.5*move[axis][a] < center[axis][b] + 0.5*move[axis][b];
+            });
+
+        build_node(order, start, mid, packed);
+        nodes[index].first = int(nodes.size());
+        nodes[index].count = 0;
+        build_node(order, mid, end, packed);
+    }
+
+    static point3 centroid(const aabb& b) {
+        return point3(0.5*(b.x.min + b.x.max), 0.5*(b.y.min + b.y.max), 0.5*(b.z.min + b.z.max));
+    }
+
+    int hit_leaf(int first, int leaf_count, const ray& r, interval& ray_t) const {
+        // Intersects all lanes of a leaf at once. The loop body has no branches or early
+        // exits, which lets it compile to packed SIMD; the closest root is chosen afterwards.
+        const double* cx = center[0].data() + first;
+        const double* cy = center[1].data() + first;
+        const double* cz = center[2].data() + first;
+        const double* mx = move[0].data() + first;
+        const double* my = move[1].data() + first;
+        const double* mz = move[2].data() + first;
+        const double* rr = radii.data() + first;
+
+        const double ox = r.origin().x(), oy = r.origin().y(), oz = r.origin().z();
+        const double dx = r.direction().x(), dy = r.direction().y(), dz = r.direction().z();
+        const double time = r.time();
+        const double a = dx*dx + dy*dy + dz*dz;
+        const double tmin = ray_t.min, tmax = ray_t.max;
+
+        double t_lane[lanes];
+        for (int k = 0; k < lanes; k++) {
+            double ocx = cx[k] + time*mx[k] - ox;
+            double ocy = cy[k] + time*my[k] - oy;
+            double ocz = cz[k] + time*mz[k] - oz;
+            double h = dx*ocx + dy*ocy + dz*ocz;
+            double c = ocx*ocx + ocy*ocy + ocz*ocz - rr[k]*rr[k];
+            double discriminant = h*h - a*c;
+            double sqrtd = std::sqrt(std::fmax(discriminant, 0.0));
+            double near_root = (h - sqrtd) / a;
+            double far_root  = (h + sqrtd) / a;
+            double root = (near_root > tmin) ? near_root : far_root;
+            bool valid = (discriminant >= 0) && (rr[k] > 0) && (root > tmin) && (root < tmax);
+            t_lane[k] = valid ? root : infinity;
+        }
+
+        int found = -1;
+        for (int k = 0; k < leaf_count; k++) {
+            if (t_lane[k] < ray_t.max) {
+                ray_t.max = t_lane[k];
+                found = first + k;
+            }
+        }
+        return found;
+    }
+};
+
+#endif
@@ -0,0 +1,376 @@
+#include "GlassTracer.h"
+
+#include "benchmark.h"
+#include "bvh.h"
+#include "compressed_bvh.h"
+#include "dynamic_scene.h"
+#include "flat_bvh.h"
+#include "heterogeneous_medium.h"
+#include "hittable_list.h"
+#include "lightmap.h"
+#include "lights.h"
+#include "material.h"
+#include "mesh.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+// Checks of behavior that the renders wouldn't show going wrong until it did: edge cases of
+// the acceleration structures, mostly. Each test is run by name, as `GlassTracerTests name`,
+// and ctest runs every one; a failed check is reported and makes the run exit non-zero.
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static hittable_list random_spheres(int count) {
+    // Small spheres scattered through a cube, overlapping here and there.
+    hittable_list list;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < count; i++) {
+        auto center = point3(random_double(-10, 10), random_double(-10, 10), random_double(-10, 10));
+        list.add(make_shared<sphere>(center, random_double(0.1, 0.6), mat));
+    }
+    return list;
+}
+
+static bool same_hits(const hittable& expected, const hittable& actual, const std::vector<ray>& rays) {
+    // Whether actual hits the same rays as expected, at the same distances.
+    for (const auto& r : rays) {
+        hit_record a, b;
+        bool hit_a = expected.hit(r, interval(0.001, infinity), a);
+        bool hit_b = actual.hit(r, interval(0.001, infinity), b);
+        if (hit_a != hit_b || (hit_a && a.t != b.t))
+            return false;
+    }
+    return true;
+}
+
+void compressed_bvh_large_leaves() {
+    // Leaves of more objects than a wide node's 8-bit leaf count can hold must be split, not
+    // truncated. One leaf of 600 takes a single extra node; one of 1500 takes two levels.
+    for (int count : { 600, 1500 }) {
+        auto list = random_spheres(count);
+        bvh_settings settings;
+        settings.max_leaf_size = count;
+        flat_bvh flat(list, settings);
+        check(flat.node_data().size() == 1 && flat.node_data()[0].count == count,
+              "flat_bvh keeps all the objects in one leaf");
+
+        compressed_bvh compressed(flat);
+        auto rays = scattered_rays(list.bounding_box(), 20000);
+        check(same_hits(flat, compressed, rays), "compressed_bvh hits what flat_bvh hits");
+    }
+}
+
+void compressed_bvh_insert_grown() {
+    // A flat_bvh grown by inserting objects in order along a line is about as deep as it has
+    // objects, and so is the compressed_bvh collapsed from it; building and traversing it must
+    // not run out of stack, and it must hit what a plain list of the objects does.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    hittable_list list;
+    flat_bvh grown{hittable_list()};
+    for (int i = 0; i < 1000; i++) {
+        auto ball = make_shared<sphere>(point3(i, 0.1 * (i % 7), 0), 0.45, mat);
+        list.add(ball);
+        grown.insert(ball);
+    }
+    compressed_bvh compressed(grown);
+
+    auto rays = scattered_rays(list.bounding_box(), 20000);
+    rays.push_back(ray(point3(-5, 0, 0), vec3(1, 0, 0)));
+    rays.push_back(ray(point3(1005, 0, 0), vec3(-1, 0, 0)));
+    check(same_hits(list, compressed, rays), "a compressed_bvh of an insert-grown tree hits what a list does");
+}
+
+void flat_bvh_partial_refit() {
+    // Refitting only the moved objects must give the same boxes as refitting everything,
+    // both for a few objects and for enough that the levels are refit in parallel.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto ball = make_shared<sphere>(point3(0, 0, 0), 0.3, mat);
+    const int count = 20000;
+    std::vector<shared_ptr<scene_object>> objects;
+    hittable_list list;
+    for (int i = 0; i < count; i++) {
+        auto offset = vec3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+        objects.push_back(make_shared<scene_object>(ball, affine_transform::translation(offset)));
+        list.add(objects.back());
+    }
+
+    for (int moving : { 10, count }) {
+        flat_bvh partial(list), full(list);
+        std::vector<int> moved;
+        for (int i = 0; i < moving; i++) {
+            int id = (moving == count) ? i : int(random_double(0, count));
+            auto offset = vec3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+            objects[id]->set_transform(affine_transform::translation(offset));
+            moved.push_back(id);
+        }
+        partial.refit(moved);
+        full.refit();
+
+        bool same = partial.node_data().size() == full.node_data().size();
+        for (size_t i = 0; same && i < full.node_data().size(); i++) {
+            const auto& a = partial.node_data()[i].bbox;
+            const auto& b = full.node_data()[i].bbox;
+            same = a.x.min == b.x.min && a.x.max == b.x.max && a.y.min == b.y.min
+                && a.y.max == b.y.max && a.z.min == b.z.min && a.z.max == b.z.max;
+        }
+        check(same, "refit(changed) gives the boxes refit() does");
+    }
+}
+
+void flat_bvh_restore() {
+    // A saved tree must restore and hit what the original does, also after edits once
+    // reorder() has dropped their garbage. Trees with garbage left in, nodes that share
+    // children, or an axis out of range must not restore.
+    auto list = random_spheres(2000);
+    auto extra = random_spheres(300);
+    flat_bvh original(list);
+    for (int i = 0; i < 300; i++)
+        original.remove(int(random_double(0, 2000)));
+    for (const auto& object : extra.objects)
+        original.insert(object);
+
+    std::vector<shared_ptr<hittable>> sources = list.objects;
+    sources.insert(sources.end(), extra.objects.begin(), extra.objects.end());
+    const auto& leaves = original.leaf_sources();
+    flat_bvh restored{bvh_settings()};
+    auto with_garbage = original.node_data();
+    check(!restored.restore(sources, with_garbage.data(), with_garbage.size(),
+                            leaves.data(), leaves.size()),
+          "a tree with garbage doesn't restore");
+
+    original.reorder(bvh_layout::depth_first);
+    auto tree = original.node_data();
+    check(restored.restore(sources, tree.data(), tree.size(), leaves.data(), leaves.size()),
+          "an edited tree restores after a reorder");
+    check(same_hits(original, restored, scattered_rays(original.bounding_box(), 20000)),
+          "the restored tree hits what the original does");
+
+    // Point the root's second child at the first one's children, if it has any, or at the
+    // root's own.
+    auto shared = tree;
+    int a = shared[0].first, b = a + 1;
+    shared[b].first = (shared[a].count == 0) ? shared[a].first : a;
+    shared[b].count = 0;
+    check(!restored.restore(sources, shared.data(), shared.size(), leaves.data(), leaves.size()),
+          "a tree whose nodes share children doesn't restore");
+
+    auto bad_axis = tree;
+    bad_axis[0].axis = 3;
+    check(!restored.restore(sources, bad_axis.data(), bad_axis.size(), leaves.data(), leaves.size()),
+          "a tree with an axis out of range doesn't restore");
+}
+
+void flat_bvh_many_inserts() {
+    // Objects inserted one at a time in order along a line make a tree about as deep as it
+    // has objects, far past any fixed traversal stack; it must still hit what a plain list
+    // of the objects does.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    hittable_list list;
+    flat_bvh bvh{hittable_list()};
+    for (int i = 0; i < 500; i++) {
+        auto ball = make_shared<sphere>(point3(i, 0.1 * (i % 7), 0), 0.45, mat);
+        list.add(ball);
+        bvh.insert(ball);
+    }
+    check(same_hits(list, bvh, scattered_rays(list.bounding_box(), 20000)),
+          "a BVH grown by insert() hits what a list does");
+}
+
+void flat_bvh_insert_degradation() {
+    // Inserting object after object makes a tree far worse than a build would, which
+    // degradation() must report so that rebuild_degraded() fixes it.
+    auto list = random_spheres(200);
+    flat_bvh bvh(list);
+    check(bvh.degradation() < 1.001, "a new build isn't degraded");
+
+    auto extra = random_spheres(2000);
+    for (const auto& object : extra.objects)
+        bvh.insert(object);
+    check(bvh.degradation() > 1.3, "inserts count as degradation");
+    check(bvh.rebuild_degraded(1.3) > 0, "rebuild_degraded() rebuilds after many inserts");
+    check(bvh.degradation() <= 1.3, "the rebuild undoes the degradation");
+}
+
+void dynamic_scene_stale_handles() {
+    // Handles that were never given out or whose objects are gone, and ids out of range, are
+    // rejected rather than followed.
+    dynamic_scene scene;
+    auto list = random_spheres(10);
+    std::vector<dynamic_scene::handle> handles;
+    for (const auto& object : list.objects)
+        handles.push_back(scene.insert(object));
+    scene.commit();
+
+    auto h = handles[3];
+    auto paint = make_shared<lambertian>(color(0.9, 0.1, 0.1));
+    check(scene.set_material(h, paint), "set_material() on a live handle");
+    check(scene.remove(h), "remove() on a live handle");
+    check(!scene.remove(h), "remove() twice");
+    check(!scene.set_transform(h, affine_transform()), "set_transform() after remove()");
+    check(!scene.set_material(h, paint), "set_material() after remove()");
+    scene.commit();
+    check(!scene.set_transform(h, affine_transform()), "set_transform() after the commit");
+    check(!scene.remove(-1) && !scene.remove(10) && !scene.set_material(99, paint),
+          "handles never given out");
+    check(scene.object_count() == 9, "the scene holds the rest");
+
+    flat_bvh bvh(list);
+    check(bvh.remove(2) && !bvh.remove(2), "flat_bvh::remove() twice");
+    check(!bvh.remove(-1) && !bvh.remove(10), "flat_bvh::remove() out of range");
+    check(!bvh.reinsert(2) && !bvh.reinsert(10), "flat_bvh::reinsert() of no object");
+    check(!bvh.refit(std::vector<int>{ 1, 10 }), "flat_bvh::refit() with an id out of range");
+    check(bvh.refit(std::vector<int>{ 1, 2 }), "flat_bvh::refit() passes removed objects over");
+}
+
+void light_list_without_lights() {
+    // Sampling a light list with no lights, or with lights added but not yet built, finds
+    // nothing rather than reading past its arrays.
+    point3 p(0, 1, 0);
+    double chance = 0;
+    ray photon;
+
+    light_list none;
+    none.build();
+    check(none.random(p).length_squared() == 0, "random() with no lights");
+    check(none.pdf_value(p, vec3(0, 1, 0)) == 0, "pdf_value() with no lights");
+    check(!none.random_by_power(chance), "random_by_power() with no lights");
+    check(none.random_photon(photon).length_squared() == 0, "random_photon() with no lights");
+
+    auto lamp = make_shared<diffuse_light>(color(4, 4, 4));
+    light_list unbuilt;
+    unbuilt.add(make_shared<quad>(point3(-1, 2, -1), vec3(2, 0, 0), vec3(0, 0, 2), lamp));
+    check(unbuilt.random(p).length_squared() == 0, "random() before build()");
+    check(!unbuilt.random_by_power(chance), "random_by_power() before build()");
+
+    for (auto selection : { light_selection::uniform, light_selection::power, light_selection::bvh }) {
+        unbuilt.selection = selection;
+        unbuilt.build();
+        check(unbuilt.random(p).length_squared() > 0, "random() once built");
+    }
+}
+
+void lightmap_leaves_meshes_alone() {
+    // Baking a mesh gives its lightmap texture coordinates to the object add() returns, not
+    // to the mesh itself, which other parts of the scene may share.
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    std::vector<point3> vertices = { point3(0,0,0), point3(4,0,0), point3(0,4,0) };
+    auto mesh = make_shared<triangle_mesh>(vertices, std::vector<int>{ 0, 1, 2 }, mat);
+    ray r(point3(1, 1, 5), vec3(0, 0, -1));
+
+    hit_record before;
+    mesh->hit(r, interval(0.001, infinity), before);
+    lightmap maps;
+    auto baked = maps.add(mesh);
+    hit_record after, charted;
+    mesh->hit(r, interval(0.001, infinity), after);
+    baked->hit(r, interval(0.001, infinity), charted);
+
+    check(after.u == before.u && after.v == before.v, "the mesh keeps its own coordinates");
+    check(charted.u != before.u || charted.v != before.v, "the baked copy reports the chart's");
+}
+
+void density_raw_bad_dimensions() {
+    // A grid with no voxels along some axis, or a negative count, isn't loaded at all, rather
+    // than read into a grid of the wrong size, even from a file that holds enough values.
+    auto path = (std::filesystem::temp_directory_path() / "glass_tracer_density_test.raw").string();
+    {
+        std::vector<float> values(64, 1.0f);
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(values.data()), std::streamsize(values.size() * sizeof(float)));
+    }
+    aabb bounds(point3(0, 0, 0), point3(1, 1, 1));
+    auto loaded = load_density_raw(path, 4, 4, 4, bounds);
+    check(loaded && !loaded->empty(), "a 4x4x4 grid loads");
+    check(!load_density_raw(path, 0, 4, 4, bounds), "no voxels along x");
+    check(!load_density_raw(path, 4, -2, 4, bounds), "a negative count along y");
+    std::remove(path.c_str());
+}
+
+void density_grid_wrong_size() {
+    // A grid given other than nx*ny*nz values, or no voxels along some axis, is left empty,
+    // with no density anywhere, rather than read past the values.
+    aabb bounds(point3(0, 0, 0), point3(1, 1, 1));
+    check(!density_grid(2, 2, 2, bounds, std::vector<float>(8, 1.0f)).empty(), "8 values for 2x2x2");
+    density_grid few(4, 4, 4, bounds, std::vector<float>(10, 1.0f));
+    check(few.empty(), "10 values for 4x4x4");
+    check(few.density(point3(0.5, 0.5, 0.5)) == 0, "no density in a rejected grid");
+    check(density_grid(0, 2, 2, bounds, std::vector<float>()).empty(), "no voxels along x");
+}
+
+void medium_list_transmittance() {
+    // Light samples pass by the collisions of the media a medium_list finds and take their
+    // ratio-tracked transmittance, which must average to the exact one: through a uniform
+    // grid whose density falls off over the outer half voxel on each side, e^-(0.25 * 7.75).
+    aabb bounds(point3(-4, -4, -4), point3(4, 4, 4));
+    auto grid = make_shared<density_grid>(8, 8, 8, bounds, std::vector<float>(512, 1.0f));
+    auto smoke = make_shared<heterogeneous_medium>(grid, 0.25, color(1, 1, 1));
+    auto floor = make_shared<quad>(point3(-10, -5, -10), vec3(20, 0, 0), vec3(0, 0, 20),
+                                   make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    hittable_list objects;
+    objects.add(smoke);
+    objects.add(floor);
+    medium_list media{bvh_node(objects)};
+    check(!media.empty(), "the medium is found under a bvh_node");
+
+    ray across(point3(-10, 0, 0), vec3(1, 0, 0));
+    const int estimates = 20000;
+    double sum = 0;
+    for (int k = 0; k < estimates; k++)
+        sum += media.transmittance(across, interval(0.001, infinity));
+    check(std::fabs(sum / estimates - std::exp(-0.25 * 7.75)) < 0.01, "mean transmittance");
+
+    hit_record rec;
+    auto dense = make_shared<heterogeneous_medium>(grid, 50.0, color(1, 1, 1));
+    hittable_list dense_objects;
+    dense_objects.add(dense);
+    check(dense->hit(across, interval(0.001, infinity), rec) && medium_list(dense_objects).passes(rec),
+          "collisions in the medium are passed by");
+    check(floor->hit(ray(point3(0, 0, 0), vec3(0, -1, 0)), interval(0.001, infinity), rec)
+          && !media.passes(rec), "surfaces are not");
+}
+
+int main(int argc, char* argv[]) {
+    struct test {
+        const char* name;
+        void (*run)();
+    };
+    static const test tests[] = {
+        { "compressed_bvh_large_leaves", compressed_bvh_large_leaves },
+        { "compressed_bvh_insert_grown", compressed_bvh_insert_grown },
+        { "flat_bvh_partial_refit", flat_bvh_partial_refit },
+        { "flat_bvh_restore", flat_bvh_restore },
+        { "flat_bvh_many_inserts", flat_bvh_many_inserts },
+        { "flat_bvh_insert_degradation", flat_bvh_insert_degradation },
+        { "dynamic_scene_stale_handles", dynamic_scene_stale_handles },
+        { "light_list_without_lights", light_list_without_lights },
+        { "lightmap_leaves_meshes_alone", lightmap_leaves_meshes_alone },
+        { "density_raw_bad_dimensions", density_raw_bad_dimensions },
+        { "density_grid_wrong_size", density_grid_wrong_size },
+        { "medium_list_transmittance", medium_list_transmittance },
+    };
+
+    bool found = false;
+    for (const auto& t : tests) {
+        if (argc > 1 && std::strcmp(argv[1], t.name) != 0)
+            continue;
+        found = true;
+        t.run();
+    }
+    if (!found) {
+        std::cerr << "ERROR: No test named '" << argv[1] << "'.\n";
+        return 1;
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+#ifndef TRAVERSAL_H
+#define TRAVERSAL_H
+
+#include "GlassTracer.h"
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <vector>
+
+template <typename T = int>
+class traversal_stack {
+  public:
+    // Nodes still to visit, as indices or as whatever else a traversal keeps for each. The
+    // first inline_capacity live in the object itself; deeper trees, such as a flat_bvh after
+    // many insertions, spill onto the heap rather than overflow.
+
+    bool empty() const { return size == 0; }
+
+    void push(const T& entry) {
+        if (size < inline_capacity)
+            local[size] = entry;
+        else
+            spill.push_back(entry);
+        size++;
+    }
+
+    T pop() {
+        size--;
+        if (size < inline_capacity)
+            return local[size];
+        auto entry = spill.back();
+        spill.pop_back();
+        return entry;
+    }
+
+  private:
+    static const int inline_capacity = 64;
+    T local[inline_capacity];
+    int size = 0;
+    std::vector<T> spill;
+};
+
+template <typename Visit>
+void traverse_nodes(int root, const Visit& visit) {
+    // Depth-first walk of a tree of nodes in an array, from root. visit(index, near, far)
+    // looks at a node and returns how many of its children to go on to: none (a leaf, or a
+    // box the ray misses), one (near), or two (near, then far once near's subtree is done).
+    traversal_stack<> stack;
+    int index = root;
+    while (true) {
+        int near = -1, far = -1;
+        auto children = visit(index, near, far);
+        if (children > 1)
+            stack.push(far);
+        if (children > 0) {
+            index = near;
+            continue;
+        }
+        if (stack.empty())
+            return;
+        index = stack.pop();
+    }
+}
+
+template <typename F>
+void walk_grid(
+    const ray& r, const vec3& inv_dir, const aabb& grid, const int* res,
+    double t_enter, double t_exit, const F& visit
+) {
+    // Calls visit(index, coords, cell_enter, cell_exit) for the cells of a res[0] x res[1] x
+    // res[2] grid over `grid` that the ray crosses between t_enter and t_exit, nearest first,
+    // until visit returns true. A 3D-DDA (Amanatides and Woo, 1987).
+    int c[3], step[3];
+    double t_next[3], t_delta[3];
+    auto p = r.at(t_enter);
+    for (int a = 0; a < 3; a++) {
+        const auto& g = grid.axis_interval(a);
+        auto size = g.size() / res[a];
+        c[a] = std::clamp(int(std::floor((p[a] - g.min) / size)), 0, res[a] - 1);
+        if (r.direction()[a] > 0) {
+            step[a] = 1;
+            t_next[a] = (g.min + (c[a] + 1) * size - r.origin()[a]) * inv_dir[a];
+            t_delta[a] = size * inv_dir[a];
+        } else if (r.direction()[a] < 0) {
+            step[a] = -1;
+            t_next[a] = (g.min + c[a] * size - r.origin()[a]) * inv_dir[a];
+            t_delta[a] = -size * inv_dir[a];
+        } else {
+            step[a] = 0;
+            t_next[a] = infinity;
+            t_delta[a] = infinity;
+        }
+    }
+
+    double t_cell = t_enter;
+    while (true) {
+        int axis = (t_next[0] < t_next[1])
+            ? (t_next[0] < t_next[2] ? 0 : 2)
+            : (t_next[1] < t_next[2] ? 1 : 2);
+        double cell_exit = std::fmin(t_next[axis], t_exit);
+        int index = (c[2] * res[1] + c[1]) * res[0] + c[0];
+        if (visit(index, c, t_cell, cell_exit))
+            return;
+        if (t_next[axis] >= t_exit)
+            return;
+
+        c[axis] += step[axis];
+        if (c[axis] < 0 || c[axis] >= res[axis])
+            return;
+        t_cell = t_next[axis];
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+#endif